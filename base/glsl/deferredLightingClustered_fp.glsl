@@ -0,0 +1,150 @@
+/*
+===========================================================================
+Copyright (C) 2007-2011 Robert Beckebans <trebor_7@users.sourceforge.net>
+
+This file is part of XreaL source code.
+
+XreaL source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+XreaL source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with XreaL source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+
+/* deferredLightingClustered_fp.glsl */
+
+uniform sampler2D	u_DiffuseMap;
+uniform sampler2D	u_NormalMap;
+uniform sampler2D	u_SpecularMap;
+uniform sampler2D 	u_DepthMap;
+uniform sampler2D	u_AttenuationMapXY;
+uniform sampler2D	u_AttenuationMapZ;
+
+uniform sampler2D	u_ClusterGridMap;	// r = first light index, g = number of lights
+uniform sampler2D	u_ClusterIndexMap;	// r = light
+uniform sampler2D	u_ClusterLightMap;	// attenuation matrix rows, origin, color
+
+uniform vec3		u_ViewOrigin;
+uniform mat4		u_ViewMatrix;
+uniform mat4		u_UnprojectMatrix;
+
+uniform vec4		u_ClusterTileScale;		// xy = tiles per pixel, zw = tile offset of the viewport
+uniform vec4		u_ClusterDepthScale;	// x = slices per log(depth), y = slice offset
+
+
+
+vec4 FetchLight(float light, float texel)
+{
+	return texture2D(u_ClusterLightMap, vec2((texel + 0.5) / float(CLUSTER_LIGHT_TEXELS), (light + 0.5) / float(MAX_CLUSTER_LIGHTS)));
+}
+
+float FetchLightIndex(float index)
+{
+	vec2 st;
+
+	st.x = (mod(index, float(CLUSTER_INDEX_WIDTH)) + 0.5) / float(CLUSTER_INDEX_WIDTH);
+	st.y = (floor(index / float(CLUSTER_INDEX_WIDTH)) + 0.5) / float(MAX_CLUSTER_INDEXES / CLUSTER_INDEX_WIDTH);
+
+	return texture2D(u_ClusterIndexMap, st).r;
+}
+
+void	main()
+{
+	// calculate the screen texcoord in the 0.0 to 1.0 range
+	vec2 st = gl_FragCoord.st * r_FBufScale;
+
+	// scale by the screen non-power-of-two-adjust
+	st *= r_NPOTScale;
+
+	// reconstruct vertex position in world space
+	float depth = texture2D(u_DepthMap, st).r;
+	vec4 P = u_UnprojectMatrix * vec4(gl_FragCoord.xy, depth, 1.0);
+	P.xyz /= P.w;
+
+	// find the cluster of this pixel
+	vec2 tile = floor(gl_FragCoord.xy * u_ClusterTileScale.xy + u_ClusterTileScale.zw);
+	tile = clamp(tile, vec2(0.0), vec2(float(CLUSTER_TILES_X - 1), float(CLUSTER_TILES_Y - 1)));
+
+	float viewDepth = -(u_ViewMatrix * vec4(P.xyz, 1.0)).z;
+	float slice = floor(log(max(viewDepth, 1.0)) * u_ClusterDepthScale.x + u_ClusterDepthScale.y);
+	slice = clamp(slice, 0.0, float(CLUSTER_SLICES - 1));
+
+	vec4 cluster = texture2D(u_ClusterGridMap, vec2((tile.y * float(CLUSTER_TILES_X) + tile.x + 0.5) / float(CLUSTER_TILES_X * CLUSTER_TILES_Y),
+													  (slice + 0.5) / float(CLUSTER_SLICES)));
+
+	float firstIndex = cluster.r;
+	float numLights = cluster.g;
+
+	if(numLights < 0.5)
+	{
+		discard;
+		return;
+	}
+
+	// compute view direction in world space
+	vec3 V = normalize(u_ViewOrigin - P.xyz);
+
+	// compute normal in world space from the G-Buffer
+	vec3 N = 2.0 * (texture2D(u_NormalMap, st).xyz - 0.5);
+
+	vec4 diffuse = texture2D(u_DiffuseMap, st);
+
+#if defined(USE_NORMAL_MAPPING)
+	vec3 specular = texture2D(u_SpecularMap, st).rgb;
+#endif
+
+	vec3 color = vec3(0.0);
+
+	for(int i = 0; i < MAX_CLUSTER_LIGHTS; i++)
+	{
+		if(float(i) >= numLights)
+			break;
+
+		float light = FetchLightIndex(firstIndex + float(i));
+
+		// transform vertex position into light space
+		vec4 Pworld = vec4(P.xyz, 1.0);
+		vec3 Plight = vec3(dot(FetchLight(light, 0.0), Pworld),
+						   dot(FetchLight(light, 1.0), Pworld),
+						   dot(FetchLight(light, 2.0), Pworld));
+
+		// the light volume is not rasterized, so clip against it here
+		if(any(lessThan(Plight, vec3(0.0))) || any(greaterThan(Plight, vec3(1.0))))
+			continue;
+
+		vec3 lightOrigin = FetchLight(light, 3.0).xyz;
+		vec3 lightColor = FetchLight(light, 4.0).rgb;	// premultiplied by the light scale
+
+		// compute light direction in world space
+		vec3 L = normalize(lightOrigin - P.xyz);
+
+		// compute half angle in world space
+		vec3 H = normalize(L + V);
+
+		// compute the diffuse term
+		float NL = clamp(dot(N, L), 0.0, 1.0);
+		vec3 lit = diffuse.rgb * NL;
+
+#if defined(USE_NORMAL_MAPPING)
+		// compute the specular term
+		lit += specular * pow(clamp(dot(N, H), 0.0, 1.0), r_SpecularExponent) * r_SpecularScale;
+#endif
+
+		// compute light attenuation
+		lit *= texture2D(u_AttenuationMapXY, Plight.xy).rgb;
+		lit *= texture2D(u_AttenuationMapZ, vec2(Plight.z, 0)).rgb;
+
+		color += lit * lightColor;
+	}
+
+	gl_FragColor = vec4(color, diffuse.a);
+}
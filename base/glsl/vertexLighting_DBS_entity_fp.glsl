@@ -32,9 +32,18 @@ uniform float		u_EnvironmentInterpolation;
 
 uniform int			u_AlphaTest;
 uniform vec3		u_ViewOrigin;
+#if defined(USE_INSTANCING)
+varying vec3		var_AmbientColor;
+varying vec3		var_LightColor;
+varying vec3		var_LightDir;
+#define u_AmbientColor var_AmbientColor
+#define u_LightColor var_LightColor
+#define u_LightDir var_LightDir
+#else
 uniform vec3		u_AmbientColor;
 uniform vec3		u_LightDir;
 uniform vec3		u_LightColor;
+#endif
 uniform float		u_SpecularExponent;
 uniform float		u_DepthScale;
 uniform vec4		u_PortalPlane;
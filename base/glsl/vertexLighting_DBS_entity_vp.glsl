@@ -43,6 +43,10 @@ uniform mat4		u_ModelViewProjectionMatrix;
 
 uniform float		u_Time;
 
+#if defined(USE_INSTANCING)
+uniform vec4		u_InstanceData[MAX_INSTANCES * INSTANCE_VECTORS];	// model matrix rows, ambient color, light color, light dir
+#endif
+
 varying vec3		var_Position;
 varying vec2		var_TexDiffuse;
 #if defined(USE_NORMAL_MAPPING)
@@ -52,6 +56,11 @@ varying vec3		var_Tangent;
 varying vec3		var_Binormal;
 #endif
 varying vec3		var_Normal;
+#if defined(USE_INSTANCING)
+varying vec3		var_AmbientColor;
+varying vec3		var_LightColor;
+varying vec3		var_LightDir;
+#endif
 
 
 
@@ -107,18 +116,40 @@ void	main()
 								u_Time);
 #endif
 
+#if defined(USE_INSTANCING)
+	int instance = gl_InstanceID * INSTANCE_VECTORS;
+
+	vec4 row0 = u_InstanceData[instance + 0];
+	vec4 row1 = u_InstanceData[instance + 1];
+	vec4 row2 = u_InstanceData[instance + 2];
+
+	mat4 modelMatrix = mat4(row0.x, row1.x, row2.x, 0.0,
+							row0.y, row1.y, row2.y, 0.0,
+							row0.z, row1.z, row2.z, 0.0,
+							row0.w, row1.w, row2.w, 1.0);
+
+	var_AmbientColor = u_InstanceData[instance + 3].rgb;
+	var_LightColor = u_InstanceData[instance + 4].rgb;
+	var_LightDir = u_InstanceData[instance + 5].xyz;
+
+	// u_ModelViewProjectionMatrix is the view projection of the world
+	gl_Position = u_ModelViewProjectionMatrix * (modelMatrix * position);
+#else
+	mat4 modelMatrix = u_ModelMatrix;
+
 	// transform vertex position into homogenous clip-space
 	gl_Position = u_ModelViewProjectionMatrix * position;
+#endif
 	
 	// transform position into world space
-	var_Position = (u_ModelMatrix * position).xyz;
+	var_Position = (modelMatrix * position).xyz;
 
 	#if defined(USE_NORMAL_MAPPING)
-	var_Tangent.xyz = (u_ModelMatrix * vec4(tangent, 0.0)).xyz;
-	var_Binormal.xyz = (u_ModelMatrix * vec4(binormal, 0.0)).xyz;
+	var_Tangent.xyz = (modelMatrix * vec4(tangent, 0.0)).xyz;
+	var_Binormal.xyz = (modelMatrix * vec4(binormal, 0.0)).xyz;
 	#endif
 	
-	var_Normal.xyz = (u_ModelMatrix * vec4(normal, 0.0)).xyz;
+	var_Normal.xyz = (modelMatrix * vec4(normal, 0.0)).xyz;
 
 	// transform diffusemap texcoords
 	var_TexDiffuse = (u_DiffuseTextureMatrix * attr_TexCoord0).st;
@@ -20,9 +20,25 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 ===========================================================================
 */
 
+#ifdef USE_LOCAL_HEADERS
+#	include "SDL.h"
+#else
+#	include <SDL.h>
+#endif
+
 #include "client.h"
 #include "snd_local.h"
 
+/*
+Video frames and audio chunks go through a bounded queue of AVI_QUEUE_SLOTS
+slots. The renderer hands the raw pixels of a frame over a few frames after
+it was rendered, see RB_TakeVideoFrameCmd. The worker threads encode the
+slots in any order but write them to the file in the order they were queued.
+While the queue is running only the thread that writes the oldest slot
+touches afd.f, afd.idxF and the counters of afd. The main thread flushes the
+queue before it reads them or uses the file itself.
+*/
+
 #define INDEX_FILE_EXTENSION ".index.dat"
 
 #define MAX_RIFF_CHUNKS 16
@@ -64,11 +80,63 @@ typedef struct aviFileData_s
 	int             chunkStack[MAX_RIFF_CHUNKS];
 	int             chunkStackTop;
 
-	byte           *cBuffer, *eBuffer;
+	byte           *cBuffer;	// gamma corrected frames
 } aviFileData_t;
 
 static aviFileData_t afd;
 
+#define AVI_QUEUE_SLOTS		6
+#define AVI_MAX_THREADS		4
+
+#define PCM_BUFFER_SIZE 44100
+
+typedef enum
+{
+	AVI_SLOT_FREE,
+	AVI_SLOT_FILLING,
+	AVI_SLOT_QUEUED,
+	AVI_SLOT_ENCODING,
+	AVI_SLOT_ENCODED
+} aviSlotState_t;
+
+typedef struct
+{
+	aviSlotState_t  state;
+	qboolean        audio;
+
+	byte           *data;		// raw RGB pixels or PCM samples, room for a padded frame
+	int             size;
+
+	byte           *encoded;	// chunk contents
+	int             encodedSize;
+} aviSlot_t;
+
+typedef struct
+{
+	SDL_mutex      *mutex;
+	SDL_cond       *cond;
+
+	SDL_Thread     *threads[AVI_MAX_THREADS];
+	int             numThreads;
+	qboolean        shutdown;
+
+	aviSlot_t       slots[AVI_QUEUE_SLOTS];
+	int             slotSize;
+	int             frameStride;	// bytes per padded BGR row
+	int             droppedFrames;	// JPEGs that did not fit into a slot
+	int             head;		// next slot to fill
+	int             next;		// next slot to encode
+	int             tail;		// next slot to write
+	qboolean        writing;	// a thread is writing the tail slot
+	qboolean        writeError;
+
+	// upper bound of the file size including everything that was queued
+	// or will be handed over by the renderer, only used by the main thread
+	unsigned int    reservedSize;
+} aviQueue_t;
+
+static aviQueue_t aq;
+
 #define MAX_AVI_BUFFER 2048
 
 static byte     buffer[MAX_AVI_BUFFER];
@@ -257,7 +325,7 @@ void CL_WriteAVIHeader(void)
 					else
 					{
 						WRITE_4BYTES(0);	// BI_RGB
-						WRITE_4BYTES(afd.width * afd.height * 3);	//biSizeImage
+						WRITE_4BYTES(PAD(afd.width * 3, AVI_LINE_PADDING) * afd.height);	//biSizeImage
 					}
 
 					WRITE_4BYTES(0);	//biXPelsPetMeter
@@ -318,6 +386,389 @@ void CL_WriteAVIHeader(void)
 	}
 }
 
+/*
+===============
+CL_PutAVI4Bytes
+===============
+*/
+static ID_INLINE void CL_PutAVI4Bytes(byte * p, int x)
+{
+	p[0] = (byte) ((x >> 0) & 0xFF);
+	p[1] = (byte) ((x >> 8) & 0xFF);
+	p[2] = (byte) ((x >> 16) & 0xFF);
+	p[3] = (byte) ((x >> 24) & 0xFF);
+}
+
+/*
+===============
+CL_WriteAVIChunk
+
+Appends a chunk to the movi list and its entry to the index.
+Runs on the thread that writes the queue, so it must not call Com_Error.
+===============
+*/
+static qboolean CL_WriteAVIChunk(const char *id, int flags, const byte * data, int size)
+{
+	int             chunkOffset = afd.fileSize - afd.moviOffset - 8;
+	int             chunkSize = 8 + size;
+	int             paddingSize = PAD(size, 2) - size;
+	byte            padding[4] = { 0 };
+	byte            header[16];
+
+	Com_Memcpy(header, id, 4);
+	CL_PutAVI4Bytes(header + 4, size);
+
+	if(FS_Write(header, 8, afd.f) < 8 || FS_Write(data, size, afd.f) < size || FS_Write(padding, paddingSize, afd.f) < paddingSize)
+		return qfalse;
+
+	afd.fileSize += (chunkSize + paddingSize);
+	afd.moviSize += (chunkSize + paddingSize);
+
+	// Index
+	Com_Memcpy(header, id, 4);	//dwIdentifier
+	CL_PutAVI4Bytes(header + 4, flags);	//dwFlags
+	CL_PutAVI4Bytes(header + 8, chunkOffset);	//dwOffset
+	CL_PutAVI4Bytes(header + 12, size);	//dwLength
+
+	if(FS_Write(header, 16, afd.idxF) < 16)
+		return qfalse;
+
+	afd.numIndices++;
+
+	return qtrue;
+}
+
+/*
+===============
+CL_EncodeAVISlot
+
+A JPEG that does not fit into the slot leaves an empty chunk,
+which players show as a repeat of the previous frame.
+===============
+*/
+static void CL_EncodeAVISlot(aviSlot_t * slot)
+{
+	int             x, y;
+	int             rowSize;
+	byte           *in, *out;
+	byte            r, g, b;
+
+	if(slot->audio)
+	{
+		slot->encoded = slot->data;
+		slot->encodedSize = slot->size;
+	}
+	else if(afd.motionJpeg)
+	{
+		slot->encodedSize = re.SaveJPGToBuffer(slot->encoded, aq.slotSize, 90, afd.width, afd.height, slot->data);
+	}
+	else
+	{
+		// convert the tightly packed RGB rows into padded BGR rows in place,
+		// going backwards so no row is overwritten before it was read
+		rowSize = afd.width * 3;
+
+		for(y = afd.height - 1; y >= 0; y--)
+		{
+			in = slot->data + y * rowSize;
+			out = slot->data + y * aq.frameStride;
+
+			Com_Memset(out + rowSize, 0, aq.frameStride - rowSize);
+
+			for(x = rowSize - 3; x >= 0; x -= 3)
+			{
+				r = in[x + 0];
+				g = in[x + 1];
+				b = in[x + 2];
+
+				out[x + 0] = b;
+				out[x + 1] = g;
+				out[x + 2] = r;
+			}
+		}
+
+		slot->encoded = slot->data;
+		slot->encodedSize = aq.frameStride * afd.height;
+	}
+}
+
+/*
+===============
+CL_WriteAVISlot
+===============
+*/
+static qboolean CL_WriteAVISlot(aviSlot_t * slot)
+{
+	if(slot->audio)
+	{
+		if(!CL_WriteAVIChunk("01wb", 0, slot->encoded, slot->encodedSize))
+			return qfalse;
+
+		afd.numAudioFrames++;
+		afd.a.totalBytes += slot->encodedSize;
+	}
+	else if(slot->encodedSize <= 0)
+	{
+		// dropped frame
+		if(!CL_WriteAVIChunk("00dc", 0, slot->encoded, 0))
+			return qfalse;
+
+		afd.numVideoFrames++;
+	}
+	else
+	{
+		// all frames are KeyFrames
+		if(!CL_WriteAVIChunk("00dc", 0x00000010, slot->encoded, slot->encodedSize))
+			return qfalse;
+
+		afd.numVideoFrames++;
+
+		if(slot->encodedSize > afd.maxRecordSize)
+			afd.maxRecordSize = slot->encodedSize;
+	}
+
+	return qtrue;
+}
+
+/*
+===============
+CL_RunAVIJob
+
+Writes the oldest slot if it is encoded or encodes the next queued slot.
+Called with aq.mutex locked, returns qfalse if there was nothing to do.
+===============
+*/
+static qboolean CL_RunAVIJob(void)
+{
+	aviSlot_t      *slot;
+	qboolean        written;
+
+	slot = &aq.slots[aq.tail % AVI_QUEUE_SLOTS];
+	if(!aq.writing && aq.tail != aq.head && slot->state == AVI_SLOT_ENCODED)
+	{
+		aq.writing = qtrue;
+		SDL_UnlockMutex(aq.mutex);
+
+		written = CL_WriteAVISlot(slot);
+
+		SDL_LockMutex(aq.mutex);
+		if(!written)
+			aq.writeError = qtrue;
+
+		slot->state = AVI_SLOT_FREE;
+		aq.tail++;
+		aq.writing = qfalse;
+
+		SDL_CondBroadcast(aq.cond);
+		return qtrue;
+	}
+
+	slot = &aq.slots[aq.next % AVI_QUEUE_SLOTS];
+	if(aq.next != aq.head && slot->state == AVI_SLOT_QUEUED)
+	{
+		slot->state = AVI_SLOT_ENCODING;
+		aq.next++;
+		SDL_UnlockMutex(aq.mutex);
+
+		CL_EncodeAVISlot(slot);
+
+		SDL_LockMutex(aq.mutex);
+		slot->state = AVI_SLOT_ENCODED;
+
+		if(!slot->audio && slot->encodedSize <= 0)
+			aq.droppedFrames++;
+
+		SDL_CondBroadcast(aq.cond);
+		return qtrue;
+	}
+
+	return qfalse;
+}
+
+/*
+===============
+CL_AVIThread
+===============
+*/
+static int CL_AVIThread(void *arg)
+{
+	SDL_LockMutex(aq.mutex);
+
+	while(qtrue)
+	{
+		if(CL_RunAVIJob())
+			continue;
+
+		if(aq.shutdown)
+			break;
+
+		SDL_CondWait(aq.cond, aq.mutex);
+	}
+
+	SDL_UnlockMutex(aq.mutex);
+
+	return 0;
+}
+
+/*
+===============
+CL_StartAVIQueue
+===============
+*/
+static qboolean CL_StartAVIQueue(void)
+{
+	int             i, numThreads;
+
+	Com_Memset(&aq, 0, sizeof(aq));
+
+	aq.mutex = SDL_CreateMutex();
+	aq.cond = SDL_CreateCond();
+
+	if(!aq.mutex || !aq.cond)
+	{
+		Com_Printf(S_COLOR_YELLOW "WARNING: AVI queue creation failed: %s\n", SDL_GetError());
+		return qfalse;
+	}
+
+	// big enough for a padded frame, its JPEG and a chunk of audio
+	aq.frameStride = PAD(afd.width * 3, AVI_LINE_PADDING);
+	aq.slotSize = aq.frameStride * afd.height;
+	if(aq.slotSize < PCM_BUFFER_SIZE)
+		aq.slotSize = PCM_BUFFER_SIZE;
+
+	// too big for the zone
+	for(i = 0; i < AVI_QUEUE_SLOTS; i++)
+	{
+		aq.slots[i].data = malloc(aq.slotSize);
+
+		if(afd.motionJpeg)
+			aq.slots[i].encoded = malloc(aq.slotSize);
+	}
+
+	numThreads = SDL_GetCPUCount() - 1;
+	if(numThreads < 1)
+		numThreads = 1;
+	if(numThreads > AVI_MAX_THREADS)
+		numThreads = AVI_MAX_THREADS;
+
+	// without threads the producers run the jobs when the queue is full
+	for(aq.numThreads = 0; aq.numThreads < numThreads; aq.numThreads++)
+	{
+		aq.threads[aq.numThreads] = SDL_CreateThread(CL_AVIThread, "avi writer", NULL);
+		if(aq.threads[aq.numThreads] == NULL)
+			break;
+	}
+
+	return qtrue;
+}
+
+/*
+===============
+CL_FlushAVIQueue
+
+Waits until everything that was queued is in the file
+===============
+*/
+static void CL_FlushAVIQueue(void)
+{
+	if(!aq.mutex)
+		return;
+
+	SDL_LockMutex(aq.mutex);
+
+	while(aq.tail != aq.head)
+	{
+		if(!CL_RunAVIJob())
+			SDL_CondWait(aq.cond, aq.mutex);
+	}
+
+	SDL_UnlockMutex(aq.mutex);
+
+	if(aq.writeError)
+	{
+		aq.writeError = qfalse;
+		Com_Error(ERR_DROP, "Failed to write avi file\n");
+	}
+}
+
+/*
+===============
+CL_StopAVIQueue
+===============
+*/
+static void CL_StopAVIQueue(void)
+{
+	int             i;
+
+	if(!aq.mutex)
+		return;
+
+	CL_FlushAVIQueue();
+
+	SDL_LockMutex(aq.mutex);
+	aq.shutdown = qtrue;
+	SDL_CondBroadcast(aq.cond);
+	SDL_UnlockMutex(aq.mutex);
+
+	for(i = 0; i < aq.numThreads; i++)
+		SDL_WaitThread(aq.threads[i], NULL);
+
+	if(aq.droppedFrames)
+		Com_Printf(S_COLOR_YELLOW "WARNING: %d video frames did not fit into the JPEG buffer\n", aq.droppedFrames);
+
+	for(i = 0; i < AVI_QUEUE_SLOTS; i++)
+	{
+		free(aq.slots[i].data);
+
+		if(afd.motionJpeg)
+			free(aq.slots[i].encoded);
+	}
+
+	SDL_DestroyCond(aq.cond);
+	SDL_DestroyMutex(aq.mutex);
+
+	Com_Memset(&aq, 0, sizeof(aq));
+}
+
+/*
+===============
+CL_QueueAVIChunk
+
+Copies the data into the next free slot, blocks while the queue is full.
+Called by the main thread and the render thread.
+===============
+*/
+static void CL_QueueAVIChunk(qboolean audio, const byte * data, int size)
+{
+	aviSlot_t      *slot;
+
+	if(size > aq.slotSize)
+		return;
+
+	SDL_LockMutex(aq.mutex);
+
+	while(aq.head - aq.tail == AVI_QUEUE_SLOTS)
+	{
+		if(!CL_RunAVIJob())
+			SDL_CondWait(aq.cond, aq.mutex);
+	}
+
+	slot = &aq.slots[aq.head % AVI_QUEUE_SLOTS];
+	slot->state = AVI_SLOT_FILLING;
+	aq.head++;
+
+	SDL_UnlockMutex(aq.mutex);
+
+	Com_Memcpy(slot->data, data, size);
+	slot->audio = audio;
+	slot->size = size;
+
+	SDL_LockMutex(aq.mutex);
+	slot->state = AVI_SLOT_QUEUED;
+	SDL_CondBroadcast(aq.cond);
+	SDL_UnlockMutex(aq.mutex);
+}
+
 /*
 ===============
 CL_OpenAVIForWriting
@@ -361,13 +812,8 @@ qboolean CL_OpenAVIForWriting(const char *fileName)
 	else
 		afd.motionJpeg = qfalse;
 
-	// Buffers only need to store RGB pixels.
-	// Allocate a bit more space for the capture buffer to account for possible
-	// padding at the end of pixel lines, and padding for alignment
-#define MAX_PACK_LEN 16
-	afd.cBuffer = Z_Malloc((afd.width * 3 + MAX_PACK_LEN - 1) * afd.height + MAX_PACK_LEN - 1);
-	// raw avi files have pixel lines start on 4-byte boundaries
-	afd.eBuffer = Z_Malloc(PAD(afd.width * 3, AVI_LINE_PADDING) * afd.height);
+	// the renderer reads back RGB pixels without line padding
+	afd.cBuffer = Z_Malloc(afd.width * afd.height * 3);
 
 	afd.a.rate = dma.speed;
 	afd.a.format = WAV_FORMAT_PCM;
@@ -418,6 +864,18 @@ qboolean CL_OpenAVIForWriting(const char *fileName)
 	SafeFS_Write(buffer, bufIndex, afd.idxF);
 
 	afd.moviSize = 4;			// For the "movi"
+
+	if(!CL_StartAVIQueue())
+	{
+		CL_StopAVIQueue();
+		Z_Free(afd.cBuffer);
+		FS_FCloseFile(afd.idxF);
+		FS_FCloseFile(afd.f);
+		return qfalse;
+	}
+
+	aq.reservedSize = afd.fileSize + 4;
+
 	afd.fileOpen = qtrue;
 
 	return qtrue;
@@ -426,12 +884,27 @@ qboolean CL_OpenAVIForWriting(const char *fileName)
 /*
 ===============
 CL_CheckFileSize
+
+Reserves room for a chunk, bytesToAdd is an upper bound of the chunk
+and its index entry. Starts a new file if the chunk doesn't fit.
 ===============
 */
-static qboolean CL_CheckFileSize(int bytesToAdd)
+static void CL_CheckFileSize(int bytesToAdd)
 {
 	unsigned int    newFileSize;
 
+	if(aq.reservedSize + bytesToAdd <= INT_MAX)
+	{
+		aq.reservedSize += bytesToAdd;
+		return;
+	}
+
+	// the reservation was too pessimistic or the file is really full
+	if(re.FinishVideoFrames)
+		re.FinishVideoFrames();
+
+	CL_FlushAVIQueue();
+
 	newFileSize = afd.fileSize +	// Current file size
 		bytesToAdd +			// What we want to add
 		(afd.numIndices * 16) +	// The index
@@ -445,61 +918,34 @@ static qboolean CL_CheckFileSize(int bytesToAdd)
 		CL_CloseAVI();
 
 		// ...And open a new one
-		CL_OpenAVIForWriting(va("%s_", afd.fileName));
+		if(CL_OpenAVIForWriting(va("%s_", afd.fileName)))
+			aq.reservedSize += bytesToAdd;
 
-		return qtrue;
+		return;
 	}
 
-	return qfalse;
+	aq.reservedSize = newFileSize;
 }
 
 /*
 ===============
 CL_WriteAVIVideoFrame
+
+Called by the renderer with the raw pixels of a frame
 ===============
 */
 void CL_WriteAVIVideoFrame(const byte * imageBuffer, int size)
 {
-	int             chunkOffset = afd.fileSize - afd.moviOffset - 8;
-	int             chunkSize = 8 + size;
-	int             paddingSize = PAD(size, 2) - size;
-	byte            padding[4] = { 0 };
-
 	if(!afd.fileOpen)
 		return;
 
-	// Chunk header + contents + padding
-	if(CL_CheckFileSize(8 + size + 2))
+	// the frame was rendered before a vid_restart
+	if(size != afd.width * afd.height * 3)
 		return;
 
-	bufIndex = 0;
-	WRITE_STRING("00dc");
-	WRITE_4BYTES(size);
-
-	SafeFS_Write(buffer, 8, afd.f);
-	SafeFS_Write(imageBuffer, size, afd.f);
-	SafeFS_Write(padding, paddingSize, afd.f);
-	afd.fileSize += (chunkSize + paddingSize);
-
-	afd.numVideoFrames++;
-	afd.moviSize += (chunkSize + paddingSize);
-
-	if(size > afd.maxRecordSize)
-		afd.maxRecordSize = size;
-
-	// Index
-	bufIndex = 0;
-	WRITE_STRING("00dc");		//dwIdentifier
-	WRITE_4BYTES(0x00000010);	//dwFlags (all frames are KeyFrames)
-	WRITE_4BYTES(chunkOffset);	//dwOffset
-	WRITE_4BYTES(size);			//dwLength
-	SafeFS_Write(buffer, 16, afd.idxF);
-
-	afd.numIndices++;
+	CL_QueueAVIChunk(qfalse, imageBuffer, size);
 }
 
-#define PCM_BUFFER_SIZE 44100
-
 /*
 ===============
 CL_WriteAVIAudioFrame
@@ -516,10 +962,6 @@ void CL_WriteAVIAudioFrame(const byte * pcmBuffer, int size)
 	if(!afd.fileOpen)
 		return;
 
-	// Chunk header + contents + padding
-	if(CL_CheckFileSize(8 + bytesInBuffer + size + 2))
-		return;
-
 	if(bytesInBuffer + size > PCM_BUFFER_SIZE)
 	{
 		Com_Printf(S_COLOR_YELLOW "WARNING: Audio capture buffer overflow -- truncating\n");
@@ -532,33 +974,11 @@ void CL_WriteAVIAudioFrame(const byte * pcmBuffer, int size)
 	// Only write if we have a frame's worth of audio
 	if(bytesInBuffer >= (int)ceil((float)afd.a.rate / (float)afd.frameRate) * afd.a.sampleSize)
 	{
-		int             chunkOffset = afd.fileSize - afd.moviOffset - 8;
-		int             chunkSize = 8 + bytesInBuffer;
-		int             paddingSize = PAD(bytesInBuffer, 2) - bytesInBuffer;
-		byte            padding[4] = { 0 };
-
-		bufIndex = 0;
-		WRITE_STRING("01wb");
-		WRITE_4BYTES(bytesInBuffer);
-
-		SafeFS_Write(buffer, 8, afd.f);
-		SafeFS_Write(pcmCaptureBuffer, bytesInBuffer, afd.f);
-		SafeFS_Write(padding, paddingSize, afd.f);
-		afd.fileSize += (chunkSize + paddingSize);
-
-		afd.numAudioFrames++;
-		afd.moviSize += (chunkSize + paddingSize);
-		afd.a.totalBytes += bytesInBuffer;
+		// Chunk header + contents + padding + index
+		CL_CheckFileSize(8 + bytesInBuffer + 2 + 16);
 
-		// Index
-		bufIndex = 0;
-		WRITE_STRING("01wb");	//dwIdentifier
-		WRITE_4BYTES(0);		//dwFlags
-		WRITE_4BYTES(chunkOffset);	//dwOffset
-		WRITE_4BYTES(bytesInBuffer);	//dwLength
-		SafeFS_Write(buffer, 16, afd.idxF);
-
-		afd.numIndices++;
+		if(afd.fileOpen)
+			CL_QueueAVIChunk(qtrue, pcmCaptureBuffer, bytesInBuffer);
 
 		bytesInBuffer = 0;
 	}
@@ -575,7 +995,16 @@ void CL_TakeVideoFrame(void)
 	if(!afd.fileOpen)
 		return;
 
-	re.TakeVideoFrame(afd.width, afd.height, afd.cBuffer, afd.eBuffer, afd.motionJpeg);
+	// Chunk header + contents + padding + index, JPEGs are never bigger than the padded frame
+	CL_CheckFileSize(8 + PAD(afd.width * 3, AVI_LINE_PADDING) * afd.height + 2 + 16);
+
+	if(!afd.fileOpen)
+		return;
+
+	if(aq.writeError)
+		CL_FlushAVIQueue();
+
+	re.TakeVideoFrame(afd.width, afd.height, afd.cBuffer);
 }
 
 /*
@@ -595,8 +1024,14 @@ qboolean CL_CloseAVI(void)
 	if(!afd.fileOpen)
 		return qfalse;
 
+	// get the frames that are still read back
+	if(re.FinishVideoFrames)
+		re.FinishVideoFrames();
+
 	afd.fileOpen = qfalse;
 
+	CL_StopAVIQueue();
+
 	FS_Seek(afd.idxF, 4, FS_SEEK_SET);
 	bufIndex = 0;
 	WRITE_4BYTES(indexSize);
@@ -643,7 +1078,6 @@ qboolean CL_CloseAVI(void)
 	SafeFS_Write(buffer, bufIndex, afd.f);
 
 	Z_Free(afd.cBuffer);
-	Z_Free(afd.eBuffer);
 	FS_FCloseFile(afd.f);
 
 	Com_Printf("Wrote %d:%d frames to %s\n", afd.numVideoFrames, afd.numAudioFrames, afd.fileName);
@@ -3326,6 +3326,7 @@ void CL_InitRef(void)
 	ri.FS_ListFiles = FS_ListFiles;
 	ri.FS_ListFilteredFiles = FS_ListFilteredFiles;
 	ri.FS_FileIsInPAK = FS_FileIsInPAK;
+	ri.FS_FileInPAKChecksum = FS_FileInPAKChecksum;
 	ri.FS_FileExists = FS_FileExists;
 
 	ri.Cvar_Get = Cvar_Get;
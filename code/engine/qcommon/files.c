@@ -1873,6 +1873,64 @@ int FS_FileIsInPAK(const char *filename, int *pChecksum)
 	return -1;
 }
 
+/*
+================
+FS_FileInPAKChecksum
+
+Like FS_FileIsInPAK, but returns the checksum of the pak contents,
+which unlike the pure checksum doesn't change with fs_checksumFeed
+================
+*/
+int FS_FileInPAKChecksum(const char *filename, int *pChecksum)
+{
+	searchpath_t   *search;
+	fileInPack_t   *pakFile;
+	long            hash;
+
+	if(!fs_searchpaths)
+	{
+		Com_Error(ERR_FATAL, "Filesystem call made without initialization\n");
+	}
+
+	if(!filename)
+	{
+		Com_Error(ERR_FATAL, "FS_FileInPAKChecksum: NULL 'filename' parameter passed\n");
+	}
+
+	// qpaths are not supposed to have a leading slash
+	if(filename[0] == '/' || filename[0] == '\\')
+	{
+		filename++;
+	}
+
+	if(strstr(filename, "..") || strstr(filename, "::"))
+	{
+		return -1;
+	}
+
+	for(search = fs_searchpaths; search; search = search->next)
+	{
+		if(!search->pack || !FS_PakIsPure(search->pack))
+		{
+			continue;
+		}
+
+		hash = FS_HashFileName(filename, search->pack->hashSize);
+		for(pakFile = search->pack->hashTable[hash]; pakFile; pakFile = pakFile->next)
+		{
+			if(!FS_FilenameCompare(pakFile->name, filename))
+			{
+				if(pChecksum)
+				{
+					*pChecksum = search->pack->checksum;
+				}
+				return 1;
+			}
+		}
+	}
+	return -1;
+}
+
 /*
 ============
 FS_ReadFile
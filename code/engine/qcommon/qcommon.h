@@ -694,6 +694,10 @@ int             FS_FileIsInPAK(const char *filename, int *pChecksum);
 
 // returns 1 if a file is in the PAK file, otherwise -1
 
+int             FS_FileInPAKChecksum(const char *filename, int *pChecksum);
+
+// same as FS_FileIsInPAK, but with the checksum of the pak contents that stays the same between restarts
+
 int             FS_Write(const void *buffer, int len, fileHandle_t f);
 
 int             FS_Read2(void *buffer, int len, fileHandle_t f);
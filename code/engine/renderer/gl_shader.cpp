@@ -35,6 +35,7 @@ GLShader_forwardLighting_directionalSun* gl_forwardLightingShader_directionalSun
 GLShader_deferredLighting_omniXYZ* gl_deferredLightingShader_omniXYZ = NULL;
 GLShader_deferredLighting_projXYZ* gl_deferredLightingShader_projXYZ = NULL;
 GLShader_deferredLighting_directionalSun* gl_deferredLightingShader_directionalSun = NULL;
+GLShader_deferredLighting_clustered* gl_deferredLightingShader_clustered = NULL;
 GLShader_geometricFill* gl_geometricFillShader = NULL;
 GLShader_shadowFill* gl_shadowFillShader = NULL;
 GLShader_reflection* gl_reflectionShader = NULL;
@@ -112,6 +113,28 @@ uint32_t	GLCompileMacro_USE_VERTEX_ANIMATION::GetRequiredVertexAttributes() cons
 	return attribs;
 }
 
+bool GLCompileMacro_USE_INSTANCING::HasConflictingMacros(int permutation, const std::vector<GLCompileMacro*>& macros) const
+{
+	for(size_t i = 0; i < macros.size(); i++)
+	{
+		GLCompileMacro* macro = macros[i];
+
+		// the bone matrices already take all vertex uniforms and
+		// the cube probes are chosen by the origin of a single entity
+		if((permutation & macro->GetBit()) != 0 && (macro->GetType() == USE_VERTEX_SKINNING || macro->GetType() == USE_REFLECTIVE_SPECULAR))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool GLCompileMacro_USE_INSTANCING::MissesRequiredMacros(int permutation, const std::vector<GLCompileMacro*>& macros) const
+{
+	return !glConfig2.drawInstancedAvailable;
+}
+
 bool GLCompileMacro_USE_DEFORM_VERTEXES::HasConflictingMacros(int permutation, const std::vector<GLCompileMacro*>& macros) const
 {
 	return (glConfig.driverType != GLDRV_OPENGL3 || !r_vboDeformVertexes->integer);
@@ -312,6 +335,17 @@ std::string	GLShader::BuildGPUShaderText(	const char *mainShaderName,
 
 		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef MAX_SHADOWMAPS\n#define MAX_SHADOWMAPS %i\n#endif\n", MAX_SHADOWMAPS));
 
+		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef CLUSTER_TILES_X\n#define CLUSTER_TILES_X %i\n#endif\n", CLUSTER_TILES_X));
+		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef CLUSTER_TILES_Y\n#define CLUSTER_TILES_Y %i\n#endif\n", CLUSTER_TILES_Y));
+		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef CLUSTER_SLICES\n#define CLUSTER_SLICES %i\n#endif\n", CLUSTER_SLICES));
+		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef MAX_CLUSTER_LIGHTS\n#define MAX_CLUSTER_LIGHTS %i\n#endif\n", MAX_CLUSTER_LIGHTS));
+		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef CLUSTER_LIGHT_TEXELS\n#define CLUSTER_LIGHT_TEXELS %i\n#endif\n", CLUSTER_LIGHT_TEXELS));
+		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef MAX_CLUSTER_INDEXES\n#define MAX_CLUSTER_INDEXES %i\n#endif\n", MAX_CLUSTER_INDEXES));
+		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef CLUSTER_INDEX_WIDTH\n#define CLUSTER_INDEX_WIDTH %i\n#endif\n", CLUSTER_INDEX_WIDTH));
+
+		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef MAX_INSTANCES\n#define MAX_INSTANCES %i\n#endif\n", MAX_INSTANCES));
+		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef INSTANCE_VECTORS\n#define INSTANCE_VECTORS %i\n#endif\n", INSTANCE_VECTORS));
+
 		Q_strcat(bufferExtra, sizeof(bufferExtra), va("#ifndef MAX_SHADER_DEFORM_PARMS\n#define MAX_SHADER_DEFORM_PARMS %i\n#endif\n", MAX_SHADER_DEFORM_PARMS));
 
 		Q_strcat(bufferExtra, sizeof(bufferExtra),
@@ -716,11 +750,20 @@ std::string	GLShader::BuildGPUShaderText(	const char *mainShaderName,
 void GLShader::LoadShader()
 {
 	_shaderPrograms = std::vector<shaderProgram_t>( 1 << _compileMacros.size() );
+	_usedPermutations = std::vector<byte>( 1 << _compileMacros.size() );
 
 	if ( !LoadShaderBinary() )
 	{
-		CompilePermutations();
-		SaveShaderBinary();
+		if( r_lazyShaders->integer )
+		{
+			// only compile what the last session used, the rest is compiled on demand
+			CompileUsedPermutations();
+		}
+		else
+		{
+			CompilePermutations();
+			SaveShaderBinary();
+		}
 	}
 }
 
@@ -939,6 +982,12 @@ void GLShader::CompileAndLinkGPUShaderProgram(	shaderProgram_t * program,
 	{
 		vertexHeader += "#version 120\n";
 		fragmentHeader += "#version 120\n";
+
+		if(glConfig2.drawInstancedAvailable)
+		{
+			vertexHeader += "#extension GL_ARB_draw_instanced : enable\n";
+			vertexHeader += "#define gl_InstanceID gl_InstanceIDARB\n";
+		}
 	}
 
 	// permutation macros
@@ -973,6 +1022,83 @@ void GLShader::CompileAndLinkGPUShaderProgram(	shaderProgram_t * program,
 	LinkProgram(program->program);
 }
 
+void GLShader::LoadShaderText()
+{
+	if( !_vertexShaderText.empty() )
+	{
+		return;
+	}
+
+	std::string vertexInlines = "";
+	this->BuildShaderVertexLibNames(vertexInlines);
+
+	std::string fragmentInlines = "";
+	this->BuildShaderFragmentLibNames(fragmentInlines);
+
+	_vertexShaderText = BuildGPUShaderText( this->GetMainShaderName().c_str(), vertexInlines.c_str(), GL_VERTEX_SHADER );
+	_fragmentShaderText = BuildGPUShaderText( this->GetMainShaderName().c_str(), fragmentInlines.c_str(), GL_FRAGMENT_SHADER );
+}
+
+/*
+BeginPermutation only issues the compile and link commands, FinishPermutation
+queries the results. Keeping the status queries out of the loop lets drivers
+with a threaded shader compiler build a whole batch of permutations in parallel.
+*/
+bool GLShader::BeginPermutation(int permutation)
+{
+	std::string compileMacros;
+
+	if(!GetCompileMacrosString(permutation, compileMacros))
+	{
+		return false;
+	}
+
+	this->BuildShaderCompileMacros(compileMacros);
+
+	//ri.Printf(PRINT_ALL, "Compile macros: '%s'\n", compileMacros.c_str());
+
+	shaderProgram_t *shaderProgram = &_shaderPrograms[permutation];
+
+	Q_strncpyz( shaderProgram->name, this->GetName().c_str(), sizeof( shaderProgram->name ) );
+
+#if 0
+	if ( !compileMacros.empty() )
+	{
+		program->compileMacros = ( char * ) ri.Hunk_Alloc( sizeof( char ) * compileMacros.length() + 1, h_low );
+		Q_strncpyz( program->compileMacros, compileMacros.c_str(), compileMacros.length() + 1 );
+	}
+	else
+#endif
+	{
+		shaderProgram->compileMacros = NULL;
+	}
+
+	shaderProgram->program = glCreateProgram();
+	shaderProgram->attribs = _vertexAttribsRequired; // | _vertexAttribsOptional;
+
+	CompileAndLinkGPUShaderProgram(	shaderProgram, _vertexShaderText, _fragmentShaderText, compileMacros, permutation);
+
+	return true;
+}
+
+void GLShader::FinishPermutation(int permutation)
+{
+	shaderProgram_t *shaderProgram = &_shaderPrograms[permutation];
+
+	CheckLinkStatus(shaderProgram->program, shaderProgram->name);
+
+	UpdateShaderProgramUniformLocations(shaderProgram);
+
+	SetShaderProgramUniformLocations(shaderProgram);
+	glUseProgram( shaderProgram->program );
+	SetShaderProgramUniforms(shaderProgram);
+	glUseProgram( 0 );
+
+	ValidateProgram(shaderProgram->program);
+	//ShowProgramUniforms(shaderProgram->program);
+	GL_CheckErrors();
+}
+
 void GLShader::CompilePermutations() 
 {
 	ri.Printf(PRINT_DEVELOPER, "/// -------------------------------------------------\n");
@@ -982,14 +1108,7 @@ void GLShader::CompilePermutations()
 	
 	//Com_Memset(_shaderPrograms, 0, sizeof(_shaderPrograms));
 
-	std::string vertexInlines = "";
-	this->BuildShaderVertexLibNames(vertexInlines);
-
-	std::string fragmentInlines = "";
-	this->BuildShaderFragmentLibNames(fragmentInlines);
-
-	std::string vertexShaderText = BuildGPUShaderText( this->GetMainShaderName().c_str(), vertexInlines.c_str(), GL_VERTEX_SHADER );
-	std::string fragmentShaderText = BuildGPUShaderText( this->GetMainShaderName().c_str(), fragmentInlines.c_str(), GL_FRAGMENT_SHADER );
+	LoadShaderText();
 
 	size_t numPermutations = (1 << _compileMacros.size());	// same as 2^n, n = no. compile macros
 	size_t numCompiled = 0;
@@ -1021,54 +1140,174 @@ void GLShader::CompilePermutations()
 			}
 		}
 
-		std::string compileMacros;
+		if(BeginPermutation(i))
+		{
+			numCompiled++;
+		}
+	}
 
-		if(GetCompileMacrosString(i, compileMacros))
+	for(size_t i = 0; i < numPermutations; i++)
+	{
+		if(_shaderPrograms[i].program)
 		{
-			this->BuildShaderCompileMacros(compileMacros);
+			FinishPermutation(i);
+		}
+	}
 
-			//ri.Printf(PRINT_ALL, "Compile macros: '%s'\n", compileMacros.c_str());
+	SelectProgram();
 
-			shaderProgram_t *shaderProgram = &_shaderPrograms[i];
+	int endTime = ri.Milliseconds();
+	ri.Printf(PRINT_DEVELOPER, "...compiled %i %s shader permutations in %5.2f seconds\n", ( int ) numCompiled, this->GetName().c_str(), ( endTime - startTime ) / 1000.0);
+}
 
-			Q_strncpyz( shaderProgram->name, this->GetName().c_str(), sizeof( shaderProgram->name ) );
+/*
+compile the base permutation, which is the fallback while other permutations
+are not compiled yet, and all permutations recorded by the previous session
+*/
+void GLShader::CompileUsedPermutations()
+{
+	int             fileLength;
+	void           *buffer;
+	char           *text_p;
+	char           *token;
+	size_t          numPermutations = _shaderPrograms.size();
+	size_t          numCompiled = 0;
 
-#if 0
-			if ( !compileMacros.empty() )
-			{
-				program->compileMacros = ( char * ) ri.Hunk_Alloc( sizeof( char ) * compileMacros.length() + 1, h_low );
-				Q_strncpyz( program->compileMacros, compileMacros.c_str(), compileMacros.length() + 1 );
-			}
-			else
-#endif
-			{
-				shaderProgram->compileMacros = NULL;
-			}
+	int startTime = ri.Milliseconds();
 
-			shaderProgram->program = glCreateProgram();
-			shaderProgram->attribs = _vertexAttribsRequired; // | _vertexAttribsOptional;
+	LoadShaderText();
 
-			CompileAndLinkGPUShaderProgram(	shaderProgram, vertexShaderText, fragmentShaderText, compileMacros, i);
+	_usedPermutations[0] = 1;
 
-			UpdateShaderProgramUniformLocations(shaderProgram);
+	fileLength = ri.FS_ReadFile( va( "glsl/%s.perm", this->GetName().c_str() ), &buffer );
 
-			SetShaderProgramUniformLocations(shaderProgram);
-			glUseProgram( shaderProgram->program );
-			SetShaderProgramUniforms(shaderProgram);
-			glUseProgram( 0 );
+	if( fileLength > 0 )
+	{
+		text_p = ( char * ) buffer;
 
-			ValidateProgram(shaderProgram->program);
-			//ShowProgramUniforms(shaderProgram->program);
-			GL_CheckErrors();
+		// the record is only valid for the same set of compile macros
+		token = Com_ParseExt( &text_p, qtrue );
+
+		if( atoi( token ) == ( int ) GL_SHADER_VERSION && atoi( Com_ParseExt( &text_p, qfalse ) ) == ( int ) _compileMacros.size() )
+		{
+			while( 1 )
+			{
+				token = Com_ParseExt( &text_p, qtrue );
 
+				if( !token[0] )
+				{
+					break;
+				}
+
+				size_t permutation = atoi( token );
+
+				if( permutation < numPermutations )
+				{
+					_usedPermutations[permutation] = 1;
+				}
+			}
+		}
+
+		ri.FS_FreeFile( buffer );
+	}
+
+	for( size_t i = 0; i < numPermutations; i++ )
+	{
+		if( _usedPermutations[i] && BeginPermutation( i ) )
+		{
 			numCompiled++;
 		}
 	}
 
+	for( size_t i = 0; i < numPermutations; i++ )
+	{
+		if( _shaderPrograms[i].program )
+		{
+			FinishPermutation( i );
+		}
+	}
+
+	if( !_shaderPrograms[0].program )
+	{
+		ri.Error( ERR_DROP, "Couldn't compile base permutation of %s", this->GetName().c_str() );
+	}
+
 	SelectProgram();
 
 	int endTime = ri.Milliseconds();
-	ri.Printf(PRINT_DEVELOPER, "...compiled %i %s shader permutations in %5.2f seconds\n", ( int ) numCompiled, this->GetName().c_str(), ( endTime - startTime ) / 1000.0);
+	ri.Printf(PRINT_DEVELOPER, "...compiled %i of %i %s shader permutations in %5.2f seconds\n", ( int ) numCompiled, ( int ) numPermutations, this->GetName().c_str(), ( endTime - startTime ) / 1000.0);
+}
+
+void GLShader::SaveUsedPermutations()
+{
+	std::string     text;
+
+	if( !_usedPermutationsChanged )
+	{
+		return;
+	}
+
+	text = va( "%i %i\n", ( int ) GL_SHADER_VERSION, ( int ) _compileMacros.size() );
+
+	for( size_t i = 0; i < _usedPermutations.size(); i++ )
+	{
+		if( _usedPermutations[i] )
+		{
+			text += va( "%i\n", ( int ) i );
+		}
+	}
+
+	ri.FS_WriteFile( va( "glsl/%s.perm", this->GetName().c_str() ), text.c_str(), text.length() );
+
+	_usedPermutationsChanged = false;
+}
+
+/*
+pick the compiled permutation that shares the most compile macros with the
+requested one without enabling any the caller did not ask for, only quality
+macros may be missing. returns NULL if there is none
+*/
+shaderProgram_t* GLShader::GetFallbackProgram(int permutation)
+{
+	int             best = -1;
+	int             bestBits = -1;
+	int             qualityBits = 0;
+
+	for( size_t j = 0; j < _compileMacros.size(); j++ )
+	{
+		if( _compileMacros[j]->IsQualityMacro() )
+		{
+			qualityBits |= _compileMacros[j]->GetBit();
+		}
+	}
+
+	for( size_t i = 0; i < _shaderPrograms.size(); i++ )
+	{
+		if( !_shaderPrograms[i].program || ( i & ~permutation ) || ( permutation & ~i & ~qualityBits ) )
+		{
+			continue;
+		}
+
+		int numBits = 0;
+
+		for( size_t j = i; j; j &= j - 1 )
+		{
+			numBits++;
+		}
+
+		if( numBits > bestBits )
+		{
+			best = i;
+			bestBits = numBits;
+		}
+	}
+
+	if( best < 0 )
+	{
+		return NULL;
+	}
+
+	return &_shaderPrograms[best];
 }
 
 void GLShader::CompileGPUShader(GLuint program, const char *programName, const char *shaderText, int shaderTextSize, GLenum shaderType) const
@@ -1084,17 +1323,7 @@ void GLShader::CompileGPUShader(GLuint program, const char *programName, const c
 
 	GL_CheckErrors();
 
-	// check if shader compiled
-	GLint compiled;
-	glGetShaderiv( shader, GL_COMPILE_STATUS, &compiled );
-
-	if(!compiled)
-	{
-		PrintShaderSource(shader);
-		PrintInfoLog(shader, qfalse);
-		ri.Error( ERR_DROP, "Couldn't compile %s %s", ( shaderType == GL_VERTEX_SHADER ? "vertex shader" : "fragment shader" ), programName );
-		return;
-	}
+	// the compile status is checked after linking by CheckLinkStatus
 
 	//PrintInfoLog(shader, qtrue);
 	//ri.Printf(PRINT_ALL, "%s\n", GLSL_PrintShaderSource(shader));
@@ -1189,8 +1418,6 @@ void GLShader::PrintInfoLog( GLuint object, bool developerOnly ) const
 
 void GLShader::LinkProgram( GLuint program ) const
 {
-	GLint           linked;
-
 #ifdef GLEW_ARB_get_program_binary
 	// Apparently, this is necessary to get the binary program via glGetProgramBinary
 	if( GLEW_ARB_get_program_binary )
@@ -1199,11 +1426,38 @@ void GLShader::LinkProgram( GLuint program ) const
 	}
 #endif
 	glLinkProgram(program);
+}
+
+void GLShader::CheckLinkStatus( GLuint program, const char *programName ) const
+{
+	GLint           linked;
+	GLint           compiled;
+	GLint           shaderType;
+	GLuint          shaders[2];
+	GLsizei         numShaders = 0;
 
 	glGetProgramiv( program, GL_LINK_STATUS, &linked );
 
 	if(!linked)
 	{
+		// the attached shaders were only flagged for deletion so we can still ask them why
+		glGetAttachedShaders( program, 2, &numShaders, shaders );
+
+		for(int i = 0; i < numShaders; i++)
+		{
+			glGetShaderiv( shaders[i], GL_COMPILE_STATUS, &compiled );
+
+			if(!compiled)
+			{
+				glGetShaderiv( shaders[i], GL_SHADER_TYPE, &shaderType );
+
+				PrintShaderSource(shaders[i]);
+				PrintInfoLog(shaders[i], qfalse);
+				ri.Error( ERR_DROP, "Couldn't compile %s %s", ( shaderType == GL_VERTEX_SHADER ? "vertex shader" : "fragment shader" ), programName );
+				return;
+			}
+		}
+
 		PrintInfoLog(program, qfalse);
 		ri.Error(ERR_DROP, "Shaders failed to link!!!");
 	}
@@ -1305,7 +1559,7 @@ void GLShader::BindAttribLocations( GLuint program ) const
 	glBindAttribLocation( program, ATTR_INDEX_NORMAL2, "attr_Normal2" );
 }
 
-void GLShader::SelectProgram()
+int GLShader::GetPermutationIndex() const
 {
 	int index = 0;
 
@@ -1319,12 +1573,56 @@ void GLShader::SelectProgram()
 		}
 	}
 
-	_currentProgram = &_shaderPrograms[index];
+	return index;
+}
+
+void GLShader::SelectProgram()
+{
+	_currentProgram = &_shaderPrograms[GetPermutationIndex()];
 }
 
 void GLShader::BindProgram()
 {
-	SelectProgram();
+	int index = GetPermutationIndex();
+	std::string compileMacros;
+
+	_currentProgram = &_shaderPrograms[index];
+
+	if(!_usedPermutations[index])
+	{
+		_usedPermutations[index] = 1;
+		_usedPermutationsChanged = true;
+	}
+
+	if(_currentProgram->program == 0 && r_lazyShaders->integer && GetCompileMacrosString(index, compileMacros))
+	{
+		shaderProgram_t *fallback = NULL;
+
+		// over this frame's budget, draw with a simpler permutation and try again next frame
+		if(r_lazyShaderCompiles->integer && backEnd.pc.c_glslCompiles >= r_lazyShaderCompiles->integer)
+		{
+			fallback = GetFallbackProgram(index);
+		}
+
+		if(fallback)
+		{
+			_currentProgram = fallback;
+
+			backEnd.pc.c_glslFallbacks++;
+		}
+		else
+		{
+			// geometry, clipping and instancing macros can't be left out
+			int startTime = ri.Milliseconds();
+
+			LoadShaderText();
+			BeginPermutation(index);
+			FinishPermutation(index);
+
+			backEnd.pc.c_glslCompiles++;
+			backEnd.pc.c_glslCompileTime += ri.Milliseconds() - startTime;
+		}
+	}
 
 	if(_currentProgram->program == 0)
 	{
@@ -1487,6 +1785,7 @@ GLShader_vertexLighting_DBS_entity::GLShader_vertexLighting_DBS_entity():
 		u_ModelMatrix(this),
 		u_ModelViewProjectionMatrix(this),
 		u_BoneMatrix(this),
+		u_InstanceData(this),
 		u_VertexInterpolation(this),
 		u_PortalPlane(this),
 		u_DepthScale(this),
@@ -1499,7 +1798,8 @@ GLShader_vertexLighting_DBS_entity::GLShader_vertexLighting_DBS_entity():
 		GLCompileMacro_USE_DEFORM_VERTEXES(this),
 		GLCompileMacro_USE_NORMAL_MAPPING(this),
 		GLCompileMacro_USE_PARALLAX_MAPPING(this),
-		GLCompileMacro_USE_REFLECTIVE_SPECULAR(this)//,
+		GLCompileMacro_USE_REFLECTIVE_SPECULAR(this),
+		GLCompileMacro_USE_INSTANCING(this)//,
 		//GLCompileMacro_TWOSIDED(this)
 {
 	LoadShader();
@@ -2058,6 +2358,45 @@ void GLShader_deferredLighting_directionalSun::SetShaderProgramUniforms( shaderP
 	}
 }
 
+GLShader_deferredLighting_clustered::GLShader_deferredLighting_clustered():
+		GLShader("deferredLighting_clustered", "deferredLightingClustered", ATTR_POSITION),
+		u_ViewOrigin(this),
+		u_ModelViewProjectionMatrix(this),
+		u_ViewMatrix(this),
+		u_UnprojectMatrix(this),
+		u_ClusterTileScale(this),
+		u_ClusterDepthScale(this),
+		GLCompileMacro_USE_NORMAL_MAPPING(this)
+{
+	LoadShader();
+}
+
+void GLShader_deferredLighting_clustered::SetShaderProgramUniformLocations( shaderProgram_t * shaderProgram )
+{
+	shaderProgram->u_DiffuseMap = glGetUniformLocation( shaderProgram->program, "u_DiffuseMap" );
+	shaderProgram->u_NormalMap = glGetUniformLocation( shaderProgram->program, "u_NormalMap" );
+	shaderProgram->u_SpecularMap = glGetUniformLocation( shaderProgram->program, "u_SpecularMap" );
+	shaderProgram->u_DepthMap = glGetUniformLocation( shaderProgram->program, "u_DepthMap" );
+	shaderProgram->u_AttenuationMapXY = glGetUniformLocation( shaderProgram->program, "u_AttenuationMapXY" );
+	shaderProgram->u_AttenuationMapZ = glGetUniformLocation( shaderProgram->program, "u_AttenuationMapZ" );
+	shaderProgram->u_ClusterGridMap = glGetUniformLocation( shaderProgram->program, "u_ClusterGridMap" );
+	shaderProgram->u_ClusterIndexMap = glGetUniformLocation( shaderProgram->program, "u_ClusterIndexMap" );
+	shaderProgram->u_ClusterLightMap = glGetUniformLocation( shaderProgram->program, "u_ClusterLightMap" );
+}
+
+void GLShader_deferredLighting_clustered::SetShaderProgramUniforms( shaderProgram_t * shaderProgram )
+{
+	glUniform1i( shaderProgram->u_DiffuseMap, 0 );
+	glUniform1i( shaderProgram->u_NormalMap, 1 );
+	glUniform1i( shaderProgram->u_SpecularMap, 2 );
+	glUniform1i( shaderProgram->u_DepthMap, 3 );
+	glUniform1i( shaderProgram->u_AttenuationMapXY, 4 );
+	glUniform1i( shaderProgram->u_AttenuationMapZ, 5 );
+	glUniform1i( shaderProgram->u_ClusterGridMap, 6 );
+	glUniform1i( shaderProgram->u_ClusterIndexMap, 7 );
+	glUniform1i( shaderProgram->u_ClusterLightMap, 8 );
+}
+
 GLShader_geometricFill::GLShader_geometricFill():
 		GLShader("geometricFill", ATTR_POSITION | ATTR_TEXCOORD | ATTR_NORMAL),
 		u_DiffuseTextureMatrix(this),
@@ -60,6 +60,13 @@ protected:
 	std::vector<shaderProgram_t>		_shaderPrograms;
 	shaderProgram_t*					_currentProgram;
 
+	// r_lazyShaders: permutations are compiled on first use and the used ones
+	// are recorded in glsl/<name>.perm so the next session can compile them up front
+	std::string							_vertexShaderText;
+	std::string							_fragmentShaderText;
+	std::vector<byte>					_usedPermutations;
+	bool								_usedPermutationsChanged;
+
 	std::vector<GLUniform*>				_uniforms;
 	std::vector<GLCompileMacro*>		_compileMacros;
 
@@ -73,6 +80,7 @@ protected:
 	  _mainShaderName(name),
 	  _activeMacros(0),
 	  _currentProgram(NULL),
+	  _usedPermutationsChanged(false),
 	  _vertexAttribsRequired(vertexAttribsRequired),
 	  _vertexAttribs(0)
 	  //_vertexAttribsOptional(vertexAttribsOptional),
@@ -86,6 +94,7 @@ protected:
 	  _mainShaderName(mainName),
 	  _activeMacros(0),
 	  _currentProgram(NULL),
+	  _usedPermutationsChanged(false),
 	  _vertexAttribsRequired(vertexAttribsRequired),
 	  _vertexAttribs(0)
 	  //_vertexAttribsOptional(vertexAttribsOptional),
@@ -94,8 +103,10 @@ protected:
 		//ri.Printf(PRINT_ALL, "/// -------------------------------------------------\n");
 	}
 
-	~GLShader()
+	virtual ~GLShader()
 	{
+		SaveUsedPermutations();
+
 		for(std::size_t i = 0; i < _shaderPrograms.size(); i++)
 		{
 			if(_shaderPrograms[i].program)
@@ -159,7 +170,13 @@ protected:
 	void				LoadShader();
 	bool				LoadShaderBinary();
 	void				SaveShaderBinary();
+	void				LoadShaderText();
 	void				CompilePermutations();
+	void				CompileUsedPermutations();
+	void				SaveUsedPermutations();
+	bool				BeginPermutation(int permutation);
+	void				FinishPermutation(int permutation);
+	shaderProgram_t*	GetFallbackProgram(int permutation);
 
 	virtual void		BuildShaderVertexLibNames( std::string& vertexInlines ) {};
 	virtual void		BuildShaderFragmentLibNames( std::string& fragmentInlines ) {};
@@ -174,6 +191,7 @@ private:
 	void				PrintInfoLog(GLuint object, bool developerOnly) const;
 
 	void				LinkProgram(GLuint program) const;
+	void				CheckLinkStatus(GLuint program, const char *programName) const;
 	void				BindAttribLocations(GLuint program) const;
 
 protected:
@@ -181,6 +199,7 @@ protected:
 	void				ShowProgramUniforms(GLuint program) const;
 	
 public:
+	int					GetPermutationIndex() const;
 	void				SelectProgram();
 	void				BindProgram();
 	void				SetRequiredVertexPointers();
@@ -266,7 +285,8 @@ protected:
 		EYE_OUTSIDE,
 		BRIGHTPASS_FILTER,
 		LIGHT_DIRECTIONAL,
-		USE_GBUFFER
+		USE_GBUFFER,
+		USE_INSTANCING
 	};
 
 public:
@@ -288,6 +308,13 @@ public:
 		return 0;
 	}
 
+	// only affects the look of the shading, so a lazily compiled permutation
+	// may be drawn without it for a frame or two
+	virtual bool		IsQualityMacro() const
+	{
+		return false;
+	}
+
 	void EnableMacro()
 	{
 		int bit = GetBit();
@@ -661,6 +688,11 @@ public:
 		return USE_NORMAL_MAPPING;
 	}
 
+	bool		IsQualityMacro() const
+	{
+		return true;
+	}
+
 	uint32_t	GetRequiredVertexAttributes() const
 	{
 		return ATTR_NORMAL | ATTR_TANGENT | ATTR_BINORMAL;
@@ -708,6 +740,11 @@ public:
 		return USE_PARALLAX_MAPPING;
 	}
 
+	bool		IsQualityMacro() const
+	{
+		return true;
+	}
+
 	bool		MissesRequiredMacros(int permutation, const std::vector<GLCompileMacro*>& macros) const;
 
 	void EnableParallaxMapping()
@@ -752,6 +789,11 @@ public:
 		return USE_REFLECTIVE_SPECULAR;
 	}
 
+	bool		IsQualityMacro() const
+	{
+		return true;
+	}
+
 	bool		MissesRequiredMacros(int permutation, const std::vector<GLCompileMacro*>& macros) const;
 
 	void EnableReflectiveSpecular()
@@ -970,6 +1012,11 @@ public:
 		return USE_SHADOWING;
 	}
 
+	bool		IsQualityMacro() const
+	{
+		return true;
+	}
+
 	void EnableShadowing()
 	{
 		EnableMacro();
@@ -1035,6 +1082,51 @@ public:
 	}
 };
 
+class GLCompileMacro_USE_INSTANCING:
+GLCompileMacro
+{
+public:
+	GLCompileMacro_USE_INSTANCING(GLShader* shader):
+	  GLCompileMacro(shader)
+	{
+	}
+
+	const char* GetName() const
+	{
+		return "USE_INSTANCING";
+	}
+
+	EGLCompileMacro GetType() const
+	{
+		return USE_INSTANCING;
+	}
+
+	bool		HasConflictingMacros(int permutation, const std::vector<GLCompileMacro*>& macros) const;
+	bool		MissesRequiredMacros(int permutation, const std::vector<GLCompileMacro*>& macros) const;
+
+	void EnableInstancing()
+	{
+		EnableMacro();
+	}
+
+	void DisableInstancing()
+	{
+		DisableMacro();
+	}
+
+	void SetInstancing(bool enable)
+	{
+		if(enable)
+		{
+			EnableInstancing();
+		}
+		else
+		{
+			DisableInstancing();
+		}
+	}
+};
+
 class u_ColorMap:
 GLUniform
 {
@@ -1619,6 +1711,56 @@ public:
 	}
 };
 
+class u_ClusterTileScale:
+GLUniform
+{
+public:
+	u_ClusterTileScale(GLShader* shader):
+	  GLUniform(shader)
+	{
+	}
+
+	const char* GetName() const
+	{
+		return "u_ClusterTileScale";
+	}
+
+	void				UpdateShaderProgramUniformLocation(shaderProgram_t *shaderProgram) const
+	{
+		shaderProgram->u_ClusterTileScale = glGetUniformLocation(shaderProgram->program, GetName());
+	}
+
+	void SetUniform_ClusterTileScale(const vec4_t v)
+	{
+		GLSL_SetUniform_ClusterTileScale(_shader->GetProgram(), v);
+	}
+};
+
+class u_ClusterDepthScale:
+GLUniform
+{
+public:
+	u_ClusterDepthScale(GLShader* shader):
+	  GLUniform(shader)
+	{
+	}
+
+	const char* GetName() const
+	{
+		return "u_ClusterDepthScale";
+	}
+
+	void				UpdateShaderProgramUniformLocation(shaderProgram_t *shaderProgram) const
+	{
+		shaderProgram->u_ClusterDepthScale = glGetUniformLocation(shaderProgram->program, GetName());
+	}
+
+	void SetUniform_ClusterDepthScale(const vec4_t v)
+	{
+		GLSL_SetUniform_ClusterDepthScale(_shader->GetProgram(), v);
+	}
+};
+
 class u_RefractionIndex :
 GLUniform
 {
@@ -2079,6 +2221,31 @@ public:
 	}
 };
 
+class u_InstanceData:
+GLUniform
+{
+public:
+	u_InstanceData(GLShader* shader):
+	  GLUniform(shader)
+	{
+	}
+
+	const char* GetName() const
+	{
+		return "u_InstanceData";
+	}
+
+	void				UpdateShaderProgramUniformLocation(shaderProgram_t *shaderProgram) const
+	{
+		shaderProgram->u_InstanceData = glGetUniformLocation(shaderProgram->program, GetName());
+	}
+
+	void SetUniform_InstanceData(int numInstances, const vec4_t instanceData[MAX_INSTANCES * INSTANCE_VECTORS])
+	{
+		glUniform4fv(_shader->GetProgram()->u_InstanceData, numInstances * INSTANCE_VECTORS, &instanceData[0][0]);
+	}
+};
+
 class u_VertexInterpolation:
 GLUniform
 {
@@ -2873,6 +3040,7 @@ public u_LightColor,
 public u_ModelMatrix,
 public u_ModelViewProjectionMatrix,
 public u_BoneMatrix,
+public u_InstanceData,
 public u_VertexInterpolation,
 public u_PortalPlane,
 public u_DepthScale,
@@ -2885,7 +3053,8 @@ public GLCompileMacro_USE_VERTEX_ANIMATION,
 public GLCompileMacro_USE_DEFORM_VERTEXES,
 public GLCompileMacro_USE_NORMAL_MAPPING,
 public GLCompileMacro_USE_PARALLAX_MAPPING,
-public GLCompileMacro_USE_REFLECTIVE_SPECULAR//,
+public GLCompileMacro_USE_REFLECTIVE_SPECULAR,
+public GLCompileMacro_USE_INSTANCING//,
 //public GLCompileMacro_TWOSIDED
 {
 public:
@@ -3156,6 +3325,22 @@ public:
 	void		SetShaderProgramUniforms( shaderProgram_t * shaderProgram );
 };
 
+class GLShader_deferredLighting_clustered:
+public GLShader,
+public u_ViewOrigin,
+public u_ModelViewProjectionMatrix,
+public u_ViewMatrix,
+public u_UnprojectMatrix,
+public u_ClusterTileScale,
+public u_ClusterDepthScale,
+public GLCompileMacro_USE_NORMAL_MAPPING
+{
+public:
+	GLShader_deferredLighting_clustered();
+	void		SetShaderProgramUniformLocations( shaderProgram_t * shaderProgram );
+	void		SetShaderProgramUniforms( shaderProgram_t * shaderProgram );
+};
+
 class GLShader_geometricFill:
 public GLShader,
 public u_DiffuseTextureMatrix,
@@ -3550,6 +3735,7 @@ extern GLShader_forwardLighting_directionalSun* gl_forwardLightingShader_directi
 extern GLShader_deferredLighting_omniXYZ* gl_deferredLightingShader_omniXYZ;
 extern GLShader_deferredLighting_projXYZ* gl_deferredLightingShader_projXYZ;
 extern GLShader_deferredLighting_directionalSun* gl_deferredLightingShader_directionalSun;
+extern GLShader_deferredLighting_clustered* gl_deferredLightingShader_clustered;
 extern GLShader_geometricFill* gl_geometricFillShader;
 extern GLShader_shadowFill* gl_shadowFillShader;
 extern GLShader_reflection* gl_reflectionShader;
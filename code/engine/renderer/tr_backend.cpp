@@ -1302,6 +1302,82 @@ enum renderDrawSurfaces_e
 	DRAWSURFACES_ALL           = 7
 };
 
+/*
+=================
+RB_RenderInstancedDrawSurfaces
+
+Draws a run of surfaces marked by R_FindInstancedDrawSurfs with a single
+instanced draw call, drawSurf is the first surface of the run
+=================
+*/
+static void RB_RenderInstancedDrawSurfaces(drawSurf_t * drawSurf, shader_t * shader)
+{
+	trRefEntity_t  *entity, *firstEntity;
+	vec4_t         *data;
+	float          *m;
+	int             i;
+
+	Tess_Begin(Tess_StageIteratorGeneric, NULL, shader, NULL, qfalse, qfalse, drawSurf->lightmapNum, drawSurf->fogNum);
+
+	firstEntity = NULL;
+	tess.numInstances = 0;
+
+	for(i = 0; i < drawSurf->numInstances; i++)
+	{
+		entity = drawSurf[i].entity;
+
+		if(glConfig2.occlusionQueryBits && glConfig.driverType != GLDRV_MESA && r_dynamicEntityOcclusionCulling->integer && !entity->occlusionQuerySamples)
+		{
+			continue;
+		}
+
+		if(!firstEntity)
+		{
+			firstEntity = entity;
+		}
+
+		R_RotateEntityForViewParms(entity, &backEnd.viewParms, &backEnd.orientation);
+
+		data = &tess.instanceData[tess.numInstances * INSTANCE_VECTORS];
+		m = backEnd.orientation.transformMatrix;
+
+		// rows of the model matrix
+		Vector4Set(data[0], m[0], m[4], m[8], m[12]);
+		Vector4Set(data[1], m[1], m[5], m[9], m[13]);
+		Vector4Set(data[2], m[2], m[6], m[10], m[14]);
+
+		VectorCopy(entity->ambientLight, data[3]);
+		VectorCopy(entity->directedLight, data[4]);
+		VectorCopy(entity->lightDir, data[5]);
+		data[3][3] = data[4][3] = data[5][3] = 0;
+
+		tess.numInstances++;
+	}
+
+	if(!firstEntity)
+	{
+		return;
+	}
+
+	backEnd.currentEntity = firstEntity;
+
+	if(tess.numInstances == 1)
+	{
+		// backEnd.orientation still belongs to the only visible entity
+		tess.numInstances = 0;
+	}
+	else
+	{
+		backEnd.orientation = backEnd.viewParms.world;
+	}
+
+	GL_LoadModelViewMatrix(backEnd.orientation.modelViewMatrix);
+
+	rb_surfaceTable[*drawSurf->surface] (drawSurf->surface);
+
+	Tess_End();
+}
+
 static void RB_RenderDrawSurfaces(bool opaque, bool depthFill, renderDrawSurfaces_e drawSurfFilter)
 {
 	trRefEntity_t  *entity, *oldEntity;
@@ -1364,6 +1440,30 @@ static void RB_RenderDrawSurfaces(bool opaque, bool depthFill, renderDrawSurface
 			}
 		}
 
+		if(drawSurf->numInstances > 1 && !depthFill)
+		{
+			if(oldShader != NULL)
+			{
+				Tess_End();
+			}
+
+			if(oldDepthRange)
+			{
+				glDepthRange(0, 1);
+				oldDepthRange = depthRange = qfalse;
+			}
+
+			RB_RenderInstancedDrawSurfaces(drawSurf, shader);
+
+			i += drawSurf->numInstances - 1;
+			drawSurf += drawSurf->numInstances - 1;
+
+			// the next surface starts a new batch and loads its own matrix
+			oldEntity = NULL;
+			oldShader = NULL;
+			continue;
+		}
+
 		if(entity == oldEntity && shader == oldShader && lightmapNum == oldLightmapNum && fogNum == oldFogNum)
 		{
 			// fast path, same as previous sort
@@ -1738,7 +1838,7 @@ static void Render_lightVolume(interaction_t * ia)
 			if(shadowCompare)
 			{
 				GL_SelectTexture(3);
-				GL_Bind(tr.shadowCubeFBOImage[light->shadowLOD]);
+				GL_Bind(RB_ShadowCubeImage(light));
 			}
 
 			// draw light scissor rectangle
@@ -2240,6 +2340,7 @@ static void RB_RenderInteractionsShadowMapped()
 	drawShadows = qtrue;
 	cubeSide = 0;
 	splitFrustumIndex = 0;
+	RB_EndShadowCache();
 
 	// if we need to clear the FBO color buffers then it should be white
 	GL_ClearColor(1.0f, 1.0f, 1.0f, 1.0f);
@@ -2277,6 +2378,12 @@ static void RB_RenderInteractionsShadowMapped()
 		// only iaCount == iaFirst if first iteration or counters were reset
 		if(iaCount == iaFirst)
 		{
+			if(drawShadows && backEnd.shadowCache.pass == SHADOWCACHE_NONE && RB_BeginShadowCache(light, ia))
+			{
+				// the cached shadow map is complete, go straight to lighting
+				drawShadows = qfalse;
+			}
+
 			if(drawShadows)
 			{
 				// HACK: bring OpenGL into a safe state or strange FBO update problems will occur
@@ -2321,8 +2428,16 @@ static void RB_RenderInteractionsShadowMapped()
 							}
 
 							R_BindFBO(tr.shadowMapFBO[light->shadowLOD]);
-							R_AttachFBOTexture2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubeSide,
-												 tr.shadowCubeFBOImage[light->shadowLOD]->texnum, 0);
+							if(backEnd.shadowCache.pass == SHADOWCACHE_STATIC)
+							{
+								R_AttachFBOTexture2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubeSide,
+													 backEnd.shadowCache.entry->image->texnum, 0);
+							}
+							else
+							{
+								R_AttachFBOTexture2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubeSide,
+													 tr.shadowCubeFBOImage[light->shadowLOD]->texnum, 0);
+							}
 							if(!r_ignoreGLErrors->integer)
 							{
 								R_CheckFBO(tr.shadowMapFBO[light->shadowLOD]);
@@ -2332,7 +2447,15 @@ static void RB_RenderInteractionsShadowMapped()
 							GL_Viewport(0, 0, shadowMapResolutions[light->shadowLOD], shadowMapResolutions[light->shadowLOD]);
 							GL_Scissor(0, 0, shadowMapResolutions[light->shadowLOD], shadowMapResolutions[light->shadowLOD]);
 
-							glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+							if(backEnd.shadowCache.pass == SHADOWCACHE_DYNAMIC)
+							{
+								// start with the static casters
+								RB_CopyShadowCacheFace(light, cubeSide);
+							}
+							else
+							{
+								glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+							}
 
 							switch (cubeSide)
 							{
@@ -3039,6 +3162,17 @@ static void RB_RenderInteractionsShadowMapped()
 				goto skipInteraction;
 			}
 
+			if(backEnd.shadowCache.pass == SHADOWCACHE_STATIC && entity != &tr.worldEntity)
+			{
+				// drawn over a copy of the cache entry in the next pass
+				goto skipInteraction;
+			}
+
+			if(backEnd.shadowCache.pass == SHADOWCACHE_DYNAMIC && entity == &tr.worldEntity)
+			{
+				goto skipInteraction;
+			}
+
 			if(light->l.rlType == RL_OMNI && !(ia->cubeSideBits & (1 << cubeSide)))
 			{
 				goto skipInteraction;
@@ -3313,7 +3447,7 @@ static void RB_RenderInteractionsShadowMapped()
 						if(cubeSide == 5)
 						{
 							cubeSide = 0;
-							drawShadows = qfalse;
+							drawShadows = RB_NextShadowCachePass();
 						}
 						else
 						{
@@ -3384,6 +3518,8 @@ static void RB_RenderInteractionsShadowMapped()
 				}
 #endif
 
+				RB_EndShadowCache();
+
 				if(iaCount < (backEnd.viewParms.numInteractions - 1))
 				{
 					// jump to next interaction and start shadowing
@@ -3606,6 +3742,199 @@ static void RB_RenderDrawSurfacesIntoGeometricBuffer()
 
 
 
+/*
+=================
+RB_RenderLightClusters
+
+Shades all lights that were binned into the froxel grid of this view
+with a single fullscreen pass
+=================
+*/
+static void RB_RenderLightClusters()
+{
+	static float    uploadBuffer[MAX_CLUSTER_INDEXES * 4];
+
+	lightClusters_t *lc = backEnd.viewParms.lightClusters;
+	trRefLight_t   *light;
+	shader_t       *lightShader;
+	shaderStage_t  *attenuationXYStage;
+	shaderStage_t  *attenuationZStage;
+	int             i, j;
+	float          *row;
+	matrix_t        ortho;
+	vec4_t          tileScale, depthScale;
+
+	if(!lc || !lc->numLights || !gl_deferredLightingShader_clustered)
+		return;
+
+	GLimp_LogComment("--- RB_RenderLightClusters ---\n");
+
+	// all clustered lights share the attenuation maps of the default dynamic light
+	lightShader = tr.defaultDynamicLightShader;
+	attenuationZStage = lightShader->stages[0];
+	attenuationXYStage = NULL;
+
+	for(j = 1; j < MAX_SHADER_STAGES; j++)
+	{
+		if(!lightShader->stages[j])
+			break;
+
+		if(lightShader->stages[j]->type == ST_ATTENUATIONMAP_XY)
+		{
+			attenuationXYStage = lightShader->stages[j];
+			break;
+		}
+	}
+
+	if(!attenuationXYStage)
+		return;
+
+	// upload the lights, one row per light
+	for(i = 0; i < lc->numLights; i++)
+	{
+		backEnd.currentLight = light = lc->lights[i];
+
+		// build the attenuation matrix
+		MatrixSetupTranslation(light->attenuationMatrix, 0.5, 0.5, 0.5);	// bias
+		MatrixMultiplyScale(light->attenuationMatrix, 0.5, 0.5, 0.5);		// scale
+		MatrixMultiply2(light->attenuationMatrix, light->projectionMatrix);	// light projection (frustum)
+		MatrixMultiply2(light->attenuationMatrix, light->viewMatrix);
+
+		R_ComputeFinalAttenuation(attenuationXYStage, light);
+
+		if(RB_EvalExpression(&attenuationXYStage->ifExp, 1.0))
+		{
+			Tess_ComputeColor(attenuationXYStage);
+		}
+		else
+		{
+			VectorClear(tess.svars.color);
+		}
+
+		row = uploadBuffer + i * CLUSTER_LIGHT_TEXELS * 4;
+
+		for(j = 0; j < 3; j++)
+		{
+			row[j * 4 + 0] = light->attenuationMatrix2[j + 0];
+			row[j * 4 + 1] = light->attenuationMatrix2[j + 4];
+			row[j * 4 + 2] = light->attenuationMatrix2[j + 8];
+			row[j * 4 + 3] = light->attenuationMatrix2[j + 12];
+		}
+
+		VectorCopy(light->origin, row + 12);
+		row[15] = 0;
+
+		VectorScale(tess.svars.color, light->l.scale, row + 16);
+		row[19] = 0;
+	}
+
+	GL_SelectTexture(8);
+	GL_Bind(tr.clusterLightImage);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_LIGHT_TEXELS, lc->numLights, GL_RGBA, GL_FLOAT, uploadBuffer);
+
+	// upload the light lists
+	for(i = 0; i < lc->numIndexes; i++)
+	{
+		uploadBuffer[i * 4 + 0] = lc->lightIndexes[i];
+		uploadBuffer[i * 4 + 1] = 0;
+		uploadBuffer[i * 4 + 2] = 0;
+		uploadBuffer[i * 4 + 3] = 0;
+	}
+
+	for(; i % CLUSTER_INDEX_WIDTH; i++)
+	{
+		Vector4Set(uploadBuffer + i * 4, 0, 0, 0, 0);
+	}
+
+	GL_SelectTexture(7);
+	GL_Bind(tr.clusterIndexImage);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_INDEX_WIDTH, i / CLUSTER_INDEX_WIDTH, GL_RGBA, GL_FLOAT, uploadBuffer);
+
+	// upload the clusters
+	for(i = 0; i < MAX_CLUSTERS; i++)
+	{
+		uploadBuffer[i * 4 + 0] = lc->clusterFirst[i];
+		uploadBuffer[i * 4 + 1] = lc->clusterCount[i];
+		uploadBuffer[i * 4 + 2] = 0;
+		uploadBuffer[i * 4 + 3] = 0;
+	}
+
+	GL_SelectTexture(6);
+	GL_Bind(tr.clusterGridImage);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_TILES_X * CLUSTER_TILES_Y, CLUSTER_SLICES, GL_RGBA, GL_FLOAT, uploadBuffer);
+
+	// set OpenGL state for additive lighting
+	GL_State(GLS_SRCBLEND_ONE | GLS_DSTBLEND_ONE | GLS_DEPTHTEST_DISABLE);
+	GL_Cull(CT_TWO_SIDED);
+
+	// set 2D virtual screen size
+	MatrixOrthogonalProjection(ortho, backEnd.viewParms.viewportX,
+										backEnd.viewParms.viewportX + backEnd.viewParms.viewportWidth,
+										backEnd.viewParms.viewportY, backEnd.viewParms.viewportY + backEnd.viewParms.viewportHeight,
+										-99999, 99999);
+
+	GL_PushMatrix();
+	GL_LoadProjectionMatrix(ortho);
+	GL_LoadModelViewMatrix(matrixIdentity);
+
+	gl_deferredLightingShader_clustered->SetNormalMapping(r_normalMapping->integer);
+	gl_deferredLightingShader_clustered->BindProgram();
+
+	// pixel -> tile
+	tileScale[0] = (float)CLUSTER_TILES_X / backEnd.viewParms.viewportWidth;
+	tileScale[1] = (float)CLUSTER_TILES_Y / backEnd.viewParms.viewportHeight;
+	tileScale[2] = -backEnd.viewParms.viewportX * tileScale[0];
+	tileScale[3] = -backEnd.viewParms.viewportY * tileScale[1];
+
+	// log(depth) -> slice
+	depthScale[0] = lc->sliceScale;
+	depthScale[1] = -log(lc->zNear) * lc->sliceScale;
+	depthScale[2] = 0;
+	depthScale[3] = 0;
+
+	gl_deferredLightingShader_clustered->SetUniform_ViewOrigin(backEnd.viewParms.orientation.origin); // in world space
+	gl_deferredLightingShader_clustered->SetUniform_ViewMatrix(backEnd.viewParms.world.viewMatrix);
+	gl_deferredLightingShader_clustered->SetUniform_UnprojectMatrix(backEnd.viewParms.unprojectionMatrix);
+	gl_deferredLightingShader_clustered->SetUniform_ModelViewProjectionMatrix(glState.modelViewProjectionMatrix[glState.stackIndex]);
+	gl_deferredLightingShader_clustered->SetUniform_ClusterTileScale(tileScale);
+	gl_deferredLightingShader_clustered->SetUniform_ClusterDepthScale(depthScale);
+
+	// bind u_DiffuseMap
+	GL_SelectTexture(0);
+	GL_Bind(tr.deferredDiffuseFBOImage);
+
+	// bind u_NormalMap
+	GL_SelectTexture(1);
+	GL_Bind(tr.deferredNormalFBOImage);
+
+	if(r_normalMapping->integer)
+	{
+		// bind u_SpecularMap
+		GL_SelectTexture(2);
+		GL_Bind(tr.deferredSpecularFBOImage);
+	}
+
+	// bind u_DepthMap
+	GL_SelectTexture(3);
+	GL_Bind(tr.depthRenderImage);
+
+	// bind u_AttenuationMapXY
+	GL_SelectTexture(4);
+	BindAnimatedImage(&attenuationXYStage->bundle[TB_COLORMAP]);
+
+	// bind u_AttenuationMapZ
+	GL_SelectTexture(5);
+	BindAnimatedImage(&attenuationZStage->bundle[TB_COLORMAP]);
+
+	// u_ClusterGridMap, u_ClusterIndexMap and u_ClusterLightMap are still bound to 6 - 8
+
+	Tess_InstantQuad(backEnd.viewParms.viewportVerts);
+
+	GL_PopMatrix();
+
+	backEnd.pc.c_clusterPasses++;
+}
+
 void RB_RenderInteractionsDeferred()
 {
 	interaction_t  *ia;
@@ -4205,6 +4534,12 @@ void RB_RenderInteractionsDeferred()
 		oldLight = light;
 	}
 
+	// reset scissor for the fullscreen pass
+	GL_Scissor(backEnd.viewParms.viewportX, backEnd.viewParms.viewportY,
+			   backEnd.viewParms.viewportWidth, backEnd.viewParms.viewportHeight);
+
+	RB_RenderLightClusters();
+
 	// clear shader so we can tell we don't have any unclosed surfaces
 	tess.multiDrawPrimitives = 0;
 	tess.numIndexes = 0;
@@ -4290,6 +4625,7 @@ static void RB_RenderInteractionsDeferredShadowMapped()
 	drawShadows = qtrue;
 	cubeSide = 0;
 	splitFrustumIndex = 0;
+	RB_EndShadowCache();
 
 	GL_State(GLS_DEFAULT);
 
@@ -4336,6 +4672,12 @@ static void RB_RenderInteractionsDeferredShadowMapped()
 		// only iaCount == iaFirst if first iteration or counters were reset
 		if(iaCount == iaFirst)
 		{
+			if(drawShadows && backEnd.shadowCache.pass == SHADOWCACHE_NONE && RB_BeginShadowCache(light, ia))
+			{
+				// the cached shadow map is complete, go straight to lighting
+				drawShadows = qfalse;
+			}
+
 			if(drawShadows)
 			{
 				// HACK: bring OpenGL into a safe state or strange FBO update problems will occur
@@ -4378,8 +4720,16 @@ static void RB_RenderInteractionsDeferredShadowMapped()
 							}
 
 							R_BindFBO(tr.shadowMapFBO[light->shadowLOD]);
-							R_AttachFBOTexture2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubeSide,
-												 tr.shadowCubeFBOImage[light->shadowLOD]->texnum, 0);
+							if(backEnd.shadowCache.pass == SHADOWCACHE_STATIC)
+							{
+								R_AttachFBOTexture2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubeSide,
+													 backEnd.shadowCache.entry->image->texnum, 0);
+							}
+							else
+							{
+								R_AttachFBOTexture2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubeSide,
+													 tr.shadowCubeFBOImage[light->shadowLOD]->texnum, 0);
+							}
 							if(!r_ignoreGLErrors->integer)
 							{
 								R_CheckFBO(tr.shadowMapFBO[light->shadowLOD]);
@@ -4389,7 +4739,15 @@ static void RB_RenderInteractionsDeferredShadowMapped()
 							GL_Viewport(0, 0, shadowMapResolutions[light->shadowLOD], shadowMapResolutions[light->shadowLOD]);
 							GL_Scissor(0, 0, shadowMapResolutions[light->shadowLOD], shadowMapResolutions[light->shadowLOD]);
 
-							glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+							if(backEnd.shadowCache.pass == SHADOWCACHE_DYNAMIC)
+							{
+								// start with the static casters
+								RB_CopyShadowCacheFace(light, cubeSide);
+							}
+							else
+							{
+								glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+							}
 
 							switch (cubeSide)
 							{
@@ -5585,7 +5943,7 @@ static void RB_RenderInteractionsDeferredShadowMapped()
 						if(shadowCompare)
 						{
 							GL_SelectTexture(6);
-							GL_Bind(tr.shadowCubeFBOImage[light->shadowLOD]);
+							GL_Bind(RB_ShadowCubeImage(light));
 						}
 
 						if(light->clipsNearPlane)
@@ -6045,6 +6403,17 @@ static void RB_RenderInteractionsDeferredShadowMapped()
 				goto skipInteraction;
 			}
 
+			if(backEnd.shadowCache.pass == SHADOWCACHE_STATIC && entity != &tr.worldEntity)
+			{
+				// drawn over a copy of the cache entry in the next pass
+				goto skipInteraction;
+			}
+
+			if(backEnd.shadowCache.pass == SHADOWCACHE_DYNAMIC && entity == &tr.worldEntity)
+			{
+				goto skipInteraction;
+			}
+
 			if(light->l.rlType == RL_OMNI && !(ia->cubeSideBits & (1 << cubeSide)))
 			{
 				goto skipInteraction;
@@ -6227,7 +6596,7 @@ static void RB_RenderInteractionsDeferredShadowMapped()
 						if(cubeSide == 5)
 						{
 							cubeSide = 0;
-							drawShadows = qfalse;
+							drawShadows = RB_NextShadowCachePass();
 						}
 						else
 						{
@@ -6298,6 +6667,8 @@ static void RB_RenderInteractionsDeferredShadowMapped()
 				}
 #endif
 
+				RB_EndShadowCache();
+
 				if(iaCount < (backEnd.viewParms.numInteractions - 1))
 				{
 					// jump to next interaction and start shadowing
@@ -11727,18 +12098,26 @@ smp extensions, or asynchronously by another thread.
 void RB_ExecuteRenderCommands(const void *data)
 {
 	int             t1, t2;
+	int             i;
+	qboolean        swapped;
 
 	GLimp_LogComment("--- RB_ExecuteRenderCommands ---\n");
 
 	t1 = ri.Milliseconds();
+	swapped = qfalse;
 
-	if(!r_smp->integer || data == backEndData[0]->commands.cmds)
+	// find the frame in the ring this command list belongs to
+	backEnd.smpFrame = 0;
+	if(r_smp->integer)
 	{
-		backEnd.smpFrame = 0;
-	}
-	else
-	{
-		backEnd.smpFrame = 1;
+		for(i = 1; i < r_smpFrames->integer; i++)
+		{
+			if(data >= backEndData[i]->commands.cmds && data < backEndData[i]->commands.cmds + MAX_RENDER_COMMANDS)
+			{
+				backEnd.smpFrame = i;
+				break;
+			}
+		}
 	}
 
 	while(1)
@@ -11768,6 +12147,7 @@ void RB_ExecuteRenderCommands(const void *data)
 				break;
 			case RC_SWAP_BUFFERS:
 				data = RB_SwapBuffers(data);
+				swapped = qtrue;
 				break;
 			case RC_SCREENSHOT:
 				data = RB_TakeScreenshotCmd(data);
@@ -11786,7 +12166,16 @@ void RB_ExecuteRenderCommands(const void *data)
 			default:
 				// stop rendering on this thread
 				t2 = ri.Milliseconds();
-				backEnd.pc.msec = t2 - t1;
+				backEnd.pc.msec += t2 - t1;
+
+				// hand the counters of the finished frame to the front end, it reads
+				// them once the fence of the frame has passed, so only the back end
+				// ever touches backEnd.pc
+				if(swapped)
+				{
+					backEndData[backEnd.smpFrame]->pc = backEnd.pc;
+					Com_Memset(&backEnd.pc, 0, sizeof(backEnd.pc));
+				}
 				return;
 		}
 	}
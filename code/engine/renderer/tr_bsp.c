@@ -23,6 +23,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 // tr_bsp.c
 #include "tr_local.h"
+#include "zlib.h"
 
 /*
 ========================================================
@@ -421,50 +422,20 @@ static ID_INLINE void rgbe2float(float *red, float *green, float *blue, unsigned
 		*red = *green = *blue = 0.0;
 }
 
-void LoadRGBEToFloats(const char *name, float **pic, int *width, int *height, qboolean doGamma, qboolean toneMap,
-							 qboolean compensate)
+/*
+===============
+R_ParseRGBEHeader
+
+Parses the text header of a lightmap written by XMap2 and returns the
+first byte of the texels, or NULL if the header is unusable
+===============
+*/
+static byte *R_ParseRGBEHeader(const char *name, byte * buffer, int *width, int *height)
 {
-	int             i, j;
 	byte           *buf_p;
-	byte           *buffer;
-	float          *floatbuf;
-	int             len;
 	char           *token;
 	int             w, h, c;
 	qboolean        formatFound;
-	//unsigned char   rgbe[4];
-	//float           red;
-	//float           green;
-	//float           blue;
-	//float           max;
-	//float           inv, dif;
-	float           exposure = 1.6;
-	//float           exposureGain = 1.0;
-	const vec3_t    LUMINANCE_VECTOR = { 0.2125f, 0.7154f, 0.0721f };
-	float           luminance;
-	float           avgLuminance;
-	float           maxLuminance;
-	float           scaledLuminance;
-	float           finalLuminance;
-	double          sum;
-	float           gamma;
-
-	union
-	{
-		byte            b[4];
-		float           f;
-	} sample;
-	vec4_t          sampleVector;
-
-	*pic = NULL;
-
-	// load the file
-	len = ri.FS_ReadFile((char *)name, (void **)&buffer);
-	if(!buffer)
-	{
-		ri.Error(ERR_DROP, "LoadRGBE: '%s' not found\n", name);
-		return;
-	}
 
 	buf_p = buffer;
 
@@ -560,23 +531,80 @@ void LoadRGBEToFloats(const char *name, float **pic, int *width, int *height, qb
 		}
 	}
 
-	if(width)
-		*width = w;
-	if(height)
-		*height = h;
-
 	if(!formatFound)
 	{
-		ri.FS_FreeFile( buffer );
-		ri.Error(ERR_DROP, "LoadRGBE: %s has no format\n", name);
+		ri.Printf(PRINT_WARNING, "WARNING: LoadRGBE: %s has no format\n", name);
+		return NULL;
+	}
+
+	if(w <= 0 || h <= 0)
+	{
+		ri.Printf(PRINT_WARNING, "WARNING: LoadRGBE: %s has an invalid image size %ix%i\n", name, w, h);
+		return NULL;
+	}
+
+	*width = w;
+	*height = h;
+
+	return buf_p;
+}
+
+void LoadRGBEToFloats(const char *name, float **pic, int *width, int *height, qboolean doGamma, qboolean toneMap,
+							 qboolean compensate)
+{
+	int             i, j;
+	byte           *buf_p;
+	byte           *buffer;
+	float          *floatbuf;
+	int             len;
+	int             w, h;
+	//unsigned char   rgbe[4];
+	//float           red;
+	//float           green;
+	//float           blue;
+	//float           max;
+	//float           inv, dif;
+	float           exposure = 1.6;
+	//float           exposureGain = 1.0;
+	const vec3_t    LUMINANCE_VECTOR = { 0.2125f, 0.7154f, 0.0721f };
+	float           luminance;
+	float           avgLuminance;
+	float           maxLuminance;
+	float           scaledLuminance;
+	float           finalLuminance;
+	double          sum;
+	float           gamma;
+
+	union
+	{
+		byte            b[4];
+		float           f;
+	} sample;
+	vec4_t          sampleVector;
+
+	*pic = NULL;
+
+	// load the file
+	len = ri.FS_ReadFile((char *)name, (void **)&buffer);
+	if(!buffer)
+	{
+		ri.Error(ERR_DROP, "LoadRGBE: '%s' not found\n", name);
+		return;
 	}
 
-	if(!w || !h)
+	buf_p = R_ParseRGBEHeader(name, buffer, &w, &h);
+	if(!buf_p)
 	{
-		ri.FS_FreeFile( buffer );
-		ri.Error(ERR_DROP, "LoadRGBE: %s has an invalid image size\n", name);
+		ri.FS_FreeFile(buffer);
+		ri.Error(ERR_DROP, "LoadRGBE: couldn't load %s\n", name);
+		return;
 	}
 
+	if(width)
+		*width = w;
+	if(height)
+		*height = h;
+
 	*pic = Com_Allocate(w * h * 3 * sizeof(float));
 	floatbuf = *pic;
 	for(i = 0; i < (w * h); i++)
@@ -705,60 +733,89 @@ void LoadRGBEToFloats(const char *name, float **pic, int *width, int *height, qb
 }
 
 
-static void LoadRGBEToBytes(const char *name, byte ** ldrImage, int *width, int *height)
-{
-	int             i, j;
-	int             w, h;
-	float          *hdrImage;
-	float          *floatbuf;
-	byte           *pixbuf;
-	vec3_t          sample;
-	float           max;
+/*
+=================================================================================
 
-#if 0
-	w = h = 0;
-	LoadRGBEToFloats(name, &hdrImage, &w, &h, qtrue, qtrue, qtrue);
+HDR LIGHTMAP DECODING
 
-	*width = w;
-	*height = h;
+The .hdr lightmaps of XMap2 hold 3 raw floats per texel after a text header.
+All files of a batch are read and parsed on the main thread because the file
+system and Com_ParseExt aren't thread safe, the texels of the pages are then
+converted in parallel by GLimp_ParallelFor and uploaded on the main thread.
 
-	*ldrImage = ri.Malloc(w * h * 4);
-	pixbuf = *ldrImage;
+A page is converted in small blocks of texels that stay in the cache while the
+scale, gamma, compensation and half float passes run over them.
 
-	floatbuf = hdrImage;
-	for(i = 0; i < (w * h); i++)
+=================================================================================
+*/
+
+#define HDR_LIGHTMAP_BATCH		8		// pages in memory at once
+#define HDR_LIGHTMAP_BLOCK		256		// texels converted at once
+
+typedef struct
+{
+	char            name[MAX_QPATH];
+	byte           *buffer;		// file contents
+	const byte     *texels;		// first texel in buffer
+	int             width, height;
+	void           *pic;		// RGB half floats or RGBA bytes
+} hdrLightmapPage_t;
+
+typedef struct
+{
+	hdrLightmapPage_t *pages;
+	qboolean        halfFloats;
+	float           gamma;		// 1.0 / r_hdrLightmapGamma
+	float           compensate;
+} hdrLightmapJob_t;
+
+void            ConvertFloatsToHalfs(const float *in, unsigned short *out, int numFloats);
+
+/*
+===============
+R_ScaleHDRSamples
+===============
+*/
+static void R_ScaleHDRSamples(float *samples, int numSamples, float divisor)
+{
+	int             i;
+
+	i = 0;
+#if id386_sse
 	{
-		for(j = 0; j < 3; j++)
+		__m128          _divisor = _mm_set1_ps(divisor);
+
+		// divide instead of multiplying with the reciprocal to match the scalar code
+		for(; i + 4 <= numSamples; i += 4)
 		{
-			sample[j] = *floatbuf++;
+			_mm_storeu_ps(samples + i, _mm_div_ps(_mm_loadu_ps(samples + i), _divisor));
 		}
+	}
+#endif
 
-		NormalizeColor(sample, sample);
-
-		*pixbuf++ = (byte) (sample[0] * 255);
-		*pixbuf++ = (byte) (sample[1] * 255);
-		*pixbuf++ = (byte) (sample[2] * 255);
-		*pixbuf++ = (byte) 255;
+	for(; i < numSamples; i++)
+	{
+		samples[i] = samples[i] / divisor;
 	}
-#else
-	w = h = 0;
-	LoadRGBEToFloats(name, &hdrImage, &w, &h, qfalse, qfalse, qfalse);
+}
 
-	*width = w;
-	*height = h;
+/*
+===============
+R_HDRSamplesToBytes
 
-	*ldrImage = ri.Z_Malloc(w * h * 4);
-	pixbuf = *ldrImage;
+Clamps with color normalization like R_HDRTonemapLightingColors
+===============
+*/
+static void R_HDRSamplesToBytes(const float *samples, byte * out, int numTexels)
+{
+	int             i;
+	float           max;
+	vec3_t          sample;
 
-	floatbuf = hdrImage;
-	for(i = 0; i < (w * h); i++)
+	for(i = 0; i < numTexels; i++, samples += 3, out += 4)
 	{
-		for(j = 0; j < 3; j++)
-		{
-			sample[j] = *floatbuf++ * 255.0f;
-		}
+		VectorScale(samples, 255.0f, sample);
 
-		// clamp with color normalization
 		max = sample[0];
 		if(sample[1] > max)
 			max = sample[1];
@@ -767,147 +824,323 @@ static void LoadRGBEToBytes(const char *name, byte ** ldrImage, int *width, int
 		if(max > 255.0f)
 			VectorScale(sample, (255.0f / max), sample);
 
-		*pixbuf++ = (byte) sample[0];
-		*pixbuf++ = (byte) sample[1];
-		*pixbuf++ = (byte) sample[2];
-		*pixbuf++ = (byte) 255;
+		out[0] = (byte) sample[0];
+		out[1] = (byte) sample[1];
+		out[2] = (byte) sample[2];
+		out[3] = (byte) 255;
 	}
-#endif
-
-	Com_Dealloc(hdrImage);
 }
 
-void LoadRGBEToHalfs(const char *name, unsigned short ** halfImage, int *width, int *height);
-
 /*
 ===============
-R_LoadLightmaps
+R_DecodeHDRLightmapPage
+
+Runs on the GLimp_ParallelFor workers
 ===============
 */
-#define	LIGHTMAP_SIZE	128
-static void R_LoadLightmaps(lump_t * l, const char *bspName)
+static void R_DecodeHDRLightmapPage(void *data, int index)
 {
-	int             len;
-	image_t        *image;
-	int             i;
-	int             numLightmaps;
+	hdrLightmapJob_t *job = (hdrLightmapJob_t *) data;
+	hdrLightmapPage_t *page = &job->pages[index];
+	float           samples[HDR_LIGHTMAP_BLOCK * 3];
+	int             i, first, numTexels, count;
 
-	len = l->filelen;
-	if(!len)
-	{
-		char            mapName[MAX_QPATH];
-		char          **lightmapFiles;
+	numTexels = page->width * page->height;
 
-		Q_strncpyz(mapName, bspName, sizeof(mapName));
-		Com_StripExtension(mapName, mapName, sizeof(mapName));
+	for(first = 0; first < numTexels; first += count)
+	{
+		count = numTexels - first;
+		if(count > HDR_LIGHTMAP_BLOCK)
+			count = HDR_LIGHTMAP_BLOCK;
 
-		if(tr.worldHDR_RGBE)
-		{
-			// we are about to upload textures
-			R_SyncRenderThread();
+		// the texels in the file are not aligned
+		Com_Memcpy(samples, page->texels + first * 3 * sizeof(float), count * 3 * sizeof(float));
 
-			// load HDR lightmaps
-			lightmapFiles = ri.FS_ListFiles(mapName, ".hdr", &numLightmaps);
+		// FIXME XMap2's output is 255 times too high
+		R_ScaleHDRSamples(samples, count * 3, 255.0f);
 
-			qsort(lightmapFiles, numLightmaps, sizeof(char *), LightmapNameCompare);
+		if(!job->halfFloats)
+		{
+			R_HDRSamplesToBytes(samples, (byte *) page->pic + first * 4, count);
+			continue;
+		}
 
-			if(!lightmapFiles || !numLightmaps)
+		if(job->gamma != 1.0f)
+		{
+			for(i = 0; i < count * 3; i++)
 			{
-				ri.Printf(PRINT_WARNING, "WARNING: no lightmap files found\n");
-				return;
+				samples[i] = pow(samples[i], job->gamma);
 			}
+		}
 
-			ri.Printf( PRINT_DEVELOPER, "...loading %i HDR lightmaps\n", numLightmaps );
+		R_ScaleHDRSamples(samples, count * 3, job->compensate);
 
-			if(r_hdrRendering->integer && r_hdrLightmap->integer && glConfig2.framebufferObjectAvailable &&
-			   glConfig2.framebufferBlitAvailable && glConfig2.textureFloatAvailable && glConfig2.textureHalfFloatAvailable)
-			{
-				int             width, height;
-				unsigned short *hdrImage;
+		ConvertFloatsToHalfs(samples, (unsigned short *)page->pic + first * 3, count * 3);
+	}
+}
 
-				for(i = 0; i < numLightmaps; i++)
-				{
-					ri.Printf( PRINT_DEVELOPER, "...loading external lightmap as RGB 16 bit half HDR '%s/%s'\n", mapName, lightmapFiles[ i ] );
+/*
+===============
+R_UploadHDRLightmapPage
+===============
+*/
+static image_t *R_UploadHDRLightmapPage(hdrLightmapPage_t * page, qboolean halfFloats)
+{
+	image_t        *image;
 
-					width = height = 0;
-					//LoadRGBEToFloats(va("%s/%s", mapName, lightmapFiles[i]), &hdrImage, &width, &height, qtrue, qfalse, qtrue);
-					LoadRGBEToHalfs(va("%s/%s", mapName, lightmapFiles[i]), &hdrImage, &width, &height);
+	if(!halfFloats)
+	{
+		return R_CreateImage(page->name, (byte *) page->pic, page->width, page->height,
+							 IF_NOPICMIP | IF_LIGHTMAP | IF_NOCOMPRESSION, FT_DEFAULT, WT_CLAMP);
+	}
 
-					//ri.Printf(PRINT_ALL, "...converted '%s/%s' to HALF format\n", mapName, lightmapFiles[i]);
+	image = R_AllocImage(page->name, qtrue);
+	if(!image)
+	{
+		return NULL;
+	}
 
-					image = R_AllocImage(va("%s/%s", mapName, lightmapFiles[i]), qtrue);
-					if(!image) {
-						Com_Dealloc(hdrImage);
-						break;
-					}
+	image->type = GL_TEXTURE_2D;
 
-					//Q_strncpyz(image->name, );
-					image->type = GL_TEXTURE_2D;
+	image->width = page->width;
+	image->height = page->height;
 
-					image->width = width;
-					image->height = height;
+	image->bits = IF_NOPICMIP | IF_RGBA16F;
+	image->filterType = FT_NEAREST;
+	image->wrapType = WT_CLAMP;
 
-					image->bits = IF_NOPICMIP | IF_RGBA16F;
-					image->filterType = FT_NEAREST;
-					image->wrapType = WT_CLAMP;
+	GL_Bind(image);
 
-					GL_Bind(image);
+	image->internalFormat = GL_RGBA16F;
+	image->uploadWidth = page->width;
+	image->uploadHeight = page->height;
 
-					image->internalFormat = GL_RGBA16F;
-					image->uploadWidth = width;
-					image->uploadHeight = height;
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, page->width, page->height, 0, GL_RGB, GL_HALF_FLOAT, page->pic);
 
-					glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_HALF_FLOAT, hdrImage);
+	glTexParameterf(image->type, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameterf(image->type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameterf(image->type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameterf(image->type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-#if 0
-					if(glConfig.hardwareType == GLHW_NV_DX10 || glConfig.hardwareType == GLHW_ATI_DX10)
-					{
-						glTexParameterf(image->type, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-						glTexParameterf(image->type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-					}
-					else
-#endif
-					{
-						glTexParameterf(image->type, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-						glTexParameterf(image->type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-					}
-					glTexParameterf(image->type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-					glTexParameterf(image->type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(image->type, 0);
 
-					glBindTexture(image->type, 0);
+	GL_CheckErrors();
 
-					GL_CheckErrors();
+	return image;
+}
 
-					Com_Dealloc(hdrImage);
+/*
+===============
+R_FreeHDRLightmapPages
+===============
+*/
+static void R_FreeHDRLightmapPages(hdrLightmapPage_t * pages, int numPages)
+{
+	int             i;
 
-					Com_AddToGrowList(&tr.lightmaps, image);
-				}
-			}
-			else
-			{
-				int             width, height;
-				byte           *ldrImage;
+	for(i = 0; i < numPages; i++)
+	{
+		if(pages[i].buffer)
+		{
+			ri.FS_FreeFile(pages[i].buffer);
+			pages[i].buffer = NULL;
+		}
 
-				for(i = 0; i < numLightmaps; i++)
-				{
-					ri.Printf( PRINT_DEVELOPER, "...loading external lightmap as RGB8 LDR '%s/%s'\n", mapName, lightmapFiles[ i ] );
+		if(pages[i].pic)
+		{
+			Com_Dealloc(pages[i].pic);
+			pages[i].pic = NULL;
+		}
+	}
+}
 
-					width = height = 0;
-					LoadRGBEToBytes(va("%s/%s", mapName, lightmapFiles[i]), &ldrImage, &width, &height);
+/*
+===============
+R_LoadHDRLightmaps
 
-					image = R_CreateImage(va("%s/%s", mapName, lightmapFiles[i]), (byte *) ldrImage, width, height,
-									  IF_NOPICMIP | IF_LIGHTMAP | IF_NOCOMPRESSION, FT_DEFAULT, WT_CLAMP);
+Pages are read and decoded HDR_LIGHTMAP_BATCH at a time, a broken page
+frees the pages of its batch before it drops the map
+===============
+*/
+static void R_LoadHDRLightmaps(const char *mapName, char **lightmapFiles, int numLightmaps, qboolean halfFloats)
+{
+	hdrLightmapPage_t pages[HDR_LIGHTMAP_BATCH];
+	hdrLightmapPage_t *page;
+	hdrLightmapJob_t job;
+	image_t        *image;
+	int             i, first, numPages, len;
+	size_t          available;
 
-					Com_AddToGrowList(&tr.lightmaps, image);
+	job.pages = pages;
+	job.halfFloats = halfFloats;
+	job.gamma = 1.0f / r_hdrLightmapGamma->value;
+	job.compensate = r_hdrLightmapCompensate->value;
 
-					ri.Free(ldrImage);
-				}
-			}
+	for(first = 0; first < numLightmaps; first += numPages)
+	{
+		numPages = numLightmaps - first;
+		if(numPages > HDR_LIGHTMAP_BATCH)
+			numPages = HDR_LIGHTMAP_BATCH;
 
-			if(tr.worldDeluxeMapping)
-			{
-				// load deluxemaps
-				lightmapFiles = ri.FS_ListFiles(mapName, ".png", &numLightmaps);
+		for(i = 0, page = pages; i < numPages; i++, page++)
+		{
+			Com_sprintf(page->name, sizeof(page->name), "%s/%s", mapName, lightmapFiles[first + i]);
+
+			ri.Printf(PRINT_DEVELOPER, "...loading external lightmap as %s '%s'\n", halfFloats ? "RGB 16 bit half HDR" : "RGB8 LDR",
+					  page->name);
+
+			page->pic = NULL;
+
+			len = ri.FS_ReadFile(page->name, (void **)&page->buffer);
+			if(!page->buffer)
+			{
+				R_FreeHDRLightmapPages(pages, i);
+				ri.Error(ERR_DROP, "LoadRGBE: '%s' not found\n", page->name);
+			}
+
+			page->texels = R_ParseRGBEHeader(page->name, page->buffer, &page->width, &page->height);
+			if(!page->texels)
+			{
+				R_FreeHDRLightmapPages(pages, i + 1);
+				ri.Error(ERR_DROP, "LoadRGBE: couldn't load %s\n", page->name);
+			}
+
+			// divide instead of multiplying the size up, so large pages can't overflow
+			available = (page->buffer + len - page->texels) / (3 * sizeof(float));
+			if(available / page->width < (size_t) page->height)
+			{
+				R_FreeHDRLightmapPages(pages, i + 1);
+				ri.Error(ERR_DROP, "LoadRGBE: %s is truncated\n", page->name);
+			}
+
+			page->pic = Com_Allocate(page->width * page->height * (halfFloats ? 3 * sizeof(unsigned short) : 4));
+		}
+
+		GLimp_ParallelFor(R_DecodeHDRLightmapPage, &job, numPages);
+
+		for(i = 0, page = pages; i < numPages; i++, page++)
+		{
+			image = R_UploadHDRLightmapPage(page, halfFloats);
+
+			R_FreeHDRLightmapPages(page, 1);
+
+			if(!image)
+			{
+				R_FreeHDRLightmapPages(page + 1, numPages - i - 1);
+				return;
+			}
+
+			Com_AddToGrowList(&tr.lightmaps, image);
+		}
+	}
+}
+
+/*
+===============
+R_LoadDDSLightmaps
+
+Loads half float or BC6H lightmaps that were converted offline from the
+XMap2 output and don't need any decoding. Returns qfalse if the map has
+none or a page can't be used, the .hdr files are loaded instead then.
+===============
+*/
+static qboolean R_LoadDDSLightmaps(const char *mapName)
+{
+	char          **lightmapFiles;
+	int             i, numLightmaps;
+	image_t        *image;
+
+	lightmapFiles = ri.FS_ListFiles(mapName, ".dds", &numLightmaps);
+
+	if(!lightmapFiles || !numLightmaps)
+	{
+		return qfalse;
+	}
+
+	qsort(lightmapFiles, numLightmaps, sizeof(char *), LightmapNameCompare);
+
+	ri.Printf(PRINT_DEVELOPER, "...loading %i DDS HDR lightmaps\n", numLightmaps);
+
+	for(i = 0; i < numLightmaps; i++)
+	{
+		ri.Printf(PRINT_DEVELOPER, "...loading external lightmap '%s/%s'\n", mapName, lightmapFiles[i]);
+
+		image = R_LoadDDSLightmap(va("%s/%s", mapName, lightmapFiles[i]));
+		if(!image)
+		{
+			ri.Printf(PRINT_WARNING, "WARNING: falling back to the .hdr lightmaps\n");
+
+			// the pages that made it stay unused in the image list
+			tr.lightmaps.currentElements = 0;
+
+			ri.FS_FreeFileList(lightmapFiles);
+			return qfalse;
+		}
+
+		Com_AddToGrowList(&tr.lightmaps, image);
+	}
+
+	ri.FS_FreeFileList(lightmapFiles);
+	return qtrue;
+}
+
+/*
+===============
+R_LoadLightmaps
+===============
+*/
+#define	LIGHTMAP_SIZE	128
+static void R_LoadLightmaps(lump_t * l, const char *bspName)
+{
+	int             len;
+	image_t        *image;
+	int             i;
+	int             numLightmaps;
+
+	len = l->filelen;
+	if(!len)
+	{
+		char            mapName[MAX_QPATH];
+		char          **lightmapFiles;
+
+		Q_strncpyz(mapName, bspName, sizeof(mapName));
+		Com_StripExtension(mapName, mapName, sizeof(mapName));
+
+		if(tr.worldHDR_RGBE)
+		{
+			// we are about to upload textures
+			R_SyncRenderThread();
+
+			// load HDR lightmaps
+			lightmapFiles = ri.FS_ListFiles(mapName, ".hdr", &numLightmaps);
+
+			qsort(lightmapFiles, numLightmaps, sizeof(char *), LightmapNameCompare);
+
+			if(!lightmapFiles || !numLightmaps)
+			{
+				ri.Printf(PRINT_WARNING, "WARNING: no lightmap files found\n");
+				return;
+			}
+
+			ri.Printf( PRINT_DEVELOPER, "...loading %i HDR lightmaps\n", numLightmaps );
+
+			if(r_hdrRendering->integer && r_hdrLightmap->integer && glConfig2.framebufferObjectAvailable &&
+			   glConfig2.framebufferBlitAvailable && glConfig2.textureFloatAvailable && glConfig2.textureHalfFloatAvailable)
+			{
+				if(!r_hdrLightmapDDS->integer || !R_LoadDDSLightmaps(mapName))
+				{
+					R_LoadHDRLightmaps(mapName, lightmapFiles, numLightmaps, qtrue);
+				}
+			}
+			else
+			{
+				R_LoadHDRLightmaps(mapName, lightmapFiles, numLightmaps, qfalse);
+			}
+
+			if(tr.worldDeluxeMapping)
+			{
+				// load deluxemaps
+				lightmapFiles = ri.FS_ListFiles(mapName, ".png", &numLightmaps);
 
 				if(!lightmapFiles || !numLightmaps)
 				{
@@ -4256,6 +4489,61 @@ void SmoothNormals(const char *name, srfVert_t * verts, int numTotalVerts)
 }
 #endif
 
+/*
+=================
+R_OptimizeWorldSurface
+
+Reorders the triangles and vertices of a world surface for the vertex cache.
+Everything stays inside the ranges of the surface in the world VBO and IBO.
+=================
+*/
+static void R_OptimizeWorldSurface(int firstVert, int numVerts, int firstTriangle, int numTriangles)
+{
+	int             i, j;
+	int            *vertexOrder;
+	srfVert_t      *verts;
+	srfTriangle_t  *triangles;
+
+	if(!numVerts || !numTriangles)
+	{
+		return;
+	}
+
+	triangles = s_worldData.triangles + firstTriangle;
+
+	for(i = 0; i < numTriangles; i++)
+	{
+		for(j = 0; j < 3; j++)
+		{
+			triangles[i].indexes[j] -= firstVert;
+		}
+	}
+
+	R_OptimizeTrianglesForVertexCache(numTriangles, triangles);
+
+	vertexOrder = ri.Hunk_AllocateTempMemory(numVerts * sizeof(int));
+	R_OptimizeVertexFetch(numVerts, numTriangles, triangles, vertexOrder);
+
+	verts = ri.Hunk_AllocateTempMemory(numVerts * sizeof(srfVert_t));
+	Com_Memcpy(verts, s_worldData.verts + firstVert, numVerts * sizeof(srfVert_t));
+
+	for(i = 0; i < numVerts; i++)
+	{
+		CopyVert(&verts[vertexOrder[i]], &s_worldData.verts[firstVert + i]);
+	}
+
+	ri.Hunk_FreeTempMemory(verts);
+	ri.Hunk_FreeTempMemory(vertexOrder);
+
+	for(i = 0; i < numTriangles; i++)
+	{
+		for(j = 0; j < 3; j++)
+		{
+			triangles[i].indexes[j] += firstVert;
+		}
+	}
+}
+
 /*
 ===============
 R_CreateWorldVBO
@@ -4465,6 +4753,29 @@ static void R_CreateWorldVBO()
 		}
 	}
 
+	// optimize the index and vertex order of every surface for the vertex cache
+	for(k = 0, surface = &s_worldData.surfaces[0]; k < s_worldData.numWorldSurfaces; k++, surface++)
+	{
+		if(*surface->data == SF_FACE)
+		{
+			srfSurfaceFace_t *srf = (srfSurfaceFace_t *) surface->data;
+
+			R_OptimizeWorldSurface(srf->firstVert, srf->numVerts, srf->firstTriangle, srf->numTriangles);
+		}
+		else if(*surface->data == SF_GRID)
+		{
+			srfGridMesh_t  *srf = (srfGridMesh_t *) surface->data;
+
+			R_OptimizeWorldSurface(srf->firstVert, srf->numVerts, srf->firstTriangle, srf->numTriangles);
+		}
+		else if(*surface->data == SF_TRIANGLES)
+		{
+			srfTriangles_t *srf = (srfTriangles_t *) surface->data;
+
+			R_OptimizeWorldSurface(srf->firstVert, srf->numVerts, srf->firstTriangle, srf->numTriangles);
+		}
+	}
+
 #if 0
 	numVerts = OptimizeVertices(numVerts, verts, numTriangles, triangles, optimizedVerts, CompareWorldVert);
 	if(c_redundantVertexes)
@@ -4583,6 +4894,7 @@ static void R_CreateSubModelVBOs()
 	srfVert_t      *verts;
 
 	srfVert_t      *optimizedVerts;
+	int            *vertexOrder;
 
 	int             numTriangles;
 	srfTriangle_t  *triangles;
@@ -4871,6 +5183,20 @@ static void R_CreateSubModelVBOs()
 					}
 				}
 
+				// optimize the index and vertex order for the vertex cache
+				R_OptimizeTrianglesForVertexCache(numTriangles, triangles);
+
+				vertexOrder = ri.Hunk_AllocateTempMemory(numVerts * sizeof(int));
+				R_OptimizeVertexFetch(numVerts, numTriangles, triangles, vertexOrder);
+
+				for(i = 0; i < numVerts; i++)
+				{
+					CopyVert(&verts[vertexOrder[i]], &optimizedVerts[i]);
+				}
+				Com_Memcpy(verts, optimizedVerts, numVerts * sizeof(srfVert_t));
+
+				ri.Hunk_FreeTempMemory(vertexOrder);
+
 #if 0
 				numVerts = OptimizeVertices(numVerts, verts, numTriangles, triangles, optimizedVerts, CompareWorldVert);
 				if(c_redundantVertexes)
@@ -6042,6 +6368,8 @@ void R_LoadEntities(lump_t * l)
 	// basic light setup
 	for(i = 0, light = s_worldData.lights; i < s_worldData.numLights; i++, light++)
 	{
+		light->worldLightNum = i;
+
 		QuatClear(light->l.rotation);
 		VectorClear(light->l.center);
 
@@ -6748,6 +7076,35 @@ static void R_RecursivePrecacheInteractionNode(bspNode_t * node, trRefLight_t *
 	}
 }
 
+/*
+================
+R_PrecacheInteractionLeafArray
+
+Same as R_RecursivePrecacheInteractionNode without walking the tree
+================
+*/
+static void R_PrecacheInteractionLeafArray(trRefLight_t * light)
+{
+	int             i, c, numLeafs;
+	bspNode_t      *node;
+	bspSurface_t  **mark;
+
+	numLeafs = R_CullLeafArray(&s_worldData, NULL, 0, light->worldBounds[0], light->worldBounds[1], qfalse);
+
+	for(i = 0; i < numLeafs; i++)
+	{
+		node = s_worldData.leafArrayCulled[i];
+
+		mark = node->markSurfaces;
+		c = node->numMarkSurfaces;
+		while(c--)
+		{
+			R_PrecacheInteractionSurface(*mark, light);
+			mark++;
+		}
+	}
+}
+
 /*
 ================
 R_RecursiveAddInteractionNode
@@ -6983,473 +7340,684 @@ static interactionVBO_t *R_CreateInteractionVBO(trRefLight_t * light)
 }
 
 /*
-=================
-InteractionCacheCompare
-compare function for qsort()
-=================
+===============================================================================
+
+INTERACTION FILE
+
+R_PrecacheInteractions stores its results in maps/<mapname>/interactions.cache.
+Later loads of the same map with the same lighting setup read them back and only
+have to upload the index buffers instead of walking the BSP for every light.
+
+All values are stored as little endian 32 bit words.
+
+===============================================================================
 */
-static int InteractionCacheCompare(const void *a, const void *b)
+
+#define INTERACTIONFILE_IDENT		(('C'<<24)+('A'<<16)+('I'<<8)+'X')	// "XIAC"
+#define INTERACTIONFILE_VERSION	1
+
+enum
 {
-	interactionCache_t *aa, *bb;
+	IAFILE_LIGHTMESH,
+	IAFILE_SHADOWMESH,
+	IAFILE_SHADOWCUBEMESH
+};
 
-	aa = *(interactionCache_t **) a;
-	bb = *(interactionCache_t **) b;
+typedef struct
+{
+	int            *words;
+	int             numWords;
+	int             maxWords;
+	int             readPos;
+	qboolean        overflow;
+} interactionFileBuffer_t;
 
-	// shader first
-	if(aa->surface->shader < bb->surface->shader)
-		return -1;
+static interactionFileBuffer_t s_iaFileRead;
+static interactionFileBuffer_t s_iaFileWrite;
+static int      s_iaFileLightMeshesPos;
 
-	else if(aa->surface->shader > bb->surface->shader)
-		return 1;
+/*
+=================
+R_ChecksumBlock
 
-	// then alphaTest
-	if(aa->surface->shader->alphaTest < bb->surface->shader->alphaTest)
-		return -1;
+32 bit FNV-1a
+=================
+*/
+static uint32_t R_ChecksumBlock(uint32_t hash, const void *buffer, int length)
+{
+	const byte     *p = (const byte *)buffer;
+	int             i;
 
-	else if(aa->surface->shader->alphaTest > bb->surface->shader->alphaTest)
-		return 1;
+	for(i = 0; i < length; i++)
+	{
+		hash ^= p[i];
+		hash *= 16777619;
+	}
 
-	return 0;
+	return hash;
 }
 
-static int UpdateLightTriangles(const srfVert_t * verts, int numTriangles, srfTriangle_t * triangles, shader_t * surfaceShader,
-								trRefLight_t * light)
+#define CHECKSUM_INIT	2166136261u
+
+/*
+=================
+R_InteractionFileConfig
+
+Everything besides the BSP itself that changes the outcome of R_PrecacheInteractions
+=================
+*/
+static uint32_t R_InteractionFileConfig(void)
 {
 	int             i;
-	srfTriangle_t  *tri;
-	int             numFacing;
+	uint32_t        hash;
+	bspSurface_t   *surface;
+	shader_t       *shader;
+	int             flags[7];
+	const char     *cvars;
 
-	numFacing = 0;
-	for(i = 0, tri = triangles; i < numTriangles; i++, tri++)
-	{
-#if 1
-		vec3_t          pos[3];
-		float           d;
+	cvars = va("%i %i %i %i %i %i %i %i %i %i %i", r_precomputedLighting->integer, r_vertexLighting->integer,
+			   r_vboLighting->integer, r_vboShadows->integer, r_shadows->integer, r_deferredShading->integer,
+			   r_noShadowPyramids->integer, r_vboOptimizeVertices->integer, r_vboOptimizeIndexes->integer,
+			   CALC_REDUNDANT_SHADOWVERTS, s_worldData.numVerts);
 
-		VectorCopy(verts[tri->indexes[0]].xyz, pos[0]);
-		VectorCopy(verts[tri->indexes[1]].xyz, pos[1]);
-		VectorCopy(verts[tri->indexes[2]].xyz, pos[2]);
+	hash = R_ChecksumBlock(CHECKSUM_INIT, cvars, strlen(cvars));
 
-		if(PlaneFromPoints(tri->plane, pos[0], pos[1], pos[2], qtrue))
-		{
-			tri->degenerated = qfalse;
+	// shader scripts may change independently of the map
+	for(i = 0, surface = s_worldData.surfaces; i < s_worldData.numSurfaces; i++, surface++)
+	{
+		shader = surface->shader;
 
-			if(light->l.rlType == RL_DIRECTIONAL)
-			{
-				vec3_t		lightDirection;
+		flags[0] = shader->sort;
+		flags[1] = shader->cullType;
+		flags[2] = shader->isSky | (shader->isPortal << 1) | (shader->interactLight << 2) | (shader->noShadows << 3);
+		flags[3] = shader->alphaTest;
+		flags[4] = ShaderRequiresCPUDeforms(shader);
+		flags[5] = shader->numStages;
+		flags[6] = *surface->data;
 
-				// light direction is from surface to light
-				#if 1
-				VectorCopy(tr.sunDirection, lightDirection);
-				#else
-				VectorCopy(light->direction, lightDirection);
-				#endif
+		hash = R_ChecksumBlock(hash, shader->name, strlen(shader->name));
+		hash = R_ChecksumBlock(hash, flags, sizeof(flags));
+	}
 
-				d = DotProduct(tri->plane, lightDirection);
+	return hash;
+}
 
-				if(surfaceShader->cullType == CT_TWO_SIDED || (d > 0 && surfaceShader->cullType != CT_BACK_SIDED))
-				{
-					tri->facingLight = qtrue;
-				}
-				else
-				{
-					tri->facingLight = qfalse;
-				}
-			}
-			else
-			{
-				// check if light origin is behind triangle
-				d = DotProduct(tri->plane, light->origin) - tri->plane[3];
+/*
+=================
+R_InteractionFileWriteInt
+=================
+*/
+static void R_InteractionFileWriteInt(int value)
+{
+	interactionFileBuffer_t *buf = &s_iaFileWrite;
+	int            *words;
 
-				if(surfaceShader->cullType == CT_TWO_SIDED || (d > 0 && surfaceShader->cullType != CT_BACK_SIDED))
-				{
-					tri->facingLight = qtrue;
-				}
-				else
-				{
-					tri->facingLight = qfalse;
-				}
-			}
-		}
-		else
-		{
-			tri->degenerated = qtrue;
-			tri->facingLight = qtrue;	// FIXME ?
-		}
+	if(buf->numWords == buf->maxWords)
+	{
+		buf->maxWords = buf->maxWords ? buf->maxWords * 2 : 65536;
 
-		if(R_CullLightTriangle(light, pos) == CULL_OUT)
+		words = Com_Allocate(buf->maxWords * sizeof(int));
+		if(buf->words)
 		{
-			tri->facingLight = qfalse;
+			Com_Memcpy(words, buf->words, buf->numWords * sizeof(int));
+			Com_Dealloc(buf->words);
 		}
-
-		if(tri->facingLight)
-			numFacing++;
-#else
-		tri->facingLight = qtrue;
-		numFacing++;
-#endif
+		buf->words = words;
 	}
 
-	return numFacing;
+	buf->words[buf->numWords++] = LittleLong(value);
+}
+
+static void R_InteractionFileWriteFloat(float value)
+{
+	floatint_t      fi;
+
+	fi.f = value;
+	R_InteractionFileWriteInt(fi.i);
 }
 
 /*
-===============
-R_CreateVBOLightMeshes
-===============
+=================
+R_InteractionFileReadInt
+
+Sets the overflow flag instead of reading past the end
+=================
 */
-static void R_CreateVBOLightMeshes(trRefLight_t * light)
+static int R_InteractionFileReadInt(void)
 {
-#if 1
-	int             i, j, k, l;
+	interactionFileBuffer_t *buf = &s_iaFileRead;
 
-	int             numVerts;
+	if(buf->readPos >= buf->numWords)
+	{
+		buf->overflow = qtrue;
+		return 0;
+	}
 
-	int             numTriangles, numLitTriangles;
-	srfTriangle_t  *triangles;
-	srfTriangle_t  *tri;
+	return LittleLong(buf->words[buf->readPos++]);
+}
 
-	interactionVBO_t *iaVBO;
+static float R_InteractionFileReadFloat(void)
+{
+	floatint_t      fi;
 
-	interactionCache_t *iaCache, *iaCache2;
-	interactionCache_t **iaCachesSorted;
-	int             numCaches;
+	fi.i = R_InteractionFileReadInt();
+	return fi.f;
+}
 
-	shader_t       *shader, *oldShader;
+static int R_InteractionFileReadIndex(int num)
+{
+	int             i;
 
-	bspSurface_t   *surface;
+	i = R_InteractionFileReadInt();
+	if(i < 0 || i >= num)
+	{
+		s_iaFileRead.overflow = qtrue;
+		return 0;
+	}
 
-	srfVBOMesh_t   *vboSurf;
-	vec3_t			bounds[2];
+	return i;
+}
 
-	if(!r_vboLighting->integer)
+/*
+=================
+R_InteractionFileWriteMesh
+
+Called by the R_CreateVBO*Meshes functions for every IBO they create
+=================
+*/
+static void R_InteractionFileWriteMesh(int type, const bspSurface_t * shaderSurface, const srfVBOMesh_t * vboSurf, int cubeSideBits,
+										int numTriangles, const srfTriangle_t * triangles)
+{
+	int             i;
+
+	if(!s_iaFileWrite.words)
+	{
 		return;
+	}
 
-	if(r_deferredShading->integer && r_shadows->integer < SHADOWING_ESM16)
+	s_iaFileWrite.words[s_iaFileLightMeshesPos] = LittleLong(LittleLong(s_iaFileWrite.words[s_iaFileLightMeshesPos]) + 1);
+
+	R_InteractionFileWriteInt(type);
+	R_InteractionFileWriteInt(shaderSurface - s_worldData.surfaces);
+	R_InteractionFileWriteInt(cubeSideBits);
+
+	for(i = 0; i < 3; i++)
+	{
+		R_InteractionFileWriteFloat(vboSurf->bounds[0][i]);
+		R_InteractionFileWriteFloat(vboSurf->bounds[1][i]);
+	}
+
+	R_InteractionFileWriteInt(vboSurf->numVerts);
+	R_InteractionFileWriteInt(numTriangles);
+
+	for(i = 0; i < numTriangles; i++)
+	{
+		R_InteractionFileWriteInt(triangles[i].indexes[0]);
+		R_InteractionFileWriteInt(triangles[i].indexes[1]);
+		R_InteractionFileWriteInt(triangles[i].indexes[2]);
+	}
+}
+
+/*
+=================
+R_InteractionFileBeginLight
+=================
+*/
+static void R_InteractionFileBeginLight(void)
+{
+	if(!s_iaFileWrite.words)
+	{
 		return;
+	}
 
-	if(!light->firstInteractionCache)
+	// number of meshes, incremented by R_InteractionFileWriteMesh
+	s_iaFileLightMeshesPos = s_iaFileWrite.numWords;
+	R_InteractionFileWriteInt(0);
+}
+
+/*
+=================
+R_InteractionFileEndLight
+=================
+*/
+static void R_InteractionFileEndLight(trRefLight_t * light)
+{
+	interactionCache_t *iaCache;
+	link_t         *l;
+	int             numInteractions;
+
+	if(!s_iaFileWrite.words)
 	{
-		// this light has no interactions precached
 		return;
 	}
 
-	// count number of interaction caches
-	numCaches = 0;
+	numInteractions = 0;
 	for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
 	{
-		if(iaCache->redundant)
-			continue;
+		numInteractions++;
+	}
 
-		surface = iaCache->surface;
+	R_InteractionFileWriteInt(numInteractions);
+	for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
+	{
+		R_InteractionFileWriteInt(iaCache->surface - s_worldData.surfaces);
+		R_InteractionFileWriteInt(iaCache->cubeSideBits | (iaCache->mergedIntoVBO ? 0x100 : 0));
+	}
 
-		if(!surface->shader->interactLight)
-			continue;
+	// oldest first so the reader can rebuild the list with InsertLink
+	R_InteractionFileWriteInt(light->leafs.numElements);
+	for(l = light->leafs.prev; l != &light->leafs; l = l->prev)
+	{
+		R_InteractionFileWriteInt((bspNode_t *) l->data - s_worldData.nodes);
+	}
+}
 
-		if(surface->shader->isPortal)
-			continue;
+/*
+=================
+R_InteractionFileValidate
 
-		if(ShaderRequiresCPUDeforms(surface->shader))
-			continue;
+Walks the whole cache without side effects so a broken file is rejected
+before anything has been allocated from it
+=================
+*/
+static qboolean R_InteractionFileValidate(void)
+{
+	int             i, j, k;
+	int             numMeshes, numTriangles, numInteractions, numLeafs;
 
-		numCaches++;
-	}
+	s_iaFileRead.readPos = 0;
+	s_iaFileRead.overflow = qfalse;
 
-	// build interaction caches list
-	iaCachesSorted = ri.Hunk_AllocateTempMemory(numCaches * sizeof(iaCachesSorted[0]));
+	if(R_InteractionFileReadInt() != INTERACTIONFILE_IDENT ||
+	   R_InteractionFileReadInt() != INTERACTIONFILE_VERSION ||
+	   R_InteractionFileReadInt() != (int)s_worldData.checksum ||
+	   R_InteractionFileReadInt() != (int)R_InteractionFileConfig() ||
+	   R_InteractionFileReadInt() != s_worldData.numLights)
+	{
+		return qfalse;
+	}
 
-	numCaches = 0;
-	for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
+	// one record for every light that was not skipped by R_PrecacheInteractions
+	for(i = 0; s_iaFileRead.readPos < s_iaFileRead.numWords && !s_iaFileRead.overflow; i++)
 	{
-		if(iaCache->redundant)
-			continue;
+		if(i == s_worldData.numLights)
+		{
+			return qfalse;
+		}
 
-		surface = iaCache->surface;
+		numMeshes = R_InteractionFileReadInt();
+		for(j = 0; j < numMeshes && !s_iaFileRead.overflow; j++)
+		{
+			R_InteractionFileReadIndex(IAFILE_SHADOWCUBEMESH + 1);
+			R_InteractionFileReadIndex(s_worldData.numSurfaces);
+			s_iaFileRead.readPos += 1 + 6 + 1;
 
-		if(!surface->shader->interactLight)
-			continue;
+			numTriangles = R_InteractionFileReadInt();
+			if(numTriangles <= 0 || numTriangles > s_iaFileRead.numWords / 3)
+			{
+				return qfalse;
+			}
 
-		if(surface->shader->isPortal)
-			continue;
+			for(k = 0; k < numTriangles * 3 && !s_iaFileRead.overflow; k++)
+			{
+				R_InteractionFileReadIndex(s_worldData.numVerts);
+			}
+		}
 
-		if(ShaderRequiresCPUDeforms(surface->shader))
-			continue;
+		numInteractions = R_InteractionFileReadInt();
+		for(j = 0; j < numInteractions && !s_iaFileRead.overflow; j++)
+		{
+			R_InteractionFileReadIndex(s_worldData.numSurfaces);
+			R_InteractionFileReadInt();
+		}
 
-		iaCachesSorted[numCaches] = iaCache;
-		numCaches++;
+		numLeafs = R_InteractionFileReadInt();
+		for(j = 0; j < numLeafs && !s_iaFileRead.overflow; j++)
+		{
+			R_InteractionFileReadIndex(s_worldData.numnodes);
+		}
 	}
 
+	return !s_iaFileRead.overflow && s_iaFileRead.readPos == s_iaFileRead.numWords;
+}
 
-	// sort interaction caches by shader
-	qsort(iaCachesSorted, numCaches, sizeof(iaCachesSorted), InteractionCacheCompare);
+/*
+=================
+R_InteractionFileReadLight
 
-	// create a VBO for each shader
-	shader = oldShader = NULL;
+Replaces the BSP walk and the mesh building of R_PrecacheInteractions for one light
+=================
+*/
+static void R_InteractionFileReadLight(trRefLight_t * light)
+{
+	int             i, j, type, bits;
+	int             numMeshes, numTriangles, numInteractions, numLeafs;
+	bspSurface_t   *surface;
+	srfTriangle_t  *triangles;
+	srfVBOMesh_t   *vboSurf;
+	interactionVBO_t *iaVBO;
+	link_t         *l;
 
-	for(k = 0; k < numCaches; k++)
+	numMeshes = R_InteractionFileReadInt();
+	for(i = 0; i < numMeshes; i++)
 	{
-		iaCache = iaCachesSorted[k];
+		type = R_InteractionFileReadInt();
+		surface = &s_worldData.surfaces[R_InteractionFileReadInt()];
+		bits = R_InteractionFileReadInt();
 
-		iaCache->mergedIntoVBO = qtrue;
+		vboSurf = ri.Hunk_Alloc(sizeof(*vboSurf), h_low);
+		vboSurf->surfaceType = SF_VBO_MESH;
+		vboSurf->lightmapNum = -1;
 
-		shader = iaCache->surface->shader;
+		for(j = 0; j < 3; j++)
+		{
+			vboSurf->bounds[0][j] = R_InteractionFileReadFloat();
+			vboSurf->bounds[1][j] = R_InteractionFileReadFloat();
+		}
 
-		if(shader != oldShader)
+		vboSurf->numVerts = R_InteractionFileReadInt();
+		numTriangles = R_InteractionFileReadInt();
+		vboSurf->numIndexes = numTriangles * 3;
+
+		triangles = ri.Hunk_AllocateTempMemory(numTriangles * sizeof(srfTriangle_t));
+		for(j = 0; j < numTriangles; j++)
 		{
-			oldShader = shader;
+			triangles[j].indexes[0] = R_InteractionFileReadInt();
+			triangles[j].indexes[1] = R_InteractionFileReadInt();
+			triangles[j].indexes[2] = R_InteractionFileReadInt();
+		}
 
-			// count vertices and indices
-			numVerts = 0;
-			numTriangles = 0;
+		vboSurf->vbo = s_worldData.vbo;
 
-			ClearBounds(bounds[0], bounds[1]);
-			for(l = k; l < numCaches; l++)
-			{
-				iaCache2 = iaCachesSorted[l];
+		iaVBO = R_CreateInteractionVBO(light);
+		iaVBO->shader = (struct shader_s *)surface->shader;
 
-				surface = iaCache2->surface;
+		switch (type)
+		{
+			case IAFILE_LIGHTMESH:
+				vboSurf->ibo = R_CreateIBO2(va("staticLightMesh_IBO %i", c_vboLightSurfaces), numTriangles, triangles, VBO_USAGE_STATIC);
+				iaVBO->vboLightMesh = (struct srfVBOMesh_s *)vboSurf;
+				c_vboLightSurfaces++;
+				break;
 
-				if(surface->shader != shader)
-					continue;
+			case IAFILE_SHADOWMESH:
+				vboSurf->ibo = R_CreateIBO2(va("staticShadowMesh_IBO %i", c_vboLightSurfaces), numTriangles, triangles, VBO_USAGE_STATIC);
+				iaVBO->vboShadowMesh = (struct srfVBOMesh_s *)vboSurf;
+				c_vboShadowSurfaces++;
+				break;
 
-				if(*surface->data == SF_FACE)
-				{
-					srfSurfaceFace_t *srf = (srfSurfaceFace_t *) surface->data;
+			default:
+				vboSurf->ibo = R_CreateIBO2(va("staticShadowPyramidMesh_IBO %i", c_vboShadowSurfaces), numTriangles, triangles, VBO_USAGE_STATIC);
+				iaVBO->cubeSideBits = bits;
+				iaVBO->vboShadowMesh = (struct srfVBOMesh_s *)vboSurf;
+				c_vboShadowSurfaces++;
+				break;
+		}
 
-					if(srf->numTriangles)
-					{
-						numLitTriangles = UpdateLightTriangles(s_worldData.verts, srf->numTriangles, s_worldData.triangles + srf->firstTriangle, surface->shader, light);
-						if(numLitTriangles)
-						{
-							BoundsAdd(bounds[0], bounds[1], srf->bounds[0], srf->bounds[1]);
-						}
+		ri.Hunk_FreeTempMemory(triangles);
+	}
 
-						numTriangles += numLitTriangles;
-					}
+	numInteractions = R_InteractionFileReadInt();
+	for(i = 0; i < numInteractions; i++)
+	{
+		R_PrecacheInteraction(light, &s_worldData.surfaces[R_InteractionFileReadInt()]);
 
-					if(srf->numVerts)
-						numVerts += srf->numVerts;
-				}
-				else if(*surface->data == SF_GRID)
-				{
-					srfGridMesh_t  *srf = (srfGridMesh_t *) surface->data;
+		bits = R_InteractionFileReadInt();
+		light->lastInteractionCache->cubeSideBits = bits & 0xFF;
+		light->lastInteractionCache->mergedIntoVBO = (bits & 0x100) ? qtrue : qfalse;
+	}
 
-					if(srf->numTriangles)
-					{
-						numLitTriangles = UpdateLightTriangles(s_worldData.verts, srf->numTriangles, s_worldData.triangles + srf->firstTriangle, surface->shader, light);
-						if(numLitTriangles)
-						{
-							BoundsAdd(bounds[0], bounds[1], srf->bounds[0], srf->bounds[1]);
-						}
-
-						numTriangles += numLitTriangles;
-					}
-
-					if(srf->numVerts)
-						numVerts += srf->numVerts;
-				}
-				else if(*surface->data == SF_TRIANGLES)
-				{
-					srfTriangles_t *srf = (srfTriangles_t *) surface->data;
-
-					if(srf->numTriangles)
-					{
-						numLitTriangles = UpdateLightTriangles(s_worldData.verts, srf->numTriangles, s_worldData.triangles + srf->firstTriangle, surface->shader, light);
-						if(numLitTriangles)
-						{
-							BoundsAdd(bounds[0], bounds[1], srf->bounds[0], srf->bounds[1]);
-						}
-
-						numTriangles += numLitTriangles;
-					}
-
-					if(srf->numVerts)
-						numVerts += srf->numVerts;
-				}
-			}
-
-			if(!numVerts || !numTriangles)
-				continue;
-
-			//ri.Printf(PRINT_ALL, "...calculating light mesh VBOs ( %s, %i verts %i tris )\n", shader->name, vertexesNum, indexesNum / 3);
-
-			// create surface
-			vboSurf = ri.Hunk_Alloc(sizeof(*vboSurf), h_low);
-			vboSurf->surfaceType = SF_VBO_MESH;
-			vboSurf->numIndexes = numTriangles * 3;
-			vboSurf->numVerts = numVerts;
-			vboSurf->lightmapNum = -1;
-
-			VectorCopy(bounds[0], vboSurf->bounds[0]);
-			VectorCopy(bounds[1], vboSurf->bounds[1]);
+	QueueInit(&light->leafs);
 
-			// create arrays
-			triangles = ri.Hunk_AllocateTempMemory(numTriangles * sizeof(srfTriangle_t));
-			numTriangles = 0;
+	numLeafs = R_InteractionFileReadInt();
+	for(i = 0; i < numLeafs; i++)
+	{
+		l = ri.Hunk_Alloc(sizeof(*l), h_low);
+		InitLink(l, &s_worldData.nodes[R_InteractionFileReadInt()]);
 
-			// build triangle indices
-			for(l = k; l < numCaches; l++)
-			{
-				iaCache2 = iaCachesSorted[l];
+		InsertLink(l, &light->leafs);
 
-				surface = iaCache2->surface;
+		light->leafs.numElements++;
+	}
+}
 
-				if(surface->shader != shader)
-					continue;
+/*
+=================
+R_InteractionFileName
+=================
+*/
+static const char *R_InteractionFileName(void)
+{
+	return va("maps/%s/interactions.cache", s_worldData.baseName);
+}
 
-				if(*surface->data == SF_FACE)
-				{
-					srfSurfaceFace_t *srf = (srfSurfaceFace_t *) surface->data;
+/*
+=================
+R_InteractionFileBegin
 
-					for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
-					{
-						if(tri->facingLight)
-						{
-							for(j = 0; j < 3; j++)
-							{
-								triangles[numTriangles].indexes[j] = tri->indexes[j];
-							}
+Returns qtrue if a valid cache was found and R_InteractionFileReadLight can be used.
+Otherwise starts recording a new one.
+=================
+*/
+static qboolean R_InteractionFileBegin(void)
+{
+	int             length;
+	void           *buffer;
 
-							numTriangles++;
-						}
-					}
-				}
-				else if(*surface->data == SF_GRID)
-				{
-					srfGridMesh_t  *srf = (srfGridMesh_t *) surface->data;
+	Com_Memset(&s_iaFileRead, 0, sizeof(s_iaFileRead));
+	Com_Memset(&s_iaFileWrite, 0, sizeof(s_iaFileWrite));
 
-					for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
-					{
-						if(tri->facingLight)
-						{
-							for(j = 0; j < 3; j++)
-							{
-								triangles[numTriangles].indexes[j] = tri->indexes[j];
-							}
+	if(!r_cacheInteractions->integer)
+	{
+		return qfalse;
+	}
 
-							numTriangles++;
-						}
-					}
-				}
-				else if(*surface->data == SF_TRIANGLES)
-				{
-					srfTriangles_t *srf = (srfTriangles_t *) surface->data;
+	length = ri.FS_ReadFile(R_InteractionFileName(), &buffer);
+	if(buffer)
+	{
+		// the file is used in place, nothing is parsed into a second copy
+		s_iaFileRead.words = (int *)buffer;
+		s_iaFileRead.numWords = length / sizeof(int);
 
-					for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
-					{
-						if(tri->facingLight)
-						{
-							for(j = 0; j < 3; j++)
-							{
-								triangles[numTriangles].indexes[j] = tri->indexes[j];
-							}
+		if(R_InteractionFileValidate())
+		{
+			// skip the header
+			s_iaFileRead.readPos = 5;
+			return qtrue;
+		}
 
-							numTriangles++;
-						}
-					}
-				}
-			}
+		ri.Printf(PRINT_DEVELOPER, "%s is out of date\n", R_InteractionFileName());
 
-			/*
-			   numVerts = OptimizeVertices(numVerts, verts, numTriangles, triangles, optimizedVerts, CompareLightVert);
-			   if(c_redundantVertexes)
-			   {
-			   ri.Printf(PRINT_DEVELOPER,
-			   "...removed %i redundant vertices from staticLightMesh %i ( %s, %i verts %i tris )\n",
-			   c_redundantVertexes, c_vboLightSurfaces, shader->name, numVerts, numTriangles);
-			   }
+		ri.FS_FreeFile(buffer);
+		Com_Memset(&s_iaFileRead, 0, sizeof(s_iaFileRead));
+	}
 
-			   vboSurf->vbo = R_CreateVBO2(va("staticLightMesh_vertices %i", c_vboLightSurfaces), numVerts, optimizedVerts,
-			   ATTR_POSITION | ATTR_TEXCOORD | ATTR_TANGENT | ATTR_BINORMAL | ATTR_NORMAL |
-			   ATTR_COLOR, VBO_USAGE_STATIC);
-			 */
+	R_InteractionFileWriteInt(INTERACTIONFILE_IDENT);
+	R_InteractionFileWriteInt(INTERACTIONFILE_VERSION);
+	R_InteractionFileWriteInt(s_worldData.checksum);
+	R_InteractionFileWriteInt(R_InteractionFileConfig());
+	R_InteractionFileWriteInt(s_worldData.numLights);
 
-#if CALC_REDUNDANT_SHADOWVERTS
-			OptimizeTrianglesLite(s_worldData.redundantLightVerts, numTriangles, triangles);
-			if(c_redundantVertexes)
-			{
-				ri.Printf(PRINT_DEVELOPER, "...removed %i redundant vertices from staticLightMesh %i ( %s, %i verts %i tris )\n",
-						  c_redundantVertexes, c_vboLightSurfaces, shader->name, numVerts, numTriangles);
-			}
-#endif
-			vboSurf->vbo = s_worldData.vbo;
-			vboSurf->ibo =
-				R_CreateIBO2(va("staticLightMesh_IBO %i", c_vboLightSurfaces), numTriangles, triangles, VBO_USAGE_STATIC);
+	return qfalse;
+}
 
-			ri.Hunk_FreeTempMemory(triangles);
+/*
+=================
+R_InteractionFileEnd
+=================
+*/
+static void R_InteractionFileEnd(void)
+{
+	if(s_iaFileRead.words)
+	{
+		ri.FS_FreeFile(s_iaFileRead.words);
+	}
 
-			// add everything needed to the light
-			iaVBO = R_CreateInteractionVBO(light);
-			iaVBO->shader = (struct shader_s *)shader;
-			iaVBO->vboLightMesh = (struct srfVBOMesh_s *)vboSurf;
+	if(s_iaFileWrite.words)
+	{
+		ri.Printf(PRINT_DEVELOPER, "writing %s\n", R_InteractionFileName());
+		ri.FS_WriteFile(R_InteractionFileName(), s_iaFileWrite.words, s_iaFileWrite.numWords * sizeof(int));
 
-			c_vboLightSurfaces++;
-		}
+		Com_Dealloc(s_iaFileWrite.words);
 	}
 
-	ri.Hunk_FreeTempMemory(iaCachesSorted);
-#endif
+	Com_Memset(&s_iaFileRead, 0, sizeof(s_iaFileRead));
+	Com_Memset(&s_iaFileWrite, 0, sizeof(s_iaFileWrite));
 }
 
 /*
-===============
-R_CreateVBOShadowMeshes
-===============
+=================
+InteractionCacheCompare
+compare function for qsort()
+=================
 */
-static void R_CreateVBOShadowMeshes(trRefLight_t * light)
+static int InteractionCacheCompare(const void *a, const void *b)
 {
-#if 1
-	int             i, j, k, l;
-
-	int             numVerts;
-
-	int             numTriangles, numLitTriangles;
-	srfTriangle_t  *triangles;
-	srfTriangle_t  *tri;
+	interactionCache_t *aa, *bb;
 
-	interactionVBO_t *iaVBO;
+	aa = *(interactionCache_t **) a;
+	bb = *(interactionCache_t **) b;
 
-	interactionCache_t *iaCache, *iaCache2;
-	interactionCache_t **iaCachesSorted;
-	int             numCaches;
+	// shader first
+	if(aa->surface->shader < bb->surface->shader)
+		return -1;
 
-	shader_t       *shader, *oldShader;
-	qboolean        alphaTest, oldAlphaTest;
+	else if(aa->surface->shader > bb->surface->shader)
+		return 1;
 
-	bspSurface_t   *surface;
+	// then alphaTest
+	if(aa->surface->shader->alphaTest < bb->surface->shader->alphaTest)
+		return -1;
 
-	srfVBOMesh_t   *vboSurf;
-	vec3_t			bounds[2];
+	else if(aa->surface->shader->alphaTest > bb->surface->shader->alphaTest)
+		return 1;
 
-	if(!r_vboShadows->integer)
-		return;
+	return 0;
+}
 
-	if(r_shadows->integer < SHADOWING_ESM16)
-		return;
+static int UpdateLightTriangles(const srfVert_t * verts, int numTriangles, srfTriangle_t * triangles, shader_t * surfaceShader,
+								trRefLight_t * light)
+{
+	int             i;
+	srfTriangle_t  *tri;
+	int             numFacing;
 
-	if(!light->firstInteractionCache)
+	numFacing = 0;
+	for(i = 0, tri = triangles; i < numTriangles; i++, tri++)
 	{
-		// this light has no interactions precached
-		return;
-	}
+#if 1
+		vec3_t          pos[3];
+		float           d;
 
-	if(light->l.noShadows)
-		return;
+		VectorCopy(verts[tri->indexes[0]].xyz, pos[0]);
+		VectorCopy(verts[tri->indexes[1]].xyz, pos[1]);
+		VectorCopy(verts[tri->indexes[2]].xyz, pos[2]);
 
-	switch (light->l.rlType)
-	{
-		case RL_OMNI:
-			return;
+		if(PlaneFromPoints(tri->plane, pos[0], pos[1], pos[2], qtrue))
+		{
+			tri->degenerated = qfalse;
 
-		case RL_DIRECTIONAL:
-		case RL_PROJ:
-			break;
+			if(light->l.rlType == RL_DIRECTIONAL)
+			{
+				vec3_t		lightDirection;
 
-		default:
-			return;
-	}
+				// light direction is from surface to light
+				#if 1
+				VectorCopy(tr.sunDirection, lightDirection);
+				#else
+				VectorCopy(light->direction, lightDirection);
+				#endif
 
-	// count number of interaction caches
+				d = DotProduct(tri->plane, lightDirection);
+
+				if(surfaceShader->cullType == CT_TWO_SIDED || (d > 0 && surfaceShader->cullType != CT_BACK_SIDED))
+				{
+					tri->facingLight = qtrue;
+				}
+				else
+				{
+					tri->facingLight = qfalse;
+				}
+			}
+			else
+			{
+				// check if light origin is behind triangle
+				d = DotProduct(tri->plane, light->origin) - tri->plane[3];
+
+				if(surfaceShader->cullType == CT_TWO_SIDED || (d > 0 && surfaceShader->cullType != CT_BACK_SIDED))
+				{
+					tri->facingLight = qtrue;
+				}
+				else
+				{
+					tri->facingLight = qfalse;
+				}
+			}
+		}
+		else
+		{
+			tri->degenerated = qtrue;
+			tri->facingLight = qtrue;	// FIXME ?
+		}
+
+		if(R_CullLightTriangle(light, pos) == CULL_OUT)
+		{
+			tri->facingLight = qfalse;
+		}
+
+		if(tri->facingLight)
+			numFacing++;
+#else
+		tri->facingLight = qtrue;
+		numFacing++;
+#endif
+	}
+
+	return numFacing;
+}
+
+/*
+===============
+R_CreateVBOLightMeshes
+===============
+*/
+static void R_CreateVBOLightMeshes(trRefLight_t * light)
+{
+#if 1
+	int             i, j, k, l;
+
+	int             numVerts;
+
+	int             numTriangles, numLitTriangles;
+	srfTriangle_t  *triangles;
+	srfTriangle_t  *tri;
+
+	interactionVBO_t *iaVBO;
+
+	interactionCache_t *iaCache, *iaCache2;
+	interactionCache_t **iaCachesSorted;
+	int             numCaches;
+
+	shader_t       *shader, *oldShader;
+
+	bspSurface_t   *surface;
+
+	srfVBOMesh_t   *vboSurf;
+	vec3_t			bounds[2];
+
+	if(!r_vboLighting->integer)
+		return;
+
+	if(r_deferredShading->integer && r_shadows->integer < SHADOWING_ESM16)
+		return;
+
+	if(!light->firstInteractionCache)
+	{
+		// this light has no interactions precached
+		return;
+	}
+
+	// count number of interaction caches
 	numCaches = 0;
 	for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
 	{
@@ -7461,15 +8029,6 @@ static void R_CreateVBOShadowMeshes(trRefLight_t * light)
 		if(!surface->shader->interactLight)
 			continue;
 
-		if(surface->shader->isSky)
-			continue;
-
-		if(surface->shader->noShadows)
-			continue;
-
-		if(surface->shader->sort > SS_OPAQUE)
-			continue;
-
 		if(surface->shader->isPortal)
 			continue;
 
@@ -7493,15 +8052,6 @@ static void R_CreateVBOShadowMeshes(trRefLight_t * light)
 		if(!surface->shader->interactLight)
 			continue;
 
-		if(surface->shader->isSky)
-			continue;
-
-		if(surface->shader->noShadows)
-			continue;
-
-		if(surface->shader->sort > SS_OPAQUE)
-			continue;
-
 		if(surface->shader->isPortal)
 			continue;
 
@@ -7518,7 +8068,6 @@ static void R_CreateVBOShadowMeshes(trRefLight_t * light)
 
 	// create a VBO for each shader
 	shader = oldShader = NULL;
-	oldAlphaTest = alphaTest = -1;
 
 	for(k = 0; k < numCaches; k++)
 	{
@@ -7527,14 +8076,10 @@ static void R_CreateVBOShadowMeshes(trRefLight_t * light)
 		iaCache->mergedIntoVBO = qtrue;
 
 		shader = iaCache->surface->shader;
-		alphaTest = shader->alphaTest;
-
-		iaCache->mergedIntoVBO = qtrue;
 
-		if(alphaTest ? shader != oldShader : alphaTest != oldAlphaTest)
+		if(shader != oldShader)
 		{
 			oldShader = shader;
-			oldAlphaTest = alphaTest;
 
 			// count vertices and indices
 			numVerts = 0;
@@ -7547,21 +8092,8 @@ static void R_CreateVBOShadowMeshes(trRefLight_t * light)
 
 				surface = iaCache2->surface;
 
-#if 0
 				if(surface->shader != shader)
-					break;
-#else
-				if(alphaTest)
-				{
-					if(surface->shader != shader)
-						break;
-				}
-				else
-				{
-					if(surface->shader->alphaTest != alphaTest)
-						break;
-				}
-#endif
+					continue;
 
 				if(*surface->data == SF_FACE)
 				{
@@ -7645,21 +8177,8 @@ static void R_CreateVBOShadowMeshes(trRefLight_t * light)
 
 				surface = iaCache2->surface;
 
-#if 0
 				if(surface->shader != shader)
-					break;
-#else
-				if(alphaTest)
-				{
-					if(surface->shader != shader)
-						break;
-				}
-				else
-				{
-					if(surface->shader->alphaTest != alphaTest)
-						break;
-				}
-#endif
+					continue;
 
 				if(*surface->data == SF_FACE)
 				{
@@ -7729,24 +8248,29 @@ static void R_CreateVBOShadowMeshes(trRefLight_t * light)
 			 */
 
 #if CALC_REDUNDANT_SHADOWVERTS
-			OptimizeTrianglesLite(s_worldData.redundantShadowVerts, numTriangles, triangles);
+			OptimizeTrianglesLite(s_worldData.redundantLightVerts, numTriangles, triangles);
 			if(c_redundantVertexes)
 			{
 				ri.Printf(PRINT_DEVELOPER, "...removed %i redundant vertices from staticLightMesh %i ( %s, %i verts %i tris )\n",
 						  c_redundantVertexes, c_vboLightSurfaces, shader->name, numVerts, numTriangles);
 			}
 #endif
+			R_OptimizeTrianglesForVertexCache(numTriangles, triangles);
+
 			vboSurf->vbo = s_worldData.vbo;
-			vboSurf->ibo = R_CreateIBO2(va("staticShadowMesh_IBO %i", c_vboLightSurfaces), numTriangles, triangles, VBO_USAGE_STATIC);
+			vboSurf->ibo =
+				R_CreateIBO2(va("staticLightMesh_IBO %i", c_vboLightSurfaces), numTriangles, triangles, VBO_USAGE_STATIC);
+
+			R_InteractionFileWriteMesh(IAFILE_LIGHTMESH, iaCache->surface, vboSurf, 0, numTriangles, triangles);
 
 			ri.Hunk_FreeTempMemory(triangles);
 
 			// add everything needed to the light
 			iaVBO = R_CreateInteractionVBO(light);
 			iaVBO->shader = (struct shader_s *)shader;
-			iaVBO->vboShadowMesh = (struct srfVBOMesh_s *)vboSurf;
+			iaVBO->vboLightMesh = (struct srfVBOMesh_s *)vboSurf;
 
-			c_vboShadowSurfaces++;
+			c_vboLightSurfaces++;
 		}
 	}
 
@@ -7756,16 +8280,17 @@ static void R_CreateVBOShadowMeshes(trRefLight_t * light)
 
 /*
 ===============
-R_CreateVBOShadowCubeMeshes
+R_CreateVBOShadowMeshes
 ===============
 */
-static void R_CreateVBOShadowCubeMeshes(trRefLight_t * light)
+static void R_CreateVBOShadowMeshes(trRefLight_t * light)
 {
+#if 1
 	int             i, j, k, l;
 
 	int             numVerts;
 
-	int             numTriangles;
+	int             numTriangles, numLitTriangles;
 	srfTriangle_t  *triangles;
 	srfTriangle_t  *tri;
 
@@ -7777,11 +8302,11 @@ static void R_CreateVBOShadowCubeMeshes(trRefLight_t * light)
 
 	shader_t       *shader, *oldShader;
 	qboolean        alphaTest, oldAlphaTest;
-	int             cubeSide;
 
 	bspSurface_t   *surface;
 
 	srfVBOMesh_t   *vboSurf;
+	vec3_t			bounds[2];
 
 	if(!r_vboShadows->integer)
 		return;
@@ -7798,8 +8323,18 @@ static void R_CreateVBOShadowCubeMeshes(trRefLight_t * light)
 	if(light->l.noShadows)
 		return;
 
-	if(light->l.rlType != RL_OMNI)
-		return;
+	switch (light->l.rlType)
+	{
+		case RL_OMNI:
+			return;
+
+		case RL_DIRECTIONAL:
+		case RL_PROJ:
+			break;
+
+		default:
+			return;
+	}
 
 	// count number of interaction caches
 	numCaches = 0;
@@ -7864,253 +8399,285 @@ static void R_CreateVBOShadowCubeMeshes(trRefLight_t * light)
 		numCaches++;
 	}
 
+
 	// sort interaction caches by shader
 	qsort(iaCachesSorted, numCaches, sizeof(iaCachesSorted), InteractionCacheCompare);
 
 	// create a VBO for each shader
-	for(cubeSide = 0; cubeSide < 6; cubeSide++)
+	shader = oldShader = NULL;
+	oldAlphaTest = alphaTest = -1;
+
+	for(k = 0; k < numCaches; k++)
 	{
-		shader = oldShader = NULL;
-		oldAlphaTest = alphaTest = -1;
+		iaCache = iaCachesSorted[k];
 
-		for(k = 0; k < numCaches; k++)
-		{
-			iaCache = iaCachesSorted[k];
-			shader = iaCache->surface->shader;
-			alphaTest = shader->alphaTest;
+		iaCache->mergedIntoVBO = qtrue;
 
-			iaCache->mergedIntoVBO = qtrue;
+		shader = iaCache->surface->shader;
+		alphaTest = shader->alphaTest;
 
-			//if(!(iaCache->cubeSideBits & (1 << cubeSide)))
-			//  continue;
+		iaCache->mergedIntoVBO = qtrue;
 
-			//if(shader != oldShader)
-			if(alphaTest ? shader != oldShader : alphaTest != oldAlphaTest)
-			{
-				oldShader = shader;
-				oldAlphaTest = alphaTest;
+		if(alphaTest ? shader != oldShader : alphaTest != oldAlphaTest)
+		{
+			oldShader = shader;
+			oldAlphaTest = alphaTest;
 
-				// count vertices and indices
-				numVerts = 0;
-				numTriangles = 0;
+			// count vertices and indices
+			numVerts = 0;
+			numTriangles = 0;
 
-				for(l = k; l < numCaches; l++)
-				{
-					iaCache2 = iaCachesSorted[l];
+			ClearBounds(bounds[0], bounds[1]);
+			for(l = k; l < numCaches; l++)
+			{
+				iaCache2 = iaCachesSorted[l];
 
-					surface = iaCache2->surface;
+				surface = iaCache2->surface;
 
 #if 0
+				if(surface->shader != shader)
+					break;
+#else
+				if(alphaTest)
+				{
 					if(surface->shader != shader)
 						break;
-#else
-					if(alphaTest)
-					{
-						if(surface->shader != shader)
-							break;
-					}
-					else
-					{
-						if(surface->shader->alphaTest != alphaTest)
-							break;
-					}
+				}
+				else
+				{
+					if(surface->shader->alphaTest != alphaTest)
+						break;
+				}
 #endif
 
-					if(!(iaCache2->cubeSideBits & (1 << cubeSide)))
-						continue;
+				if(*surface->data == SF_FACE)
+				{
+					srfSurfaceFace_t *srf = (srfSurfaceFace_t *) surface->data;
 
-					if(*surface->data == SF_FACE)
+					if(srf->numTriangles)
 					{
-						srfSurfaceFace_t *srf = (srfSurfaceFace_t *) surface->data;
-
-						if(srf->numTriangles)
-							numTriangles +=
-								UpdateLightTriangles(s_worldData.verts, srf->numTriangles,
-													 s_worldData.triangles + srf->firstTriangle, surface->shader, light);
+						numLitTriangles = UpdateLightTriangles(s_worldData.verts, srf->numTriangles, s_worldData.triangles + srf->firstTriangle, surface->shader, light);
+						if(numLitTriangles)
+						{
+							BoundsAdd(bounds[0], bounds[1], srf->bounds[0], srf->bounds[1]);
+						}
 
-						if(srf->numVerts)
-							numVerts += srf->numVerts;
+						numTriangles += numLitTriangles;
 					}
-					else if(*surface->data == SF_GRID)
-					{
-						srfGridMesh_t  *srf = (srfGridMesh_t *) surface->data;
 
-						if(srf->numTriangles)
-							numTriangles +=
-								UpdateLightTriangles(s_worldData.verts, srf->numTriangles,
-													 s_worldData.triangles + srf->firstTriangle, surface->shader, light);
+					if(srf->numVerts)
+						numVerts += srf->numVerts;
+				}
+				else if(*surface->data == SF_GRID)
+				{
+					srfGridMesh_t  *srf = (srfGridMesh_t *) surface->data;
 
-						if(srf->numVerts)
-							numVerts += srf->numVerts;
-					}
-					else if(*surface->data == SF_TRIANGLES)
+					if(srf->numTriangles)
 					{
-						srfTriangles_t *srf = (srfTriangles_t *) surface->data;
+						numLitTriangles = UpdateLightTriangles(s_worldData.verts, srf->numTriangles, s_worldData.triangles + srf->firstTriangle, surface->shader, light);
+						if(numLitTriangles)
+						{
+							BoundsAdd(bounds[0], bounds[1], srf->bounds[0], srf->bounds[1]);
+						}
 
-						if(srf->numTriangles)
-							numTriangles +=
-								UpdateLightTriangles(s_worldData.verts, srf->numTriangles,
-													 s_worldData.triangles + srf->firstTriangle, surface->shader, light);
+						numTriangles += numLitTriangles;
+					}
 
-						if(srf->numVerts)
-							numVerts += srf->numVerts;
+					if(srf->numVerts)
+						numVerts += srf->numVerts;
+				}
+				else if(*surface->data == SF_TRIANGLES)
+				{
+					srfTriangles_t *srf = (srfTriangles_t *) surface->data;
+
+					if(srf->numTriangles)
+					{
+						numLitTriangles = UpdateLightTriangles(s_worldData.verts, srf->numTriangles, s_worldData.triangles + srf->firstTriangle, surface->shader, light);
+						if(numLitTriangles)
+						{
+							BoundsAdd(bounds[0], bounds[1], srf->bounds[0], srf->bounds[1]);
+						}
+
+						numTriangles += numLitTriangles;
 					}
+
+					if(srf->numVerts)
+						numVerts += srf->numVerts;
 				}
+			}
 
-				if(!numVerts || !numTriangles)
-					continue;
+			if(!numVerts || !numTriangles)
+				continue;
 
-				//ri.Printf(PRINT_ALL, "...calculating light mesh VBOs ( %s, %i verts %i tris )\n", shader->name, vertexesNum, indexesNum / 3);
+			//ri.Printf(PRINT_ALL, "...calculating light mesh VBOs ( %s, %i verts %i tris )\n", shader->name, vertexesNum, indexesNum / 3);
 
-				// create surface
-				vboSurf = ri.Hunk_Alloc(sizeof(*vboSurf), h_low);
-				vboSurf->surfaceType = SF_VBO_MESH;
-				vboSurf->numIndexes = numTriangles * 3;
-				vboSurf->numVerts = numVerts;
-				vboSurf->lightmapNum = -1;
-				ZeroBounds(vboSurf->bounds[0], vboSurf->bounds[1]);
+			// create surface
+			vboSurf = ri.Hunk_Alloc(sizeof(*vboSurf), h_low);
+			vboSurf->surfaceType = SF_VBO_MESH;
+			vboSurf->numIndexes = numTriangles * 3;
+			vboSurf->numVerts = numVerts;
+			vboSurf->lightmapNum = -1;
 
-				// create arrays
-				triangles = ri.Hunk_AllocateTempMemory(numTriangles * sizeof(srfTriangle_t));
-				numTriangles = 0;
+			VectorCopy(bounds[0], vboSurf->bounds[0]);
+			VectorCopy(bounds[1], vboSurf->bounds[1]);
 
-				// build triangle indices
-				for(l = k; l < numCaches; l++)
-				{
-					iaCache2 = iaCachesSorted[l];
+			// create arrays
+			triangles = ri.Hunk_AllocateTempMemory(numTriangles * sizeof(srfTriangle_t));
+			numTriangles = 0;
 
-					surface = iaCache2->surface;
+			// build triangle indices
+			for(l = k; l < numCaches; l++)
+			{
+				iaCache2 = iaCachesSorted[l];
+
+				surface = iaCache2->surface;
 
 #if 0
+				if(surface->shader != shader)
+					break;
+#else
+				if(alphaTest)
+				{
 					if(surface->shader != shader)
 						break;
-#else
-					if(alphaTest)
-					{
-						if(surface->shader != shader)
-							break;
-					}
-					else
-					{
-						if(surface->shader->alphaTest != alphaTest)
-							break;
-					}
+				}
+				else
+				{
+					if(surface->shader->alphaTest != alphaTest)
+						break;
+				}
 #endif
 
-					if(!(iaCache2->cubeSideBits & (1 << cubeSide)))
-						continue;
+				if(*surface->data == SF_FACE)
+				{
+					srfSurfaceFace_t *srf = (srfSurfaceFace_t *) surface->data;
 
-					if(*surface->data == SF_FACE)
+					for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
 					{
-						srfSurfaceFace_t *srf = (srfSurfaceFace_t *) surface->data;
-
-						for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
+						if(tri->facingLight)
 						{
-							if(tri->facingLight)
+							for(j = 0; j < 3; j++)
 							{
-								for(j = 0; j < 3; j++)
-								{
-									triangles[numTriangles].indexes[j] = tri->indexes[j];
-								}
-
-								numTriangles++;
+								triangles[numTriangles].indexes[j] = tri->indexes[j];
 							}
+
+							numTriangles++;
 						}
 					}
-					else if(*surface->data == SF_GRID)
-					{
-						srfGridMesh_t  *srf = (srfGridMesh_t *) surface->data;
+				}
+				else if(*surface->data == SF_GRID)
+				{
+					srfGridMesh_t  *srf = (srfGridMesh_t *) surface->data;
 
-						for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
+					for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
+					{
+						if(tri->facingLight)
 						{
-							if(tri->facingLight)
+							for(j = 0; j < 3; j++)
 							{
-								for(j = 0; j < 3; j++)
-								{
-									triangles[numTriangles].indexes[j] = tri->indexes[j];
-								}
-
-								numTriangles++;
+								triangles[numTriangles].indexes[j] = tri->indexes[j];
 							}
+
+							numTriangles++;
 						}
 					}
-					else if(*surface->data == SF_TRIANGLES)
-					{
-						srfTriangles_t *srf = (srfTriangles_t *) surface->data;
+				}
+				else if(*surface->data == SF_TRIANGLES)
+				{
+					srfTriangles_t *srf = (srfTriangles_t *) surface->data;
 
-						for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
+					for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
+					{
+						if(tri->facingLight)
 						{
-							if(tri->facingLight)
+							for(j = 0; j < 3; j++)
 							{
-								for(j = 0; j < 3; j++)
-								{
-									triangles[numTriangles].indexes[j] = tri->indexes[j];
-								}
-
-								numTriangles++;
+								triangles[numTriangles].indexes[j] = tri->indexes[j];
 							}
+
+							numTriangles++;
 						}
 					}
 				}
+			}
+
+			/*
+			   numVerts = OptimizeVertices(numVerts, verts, numTriangles, triangles, optimizedVerts, CompareLightVert);
+			   if(c_redundantVertexes)
+			   {
+			   ri.Printf(PRINT_DEVELOPER,
+			   "...removed %i redundant vertices from staticLightMesh %i ( %s, %i verts %i tris )\n",
+			   c_redundantVertexes, c_vboLightSurfaces, shader->name, numVerts, numTriangles);
+			   }
+
+			   vboSurf->vbo = R_CreateVBO2(va("staticLightMesh_vertices %i", c_vboLightSurfaces), numVerts, optimizedVerts,
+			   ATTR_POSITION | ATTR_TEXCOORD | ATTR_TANGENT | ATTR_BINORMAL | ATTR_NORMAL |
+			   ATTR_COLOR, VBO_USAGE_STATIC);
+			 */
 
-				if(alphaTest)
-				{
-#if CALC_REDUNDANT_SHADOWVERTS
-					//OptimizeTriangles(s_worldData.numVerts, s_worldData.verts, numTriangles, triangles, CompareShadowVertAlphaTest);
-					OptimizeTrianglesLite(s_worldData.redundantShadowAlphaTestVerts, numTriangles, triangles);
-					if(c_redundantVertexes)
-					{
-						ri.Printf(PRINT_DEVELOPER,
-								  "...removed %i redundant vertices from staticShadowPyramidMesh %i ( %s, %i verts %i tris )\n",
-								  c_redundantVertexes, c_vboShadowSurfaces, shader->name, numVerts, numTriangles);
-					}
-#endif
-					vboSurf->vbo = s_worldData.vbo;
-					vboSurf->ibo =
-						R_CreateIBO2(va("staticShadowPyramidMesh_IBO %i", c_vboShadowSurfaces), numTriangles, triangles,
-									 VBO_USAGE_STATIC);
-				}
-				else
-				{
 #if CALC_REDUNDANT_SHADOWVERTS
-					//OptimizeTriangles(s_worldData.numVerts, s_worldData.verts, numTriangles, triangles, CompareShadowVert);
-					OptimizeTrianglesLite(s_worldData.redundantShadowVerts, numTriangles, triangles);
-					if(c_redundantVertexes)
-					{
-						ri.Printf(PRINT_DEVELOPER,
-								  "...removed %i redundant vertices from staticShadowPyramidMesh %i ( %s, %i verts %i tris )\n",
-								  c_redundantVertexes, c_vboShadowSurfaces, shader->name, numVerts, numTriangles);
-					}
+			OptimizeTrianglesLite(s_worldData.redundantShadowVerts, numTriangles, triangles);
+			if(c_redundantVertexes)
+			{
+				ri.Printf(PRINT_DEVELOPER, "...removed %i redundant vertices from staticLightMesh %i ( %s, %i verts %i tris )\n",
+						  c_redundantVertexes, c_vboLightSurfaces, shader->name, numVerts, numTriangles);
+			}
 #endif
-					vboSurf->vbo = s_worldData.vbo;
-					vboSurf->ibo =
-						R_CreateIBO2(va("staticShadowPyramidMesh_IBO %i", c_vboShadowSurfaces), numTriangles, triangles,
-									 VBO_USAGE_STATIC);
-				}
+			R_OptimizeTrianglesForVertexCache(numTriangles, triangles);
 
-				ri.Hunk_FreeTempMemory(triangles);
+			vboSurf->vbo = s_worldData.vbo;
+			vboSurf->ibo = R_CreateIBO2(va("staticShadowMesh_IBO %i", c_vboLightSurfaces), numTriangles, triangles, VBO_USAGE_STATIC);
 
-				// add everything needed to the light
-				iaVBO = R_CreateInteractionVBO(light);
-				iaVBO->cubeSideBits = (1 << cubeSide);
-				iaVBO->shader = (struct shader_s *)shader;
-				iaVBO->vboShadowMesh = (struct srfVBOMesh_s *)vboSurf;
+			R_InteractionFileWriteMesh(IAFILE_SHADOWMESH, iaCache->surface, vboSurf, 0, numTriangles, triangles);
 
-				c_vboShadowSurfaces++;
-			}
-		}
-	}
+			ri.Hunk_FreeTempMemory(triangles);
 
-	ri.Hunk_FreeTempMemory(iaCachesSorted);
+			// add everything needed to the light
+			iaVBO = R_CreateInteractionVBO(light);
+			iaVBO->shader = (struct shader_s *)shader;
+			iaVBO->vboShadowMesh = (struct srfVBOMesh_s *)vboSurf;
+
+			c_vboShadowSurfaces++;
+		}
+	}
+
+	ri.Hunk_FreeTempMemory(iaCachesSorted);
+#endif
 }
 
-static void R_CalcInteractionCubeSideBits(trRefLight_t * light)
+/*
+===============
+R_CreateVBOShadowCubeMeshes
+===============
+*/
+static void R_CreateVBOShadowCubeMeshes(trRefLight_t * light)
 {
-	interactionCache_t *iaCache;
+	int             i, j, k, l;
+
+	int             numVerts;
+
+	int             numTriangles;
+	srfTriangle_t  *triangles;
+	srfTriangle_t  *tri;
+
+	interactionVBO_t *iaVBO;
+
+	interactionCache_t *iaCache, *iaCache2;
+	interactionCache_t **iaCachesSorted;
+	int             numCaches;
+
+	shader_t       *shader, *oldShader;
+	qboolean        alphaTest, oldAlphaTest;
+	int             cubeSide;
+
 	bspSurface_t   *surface;
-	vec3_t          localBounds[2];
 
-	if(r_shadows->integer <= SHADOWING_BLOB)
+	srfVBOMesh_t   *vboSurf;
+
+	if(!r_vboShadows->integer)
+		return;
+
+	if(r_shadows->integer < SHADOWING_ESM16)
 		return;
 
 	if(!light->firstInteractionCache)
@@ -8120,455 +8687,1272 @@ static void R_CalcInteractionCubeSideBits(trRefLight_t * light)
 	}
 
 	if(light->l.noShadows)
-	{
-		// actually noShadows lights are quite bad concerning this optimization
 		return;
-	}
 
 	if(light->l.rlType != RL_OMNI)
 		return;
 
-	/*
-	   if(glConfig.vertexBufferObjectAvailable && r_vboLighting->integer)
-	   {
-	   srfVBOLightMesh_t *srf;
+	// count number of interaction caches
+	numCaches = 0;
+	for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
+	{
+		if(iaCache->redundant)
+			continue;
 
-	   for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
-	   {
-	   if(iaCache->redundant)
-	   continue;
+		surface = iaCache->surface;
 
-	   if(!iaCache->vboLightMesh)
-	   continue;
+		if(!surface->shader->interactLight)
+			continue;
 
-	   srf = iaCache->vboLightMesh;
+		if(surface->shader->isSky)
+			continue;
 
-	   VectorCopy(srf->bounds[0], localBounds[0]);
-	   VectorCopy(srf->bounds[1], localBounds[1]);
+		if(surface->shader->noShadows)
+			continue;
 
-	   light->shadowLOD = 0;    // important for R_CalcLightCubeSideBits
-	   iaCache->cubeSideBits = R_CalcLightCubeSideBits(light, localBounds);
-	   }
-	   }
-	   else
-	 */
+		if(surface->shader->sort > SS_OPAQUE)
+			continue;
+
+		if(surface->shader->isPortal)
+			continue;
+
+		if(ShaderRequiresCPUDeforms(surface->shader))
+			continue;
+
+		numCaches++;
+	}
+
+	// build interaction caches list
+	iaCachesSorted = ri.Hunk_AllocateTempMemory(numCaches * sizeof(iaCachesSorted[0]));
+
+	numCaches = 0;
+	for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
 	{
-		for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
+		if(iaCache->redundant)
+			continue;
+
+		surface = iaCache->surface;
+
+		if(!surface->shader->interactLight)
+			continue;
+
+		if(surface->shader->isSky)
+			continue;
+
+		if(surface->shader->noShadows)
+			continue;
+
+		if(surface->shader->sort > SS_OPAQUE)
+			continue;
+
+		if(surface->shader->isPortal)
+			continue;
+
+		if(ShaderRequiresCPUDeforms(surface->shader))
+			continue;
+
+		iaCachesSorted[numCaches] = iaCache;
+		numCaches++;
+	}
+
+	// sort interaction caches by shader
+	qsort(iaCachesSorted, numCaches, sizeof(iaCachesSorted), InteractionCacheCompare);
+
+	// create a VBO for each shader
+	for(cubeSide = 0; cubeSide < 6; cubeSide++)
+	{
+		shader = oldShader = NULL;
+		oldAlphaTest = alphaTest = -1;
+
+		for(k = 0; k < numCaches; k++)
 		{
-			surface = iaCache->surface;
+			iaCache = iaCachesSorted[k];
+			shader = iaCache->surface->shader;
+			alphaTest = shader->alphaTest;
 
-			if(*surface->data == SF_FACE || *surface->data == SF_GRID || *surface->data == SF_TRIANGLES)
-			{
-				srfGeneric_t *gen;
+			iaCache->mergedIntoVBO = qtrue;
 
-				gen = (srfGeneric_t *) surface->data;
+			//if(!(iaCache->cubeSideBits & (1 << cubeSide)))
+			//  continue;
 
-				VectorCopy(gen->bounds[0], localBounds[0]);
-				VectorCopy(gen->bounds[1], localBounds[1]);
-			}
-			else
+			//if(shader != oldShader)
+			if(alphaTest ? shader != oldShader : alphaTest != oldAlphaTest)
 			{
-				iaCache->cubeSideBits = CUBESIDE_CLIPALL;
-				continue;
-			}
+				oldShader = shader;
+				oldAlphaTest = alphaTest;
 
-			light->shadowLOD = 0;	// important for R_CalcLightCubeSideBits
-			iaCache->cubeSideBits = R_CalcLightCubeSideBits(light, localBounds);
-		}
-	}
-}
+				// count vertices and indices
+				numVerts = 0;
+				numTriangles = 0;
+
+				for(l = k; l < numCaches; l++)
+				{
+					iaCache2 = iaCachesSorted[l];
+
+					surface = iaCache2->surface;
+
+#if 0
+					if(surface->shader != shader)
+						break;
+#else
+					if(alphaTest)
+					{
+						if(surface->shader != shader)
+							break;
+					}
+					else
+					{
+						if(surface->shader->alphaTest != alphaTest)
+							break;
+					}
+#endif
+
+					if(!(iaCache2->cubeSideBits & (1 << cubeSide)))
+						continue;
+
+					if(*surface->data == SF_FACE)
+					{
+						srfSurfaceFace_t *srf = (srfSurfaceFace_t *) surface->data;
+
+						if(srf->numTriangles)
+							numTriangles +=
+								UpdateLightTriangles(s_worldData.verts, srf->numTriangles,
+													 s_worldData.triangles + srf->firstTriangle, surface->shader, light);
+
+						if(srf->numVerts)
+							numVerts += srf->numVerts;
+					}
+					else if(*surface->data == SF_GRID)
+					{
+						srfGridMesh_t  *srf = (srfGridMesh_t *) surface->data;
+
+						if(srf->numTriangles)
+							numTriangles +=
+								UpdateLightTriangles(s_worldData.verts, srf->numTriangles,
+													 s_worldData.triangles + srf->firstTriangle, surface->shader, light);
+
+						if(srf->numVerts)
+							numVerts += srf->numVerts;
+					}
+					else if(*surface->data == SF_TRIANGLES)
+					{
+						srfTriangles_t *srf = (srfTriangles_t *) surface->data;
+
+						if(srf->numTriangles)
+							numTriangles +=
+								UpdateLightTriangles(s_worldData.verts, srf->numTriangles,
+													 s_worldData.triangles + srf->firstTriangle, surface->shader, light);
+
+						if(srf->numVerts)
+							numVerts += srf->numVerts;
+					}
+				}
+
+				if(!numVerts || !numTriangles)
+					continue;
+
+				//ri.Printf(PRINT_ALL, "...calculating light mesh VBOs ( %s, %i verts %i tris )\n", shader->name, vertexesNum, indexesNum / 3);
+
+				// create surface
+				vboSurf = ri.Hunk_Alloc(sizeof(*vboSurf), h_low);
+				vboSurf->surfaceType = SF_VBO_MESH;
+				vboSurf->numIndexes = numTriangles * 3;
+				vboSurf->numVerts = numVerts;
+				vboSurf->lightmapNum = -1;
+				ZeroBounds(vboSurf->bounds[0], vboSurf->bounds[1]);
+
+				// create arrays
+				triangles = ri.Hunk_AllocateTempMemory(numTriangles * sizeof(srfTriangle_t));
+				numTriangles = 0;
+
+				// build triangle indices
+				for(l = k; l < numCaches; l++)
+				{
+					iaCache2 = iaCachesSorted[l];
+
+					surface = iaCache2->surface;
+
+#if 0
+					if(surface->shader != shader)
+						break;
+#else
+					if(alphaTest)
+					{
+						if(surface->shader != shader)
+							break;
+					}
+					else
+					{
+						if(surface->shader->alphaTest != alphaTest)
+							break;
+					}
+#endif
+
+					if(!(iaCache2->cubeSideBits & (1 << cubeSide)))
+						continue;
+
+					if(*surface->data == SF_FACE)
+					{
+						srfSurfaceFace_t *srf = (srfSurfaceFace_t *) surface->data;
+
+						for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
+						{
+							if(tri->facingLight)
+							{
+								for(j = 0; j < 3; j++)
+								{
+									triangles[numTriangles].indexes[j] = tri->indexes[j];
+								}
+
+								numTriangles++;
+							}
+						}
+					}
+					else if(*surface->data == SF_GRID)
+					{
+						srfGridMesh_t  *srf = (srfGridMesh_t *) surface->data;
+
+						for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
+						{
+							if(tri->facingLight)
+							{
+								for(j = 0; j < 3; j++)
+								{
+									triangles[numTriangles].indexes[j] = tri->indexes[j];
+								}
+
+								numTriangles++;
+							}
+						}
+					}
+					else if(*surface->data == SF_TRIANGLES)
+					{
+						srfTriangles_t *srf = (srfTriangles_t *) surface->data;
+
+						for(i = 0, tri = s_worldData.triangles + srf->firstTriangle; i < srf->numTriangles; i++, tri++)
+						{
+							if(tri->facingLight)
+							{
+								for(j = 0; j < 3; j++)
+								{
+									triangles[numTriangles].indexes[j] = tri->indexes[j];
+								}
+
+								numTriangles++;
+							}
+						}
+					}
+				}
+
+				if(alphaTest)
+				{
+#if CALC_REDUNDANT_SHADOWVERTS
+					//OptimizeTriangles(s_worldData.numVerts, s_worldData.verts, numTriangles, triangles, CompareShadowVertAlphaTest);
+					OptimizeTrianglesLite(s_worldData.redundantShadowAlphaTestVerts, numTriangles, triangles);
+					if(c_redundantVertexes)
+					{
+						ri.Printf(PRINT_DEVELOPER,
+								  "...removed %i redundant vertices from staticShadowPyramidMesh %i ( %s, %i verts %i tris )\n",
+								  c_redundantVertexes, c_vboShadowSurfaces, shader->name, numVerts, numTriangles);
+					}
+#endif
+					R_OptimizeTrianglesForVertexCache(numTriangles, triangles);
+
+					vboSurf->vbo = s_worldData.vbo;
+					vboSurf->ibo =
+						R_CreateIBO2(va("staticShadowPyramidMesh_IBO %i", c_vboShadowSurfaces), numTriangles, triangles,
+									 VBO_USAGE_STATIC);
+				}
+				else
+				{
+#if CALC_REDUNDANT_SHADOWVERTS
+					//OptimizeTriangles(s_worldData.numVerts, s_worldData.verts, numTriangles, triangles, CompareShadowVert);
+					OptimizeTrianglesLite(s_worldData.redundantShadowVerts, numTriangles, triangles);
+					if(c_redundantVertexes)
+					{
+						ri.Printf(PRINT_DEVELOPER,
+								  "...removed %i redundant vertices from staticShadowPyramidMesh %i ( %s, %i verts %i tris )\n",
+								  c_redundantVertexes, c_vboShadowSurfaces, shader->name, numVerts, numTriangles);
+					}
+#endif
+					R_OptimizeTrianglesForVertexCache(numTriangles, triangles);
+
+					vboSurf->vbo = s_worldData.vbo;
+					vboSurf->ibo =
+						R_CreateIBO2(va("staticShadowPyramidMesh_IBO %i", c_vboShadowSurfaces), numTriangles, triangles,
+									 VBO_USAGE_STATIC);
+				}
+
+				R_InteractionFileWriteMesh(IAFILE_SHADOWCUBEMESH, iaCache->surface, vboSurf, (1 << cubeSide), numTriangles, triangles);
+
+				ri.Hunk_FreeTempMemory(triangles);
+
+				// add everything needed to the light
+				iaVBO = R_CreateInteractionVBO(light);
+				iaVBO->cubeSideBits = (1 << cubeSide);
+				iaVBO->shader = (struct shader_s *)shader;
+				iaVBO->vboShadowMesh = (struct srfVBOMesh_s *)vboSurf;
+
+				c_vboShadowSurfaces++;
+			}
+		}
+	}
+
+	ri.Hunk_FreeTempMemory(iaCachesSorted);
+}
+
+static void R_CalcInteractionCubeSideBits(trRefLight_t * light)
+{
+	interactionCache_t *iaCache;
+	bspSurface_t   *surface;
+	vec3_t          localBounds[2];
+
+	if(r_shadows->integer <= SHADOWING_BLOB)
+		return;
+
+	if(!light->firstInteractionCache)
+	{
+		// this light has no interactions precached
+		return;
+	}
+
+	if(light->l.noShadows)
+	{
+		// actually noShadows lights are quite bad concerning this optimization
+		return;
+	}
+
+	if(light->l.rlType != RL_OMNI)
+		return;
+
+	/*
+	   if(glConfig.vertexBufferObjectAvailable && r_vboLighting->integer)
+	   {
+	   srfVBOLightMesh_t *srf;
+
+	   for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
+	   {
+	   if(iaCache->redundant)
+	   continue;
+
+	   if(!iaCache->vboLightMesh)
+	   continue;
+
+	   srf = iaCache->vboLightMesh;
+
+	   VectorCopy(srf->bounds[0], localBounds[0]);
+	   VectorCopy(srf->bounds[1], localBounds[1]);
+
+	   light->shadowLOD = 0;    // important for R_CalcLightCubeSideBits
+	   iaCache->cubeSideBits = R_CalcLightCubeSideBits(light, localBounds);
+	   }
+	   }
+	   else
+	 */
+	{
+		for(iaCache = light->firstInteractionCache; iaCache; iaCache = iaCache->next)
+		{
+			surface = iaCache->surface;
+
+			if(*surface->data == SF_FACE || *surface->data == SF_GRID || *surface->data == SF_TRIANGLES)
+			{
+				srfGeneric_t *gen;
+
+				gen = (srfGeneric_t *) surface->data;
+
+				VectorCopy(gen->bounds[0], localBounds[0]);
+				VectorCopy(gen->bounds[1], localBounds[1]);
+			}
+			else
+			{
+				iaCache->cubeSideBits = CUBESIDE_CLIPALL;
+				continue;
+			}
+
+			light->shadowLOD = 0;	// important for R_CalcLightCubeSideBits
+			iaCache->cubeSideBits = R_CalcLightCubeSideBits(light, localBounds);
+		}
+	}
+}
+
+/*
+=============
+R_PrecacheInteractions
+=============
+*/
+void R_PrecacheInteractions()
+{
+	int             i;
+	trRefLight_t   *light;
+	bspSurface_t   *surface;
+//	int             numLeafs;
+	int             startTime, endTime;
+	qboolean        cached;
+
+	//if(r_precomputedLighting->integer)
+	//  return;
+
+	startTime = ri.Milliseconds();
+
+	// reset surfaces' viewCount
+	s_lightCount = 0;
+	for(i = 0, surface = s_worldData.surfaces; i < s_worldData.numSurfaces; i++, surface++)
+	{
+		surface->lightCount = -1;
+	}
+
+	Com_InitGrowList(&s_interactions, 100);
+
+	c_redundantInteractions = 0;
+	c_vboWorldSurfaces = 0;
+	c_vboLightSurfaces = 0;
+	c_vboShadowSurfaces = 0;
+
+	cached = R_InteractionFileBegin();
+
+	ri.Printf(PRINT_DEVELOPER, "...precaching %i lights%s\n", s_worldData.numLights, cached ? " from cache" : "");
+
+	for(i = 0; i < s_worldData.numLights; i++)
+	{
+		light = &s_worldData.lights[i];
+
+		if((r_precomputedLighting->integer || r_vertexLighting->integer) && !light->noRadiosity)
+			continue;
+
+#if 0
+		ri.Printf(PRINT_ALL, "light %i: origin(%i %i %i) radius(%i %i %i) color(%f %f %f)\n",
+				  i,
+				  (int)light->l.origin[0], (int)light->l.origin[1], (int)light->l.origin[2],
+				  (int)light->l.radius[0], (int)light->l.radius[1], (int)light->l.radius[2],
+				  light->l.color[0], light->l.color[1], light->l.color[2]);
+#endif
+
+		// set up light transform matrix
+		MatrixSetupTransformFromQuat(light->transformMatrix, light->l.rotation, light->l.origin);
+
+		// set up light origin for lighting and shadowing
+		R_SetupLightOrigin(light);
+
+		// set up model to light view matrix
+		R_SetupLightView(light);
+
+		// set up projection
+		R_SetupLightProjection(light);
+
+		// calc local bounds for culling
+		R_SetupLightLocalBounds(light);
+
+		// setup world bounds for intersection tests
+		R_SetupLightWorldBounds(light);
+
+		// setup frustum planes for intersection tests
+		R_SetupLightFrustum(light);
+
+		// setup interactions
+		light->firstInteractionCache = NULL;
+		light->lastInteractionCache = NULL;
+
+		light->firstInteractionVBO = NULL;
+		light->lastInteractionVBO = NULL;
+
+		if(cached)
+		{
+			R_InteractionFileReadLight(light);
+			continue;
+		}
+
+		R_InteractionFileBeginLight();
+
+		// perform culling and add all the potentially visible surfaces
+		s_lightCount++;
+		if(r_leafArrayCulling->integer && s_worldData.numLeafArrayBlocks)
+		{
+			R_PrecacheInteractionLeafArray(light);
+		}
+		else
+		{
+			R_RecursivePrecacheInteractionNode(s_worldData.nodes, light);
+		}
+
+		// count number of leafs that touch this light
+		s_lightCount++;
+		QueueInit(&light->leafs);
+		R_RecursiveAddInteractionNode(s_worldData.nodes, light);
+		//ri.Printf(PRINT_ALL, "light %i touched %i leaves\n", i, QueueSize(&light->leafs));
+
+#if 0
+		// Tr3b: this can cause really bad shadow problems :/
+
+		// check if interactions are inside shadows of other interactions
+		R_KillRedundantInteractions(light);
+#endif
+
+		// create a static VBO surface for each light geometry batch
+		R_CreateVBOLightMeshes(light);
+
+		// create a static VBO surface for each shadow geometry batch
+		R_CreateVBOShadowMeshes(light);
+
+		// calculate pyramid bits for each interaction in omni-directional lights
+		R_CalcInteractionCubeSideBits(light);
+
+		// create a static VBO surface for each light geometry batch inside a cubemap pyramid
+		R_CreateVBOShadowCubeMeshes(light);
+
+		R_InteractionFileEndLight(light);
+	}
+
+	R_InteractionFileEnd();
+
+	// move interactions grow list to hunk
+	s_worldData.numInteractions = s_interactions.currentElements;
+	s_worldData.interactions = ri.Hunk_Alloc(s_worldData.numInteractions * sizeof(*s_worldData.interactions), h_low);
+
+	for(i = 0; i < s_worldData.numInteractions; i++)
+	{
+		s_worldData.interactions[i] = (interactionCache_t *) Com_GrowListElement(&s_interactions, i);
+	}
+
+	Com_DestroyGrowList(&s_interactions);
+
+	ri.Printf(PRINT_DEVELOPER, "%i interactions precached\n", s_worldData.numInteractions);
+	ri.Printf(PRINT_DEVELOPER, "%i interactions were hidden in shadows\n", c_redundantInteractions);
+
+	if(r_shadows->integer >= SHADOWING_ESM16)
+	{
+		// only interesting for omni-directional shadow mapping
+		ri.Printf(PRINT_DEVELOPER, "%i omni pyramid tests\n", tr.pc.c_pyramidTests);
+		ri.Printf(PRINT_DEVELOPER, "%i omni pyramid surfaces visible\n", tr.pc.c_pyramid_cull_ent_in);
+		ri.Printf(PRINT_DEVELOPER, "%i omni pyramid surfaces clipped\n", tr.pc.c_pyramid_cull_ent_clip);
+		ri.Printf(PRINT_DEVELOPER, "%i omni pyramid surfaces culled\n", tr.pc.c_pyramid_cull_ent_out);
+	}
+
+	endTime = ri.Milliseconds();
+
+	ri.Printf(PRINT_DEVELOPER, "lights precaching time = %5.2f seconds\n", (endTime - startTime) / 1000.0);
+}
+
+
+#define HASHTABLE_SIZE 7919 // 32749 // 2039 	/* prime, use % */
+#define HASH_USE_EPSILON
+
+#ifdef HASH_USE_EPSILON
+#define HASH_XYZ_EPSILON					0.01f
+#define HASH_XYZ_EPSILONSPACE_MULTIPLIER	1.f / HASH_XYZ_EPSILON
+#endif
+
+unsigned int VertexCoordGenerateHash(const vec3_t xyz)
+{
+	unsigned int    hash = 0;
+
+#ifndef HASH_USE_EPSILON
+	hash += ~(*((unsigned int *)&xyz[0]) << 15);
+	hash ^= (*((unsigned int *)&xyz[0]) >> 10);
+	hash += (*((unsigned int *)&xyz[1]) << 3);
+	hash ^= (*((unsigned int *)&xyz[1]) >> 6);
+	hash += ~(*((unsigned int *)&xyz[2]) << 11);
+	hash ^= (*((unsigned int *)&xyz[2]) >> 16);
+#else
+	vec3_t          xyz_epsilonspace;
+
+	VectorScale(xyz, HASH_XYZ_EPSILONSPACE_MULTIPLIER, xyz_epsilonspace);
+	xyz_epsilonspace[0] = (double)floor(xyz_epsilonspace[0]);
+	xyz_epsilonspace[1] = (double)floor(xyz_epsilonspace[1]);
+	xyz_epsilonspace[2] = (double)floor(xyz_epsilonspace[2]);
+
+	hash += ~(*((unsigned int *)&xyz_epsilonspace[0]) << 15);
+	hash ^= (*((unsigned int *)&xyz_epsilonspace[0]) >> 10);
+	hash += (*((unsigned int *)&xyz_epsilonspace[1]) << 3);
+	hash ^= (*((unsigned int *)&xyz_epsilonspace[1]) >> 6);
+	hash += ~(*((unsigned int *)&xyz_epsilonspace[2]) << 11);
+	hash ^= (*((unsigned int *)&xyz_epsilonspace[2]) >> 16);
+
+/*
+	// strict aliasing... better?
+	hash += ~({floatint_t __f; __f.f = xyz_epsilonspace[0]; __f.i << 15;});
+	hash ^= ({floatint_t __f; __f.f = xyz_epsilonspace[0]; __f.i >> 10;});
+	hash += ({floatint_t __f; __f.f = xyz_epsilonspace[1]; __f.i << 3;});
+	hash ^= ({floatint_t __f; __f.f = xyz_epsilonspace[1]; __f.i >> 6;});
+	hash += ~({floatint_t __f; __f.f = xyz_epsilonspace[2]; __f.i << 11;});
+	hash ^= ({floatint_t __f; __f.f = xyz_epsilonspace[2]; __f.i >> 16;});
+*/
+
+#endif
+
+	hash = (int)fabs(xyz[3]) / 8;
+
+	hash = hash % (HASHTABLE_SIZE);
+	return hash;
+}
+
+vertexHash_t **NewVertexHashTable(void)
+{
+	vertexHash_t **hashTable = Com_Allocate(HASHTABLE_SIZE * sizeof(vertexHash_t *));
+
+	Com_Memset(hashTable, 0, HASHTABLE_SIZE * sizeof(vertexHash_t *));
+
+	return hashTable;
+}
+
+void FreeVertexHashTable(vertexHash_t ** hashTable)
+{
+	int             i;
+	vertexHash_t *vertexHash;
+	vertexHash_t *nextVertexHash;
+
+	if(hashTable == NULL)
+		return;
+
+	for(i = 0; i < HASHTABLE_SIZE; i++)
+	{
+		if(hashTable[i])
+		{
+			nextVertexHash = NULL;
+
+			for(vertexHash = hashTable[i]; vertexHash; vertexHash = nextVertexHash)
+			{
+				nextVertexHash = vertexHash->next;
+				/*
+				if(vertexHash->data != NULL)
+				{
+					Com_Dealloc(vertexHash->data);
+				}
+				*/
+				Com_Dealloc(vertexHash);
+			}
+		}
+	}
+
+	Com_Dealloc(hashTable);
+}
+
+vertexHash_t *FindVertexInHashTable(vertexHash_t ** hashTable, const vec3_t xyz, float distance)
+{
+	unsigned int    hash;
+	vertexHash_t *vertexHash;
+
+	if(hashTable == NULL || xyz == NULL)
+		return NULL;
+
+	hash = VertexCoordGenerateHash(xyz);
+
+	for(vertexHash = hashTable[hash]; vertexHash; vertexHash = vertexHash->next)
+	{
+#ifndef HASH_USE_EPSILON
+		if((vertexHash->vcd.xyz[0] != xyz[0] || vertexHash->vcd.xyz[1] != xyz[1] ||
+			vertexHash->vcd.xyz[2] != xyz[2]))
+			continue;
+
+#elif 1
+		if(Distance(xyz, vertexHash->xyz) > distance)
+			continue;
+
+#else
+		if((fabs(xyz[0] - vertexHash->vcd.xyz[0])) > HASH_XYZ_EPSILON ||
+		   (fabs(xyz[1] - vertexHash->vcd.xyz[1])) > HASH_XYZ_EPSILON ||
+		   (fabs(xyz[2] - vertexHash->vcd.xyz[2])) > HASH_XYZ_EPSILON)
+			continue;
+#endif
+		return vertexHash;
+	}
+
+	return NULL;
+}
+
+vertexHash_t *AddVertexToHashTable(vertexHash_t ** hashTable, vec3_t xyz, void *data)
+{
+	unsigned int    hash;
+	vertexHash_t *vertexHash;
+
+	if(hashTable == NULL || xyz == NULL)
+		return NULL;
+
+	vertexHash = Com_Allocate(sizeof(vertexHash_t));
+
+	if(!vertexHash)
+		return NULL;
+
+	hash = VertexCoordGenerateHash(xyz);
+
+	VectorCopy(xyz, vertexHash->xyz);
+	vertexHash->data = data;
+
+	// link into table
+	vertexHash->next = hashTable[hash];
+	hashTable[hash] = vertexHash;
+
+	return vertexHash;
+}
+
+/*
+===============================================================================
+
+CUBEMAP PROBES
+
+R_BuildCubeMaps renders the probes and stores them in maps/<mapname>/cubemaps.cache
+together with the checksum of the BSP. RE_LoadWorldMap reads them back with
+R_LoadCubeMaps, which only has to upload the cube images.
+
+The nearest probes are looked up in a uniform grid that is filled once after
+the probes were loaded or rendered. The search visits the grid cells in growing
+shells around the cell of the position and stops as soon as no unvisited cell
+can hold a closer probe.
+
+===============================================================================
+*/
+
+#define CUBEPROBEFILE_IDENT		(('C'<<24)+('P'<<16)+('C'<<8)+'X')	// "XCPC"
+#define CUBEPROBEFILE_VERSION	1
+#define CUBEPROBEFILE_PROBESIZE	(6 * REF_CUBEMAP_SIZE * REF_CUBEMAP_SIZE * 4)
+
+#define CUBEPROBEGRID_SIZE		256	// initial cell size, same as the minimum probe distance
+#define CUBEPROBEGRID_MAX_CELLS	65536
+
+typedef struct
+{
+	int             ident;
+	int             version;
+	int             checksum;
+	int             cubeSize;
+	int             numProbes;
+	int             compressedSize;
+} cubeProbeFileHeader_t;
+
+/*
+=================
+R_FreeCubeProbeGrid
+=================
+*/
+void R_FreeCubeProbeGrid(void)
+{
+	if(tr.cubeProbeGridCells)
+	{
+		Com_Dealloc(tr.cubeProbeGridCells);
+		tr.cubeProbeGridCells = NULL;
+	}
+
+	if(tr.cubeProbeGridProbes)
+	{
+		Com_Dealloc(tr.cubeProbeGridProbes);
+		tr.cubeProbeGridProbes = NULL;
+	}
+}
+
+/*
+=================
+R_CubeProbeGridCell
+=================
+*/
+static void R_CubeProbeGridCell(const vec3_t position, int cell[3])
+{
+	int             i;
+
+	for(i = 0; i < 3; i++)
+	{
+		cell[i] = (int)floor((position[i] - tr.cubeProbeGridOrigin[i]) / tr.cubeProbeGridCellSize);
+		Q_clamp(cell[i], 0, tr.cubeProbeGridBounds[i] - 1);
+	}
+}
+
+/*
+=================
+R_CreateCubeProbeGrid
 
-/*
-=============
-R_PrecacheInteractions
-=============
+Sorts the probes into grid cells, tr.cubeProbeGridCells[cell] is the index of the
+first probe of the cell in tr.cubeProbeGridProbes
+=================
 */
-void R_PrecacheInteractions()
+static void R_CreateCubeProbeGrid(void)
 {
-	int             i;
-	trRefLight_t   *light;
-	bspSurface_t   *surface;
-//	int             numLeafs;
-	int             startTime, endTime;
+	int             i, j, numCells, index;
+	int             cell[3];
+	vec3_t          mins, maxs;
+	cubemapProbe_t *cubeProbe;
 
-	//if(r_precomputedLighting->integer)
-	//  return;
+	R_FreeCubeProbeGrid();
 
-	startTime = ri.Milliseconds();
+	if(!tr.cubeProbes.currentElements)
+	{
+		return;
+	}
 
-	// reset surfaces' viewCount
-	s_lightCount = 0;
-	for(i = 0, surface = s_worldData.surfaces; i < s_worldData.numSurfaces; i++, surface++)
+	ClearBounds(mins, maxs);
+	for(j = 0; j < tr.cubeProbes.currentElements; j++)
 	{
-		surface->lightCount = -1;
+		cubeProbe = Com_GrowListElement(&tr.cubeProbes, j);
+		AddPointToBounds(cubeProbe->origin, mins, maxs);
 	}
 
-	Com_InitGrowList(&s_interactions, 100);
+	// grow the cells until the grid stays small for huge maps with few probes
+	tr.cubeProbeGridCellSize = CUBEPROBEGRID_SIZE;
+	while(1)
+	{
+		numCells = 1;
+		for(i = 0; i < 3; i++)
+		{
+			tr.cubeProbeGridBounds[i] = (int)((maxs[i] - mins[i]) / tr.cubeProbeGridCellSize) + 1;
+			numCells *= tr.cubeProbeGridBounds[i];
+		}
 
-	c_redundantInteractions = 0;
-	c_vboWorldSurfaces = 0;
-	c_vboLightSurfaces = 0;
-	c_vboShadowSurfaces = 0;
+		if(numCells <= CUBEPROBEGRID_MAX_CELLS && numCells <= tr.cubeProbes.currentElements * 4)
+		{
+			break;
+		}
 
-	ri.Printf(PRINT_DEVELOPER, "...precaching %i lights\n", s_worldData.numLights);
+		tr.cubeProbeGridCellSize *= 2;
+	}
 
-	for(i = 0; i < s_worldData.numLights; i++)
+	VectorCopy(mins, tr.cubeProbeGridOrigin);
+
+	tr.cubeProbeGridCells = Com_Allocate((numCells + 1) * sizeof(int));
+	tr.cubeProbeGridProbes = Com_Allocate(tr.cubeProbes.currentElements * sizeof(cubemapProbe_t *));
+
+	Com_Memset(tr.cubeProbeGridCells, 0, (numCells + 1) * sizeof(int));
+
+	// count the probes of each cell
+	for(j = 0; j < tr.cubeProbes.currentElements; j++)
 	{
-		light = &s_worldData.lights[i];
+		cubeProbe = Com_GrowListElement(&tr.cubeProbes, j);
 
-		if((r_precomputedLighting->integer || r_vertexLighting->integer) && !light->noRadiosity)
-			continue;
+		R_CubeProbeGridCell(cubeProbe->origin, cell);
+		tr.cubeProbeGridCells[(cell[2] * tr.cubeProbeGridBounds[1] + cell[1]) * tr.cubeProbeGridBounds[0] + cell[0] + 1]++;
+	}
 
-#if 0
-		ri.Printf(PRINT_ALL, "light %i: origin(%i %i %i) radius(%i %i %i) color(%f %f %f)\n",
-				  i,
-				  (int)light->l.origin[0], (int)light->l.origin[1], (int)light->l.origin[2],
-				  (int)light->l.radius[0], (int)light->l.radius[1], (int)light->l.radius[2],
-				  light->l.color[0], light->l.color[1], light->l.color[2]);
-#endif
+	for(i = 0; i < numCells; i++)
+	{
+		tr.cubeProbeGridCells[i + 1] += tr.cubeProbeGridCells[i];
+	}
 
-		// set up light transform matrix
-		MatrixSetupTransformFromQuat(light->transformMatrix, light->l.rotation, light->l.origin);
+	// fill the cells, this moves the start of each cell to the start of the next one
+	for(j = 0; j < tr.cubeProbes.currentElements; j++)
+	{
+		cubeProbe = Com_GrowListElement(&tr.cubeProbes, j);
 
-		// set up light origin for lighting and shadowing
-		R_SetupLightOrigin(light);
+		R_CubeProbeGridCell(cubeProbe->origin, cell);
+		index = (cell[2] * tr.cubeProbeGridBounds[1] + cell[1]) * tr.cubeProbeGridBounds[0] + cell[0];
 
-		// set up model to light view matrix
-		R_SetupLightView(light);
+		tr.cubeProbeGridProbes[tr.cubeProbeGridCells[index]++] = cubeProbe;
+	}
 
-		// set up projection
-		R_SetupLightProjection(light);
+	for(i = numCells; i > 0; i--)
+	{
+		tr.cubeProbeGridCells[i] = tr.cubeProbeGridCells[i - 1];
+	}
+	tr.cubeProbeGridCells[0] = 0;
 
-		// calc local bounds for culling
-		R_SetupLightLocalBounds(light);
+	ri.Printf(PRINT_DEVELOPER, "...%i cubemap probes in a %ix%ix%i grid\n", tr.cubeProbes.currentElements,
+			  tr.cubeProbeGridBounds[0], tr.cubeProbeGridBounds[1], tr.cubeProbeGridBounds[2]);
+}
 
-		// setup world bounds for intersection tests
-		R_SetupLightWorldBounds(light);
+/*
+=================
+R_FindNearestCubeProbes
 
-		// setup frustum planes for intersection tests
-		R_SetupLightFrustum(light);
+cubeProbeSecondNearest may be NULL if only the nearest probe is needed
+=================
+*/
+static void R_FindNearestCubeProbes(const vec3_t position, cubemapProbe_t ** cubeProbeNearest, cubemapProbe_t ** cubeProbeSecondNearest)
+{
+	int             i, r, maxR, x, y, z, index;
+	int             cell[3];
+	float           distance, maxDistance, maxDistance2;
+	cubemapProbe_t *cubeProbe;
 
-		// setup interactions
-		light->firstInteractionCache = NULL;
-		light->lastInteractionCache = NULL;
+	*cubeProbeNearest = NULL;
+	if(cubeProbeSecondNearest)
+	{
+		*cubeProbeSecondNearest = NULL;
+	}
 
-		light->firstInteractionVBO = NULL;
-		light->lastInteractionVBO = NULL;
+	if(!tr.cubeProbeGridCells || position == NULL)
+	{
+		return;
+	}
 
-		// perform culling and add all the potentially visible surfaces
-		s_lightCount++;
-		R_RecursivePrecacheInteractionNode(s_worldData.nodes, light);
+	R_CubeProbeGridCell(position, cell);
 
-		// count number of leafs that touch this light
-		s_lightCount++;
-		QueueInit(&light->leafs);
-		R_RecursiveAddInteractionNode(s_worldData.nodes, light);
-		//ri.Printf(PRINT_ALL, "light %i touched %i leaves\n", i, QueueSize(&light->leafs));
+	maxR = 0;
+	for(i = 0; i < 3; i++)
+	{
+		maxR = Q_max(maxR, Q_max(cell[i], tr.cubeProbeGridBounds[i] - 1 - cell[i]));
+	}
 
-#if 0
-		// Tr3b: this can cause really bad shadow problems :/
+	maxDistance = maxDistance2 = 9999999.0f;
 
-		// check if interactions are inside shadows of other interactions
-		R_KillRedundantInteractions(light);
-#endif
+	for(r = 0; r <= maxR; r++)
+	{
+		for(z = Q_max(cell[2] - r, 0); z <= Q_min(cell[2] + r, tr.cubeProbeGridBounds[2] - 1); z++)
+		{
+			for(y = Q_max(cell[1] - r, 0); y <= Q_min(cell[1] + r, tr.cubeProbeGridBounds[1] - 1); y++)
+			{
+				for(x = Q_max(cell[0] - r, 0); x <= Q_min(cell[0] + r, tr.cubeProbeGridBounds[0] - 1); x++)
+				{
+					// only the shell, the inner cells were visited before
+					if(abs(x - cell[0]) != r && abs(y - cell[1]) != r && abs(z - cell[2]) != r)
+					{
+						continue;
+					}
 
-		// create a static VBO surface for each light geometry batch
-		R_CreateVBOLightMeshes(light);
+					index = (z * tr.cubeProbeGridBounds[1] + y) * tr.cubeProbeGridBounds[0] + x;
 
-		// create a static VBO surface for each shadow geometry batch
-		R_CreateVBOShadowMeshes(light);
+					for(i = tr.cubeProbeGridCells[index]; i < tr.cubeProbeGridCells[index + 1]; i++)
+					{
+						cubeProbe = tr.cubeProbeGridProbes[i];
 
-		// calculate pyramid bits for each interaction in omni-directional lights
-		R_CalcInteractionCubeSideBits(light);
+						distance = Distance(cubeProbe->origin, position);
+						if(distance < maxDistance)
+						{
+							if(cubeProbeSecondNearest)
+							{
+								*cubeProbeSecondNearest = *cubeProbeNearest;
+							}
+							maxDistance2 = maxDistance;
 
-		// create a static VBO surface for each light geometry batch inside a cubemap pyramid
-		R_CreateVBOShadowCubeMeshes(light);
+							*cubeProbeNearest = cubeProbe;
+							maxDistance = distance;
+						}
+						else if(cubeProbeSecondNearest && distance < maxDistance2 && distance > maxDistance)
+						{
+							*cubeProbeSecondNearest = cubeProbe;
+							maxDistance2 = distance;
+						}
+					}
+				}
+			}
+		}
+
+		// every probe in the next shell is at least r cells away
+		if((cubeProbeSecondNearest ? maxDistance2 : maxDistance) <= r * tr.cubeProbeGridCellSize)
+		{
+			break;
+		}
 	}
+}
 
-	// move interactions grow list to hunk
-	s_worldData.numInteractions = s_interactions.currentElements;
-	s_worldData.interactions = ri.Hunk_Alloc(s_worldData.numInteractions * sizeof(*s_worldData.interactions), h_low);
+void GL_BindNearestCubeMap(const vec3_t xyz)
+{
+	cubemapProbe_t *cubeProbe;
 
-	for(i = 0; i < s_worldData.numInteractions; i++)
-	{
-		s_worldData.interactions[i] = (interactionCache_t *) Com_GrowListElement(&s_interactions, i);
-	}
+	GLimp_LogComment("--- GL_BindNearestCubeMap ---\n");
 
-	Com_DestroyGrowList(&s_interactions);
+	tr.autoCubeImage = tr.whiteCubeImage;
+	if(!r_reflectionMapping->integer)
+		return;
 
-	ri.Printf(PRINT_DEVELOPER, "%i interactions precached\n", s_worldData.numInteractions);
-	ri.Printf(PRINT_DEVELOPER, "%i interactions were hidden in shadows\n", c_redundantInteractions);
+	if(tr.cubeHashTable == NULL || xyz == NULL)
+		return;
 
-	if(r_shadows->integer >= SHADOWING_ESM16)
+	R_FindNearestCubeProbes(xyz, &cubeProbe, NULL);
+	if(cubeProbe && cubeProbe->cubemap)
 	{
-		// only interesting for omni-directional shadow mapping
-		ri.Printf(PRINT_DEVELOPER, "%i omni pyramid tests\n", tr.pc.c_pyramidTests);
-		ri.Printf(PRINT_DEVELOPER, "%i omni pyramid surfaces visible\n", tr.pc.c_pyramid_cull_ent_in);
-		ri.Printf(PRINT_DEVELOPER, "%i omni pyramid surfaces clipped\n", tr.pc.c_pyramid_cull_ent_clip);
-		ri.Printf(PRINT_DEVELOPER, "%i omni pyramid surfaces culled\n", tr.pc.c_pyramid_cull_ent_out);
+		tr.autoCubeImage = cubeProbe->cubemap;
 	}
 
-	endTime = ri.Milliseconds();
-
-	ri.Printf(PRINT_DEVELOPER, "lights precaching time = %5.2f seconds\n", (endTime - startTime) / 1000.0);
+#if defined(USE_D3D10)
+	// TODO
+#else
+	GL_Bind(tr.autoCubeImage);
+#endif
 }
 
+void R_FindTwoNearestCubeMaps(const vec3_t position, cubemapProbe_t **cubeProbeNearest, cubemapProbe_t **cubeProbeSecondNearest)
+{
+	GLimp_LogComment("--- R_FindTwoNearestCubeMaps ---\n");
 
-#define HASHTABLE_SIZE 7919 // 32749 // 2039 	/* prime, use % */
-#define HASH_USE_EPSILON
+	*cubeProbeNearest = NULL;
+	*cubeProbeSecondNearest = NULL;
 
-#ifdef HASH_USE_EPSILON
-#define HASH_XYZ_EPSILON					0.01f
-#define HASH_XYZ_EPSILONSPACE_MULTIPLIER	1.f / HASH_XYZ_EPSILON
-#endif
+	if(tr.cubeHashTable == NULL || position == NULL)
+		return;
 
-unsigned int VertexCoordGenerateHash(const vec3_t xyz)
+	R_FindNearestCubeProbes(position, cubeProbeNearest, cubeProbeSecondNearest);
+}
+
+/*
+=================
+R_CubeProbeFileName
+=================
+*/
+static const char *R_CubeProbeFileName(void)
 {
-	unsigned int    hash = 0;
+	return va("maps/%s/cubemaps.cache", tr.world->baseName);
+}
 
-#ifndef HASH_USE_EPSILON
-	hash += ~(*((unsigned int *)&xyz[0]) << 15);
-	hash ^= (*((unsigned int *)&xyz[0]) >> 10);
-	hash += (*((unsigned int *)&xyz[1]) << 3);
-	hash ^= (*((unsigned int *)&xyz[1]) >> 6);
-	hash += ~(*((unsigned int *)&xyz[2]) << 11);
-	hash ^= (*((unsigned int *)&xyz[2]) >> 16);
-#else
-	vec3_t          xyz_epsilonspace;
+/*
+=================
+R_AddCubeProbe
+=================
+*/
+static cubemapProbe_t *R_AddCubeProbe(const vec3_t origin)
+{
+	cubemapProbe_t *cubeProbe;
 
-	VectorScale(xyz, HASH_XYZ_EPSILONSPACE_MULTIPLIER, xyz_epsilonspace);
-	xyz_epsilonspace[0] = (double)floor(xyz_epsilonspace[0]);
-	xyz_epsilonspace[1] = (double)floor(xyz_epsilonspace[1]);
-	xyz_epsilonspace[2] = (double)floor(xyz_epsilonspace[2]);
+	cubeProbe = ri.Hunk_Alloc(sizeof(*cubeProbe), h_low);
+	Com_AddToGrowList(&tr.cubeProbes, cubeProbe);
 
-	hash += ~(*((unsigned int *)&xyz_epsilonspace[0]) << 15);
-	hash ^= (*((unsigned int *)&xyz_epsilonspace[0]) >> 10);
-	hash += (*((unsigned int *)&xyz_epsilonspace[1]) << 3);
-	hash ^= (*((unsigned int *)&xyz_epsilonspace[1]) >> 6);
-	hash += ~(*((unsigned int *)&xyz_epsilonspace[2]) << 11);
-	hash ^= (*((unsigned int *)&xyz_epsilonspace[2]) >> 16);
+	VectorCopy(origin, cubeProbe->origin);
+
+	AddVertexToHashTable(tr.cubeHashTable, cubeProbe->origin, cubeProbe);
+
+	return cubeProbe;
+}
 
 /*
-	// strict aliasing... better?
-	hash += ~({floatint_t __f; __f.f = xyz_epsilonspace[0]; __f.i << 15;});
-	hash ^= ({floatint_t __f; __f.f = xyz_epsilonspace[0]; __f.i >> 10;});
-	hash += ({floatint_t __f; __f.f = xyz_epsilonspace[1]; __f.i << 3;});
-	hash ^= ({floatint_t __f; __f.f = xyz_epsilonspace[1]; __f.i >> 6;});
-	hash += ~({floatint_t __f; __f.f = xyz_epsilonspace[2]; __f.i << 11;});
-	hash ^= ({floatint_t __f; __f.f = xyz_epsilonspace[2]; __f.i >> 16;});
+=================
+R_UploadCubeProbe
+=================
 */
+static void R_UploadCubeProbe(cubemapProbe_t * cubeProbe, int num, byte * faces[6])
+{
+#if defined(USE_D3D10)
+	// TODO
+#else
+	if(!cubeProbe->cubemap)
+	{
+		cubeProbe->cubemap = R_AllocImage(va("_autoCube%d", num), qfalse);
+		if(!cubeProbe->cubemap)
+			return;
 
-#endif
+		cubeProbe->cubemap->type = GL_TEXTURE_CUBE_MAP;
 
-	hash = (int)fabs(xyz[3]) / 8;
+		cubeProbe->cubemap->width = REF_CUBEMAP_SIZE;
+		cubeProbe->cubemap->height = REF_CUBEMAP_SIZE;
 
-	hash = hash % (HASHTABLE_SIZE);
-	return hash;
+		cubeProbe->cubemap->bits = IF_NOPICMIP;
+		cubeProbe->cubemap->filterType = FT_LINEAR;
+		cubeProbe->cubemap->wrapType = WT_EDGE_CLAMP;
+	}
+
+	GL_Bind(cubeProbe->cubemap);
+
+	R_UploadImage((const byte **)faces, 6, cubeProbe->cubemap);
+
+	glBindTexture(cubeProbe->cubemap->type, 0);
+#endif
 }
 
-vertexHash_t **NewVertexHashTable(void)
+/*
+=================
+R_WriteCubeProbeFile
+
+faces holds the 6 RGBA faces of every probe
+=================
+*/
+static void R_WriteCubeProbeFile(const byte * faces)
 {
-	vertexHash_t **hashTable = Com_Allocate(HASHTABLE_SIZE * sizeof(vertexHash_t *));
+	int             j, k, numProbes, headerSize;
+	uLong           rawSize, compressedSize;
+	byte           *buffer;
+	float          *origins;
+	cubeProbeFileHeader_t *header;
+	cubemapProbe_t *cubeProbe;
 
-	Com_Memset(hashTable, 0, HASHTABLE_SIZE * sizeof(vertexHash_t *));
+	numProbes = tr.cubeProbes.currentElements;
+	headerSize = sizeof(cubeProbeFileHeader_t) + numProbes * sizeof(vec3_t);
 
-	return hashTable;
-}
+	rawSize = numProbes * CUBEPROBEFILE_PROBESIZE;
+	compressedSize = compressBound(rawSize);
 
-void FreeVertexHashTable(vertexHash_t ** hashTable)
-{
-	int             i;
-	vertexHash_t *vertexHash;
-	vertexHash_t *nextVertexHash;
+	buffer = Com_Allocate(headerSize + compressedSize);
 
-	if(hashTable == NULL)
+	if(compress2(buffer + headerSize, &compressedSize, faces, rawSize, Z_BEST_SPEED) != Z_OK)
+	{
+		ri.Printf(PRINT_WARNING, "WARNING: couldn't compress %s\n", R_CubeProbeFileName());
+		Com_Dealloc(buffer);
 		return;
+	}
 
-	for(i = 0; i < HASHTABLE_SIZE; i++)
+	header = (cubeProbeFileHeader_t *) buffer;
+	header->ident = LittleLong(CUBEPROBEFILE_IDENT);
+	header->version = LittleLong(CUBEPROBEFILE_VERSION);
+	header->checksum = LittleLong(tr.world->checksum);
+	header->cubeSize = LittleLong(REF_CUBEMAP_SIZE);
+	header->numProbes = LittleLong(numProbes);
+	header->compressedSize = LittleLong(compressedSize);
+
+	origins = (float *)(buffer + sizeof(cubeProbeFileHeader_t));
+	for(j = 0; j < numProbes; j++)
 	{
-		if(hashTable[i])
-		{
-			nextVertexHash = NULL;
+		cubeProbe = Com_GrowListElement(&tr.cubeProbes, j);
 
-			for(vertexHash = hashTable[i]; vertexHash; vertexHash = nextVertexHash)
-			{
-				nextVertexHash = vertexHash->next;
-				/*
-				if(vertexHash->data != NULL)
-				{
-					Com_Dealloc(vertexHash->data);
-				}
-				*/
-				Com_Dealloc(vertexHash);
-			}
+		for(k = 0; k < 3; k++)
+		{
+			origins[j * 3 + k] = LittleFloat(cubeProbe->origin[k]);
 		}
 	}
 
-	Com_Dealloc(hashTable);
+	ri.Printf(PRINT_ALL, "writing %s\n", R_CubeProbeFileName());
+	ri.FS_WriteFile(R_CubeProbeFileName(), buffer, headerSize + compressedSize);
+
+	Com_Dealloc(buffer);
 }
 
-vertexHash_t *FindVertexInHashTable(vertexHash_t ** hashTable, const vec3_t xyz, float distance)
+/*
+=================
+R_ReadCubeProbeFile
+
+Returns qfalse if the file is missing or belongs to another version of the BSP
+=================
+*/
+static qboolean R_ReadCubeProbeFile(void)
 {
-	unsigned int    hash;
-	vertexHash_t *vertexHash;
+	int             j, k, length, numProbes, headerSize, compressedSize;
+	uLong           rawSize;
+	void           *buffer;
+	byte           *faces;
+	byte           *face[6];
+	float          *origins;
+	vec3_t          origin;
+	cubeProbeFileHeader_t *header;
+
+	length = ri.FS_ReadFile(R_CubeProbeFileName(), &buffer);
+	if(!buffer)
+	{
+		return qfalse;
+	}
 
-	if(hashTable == NULL || xyz == NULL)
-		return NULL;
+	header = (cubeProbeFileHeader_t *) buffer;
 
-	hash = VertexCoordGenerateHash(xyz);
+	if(length < (int)sizeof(cubeProbeFileHeader_t) ||
+	   LittleLong(header->ident) != CUBEPROBEFILE_IDENT ||
+	   LittleLong(header->version) != CUBEPROBEFILE_VERSION ||
+	   (uint32_t) LittleLong(header->checksum) != tr.world->checksum ||
+	   LittleLong(header->cubeSize) != REF_CUBEMAP_SIZE)
+	{
+		ri.Printf(PRINT_DEVELOPER, "%s is out of date\n", R_CubeProbeFileName());
+		ri.FS_FreeFile(buffer);
+		return qfalse;
+	}
 
-	for(vertexHash = hashTable[hash]; vertexHash; vertexHash = vertexHash->next)
+	numProbes = LittleLong(header->numProbes);
+	compressedSize = LittleLong(header->compressedSize);
+
+	// there is at most one probe per node, which also keeps the sizes below in range
+	if(numProbes <= 0 || numProbes > Q_max(tr.world->numnodes, 1) ||
+	   numProbes > (INT_MAX - (int)sizeof(cubeProbeFileHeader_t)) / CUBEPROBEFILE_PROBESIZE)
 	{
-#ifndef HASH_USE_EPSILON
-		if((vertexHash->vcd.xyz[0] != xyz[0] || vertexHash->vcd.xyz[1] != xyz[1] ||
-			vertexHash->vcd.xyz[2] != xyz[2]))
-			continue;
+		ri.Printf(PRINT_WARNING, "WARNING: %s has a bad probe count %i\n", R_CubeProbeFileName(), numProbes);
+		ri.FS_FreeFile(buffer);
+		return qfalse;
+	}
 
-#elif 1
-		if(Distance(xyz, vertexHash->xyz) > distance)
-			continue;
+	headerSize = sizeof(cubeProbeFileHeader_t) + numProbes * sizeof(vec3_t);
 
-#else
-		if((fabs(xyz[0] - vertexHash->vcd.xyz[0])) > HASH_XYZ_EPSILON ||
-		   (fabs(xyz[1] - vertexHash->vcd.xyz[1])) > HASH_XYZ_EPSILON ||
-		   (fabs(xyz[2] - vertexHash->vcd.xyz[2])) > HASH_XYZ_EPSILON)
-			continue;
-#endif
-		return vertexHash;
+	if(compressedSize < 0 || length < headerSize || length - headerSize < compressedSize)
+	{
+		ri.Printf(PRINT_WARNING, "WARNING: %s is truncated\n", R_CubeProbeFileName());
+		ri.FS_FreeFile(buffer);
+		return qfalse;
 	}
 
-	return NULL;
-}
+	rawSize = numProbes * CUBEPROBEFILE_PROBESIZE;
+	faces = Com_Allocate(rawSize);
 
-vertexHash_t *AddVertexToHashTable(vertexHash_t ** hashTable, vec3_t xyz, void *data)
-{
-	unsigned int    hash;
-	vertexHash_t *vertexHash;
+	if(uncompress(faces, &rawSize, (byte *) buffer + headerSize, compressedSize) != Z_OK ||
+	   rawSize != (uLong) (numProbes * CUBEPROBEFILE_PROBESIZE))
+	{
+		ri.Printf(PRINT_WARNING, "WARNING: %s is corrupt\n", R_CubeProbeFileName());
+		Com_Dealloc(faces);
+		ri.FS_FreeFile(buffer);
+		return qfalse;
+	}
 
-	if(hashTable == NULL || xyz == NULL)
-		return NULL;
+	Com_InitGrowList(&tr.cubeProbes, numProbes);
+	tr.cubeHashTable = NewVertexHashTable();
 
-	vertexHash = Com_Allocate(sizeof(vertexHash_t));
+	origins = (float *)((byte *) buffer + sizeof(cubeProbeFileHeader_t));
+	for(j = 0; j < numProbes; j++)
+	{
+		for(k = 0; k < 3; k++)
+		{
+			origin[k] = LittleFloat(origins[j * 3 + k]);
+		}
 
-	if(!vertexHash)
-		return NULL;
+		for(k = 0; k < 6; k++)
+		{
+			face[k] = faces + j * CUBEPROBEFILE_PROBESIZE + k * REF_CUBEMAP_SIZE * REF_CUBEMAP_SIZE * 4;
+		}
 
-	hash = VertexCoordGenerateHash(xyz);
+		R_UploadCubeProbe(R_AddCubeProbe(origin), j, face);
+	}
 
-	VectorCopy(xyz, vertexHash->xyz);
-	vertexHash->data = data;
+	Com_Dealloc(faces);
+	ri.FS_FreeFile(buffer);
 
-	// link into table
-	vertexHash->next = hashTable[hash];
-	hashTable[hash] = vertexHash;
+	ri.Printf(PRINT_DEVELOPER, "...loaded %i cubemap probes from %s\n", numProbes, R_CubeProbeFileName());
 
-	return vertexHash;
+	return qtrue;
 }
 
-void GL_BindNearestCubeMap(const vec3_t xyz)
+/*
+=================
+R_CreateCubeProbes
+
+Places the probes, one for every BSP leaf that is at least 256 units away from the others
+=================
+*/
+static void R_CreateCubeProbes(void)
 {
-#if 0
-	int             j;
-	float			distance, maxDistance;
-	cubemapProbe_t *cubeProbe;
+	int             i;
+	bspNode_t      *node;
 
-	GLimp_LogComment("--- GL_BindNearestCubeMap ---\n");
+	Com_InitGrowList(&tr.cubeProbes, 4000);
+	tr.cubeHashTable = NewVertexHashTable();
 
-	maxDistance = 9999999.0f;
-	tr.autoCubeImage = tr.blackCubeImage;
-	for(j = 0; j < tr.cubeProbes.currentElements; j++)
+	for(i = 0; i < tr.world->numnodes; i++)
 	{
-		cubeProbe = Com_GrowListElement(&tr.cubeProbes, j);
+		node = &tr.world->nodes[i];
+
+		// check to see if this is a shit location
+		if(node->contents == CONTENTS_NODE)
+			continue;
 
-		distance = Distance(cubeProbe->origin, xyz);
-		if(distance < maxDistance)
+		if(node->area == -1)
 		{
-			tr.autoCubeImage = cubeProbe->cubemap;
-			maxDistance = distance;
+			// location is in the void
+			continue;
 		}
-	}
-#else
-	float			distance, maxDistance;
-	cubemapProbe_t *cubeProbe;
-	unsigned int    hash;
-	vertexHash_t	*vertexHash;
-
-	tr.autoCubeImage = tr.whiteCubeImage;
-	if(!r_reflectionMapping->integer)
-		return;
-
-	if(tr.cubeHashTable == NULL || xyz == NULL)
-		return;
-
-	maxDistance = 9999999.0f;
-
-	hash = VertexCoordGenerateHash(xyz);
-
-	for(vertexHash = tr.cubeHashTable[hash]; vertexHash; vertexHash = vertexHash->next)
-	{
-		cubeProbe = vertexHash->data;
 
-		distance = Distance(cubeProbe->origin, xyz);
-		if(distance < maxDistance)
+		if(FindVertexInHashTable(tr.cubeHashTable, node->origin, 256) == NULL)
 		{
-			tr.autoCubeImage = cubeProbe->cubemap;
-			maxDistance = distance;
+			R_AddCubeProbe(node->origin);
 		}
 	}
-#endif
-
-#if defined(USE_D3D10)
-	// TODO
-#else
-	GL_Bind(tr.autoCubeImage);
-#endif
-}
 
-void R_FindTwoNearestCubeMaps(const vec3_t position, cubemapProbe_t **cubeProbeNearest, cubemapProbe_t **cubeProbeSecondNearest)
-{
-	int             j;
-	float			distance, maxDistance, maxDistance2;
-	cubemapProbe_t *cubeProbe;
-	unsigned int    hash;
-	vertexHash_t	*vertexHash;
+	// if we can't find one, fake one
+	if(tr.cubeProbes.currentElements == 0)
+	{
+		vec3_t          origin;
 
-	GLimp_LogComment("--- R_FindTwoNearestCubeMaps ---\n");
+		VectorClear(origin);
+		R_AddCubeProbe(origin);
+	}
+}
 
-	*cubeProbeNearest = NULL;
-	*cubeProbeSecondNearest = NULL;
+/*
+=================
+R_LoadCubeMaps
 
-	if(tr.cubeHashTable == NULL || position == NULL)
+Called by RE_LoadWorldMap
+=================
+*/
+static void R_LoadCubeMaps(void)
+{
+	if(!r_cubeProbes->integer)
+	{
 		return;
+	}
 
-	hash = VertexCoordGenerateHash(position);
-	maxDistance = maxDistance2 = 9999999.0f;
-	
-#if 0
-	for(j = 0; j < tr.cubeProbes.currentElements; j++)
+	if(R_ReadCubeProbeFile())
 	{
-		cubeProbe = Com_GrowListElement(&tr.cubeProbes, j);
-#else
-	for(j = 0, vertexHash = tr.cubeHashTable[hash]; vertexHash; vertexHash = vertexHash->next, j++)
-	{
-		cubeProbe = vertexHash->data;
-#endif
-		distance = Distance(cubeProbe->origin, position);
-		if(distance < maxDistance)
-		{
-			*cubeProbeSecondNearest = *cubeProbeNearest;
-			maxDistance2 = maxDistance;
-
-			*cubeProbeNearest = cubeProbe;
-			maxDistance = distance;
-		}
-		else if(distance < maxDistance2 && distance > maxDistance)
-		{
-			*cubeProbeSecondNearest = cubeProbe;
-			maxDistance2 = distance;
-		}
+		R_CreateCubeProbeGrid();
+		return;
 	}
 
-	//ri.Printf(PRINT_ALL, "iterated through %i cubeprobes\n", j);
+	if(r_cubeProbes->integer >= 2)
+	{
+		R_BuildCubeMaps();
+	}
 }
 
 void R_BuildCubeMaps(void)
@@ -8602,21 +9986,38 @@ void R_BuildCubeMaps(void)
 	int             startTime, endTime;
 	size_t			tics = 0;
 	size_t			nextTicCount = 0;
+	byte           *cacheBuf;
+	int             faceSize;
+
+	if(!tr.world)
+	{
+		ri.Printf(PRINT_ALL, "buildcubemaps: no map loaded\n");
+		return;
+	}
 
 	startTime = ri.Milliseconds();
 
 	memset(&rf, 0, sizeof(refdef_t));
 
+	faceSize = REF_CUBEMAP_SIZE * REF_CUBEMAP_SIZE * 4;
+
 	for(i = 0; i < 6; i++)
 	{
-		tr.cubeTemp[i] = ri.Z_Malloc(REF_CUBEMAP_SIZE * REF_CUBEMAP_SIZE * 4);
+		if(!tr.cubeTemp[i])
+		{
+			tr.cubeTemp[i] = ri.Z_Malloc(faceSize);
+		}
 	}
 
 //	fileBuf = ri.Z_Malloc(REF_CUBEMAP_STORE_SIZE * REF_CUBEMAP_STORE_SIZE * 4);
 
-	// calculate origins for our probes
-	Com_InitGrowList(&tr.cubeProbes, 4000);
-	tr.cubeHashTable = NewVertexHashTable();
+	// calculate origins for our probes, probes loaded from the cache are rendered again
+	if(!tr.cubeHashTable)
+	{
+		R_CreateCubeProbes();
+	}
+
+	cacheBuf = Com_Allocate(tr.cubeProbes.currentElements * 6 * faceSize);
 
 #if 0
 	if(tr.world->vis)
@@ -8646,36 +10047,7 @@ void R_BuildCubeMaps(void)
 			}
 		}
 	}
-#elif 1
-	{
-		bspNode_t      *node;
-
-		for(i = 0; i < tr.world->numnodes; i++)
-		{
-			node = &tr.world->nodes[i];
-
-			// check to see if this is a shit location
-			if(node->contents == CONTENTS_NODE)
-				continue;
-
-			if(node->area == -1)
-			{
-				// location is in the void
-				continue;
-			}
-
-			if(FindVertexInHashTable(tr.cubeHashTable, node->origin, 256) == NULL)
-			{
-				cubeProbe = ri.Hunk_Alloc(sizeof(*cubeProbe), h_high);
-				Com_AddToGrowList(&tr.cubeProbes, cubeProbe);
-
-				VectorCopy(node->origin, cubeProbe->origin);
-
-				AddVertexToHashTable(tr.cubeHashTable, cubeProbe->origin, cubeProbe);
-			}
-		}
-	}
-#else
+#elif 0
 	{
 		int             numGridPoints;
 		bspGridPoint_t *gridPoint;
@@ -8734,15 +10106,6 @@ void R_BuildCubeMaps(void)
 	}
 #endif
 
-	// if we can't find one, fake one
-	if(tr.cubeProbes.currentElements == 0)
-	{
-		cubeProbe = ri.Hunk_Alloc(sizeof(*cubeProbe), h_low);
-		Com_AddToGrowList(&tr.cubeProbes, cubeProbe);
-
-		VectorClear(cubeProbe->origin);
-	}
-
 	ri.Printf(PRINT_ALL, "...pre-rendering %d cubemaps\n", tr.cubeProbes.currentElements);
 	ri.Cvar_Set("viewlog", "1");
 	ri.Printf(PRINT_ALL, "0%%  10   20   30   40   50   60   70   80   90   100%%\n");
@@ -8974,6 +10337,8 @@ void R_BuildCubeMaps(void)
 				}
 			}
 
+			Com_Memcpy(cacheBuf + (j * 6 + i) * faceSize, tr.cubeTemp[i], faceSize);
+
 			// collate cubemaps into one large image and write it out
 #if 0
 			if(qfalse)
@@ -9020,24 +10385,7 @@ void R_BuildCubeMaps(void)
 #else
 		// build the cubemap
 		//cubeProbe->cubemap = R_CreateCubeImage(va("_autoCube%d", j), (const byte **)tr.cubeTemp, REF_CUBEMAP_SIZE, REF_CUBEMAP_SIZE, IF_NOPICMIP, FT_LINEAR, WT_EDGE_CLAMP);
-		cubeProbe->cubemap = R_AllocImage(va("_autoCube%d", j), qfalse);
-		if(!cubeProbe->cubemap)
-			return;
-
-		cubeProbe->cubemap->type = GL_TEXTURE_CUBE_MAP;
-
-		cubeProbe->cubemap->width = REF_CUBEMAP_SIZE;
-		cubeProbe->cubemap->height = REF_CUBEMAP_SIZE;
-
-		cubeProbe->cubemap->bits = IF_NOPICMIP;
-		cubeProbe->cubemap->filterType = FT_LINEAR;
-		cubeProbe->cubemap->wrapType = WT_EDGE_CLAMP;
-
-		GL_Bind(cubeProbe->cubemap);
-
-		R_UploadImage((const byte **)tr.cubeTemp, 6, cubeProbe->cubemap);
-
-		glBindTexture(cubeProbe->cubemap->type, 0);
+		R_UploadCubeProbe(cubeProbe, j, tr.cubeTemp);
 #endif
 	}
 	ri.Printf(PRINT_ALL, "\n");
@@ -9058,6 +10406,11 @@ void R_BuildCubeMaps(void)
 	// turn pixel targets off
 	tr.refdef.pixelTarget = NULL;
 
+	R_WriteCubeProbeFile(cacheBuf);
+	Com_Dealloc(cacheBuf);
+
+	R_CreateCubeProbeGrid();
+
 
 	// assign the surfs a cubemap
 #if 0
@@ -9122,7 +10475,7 @@ Called directly from cgame
 */
 void RE_LoadWorldMap(const char *name)
 {
-	int             i;
+	int             i, length;
 	dheader_t      *header;
 	byte           *buffer;
 	byte           *startMarker;
@@ -9171,7 +10524,7 @@ void RE_LoadWorldMap(const char *name)
 	tr.worldMapLoaded = qtrue;
 
 	// load it
-	ri.FS_ReadFile(name, (void **)&buffer);
+	length = ri.FS_ReadFile(name, (void **)&buffer);
 	if(!buffer)
 	{
 		ri.Error(ERR_DROP, "RE_LoadWorldMap: %s not found", name);
@@ -9181,6 +10534,9 @@ void RE_LoadWorldMap(const char *name)
 	// try will not look at the partially loaded version
 	tr.world = NULL;
 
+	// cached shadow maps belong to the lights of the previous map
+	R_ClearShadowCache();
+
 	// tr.worldDeluxeMapping will be set by R_LoadEntities()
 	tr.worldDeluxeMapping = qfalse;
 	tr.worldHDR_RGBE = qfalse;
@@ -9191,6 +10547,8 @@ void RE_LoadWorldMap(const char *name)
 	Q_strncpyz(s_worldData.baseName, Com_SkipPath(s_worldData.name), sizeof(s_worldData.name));
 	Com_StripExtension(s_worldData.baseName, s_worldData.baseName, sizeof(s_worldData.baseName));
 
+	s_worldData.checksum = R_ChecksumBlock(CHECKSUM_INIT, buffer, length);
+
 	startMarker = ri.Hunk_Alloc(0, h_low);
 
 	header = (dheader_t *) buffer;
@@ -9233,6 +10591,12 @@ void RE_LoadWorldMap(const char *name)
 //	ri.Cmd_ExecuteText(EXEC_NOW, "updatescreen\n");
 	R_LoadSubmodels(&header->lumps[LUMP_MODELS]);
 
+	// select the faces for the software occlusion culling
+	R_CreateOccluders(&s_worldData);
+
+	// flatten the leafs for culling without walking the tree
+	R_CreateLeafArray(&s_worldData);
+
 	// moved fog lump loading here, so fogs can be tagged with a model num
 //	ri.Cmd_ExecuteText(EXEC_NOW, "updatescreen\n");
 	R_LoadFogs(&header->lumps[LUMP_FOGS], &header->lumps[LUMP_BRUSHES], &header->lumps[LUMP_BRUSHSIDES]);
@@ -9276,8 +10640,8 @@ void RE_LoadWorldMap(const char *name)
 	}
 	//----(SA)  end
 
-	// build cubemaps after the necessary vbo stuff is done
-	//R_BuildCubeMaps();
+	// load or build cubemaps after the necessary vbo stuff is done
+	R_LoadCubeMaps();
 
 	// never move this to RE_BeginFrame because we need it to set it here for the first frame
 	// but we need the information across 2 frames
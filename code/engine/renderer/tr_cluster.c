@@ -0,0 +1,400 @@
+/*
+===========================================================================
+Copyright (C) 2006-2011 Robert Beckebans <trebor_7@users.sourceforge.net>
+
+This file is part of XreaL source code.
+
+XreaL source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+XreaL source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with XreaL source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// tr_cluster.c -- binning of deferred lights into a view space froxel grid
+#include "tr_local.h"
+
+/*
+The view frustum is split into CLUSTER_TILES_X * CLUSTER_TILES_Y screen tiles
+and CLUSTER_SLICES depth slices that grow exponentially from zNear to zFar.
+Every light is a bounding sphere in eye space and is appended to the light
+list of each cluster whose bounding box it touches. The backend uploads the
+lists as float textures and shades all of these lights in a single fullscreen
+pass over the G-Buffer.
+
+Cluster c = (slice * CLUSTER_TILES_Y + tileY) * CLUSTER_TILES_X + tileX, which
+is also the texel of the cluster grid texture.
+
+Binning works in ( x, y, depth ) with depth = -z of the OpenGL eye space.
+The tile borders are planes through the eye, so at a given depth the border
+of tile column i is at x = depth * tileFactorsX[i].
+
+The functions operating on a lightClusters_t only read the view parameters
+and lights stored in it and don't touch OpenGL.
+*/
+
+#define CLUSTER_INFINITE_DEPTH	65536.0f	// used as zFar for infinite projections
+#define CLUSTER_FAR_DEPTH		1e20f		// the last slice reaches out to here
+
+/*
+=================
+R_ClearLightClusters
+
+zFar <= zNear means the projection has no far plane
+=================
+*/
+void R_ClearLightClusters(lightClusters_t * lc, const matrix_t projectionMatrix, float zNear, float zFar)
+{
+	int             i;
+	float           border, f;
+
+	if(zNear < 1.0f)
+	{
+		zNear = 1.0f;
+	}
+
+	if(zFar <= zNear)
+	{
+		zFar = CLUSTER_INFINITE_DEPTH;
+	}
+
+	lc->zNear = zNear;
+	lc->zFar = zFar;
+	lc->sliceScale = CLUSTER_SLICES / log(zFar / zNear);
+
+	for(i = 0; i < CLUSTER_SLICES; i++)
+	{
+		lc->sliceDepths[i] = zNear * pow(zFar / zNear, (float)i / CLUSTER_SLICES);
+	}
+	lc->sliceDepths[CLUSTER_SLICES] = CLUSTER_FAR_DEPTH;
+
+	// ndc.x = (m[0] * x + m[8] * z) / -z
+	for(i = 0; i <= CLUSTER_TILES_X; i++)
+	{
+		border = -1.0f + 2.0f * i / CLUSTER_TILES_X;
+		f = (border + projectionMatrix[8]) / projectionMatrix[0];
+
+		lc->tileFactorsX[i] = f;
+		lc->tileScalesX[i] = 1.0f / sqrt(1.0f + f * f);
+	}
+
+	for(i = 0; i <= CLUSTER_TILES_Y; i++)
+	{
+		border = -1.0f + 2.0f * i / CLUSTER_TILES_Y;
+		f = (border + projectionMatrix[9]) / projectionMatrix[5];
+
+		lc->tileFactorsY[i] = f;
+		lc->tileScalesY[i] = 1.0f / sqrt(1.0f + f * f);
+	}
+
+	lc->numLights = 0;
+	lc->numIndexes = 0;
+}
+
+/*
+=================
+R_ClusterSlice
+=================
+*/
+static int R_ClusterSlice(const lightClusters_t * lc, float depth)
+{
+	int             slice;
+
+	if(depth <= lc->zNear)
+	{
+		return 0;
+	}
+
+	slice = (int)(log(depth / lc->zNear) * lc->sliceScale);
+
+	return Q_min(slice, CLUSTER_SLICES - 1);
+}
+
+/*
+=================
+R_ClusterTileRange
+
+Finds the range of tiles between the border planes that the sphere touches.
+Returns qfalse if it is outside of all of them.
+=================
+*/
+static qboolean R_ClusterTileRange(const float *factors, const float *scales, int numTiles, float c, float depth, float radius, int *first, int *last)
+{
+	int             i;
+
+	*first = numTiles;
+	*last = -1;
+
+	for(i = 0; i < numTiles; i++)
+	{
+		// signed distances to the lower and upper border, positive towards the upper side
+		if((c - depth * factors[i]) * scales[i] < -radius || (c - depth * factors[i + 1]) * scales[i + 1] > radius)
+		{
+			continue;
+		}
+
+		if(i < *first)
+		{
+			*first = i;
+		}
+		*last = i;
+	}
+
+	return *last >= 0;
+}
+
+/*
+=================
+R_AddClusterLight
+
+Appends the light to the lists of all clusters touched by the sphere.
+center is in OpenGL eye space.
+
+Returns qfalse and leaves the clusters unchanged if the light does not fit
+into the lists anymore, so the caller can shade it the old way.
+=================
+*/
+qboolean R_AddClusterLight(lightClusters_t * lc, const vec3_t center, float radius, trRefLight_t * light)
+{
+	int             x, y, slice, i;
+	int             firstX, lastX, firstY, lastY, firstSlice, lastSlice;
+	int             lightNum, firstIndex, mask, cluster;
+	float           depth, radiusSqr;
+	float           d0, d1, e, depthSqr, rowSqr, lo, hi;
+	const float    *fx, *fy;
+
+	if(lc->numLights >= MAX_CLUSTER_LIGHTS)
+	{
+		return qfalse;
+	}
+
+	depth = -center[2];
+	radiusSqr = radius * radius;
+
+	if(depth + radius < lc->zNear)
+	{
+		// behind the near plane, nothing to shade
+		return qtrue;
+	}
+
+	if(!R_ClusterTileRange(lc->tileFactorsX, lc->tileScalesX, CLUSTER_TILES_X, center[0], depth, radius, &firstX, &lastX) ||
+	   !R_ClusterTileRange(lc->tileFactorsY, lc->tileScalesY, CLUSTER_TILES_Y, center[1], depth, radius, &firstY, &lastY))
+	{
+		return qtrue;
+	}
+
+	firstSlice = R_ClusterSlice(lc, depth - radius);
+	lastSlice = R_ClusterSlice(lc, depth + radius);
+
+	lightNum = lc->numLights;
+	firstIndex = lc->numIndexes;
+
+	fx = lc->tileFactorsX;
+	fy = lc->tileFactorsY;
+
+	for(slice = firstSlice; slice <= lastSlice; slice++)
+	{
+		d0 = lc->sliceDepths[slice];
+		d1 = lc->sliceDepths[slice + 1];
+
+		e = Q_max(d0 - depth, 0) + Q_max(depth - d1, 0);
+		depthSqr = e * e;
+
+		if(depthSqr > radiusSqr)
+		{
+			continue;
+		}
+
+		for(y = firstY; y <= lastY; y++)
+		{
+			lo = Q_min(d0 * fy[y], d1 * fy[y]);
+			hi = Q_max(d0 * fy[y + 1], d1 * fy[y + 1]);
+
+			e = Q_max(lo - center[1], 0) + Q_max(center[1] - hi, 0);
+			rowSqr = depthSqr + e * e;
+
+			if(rowSqr > radiusSqr)
+			{
+				continue;
+			}
+
+			// test 4 clusters of the row at once against the sphere
+			for(x = firstX & ~3; x <= lastX; x += 4)
+			{
+#if id386_sse
+				__m128          _d0, _d1, _f0, _f1, _lo, _hi, _c, _e, _zero;
+
+				_d0 = _mm_set1_ps(d0);
+				_d1 = _mm_set1_ps(d1);
+				_c = _mm_set1_ps(center[0]);
+				_zero = _mm_setzero_ps();
+
+				_f0 = _mm_loadu_ps(fx + x);
+				_f1 = _mm_loadu_ps(fx + x + 1);
+
+				_lo = _mm_min_ps(_mm_mul_ps(_d0, _f0), _mm_mul_ps(_d1, _f0));
+				_hi = _mm_max_ps(_mm_mul_ps(_d0, _f1), _mm_mul_ps(_d1, _f1));
+
+				_e = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_lo, _c), _zero), _mm_max_ps(_mm_sub_ps(_c, _hi), _zero));
+				_e = _mm_add_ps(_mm_mul_ps(_e, _e), _mm_set1_ps(rowSqr));
+
+				mask = _mm_movemask_ps(_mm_cmple_ps(_e, _mm_set1_ps(radiusSqr)));
+#else
+				mask = 0;
+
+				for(i = 0; i < 4; i++)
+				{
+					lo = Q_min(d0 * fx[x + i], d1 * fx[x + i]);
+					hi = Q_max(d0 * fx[x + i + 1], d1 * fx[x + i + 1]);
+
+					e = Q_max(lo - center[0], 0) + Q_max(center[0] - hi, 0);
+
+					if(rowSqr + e * e <= radiusSqr)
+					{
+						mask |= 1 << i;
+					}
+				}
+#endif
+
+				for(i = 0; i < 4; i++)
+				{
+					if(!(mask & (1 << i)) || x + i < firstX || x + i > lastX)
+					{
+						continue;
+					}
+
+					if(lc->numIndexes >= MAX_CLUSTER_INDEXES)
+					{
+						// undo this light
+						lc->numIndexes = firstIndex;
+						return qfalse;
+					}
+
+					cluster = (slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x + i;
+
+					lc->clusterPairs[lc->numIndexes++] = (cluster << 8) | lightNum;
+				}
+			}
+		}
+	}
+
+	if(lc->numIndexes != firstIndex)
+	{
+		lc->lights[lc->numLights++] = light;
+	}
+
+	return qtrue;
+}
+
+/*
+=================
+R_FinishLightClusters
+
+Sorts the binned lights by cluster
+=================
+*/
+void R_FinishLightClusters(lightClusters_t * lc)
+{
+	int             i, cluster, first;
+
+	Com_Memset(lc->clusterCount, 0, sizeof(lc->clusterCount));
+
+	for(i = 0; i < lc->numIndexes; i++)
+	{
+		lc->clusterCount[lc->clusterPairs[i] >> 8]++;
+	}
+
+	for(i = 0, first = 0; i < MAX_CLUSTERS; i++)
+	{
+		lc->clusterFirst[i] = first;
+		first += lc->clusterCount[i];
+
+		lc->clusterCount[i] = 0;
+	}
+
+	// lights stay in the order they were added within every cluster
+	for(i = 0; i < lc->numIndexes; i++)
+	{
+		cluster = lc->clusterPairs[i] >> 8;
+
+		lc->lightIndexes[lc->clusterFirst[cluster] + lc->clusterCount[cluster]++] = lc->clusterPairs[i] & 0xFF;
+	}
+}
+
+
+/*
+=================
+R_SetupViewLightClusters
+
+Returns the clusters of the current view or NULL if its lights
+are shaded one by one
+=================
+*/
+lightClusters_t *R_SetupViewLightClusters(void)
+{
+	backEndData_t  *data;
+	lightClusters_t *lc;
+
+	if(!r_clusteredLighting->integer || !tr.clusterGridImage || !DS_STANDARD_ENABLED() || r_shadows->integer >= SHADOWING_ESM16)
+	{
+		return NULL;
+	}
+
+	// the light volumes of the old path are needed for clipping against the portal plane
+	if(tr.viewParms.isPortal)
+	{
+		return NULL;
+	}
+
+	data = backEndData[tr.smpFrame];
+
+	if(data->numLightClusters >= MAX_LIGHT_CLUSTER_VIEWS)
+	{
+		return NULL;
+	}
+
+	lc = &data->lightClusters[data->numLightClusters++];
+
+	R_ClearLightClusters(lc, tr.viewParms.projectionMatrix, tr.viewParms.zNear, tr.viewParms.zFar);
+
+	tr.viewParms.lightClusters = lc;
+	tr.pc.c_clusterViews++;
+
+	return lc;
+}
+
+/*
+=================
+R_AddLightToViewClusters
+
+Only unshadowed omni lights with the default dynamic light shader can be
+clustered because the fullscreen pass binds a single pair of attenuation maps
+=================
+*/
+qboolean R_AddLightToViewClusters(lightClusters_t * lc, trRefLight_t * light)
+{
+	vec3_t          center;
+
+	if(light->l.rlType != RL_OMNI || light->shader != tr.defaultDynamicLightShader)
+	{
+		return qfalse;
+	}
+
+	MatrixTransformPoint(tr.viewParms.world.viewMatrix, light->origin, center);
+
+	if(!R_AddClusterLight(lc, center, light->sphereRadius, light))
+	{
+		tr.pc.c_clusterOverflows++;
+		return qfalse;
+	}
+
+	return qtrue;
+}
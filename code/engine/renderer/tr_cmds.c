@@ -27,6 +27,9 @@ volatile renderCommandList_t *renderCommandList;
 
 volatile qboolean renderThreadActive;
 
+int             c_blockedOnRender;
+int             c_blockedOnMain;
+
 /*
 =====================
 R_PerformanceCounters
@@ -34,38 +37,42 @@ R_PerformanceCounters
 */
 void R_PerformanceCounters(void)
 {
+	const backEndCounters_t *pc;
+
+	// the back end published its counters when it was done with this frame
+	pc = &backEndData[tr.smpFrame]->pc;
+
 	if(!r_speeds->integer)
 	{
 		// clear the counters even if we aren't printing
 		Com_Memset(&tr.pc, 0, sizeof(tr.pc));
-		Com_Memset(&backEnd.pc, 0, sizeof(backEnd.pc));
 		return;
 	}
 
 	if(r_speeds->integer == RSPEEDS_GENERAL)
 	{
-		ri.Printf(PRINT_ALL, "%i views %i portals %i batches %i surfs %i leafs %i verts %i tris\n",
-				  backEnd.pc.c_views, backEnd.pc.c_portals, backEnd.pc.c_batches, backEnd.pc.c_surfaces, tr.pc.c_leafs,
-				  backEnd.pc.c_vertexes, backEnd.pc.c_indexes / 3);
+		ri.Printf(PRINT_ALL, "%i views %i portals %i batches %i surfs %i leafs %i leaf blocks %i verts %i tris\n",
+				  pc->c_views, pc->c_portals, pc->c_batches, pc->c_surfaces, tr.pc.c_leafs,
+				  tr.pc.c_leafArrayBlocks, pc->c_vertexes, pc->c_indexes / 3);
 
 		ri.Printf(PRINT_ALL, "%i lights %i bout %i pvsout %i queryout %i interactions\n",
-				  tr.pc.c_dlights + tr.pc.c_slights - backEnd.pc.c_occlusionQueriesLightsCulled,
+				  tr.pc.c_dlights + tr.pc.c_slights - pc->c_occlusionQueriesLightsCulled,
 				  tr.pc.c_box_cull_light_out,
 				  tr.pc.c_pvs_cull_light_out,
-				  backEnd.pc.c_occlusionQueriesLightsCulled,
-				  tr.pc.c_dlightInteractions + tr.pc.c_slightInteractions - backEnd.pc.c_occlusionQueriesInteractionsCulled);
+				  pc->c_occlusionQueriesLightsCulled,
+				  tr.pc.c_dlightInteractions + tr.pc.c_slightInteractions - pc->c_occlusionQueriesInteractionsCulled);
 
 		ri.Printf(PRINT_ALL, "%i draws %i queries %i CHC++ ms %i vbos %i ibos %i verts %i tris\n",
-				  backEnd.pc.c_drawElements,
+				  pc->c_drawElements,
 				  tr.pc.c_occlusionQueries,
 				  tr.pc.c_CHCTime,
-				  backEnd.pc.c_vboVertexBuffers, backEnd.pc.c_vboIndexBuffers,
-				  backEnd.pc.c_vboVertexes, backEnd.pc.c_vboIndexes / 3);
+				  pc->c_vboVertexBuffers, pc->c_vboIndexBuffers,
+				  pc->c_vboVertexes, pc->c_vboIndexes / 3);
 
 		ri.Printf(PRINT_ALL, "%i multidraws %i primitives %i tris\n",
-				  backEnd.pc.c_multiDrawElements,
-				  backEnd.pc.c_multiDrawPrimitives,
-				  backEnd.pc.c_multiVboIndexes / 3);
+				  pc->c_multiDrawElements,
+				  pc->c_multiDrawPrimitives,
+				  pc->c_multiVboIndexes / 3);
 	}
 	else if(r_speeds->integer == RSPEEDS_CULLING)
 	{
@@ -103,24 +110,24 @@ void R_PerformanceCounters(void)
 	}
 	else if(r_speeds->integer == RSPEEDS_FOG)
 	{
-		ri.Printf(PRINT_ALL, "fog srf:%i batches:%i\n", backEnd.pc.c_fogSurfaces, backEnd.pc.c_fogBatches);
+		ri.Printf(PRINT_ALL, "fog srf:%i batches:%i\n", pc->c_fogSurfaces, pc->c_fogBatches);
 	}
 	else if(r_speeds->integer == RSPEEDS_FLARES)
 	{
 		ri.Printf(PRINT_ALL, "flare adds:%i tests:%i renders:%i\n",
-				  backEnd.pc.c_flareAdds, backEnd.pc.c_flareTests, backEnd.pc.c_flareRenders);
+				  pc->c_flareAdds, pc->c_flareTests, pc->c_flareRenders);
 	}
 	else if(r_speeds->integer == RSPEEDS_OCCLUSION_QUERIES)
 	{
 		ri.Printf(PRINT_ALL, "occlusion queries:%i multi:%i saved:%i culled lights:%i culled entities:%i culled leafs:%i response time:%i fetch time:%i\n",
-				  backEnd.pc.c_occlusionQueries,
-				  backEnd.pc.c_occlusionQueriesMulti,
-				  backEnd.pc.c_occlusionQueriesSaved,
-				  backEnd.pc.c_occlusionQueriesLightsCulled,
-				  backEnd.pc.c_occlusionQueriesEntitiesCulled,
-				  backEnd.pc.c_occlusionQueriesLeafsCulled,
-				  backEnd.pc.c_occlusionQueriesResponseTime,
-				  backEnd.pc.c_occlusionQueriesFetchTime);
+				  pc->c_occlusionQueries,
+				  pc->c_occlusionQueriesMulti,
+				  pc->c_occlusionQueriesSaved,
+				  pc->c_occlusionQueriesLightsCulled,
+				  pc->c_occlusionQueriesEntitiesCulled,
+				  pc->c_occlusionQueriesLeafsCulled,
+				  pc->c_occlusionQueriesResponseTime,
+				  pc->c_occlusionQueriesFetchTime);
 	}
 	else if(r_speeds->integer == RSPEEDS_DEPTH_BOUNDS_TESTS)
 	{
@@ -129,11 +136,11 @@ void R_PerformanceCounters(void)
 	else if(r_speeds->integer == RSPEEDS_SHADING_TIMES)
 	{
 		if(DS_STANDARD_ENABLED())
-			ri.Printf(PRINT_ALL, "deferred shading times: g-buffer:%i lighting:%i translucent:%i\n", backEnd.pc.c_deferredGBufferTime,
-					  backEnd.pc.c_deferredLightingTime, backEnd.pc.c_forwardTranslucentTime);
+			ri.Printf(PRINT_ALL, "deferred shading times: g-buffer:%i lighting:%i translucent:%i\n", pc->c_deferredGBufferTime,
+					  pc->c_deferredLightingTime, pc->c_forwardTranslucentTime);
 		else
-			ri.Printf(PRINT_ALL, "forward shading times: ambient:%i lighting:%i\n", backEnd.pc.c_forwardAmbientTime,
-					  backEnd.pc.c_forwardLightingTime);
+			ri.Printf(PRINT_ALL, "forward shading times: ambient:%i lighting:%i\n", pc->c_forwardAmbientTime,
+					  pc->c_forwardLightingTime);
 	}
 	else if(r_speeds->integer == RSPEEDS_CHC)
 	{
@@ -153,9 +160,46 @@ void R_PerformanceCounters(void)
 				  tr.pc.c_decalProjectors, tr.pc.c_decalTestSurfaces, tr.pc.c_decalClipSurfaces, tr.pc.c_decalSurfaces,
 				  tr.pc.c_decalSurfacesCreated);
 	}
+	else if(r_speeds->integer == RSPEEDS_SOFTWARE_OCCLUSION)
+	{
+		ri.Printf(PRINT_ALL, "occluders:%i triangles:%i tests:%i culled:%i ms:%i\n",
+				  tr.pc.c_occluders, tr.pc.c_occluderTriangles,
+				  tr.pc.c_occlusionBufferTests, tr.pc.c_occlusionBufferCulled, tr.pc.c_occlusionBufferTime);
+	}
+	else if(r_speeds->integer == RSPEEDS_SMP)
+	{
+		ri.Printf(PRINT_ALL, "smp frames:%i stalls:%i stall ms:%i flushes:%i render busy:%i render idle:%i\n",
+				  glConfig.smpActive ? r_smpFrames->integer : 1,
+				  tr.pc.c_smpStalls, tr.pc.c_smpStallMsec, tr.pc.c_smpFlushes, c_blockedOnRender, c_blockedOnMain);
+
+		c_blockedOnRender = 0;
+		c_blockedOnMain = 0;
+	}
+	else if(r_speeds->integer == RSPEEDS_GLSL)
+	{
+		ri.Printf(PRINT_ALL, "glsl permutations compiled:%i ms:%i fallbacks:%i\n",
+				  pc->c_glslCompiles, pc->c_glslCompileTime, pc->c_glslFallbacks);
+	}
+	else if(r_speeds->integer == RSPEEDS_LIGHT_CLUSTERS)
+	{
+		ri.Printf(PRINT_ALL, "cluster views:%i lights:%i indexes:%i overflows:%i passes:%i\n",
+				  tr.pc.c_clusterViews, tr.pc.c_clusterLights, tr.pc.c_clusterIndexes, tr.pc.c_clusterOverflows,
+				  pc->c_clusterPasses);
+	}
+	else if(r_speeds->integer == RSPEEDS_SHADOW_CACHE)
+	{
+		ri.Printf(PRINT_ALL, "shadow cache hits:%i misses:%i composites:%i evictions:%i uncached:%i resident:%i/%i\n",
+				  pc->c_shadowCacheHits, pc->c_shadowCacheMisses, pc->c_shadowCacheComposites,
+				  pc->c_shadowCacheEvictions, pc->c_shadowCacheUncached,
+				  R_ShadowCacheResidency(), tr.numShadowCacheEntries);
+	}
+	else if(r_speeds->integer == RSPEEDS_INSTANCING)
+	{
+		ri.Printf(PRINT_ALL, "instance runs:%i surfaces:%i instanced draws:%i instances:%i\n",
+				  tr.pc.c_instanceRuns, tr.pc.c_instanceSurfaces, pc->c_instancedDraws, pc->c_instances);
+	}
 
 	Com_Memset(&tr.pc, 0, sizeof(tr.pc));
-	Com_Memset(&backEnd.pc, 0, sizeof(backEnd.pc));
 }
 
 
@@ -164,10 +208,7 @@ void R_PerformanceCounters(void)
 R_IssueRenderCommands
 ====================
 */
-int             c_blockedOnRender;
-int             c_blockedOnMain;
-
-void R_IssueRenderCommands(qboolean runPerformanceCounters)
+void R_IssueRenderCommands(void)
 {
 	renderCommandList_t *cmdList;
 
@@ -181,7 +222,8 @@ void R_IssueRenderCommands(qboolean runPerformanceCounters)
 
 	if(glConfig.smpActive)
 	{
-		// if the render thread is not idle, wait for it
+		// the front end does not wait here anymore, we only track
+		// whether the render thread was still busy with an older frame
 		if(renderThreadActive)
 		{
 			c_blockedOnRender++;
@@ -198,16 +240,6 @@ void R_IssueRenderCommands(qboolean runPerformanceCounters)
 				ri.Printf(PRINT_ALL, ".");
 			}
 		}
-
-		// sleep until the renderer has completed
-		GLimp_FrontEndSleep();
-	}
-
-	// at this point, the back end thread is idle, so it is ok
-	// to look at its performance counters
-	if(runPerformanceCounters)
-	{
-		R_PerformanceCounters();
 	}
 
 	// actually start the commands going
@@ -220,7 +252,39 @@ void R_IssueRenderCommands(qboolean runPerformanceCounters)
 		}
 		else
 		{
-			GLimp_WakeRenderer(cmdList);
+			backEndData[tr.smpFrame]->fence = GLimp_WakeRenderer(cmdList->cmds);
+		}
+	}
+}
+
+
+/*
+====================
+R_WaitSmpFrame
+
+Blocks until the render thread does not need the
+backEndData of the given frame anymore.
+====================
+*/
+void R_WaitSmpFrame(int smpFrame)
+{
+	int             startTime;
+
+	if(!glConfig.smpActive)
+	{
+		return;
+	}
+
+	startTime = ri.Milliseconds();
+
+	if(GLimp_WaitRenderFence(backEndData[smpFrame]->fence))
+	{
+		tr.pc.c_smpStalls++;
+		tr.pc.c_smpStallMsec += ri.Milliseconds() - startTime;
+
+		if(r_showSmp->integer)
+		{
+			ri.Printf(PRINT_ALL, "S");
 		}
 	}
 }
@@ -243,7 +307,7 @@ void R_SyncRenderThread(void)
 		return;
 	}
 
-	R_IssueRenderCommands(qfalse);
+	R_IssueRenderCommands();
 
 	if(!glConfig.smpActive)
 	{
@@ -276,8 +340,12 @@ void           *R_GetCommandBuffer(int bytes)
 			ri.Error(ERR_FATAL, "R_GetCommandBuffer: bad size %i", bytes);
 		}
 
-		// if we run out of room, just start dropping commands
-		return NULL;
+		// if we run out of room, hand over what we have so far
+		// and recycle the command memory instead of dropping commands
+		tr.pc.c_smpFlushes++;
+
+		R_IssueRenderCommands();
+		R_WaitSmpFrame(tr.smpFrame);
 	}
 
 	cmdList->used += bytes;
@@ -668,12 +736,16 @@ void RE_EndFrame(int *frontEndMsec, int *backEndMsec)
 	}
 	cmd->commandId = RC_SWAP_BUFFERS;
 
-	R_IssueRenderCommands(qtrue);
+	R_IssueRenderCommands();
 
 	// use the other buffers next frame, because another CPU
 	// may still be rendering into the current ones
 	R_ToggleSmpFrame();
 
+	// the render thread is done with the frame we are going to recycle,
+	// so its back end counters are final
+	R_PerformanceCounters();
+
 	if(frontEndMsec)
 	{
 		*frontEndMsec = tr.frontEndMsec;
@@ -681,9 +753,8 @@ void RE_EndFrame(int *frontEndMsec, int *backEndMsec)
 	tr.frontEndMsec = 0;
 	if(backEndMsec)
 	{
-		*backEndMsec = backEnd.pc.msec;
+		*backEndMsec = backEndData[tr.smpFrame]->pc.msec;
 	}
-	backEnd.pc.msec = 0;
 }
 
 /*
@@ -691,7 +762,7 @@ void RE_EndFrame(int *frontEndMsec, int *backEndMsec)
 RE_TakeVideoFrame
 =============
 */
-void RE_TakeVideoFrame(int width, int height, byte * captureBuffer, byte * encodeBuffer, qboolean motionJpeg)
+void RE_TakeVideoFrame(int width, int height, byte * captureBuffer)
 {
 	videoFrameCommand_t *cmd;
 
@@ -711,8 +782,26 @@ void RE_TakeVideoFrame(int width, int height, byte * captureBuffer, byte * encod
 	cmd->width = width;
 	cmd->height = height;
 	cmd->captureBuffer = captureBuffer;
-	cmd->encodeBuffer = encodeBuffer;
-	cmd->motionJpeg = motionJpeg;
+}
+
+/*
+=============
+RE_FinishVideoFrames
+
+Hands the video frames that are still read back to the client,
+called before the client closes the video
+=============
+*/
+void RE_FinishVideoFrames(void)
+{
+	if(!tr.registered)
+	{
+		return;
+	}
+
+	R_SyncRenderThread();
+
+	RB_FinishVideoFrames();
 }
 
 //bani
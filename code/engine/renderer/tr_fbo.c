@@ -688,6 +688,12 @@ void R_InitFBOs(void)
 			R_CheckFBO(tr.shadowMapFBO[i]);
 		}
 
+		if(tr.numShadowCacheEntries)
+		{
+			// only gets a cube face of a cache entry attached for reading
+			tr.shadowCacheFBO = R_CreateFBO("_shadowCache", shadowMapResolutions[0], shadowMapResolutions[0]);
+		}
+
 
 		// sun requires different resolutions
 		for(i = 0; i < MAX_SHADOWMAPS; i++)
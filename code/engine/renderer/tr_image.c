@@ -3187,6 +3187,29 @@ static void R_CreateDeferredRenderFBOImages(void)
 	ri.Hunk_FreeTempMemory(data);
 }
 
+static void R_CreateLightClusterImages(void)
+{
+	byte           *data;
+
+	if(!r_clusteredLighting->integer || !DS_STANDARD_ENABLED() || !glConfig2.textureFloatAvailable)
+		return;
+
+	// the index texture is the largest one
+	data = ri.Hunk_AllocateTempMemory(MAX_CLUSTER_INDEXES * 4);
+	Com_Memset(data, 0, MAX_CLUSTER_INDEXES * 4);
+
+	// first light index and light count of every cluster
+	tr.clusterGridImage = R_CreateImage("_clusterGrid", data, CLUSTER_TILES_X * CLUSTER_TILES_Y, CLUSTER_SLICES, IF_NOPICMIP | IF_RGBA32F, FT_NEAREST, WT_CLAMP);
+
+	// light lists of all clusters, one light per texel
+	tr.clusterIndexImage = R_CreateImage("_clusterIndex", data, CLUSTER_INDEX_WIDTH, MAX_CLUSTER_INDEXES / CLUSTER_INDEX_WIDTH, IF_NOPICMIP | IF_RGBA32F, FT_NEAREST, WT_CLAMP);
+
+	// attenuation matrix, origin and color, one light per row
+	tr.clusterLightImage = R_CreateImage("_clusterLight", data, CLUSTER_LIGHT_TEXELS, MAX_CLUSTER_LIGHTS, IF_NOPICMIP | IF_RGBA32F, FT_NEAREST, WT_CLAMP);
+
+	ri.Hunk_FreeTempMemory(data);
+}
+
 // *INDENT-OFF*
 static void R_CreateShadowMapFBOImage(void)
 {
@@ -3374,6 +3397,84 @@ static void R_CreateShadowCubeFBOImage(void)
 }
 // *INDENT-ON*
 
+/*
+================
+R_CreateShadowCacheImages
+
+Spends r_shadowCacheSize megabytes on cube maps for the static shadow cache.
+Every round adds one cube per LOD, starting with the small ones. LOD 0 is
+left out because a single 2048 cube map would eat most of the budget.
+================
+*/
+static void R_CreateShadowCacheImages(void)
+{
+	int             i, lod;
+	int             width, height;
+	int             texelBytes, size, budget;
+	byte           *data[6];
+	image_t        *image;
+	shadowCacheEntry_t *entry;
+	qboolean        added;
+
+	tr.numShadowCacheEntries = 0;
+
+	if(!r_shadowCache->integer || !glConfig2.framebufferBlitAvailable || !tr.shadowCubeFBOImage[0])
+		return;
+
+	// the cache entries must match the format of the shadow cube maps
+	// so they can be copied into each other
+	image = tr.shadowCubeFBOImage[0];
+
+	if(image->bits & IF_RGBA32F)
+		texelBytes = 16;
+	else if(image->bits & (IF_RGBA16F | IF_LA32F))
+		texelBytes = 8;
+	else if(image->bits & (IF_LA16F | IF_ALPHA32F))
+		texelBytes = 4;
+	else
+		texelBytes = 2;
+
+	budget = Q_bound(0, r_shadowCacheSize->integer, 1024) * 1024 * 1024;
+
+	do
+	{
+		added = qfalse;
+
+		for(lod = MAX_SHADOWMAPS - 1; lod >= 1 && tr.numShadowCacheEntries < MAX_SHADOWCACHE_ENTRIES; lod--)
+		{
+			width = height = shadowMapResolutions[lod];
+
+			size = width * height * 6 * texelBytes;
+			if(size > budget)
+				continue;
+
+			for(i = 0; i < 6; i++)
+			{
+				data[i] = ri.Hunk_AllocateTempMemory(width * height * 4);
+			}
+
+			entry = &tr.shadowCacheEntries[tr.numShadowCacheEntries];
+			entry->image = R_CreateCubeImage(va("_shadowCache%d", tr.numShadowCacheEntries), (const byte **)data, width, height,
+											 tr.shadowCubeFBOImage[lod]->bits, tr.shadowCubeFBOImage[lod]->filterType, WT_EDGE_CLAMP);
+			entry->lod = lod;
+			entry->lightNum = -1;
+			entry->lastUsed = 0;
+
+			tr.numShadowCacheEntries++;
+
+			for(i = 5; i >= 0; i--)
+			{
+				ri.Hunk_FreeTempMemory(data[i]);
+			}
+
+			budget -= size;
+			added = qtrue;
+		}
+	} while(added);
+
+	ri.Printf(PRINT_ALL, "%i shadow cache cube maps, %i KB left\n", tr.numShadowCacheEntries, budget / 1024);
+}
+
 // *INDENT-OFF*
 static void R_CreateBlackCubeImage(void)
 {
@@ -3543,8 +3644,10 @@ void R_CreateBuiltinImages(void)
 	R_CreateDepthToColorFBOImages();
 	R_CreateDownScaleFBOImages();
 	R_CreateDeferredRenderFBOImages();
+	R_CreateLightClusterImages();
 	R_CreateShadowMapFBOImage();
 	R_CreateShadowCubeFBOImage();
+	R_CreateShadowCacheImages();
 	R_CreateBlackCubeImage();
 	R_CreateWhiteCubeImage();
 }
@@ -3746,6 +3849,9 @@ void R_ShutdownImages(void)
 	Com_DestroyGrowList(&tr.cubeProbes);
 
 	FreeVertexHashTable(tr.cubeHashTable);
+	tr.cubeHashTable = NULL;
+
+	R_FreeCubeProbeGrid();
 }
 
 
@@ -1186,4 +1186,199 @@ image_t        *R_LoadDDSImage(const char *name, int bits, filterType_t filterTy
 	return ret;
 }
 
-#endif
\ No newline at end of file
+#endif
+
+/*
+=================================================================================
+
+DDS HDR LIGHTMAPS
+
+Lightmaps converted offline from the XMap2 .hdr output, they are uploaded
+without any decoding. Only the top level of RGBA half float pages or of BC6H
+pages is used. The header is read by offsets so this works without USE_DDS.
+
+=================================================================================
+*/
+
+#define DDS_LIGHTMAP_MAGIC				(('D' << 0) | ('D' << 8) | ('S' << 16) | (' ' << 24))
+#define DDS_LIGHTMAP_FOURCC_DX10		(('D' << 0) | ('X' << 8) | ('1' << 16) | ('0' << 24))
+#define DDS_LIGHTMAP_FOURCC_RGBA16F		113		// D3DFMT_A16B16G16R16F
+
+#define DXGI_FORMAT_R16G16B16A16_FLOAT	10
+#define DXGI_FORMAT_BC6H_UF16			95
+#define DXGI_FORMAT_BC6H_SF16			96
+
+/*
+===============
+R_DDSLightmapLong
+===============
+*/
+static int R_DDSLightmapLong(const byte * buffer, int offset)
+{
+	int             l;
+
+	Com_Memcpy(&l, buffer + offset, sizeof(l));
+
+	return LittleLong(l);
+}
+
+/*
+===============
+R_DDSLightmapFormat
+
+Returns the internal format of the page or 0 if it can't be used
+===============
+*/
+static GLenum R_DDSLightmapFormat(const char *name, const byte * buffer, int len, int *width, int *height, int *dataOffset,
+								  int *dataSize)
+{
+	int             fourCC, format;
+	int             blockSize, blockBytes, blocksX, blocksY;
+	GLenum          internalFormat;
+
+	if(len < 128 || R_DDSLightmapLong(buffer, 0) != DDS_LIGHTMAP_MAGIC || R_DDSLightmapLong(buffer, 4) != 124)
+	{
+		ri.Printf(PRINT_WARNING, "WARNING: '%s' is not a DDS file\n", name);
+		return 0;
+	}
+
+	*height = R_DDSLightmapLong(buffer, 12);
+	*width = R_DDSLightmapLong(buffer, 16);
+	*dataOffset = 128;
+
+	if(*width <= 0 || *height <= 0)
+	{
+		ri.Printf(PRINT_WARNING, "WARNING: '%s' has an invalid size %ix%i\n", name, *width, *height);
+		return 0;
+	}
+
+	fourCC = R_DDSLightmapLong(buffer, 84);
+	if(fourCC == DDS_LIGHTMAP_FOURCC_DX10 && len >= 148)
+	{
+		format = R_DDSLightmapLong(buffer, 128);
+		*dataOffset = 148;
+	}
+	else if(fourCC == DDS_LIGHTMAP_FOURCC_RGBA16F)
+	{
+		format = DXGI_FORMAT_R16G16B16A16_FLOAT;
+	}
+	else
+	{
+		format = 0;
+	}
+
+	switch (format)
+	{
+		case DXGI_FORMAT_R16G16B16A16_FLOAT:
+			internalFormat = GL_RGBA16F;
+			blockSize = 1;
+			blockBytes = 4 * sizeof(unsigned short);
+			break;
+
+		case DXGI_FORMAT_BC6H_UF16:
+		case DXGI_FORMAT_BC6H_SF16:
+			if(!glConfig2.textureCompressionBPTCAvailable)
+			{
+				ri.Printf(PRINT_WARNING, "WARNING: '%s' needs GL_ARB_texture_compression_bptc\n", name);
+				return 0;
+			}
+
+			if(format == DXGI_FORMAT_BC6H_UF16)
+				internalFormat = GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT_ARB;
+			else
+				internalFormat = GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT_ARB;
+
+			// 16 bytes per 4x4 block
+			blockSize = 4;
+			blockBytes = 16;
+			break;
+
+		default:
+			ri.Printf(PRINT_WARNING, "WARNING: '%s' is neither RGBA16F nor BC6H\n", name);
+			return 0;
+	}
+
+	blocksX = *width / blockSize + (*width % blockSize != 0);
+	blocksY = *height / blockSize + (*height % blockSize != 0);
+
+	// check against the file before multiplying, so huge pages can't overflow the size
+	if(len < *dataOffset || blocksY > (len - *dataOffset) / blockBytes / blocksX)
+	{
+		ri.Printf(PRINT_WARNING, "WARNING: '%s' is truncated\n", name);
+		return 0;
+	}
+
+	*dataSize = blocksX * blocksY * blockBytes;
+
+	return internalFormat;
+}
+
+/*
+===============
+R_LoadDDSLightmap
+===============
+*/
+image_t        *R_LoadDDSLightmap(const char *name)
+{
+	image_t        *image;
+	byte           *buffer;
+	int             len, width, height, dataOffset, dataSize;
+	GLenum          internalFormat;
+
+	len = ri.FS_ReadFile(name, (void **)&buffer);
+	if(!buffer)
+	{
+		return NULL;
+	}
+
+	internalFormat = R_DDSLightmapFormat(name, buffer, len, &width, &height, &dataOffset, &dataSize);
+	if(!internalFormat)
+	{
+		ri.FS_FreeFile(buffer);
+		return NULL;
+	}
+
+	image = R_AllocImage(name, qtrue);
+	if(!image)
+	{
+		ri.FS_FreeFile(buffer);
+		return NULL;
+	}
+
+	image->type = GL_TEXTURE_2D;
+
+	image->width = width;
+	image->height = height;
+
+	image->bits = IF_NOPICMIP | IF_RGBA16F;
+	image->filterType = FT_NEAREST;
+	image->wrapType = WT_CLAMP;
+
+	GL_Bind(image);
+
+	image->internalFormat = internalFormat;
+	image->uploadWidth = width;
+	image->uploadHeight = height;
+
+	if(internalFormat == GL_RGBA16F)
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_HALF_FLOAT, buffer + dataOffset);
+	}
+	else
+	{
+		glCompressedTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, dataSize, buffer + dataOffset);
+	}
+
+	glTexParameterf(image->type, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameterf(image->type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameterf(image->type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameterf(image->type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glBindTexture(image->type, 0);
+
+	GL_CheckErrors();
+
+	ri.FS_FreeFile(buffer);
+
+	return image;
+}
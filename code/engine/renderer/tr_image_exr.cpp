@@ -40,63 +40,24 @@ extern          "C"
 {
 #endif
 
-void LoadRGBEToFloats(const char *name, float **pic, int *width, int *height, qboolean doGamma, qboolean toneMap, qboolean compensate);
+/*
+===============
+ConvertFloatsToHalfs
 
-void LoadRGBEToHalfs(const char *name, unsigned short ** halfImage, int *width, int *height)
+Converts numFloats floats to the bits of OpenEXR half floats.
+Only uses the constant lookup tables of half, so it can be called by several threads at once.
+===============
+*/
+void ConvertFloatsToHalfs(const float *in, unsigned short *out, int numFloats)
 {
-	int             i, j;
-	int             w, h;
-	float          *hdrImage;
-	float          *floatbuf;
-	unsigned short *halfbuf;
-
-#if 0
-	w = h = 0;
-	LoadRGBEToFloats(name, &hdrImage, &w, &h, qtrue, qtrue, qtrue);
-
-	*width = w;
-	*height = h;
+	int             i;
 
-	*ldrImage = ri.Malloc(w * h * 4);
-	pixbuf = *ldrImage;
-
-	floatbuf = hdrImage;
-	for(i = 0; i < (w * h); i++)
+	for(i = 0; i < numFloats; i++)
 	{
-		for(j = 0; j < 3; j++)
-		{
-			sample[j] = *floatbuf++;
-		}
-
-		NormalizeColor(sample, sample);
+		half            sample(in[i]);
 
-		*pixbuf++ = (byte) (sample[0] * 255);
-		*pixbuf++ = (byte) (sample[1] * 255);
-		*pixbuf++ = (byte) (sample[2] * 255);
-		*pixbuf++ = (byte) 255;
+		out[i] = sample.bits();
 	}
-#else
-	w = h = 0;
-	LoadRGBEToFloats(name, &hdrImage, &w, &h, qtrue, qfalse, qtrue);
-
-	*width = w;
-	*height = h;
-
-	*halfImage = (unsigned short *) Com_Allocate(w * h * 3 * 6);
-
-	halfbuf = *halfImage;
-	floatbuf = hdrImage;
-	for(i = 0; i < (w * h); i++)
-	{
-		for(j = 0; j < 3; j++)
-		{
-			half sample(*floatbuf++);
-			*halfbuf++ = sample.bits();
-		}
-	}
-#endif
-
-	Com_Dealloc(hdrImage);
 }
 
 #ifdef __cplusplus
@@ -263,6 +263,7 @@ typedef struct
 
 	byte           *outfile;	/* target stream */
 	int             size;
+	qboolean        overflow;
 } my_destination_mgr;
 
 typedef my_destination_mgr *my_dest_ptr;
@@ -279,6 +280,7 @@ static void init_destination(j_compress_ptr cinfo)
 
 	dest->pub.next_output_byte = dest->outfile;
 	dest->pub.free_in_buffer = dest->size;
+	dest->overflow = qfalse;
 }
 
 
@@ -309,12 +311,13 @@ static          boolean empty_output_buffer(j_compress_ptr cinfo)
 {
 	my_dest_ptr     dest = (my_dest_ptr) cinfo->dest;
 
-	jpeg_destroy_compress(cinfo);
-
-	// Make crash fatal or we would probably leak memory.
-	ri.Error(ERR_FATAL, "Output buffer for encoded JPEG image has insufficient size of %d bytes", dest->size);
+	// the video recorder calls this from its own threads, so don't call ri.Error here.
+	// Discard the output and let SaveJPGToBuffer report the failure
+	dest->overflow = qtrue;
+	dest->pub.next_output_byte = dest->outfile;
+	dest->pub.free_in_buffer = dest->size;
 
-	return FALSE;
+	return TRUE;
 }
 
 /*
@@ -366,7 +369,7 @@ static void jpegDest(j_compress_ptr cinfo, byte * outfile, int size)
 SaveJPGToBuffer
 
 Encodes JPEG from image in image_buffer and writes to buffer.
-Expects RGB input data
+Expects RGB input data, returns 0 if the JPEG does not fit into buffer
 =================
 */
 int SaveJPGToBuffer(byte * buffer, size_t bufSize, int quality, int image_width, int image_height, byte * image_buffer)
@@ -426,7 +429,10 @@ int SaveJPGToBuffer(byte * buffer, size_t bufSize, int quality, int image_width,
 	jpeg_finish_compress(&cinfo);
 
 	dest = (my_dest_ptr) cinfo.dest;
-	outcount = dest->size - dest->pub.free_in_buffer;
+	if(dest->overflow)
+		outcount = 0;
+	else
+		outcount = dest->size - dest->pub.free_in_buffer;
 
 	/* Step 7: release JPEG compression object */
 	jpeg_destroy_compress(&cinfo);
@@ -444,7 +450,10 @@ void SaveJPG(char *filename, int quality, int image_width, int image_height, byt
 	out = ri.Hunk_AllocateTempMemory(bufSize);
 
 	bufSize = SaveJPGToBuffer(out, bufSize, quality, image_width, image_height, image_buffer);
-	ri.FS_WriteFile(filename, out, bufSize);
+	if(bufSize)
+		ri.FS_WriteFile(filename, out, bufSize);
+	else
+		ri.Printf(PRINT_WARNING, "WARNING: SaveJPG: %s does not fit into %d bytes\n", filename, image_width * image_height * 3);
 
 	ri.Hunk_FreeTempMemory(out);
 }
@@ -62,6 +62,7 @@ cvar_t         *r_znear;
 cvar_t         *r_zfar;
 
 cvar_t         *r_smp;
+cvar_t         *r_smpFrames;
 cvar_t         *r_showSmp;
 cvar_t         *r_skipBackEnd;
 cvar_t         *r_skipLightBuffer;
@@ -101,6 +102,14 @@ cvar_t         *r_compressNormalMaps;
 cvar_t         *r_heatHazeFix;
 cvar_t         *r_noMarksOnTrisurfs;
 cvar_t         *r_recompileShaders;
+cvar_t         *r_lazyShaders;
+cvar_t         *r_lazyShaderCompiles;
+cvar_t         *r_clusteredLighting;
+cvar_t         *r_shadowCache;
+cvar_t         *r_shadowCacheSize;
+cvar_t         *r_instancing;
+cvar_t         *r_leafArrayCulling;
+cvar_t         *r_cubeProbes;
 
 cvar_t         *r_ext_compressed_textures;
 cvar_t         *r_ext_occlusion_query;
@@ -258,7 +267,10 @@ cvar_t         *r_vboTriangles;
 cvar_t         *r_vboShadows;
 cvar_t         *r_vboLighting;
 cvar_t         *r_vboModels;
+cvar_t         *r_cacheInteractions;
+cvar_t         *r_cacheMaterials;
 cvar_t         *r_vboOptimizeVertices;
+cvar_t         *r_vboOptimizeIndexes;
 cvar_t         *r_vboVertexSkinning;
 cvar_t         *r_vboDeformVertexes;
 cvar_t         *r_vboSmoothNormals;
@@ -275,6 +287,7 @@ cvar_t         *r_parallaxMapping;
 cvar_t         *r_parallaxDepthScale;
 
 cvar_t         *r_dynamicBspOcclusionCulling;
+cvar_t         *r_softwareOcclusionCulling;
 cvar_t         *r_dynamicEntityOcclusionCulling;
 cvar_t         *r_dynamicLightOcclusionCulling;
 cvar_t         *r_chcMaxPrevInvisNodesBatchSize;
@@ -292,6 +305,7 @@ cvar_t         *r_hdrLightmap;
 cvar_t         *r_hdrLightmapExposure;
 cvar_t         *r_hdrLightmapGamma;
 cvar_t         *r_hdrLightmapCompensate;
+cvar_t         *r_hdrLightmapDDS;
 cvar_t         *r_hdrToneMappingOperator;
 cvar_t         *r_hdrGamma;
 cvar_t         *r_hdrDebug;
@@ -1037,6 +1051,114 @@ static void R_GenerateMaterialFile_f(void)
 
 //============================================================================
 
+/*
+==================
+VIDEO FRAME READBACK
+
+glReadPixels into a pixel pack buffer returns right away, the frame is mapped
+VIDEO_READBACK_FRAMES - 1 frames later when the GPU is long done with it.
+The client gets the raw RGB pixels and encodes them on its own threads.
+==================
+*/
+
+#define VIDEO_READBACK_FRAMES	3
+
+typedef struct
+{
+	GLuint          pbo;
+	GLsync          fence;
+	int             size;
+	byte           *captureBuffer;
+} videoReadback_t;
+
+static videoReadback_t videoReadbacks[VIDEO_READBACK_FRAMES];
+static int      videoReadbackHead;
+static int      videoReadbackTail;
+
+/*
+==================
+RB_RetireVideoFrame
+
+Maps the oldest pending readback and hands it to the client
+==================
+*/
+static void RB_RetireVideoFrame(void)
+{
+	videoReadback_t *readback;
+	const byte     *pixels;
+
+	readback = &videoReadbacks[videoReadbackTail % VIDEO_READBACK_FRAMES];
+	videoReadbackTail++;
+
+	glClientWaitSync(readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	glDeleteSync(readback->fence);
+	readback->fence = NULL;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+
+	pixels = (const byte *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readback->size, GL_MAP_READ_BIT);
+	if(pixels)
+	{
+		// recording may have stopped while the frame was in flight
+		if(ri.CL_VideoRecording())
+		{
+			// gamma correct
+			if((tr.overbrightBits > 0) && glConfig.deviceSupportsGamma)
+			{
+				Com_Memcpy(readback->captureBuffer, pixels, readback->size);
+				R_GammaCorrect(readback->captureBuffer, readback->size);
+				ri.CL_WriteAVIVideoFrame(readback->captureBuffer, readback->size);
+			}
+			else
+			{
+				ri.CL_WriteAVIVideoFrame(pixels, readback->size);
+			}
+		}
+
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/*
+==================
+RB_FinishVideoFrames
+
+Hands all pending readbacks to the client
+==================
+*/
+void RB_FinishVideoFrames(void)
+{
+	while(videoReadbackTail != videoReadbackHead)
+	{
+		RB_RetireVideoFrame();
+	}
+}
+
+/*
+==================
+R_ShutdownVideoFrames
+==================
+*/
+static void R_ShutdownVideoFrames(void)
+{
+	int             i;
+
+	RB_FinishVideoFrames();
+
+	for(i = 0; i < VIDEO_READBACK_FRAMES; i++)
+	{
+		if(videoReadbacks[i].pbo)
+		{
+			glDeleteBuffers(1, &videoReadbacks[i].pbo);
+		}
+	}
+
+	Com_Memset(videoReadbacks, 0, sizeof(videoReadbacks));
+	videoReadbackHead = videoReadbackTail = 0;
+}
+
 /*
 ==================
 RB_TakeVideoFrameCmd
@@ -1045,8 +1167,8 @@ RB_TakeVideoFrameCmd
 const void     *RB_TakeVideoFrameCmd(const void *data)
 {
 	const videoFrameCommand_t *cmd;
+	videoReadback_t *readback;
 	int             frameSize;
-	int             i;
 
 	cmd = (const videoFrameCommand_t *)data;
 
@@ -1054,32 +1176,39 @@ const void     *RB_TakeVideoFrameCmd(const void *data)
 	// video recording
 	if(ri.CL_VideoRecording())
 	{
-		glReadPixels(0, 0, cmd->width, cmd->height, GL_RGB, GL_UNSIGNED_BYTE, cmd->captureBuffer);
-
-		// gamma correct
-		if((tr.overbrightBits > 0) && glConfig.deviceSupportsGamma)
+		if(videoReadbackHead - videoReadbackTail == VIDEO_READBACK_FRAMES)
 		{
-			R_GammaCorrect(cmd->captureBuffer, cmd->width * cmd->height * 4);
+			RB_RetireVideoFrame();
 		}
 
-		if(cmd->motionJpeg)
+		readback = &videoReadbacks[videoReadbackHead % VIDEO_READBACK_FRAMES];
+		videoReadbackHead++;
+
+		// rows are tightly packed, the client pads them to AVI_LINE_PADDING when it encodes the frame
+		frameSize = cmd->width * cmd->height * 3;
+
+		if(!readback->pbo)
 		{
-			frameSize = SaveJPGToBuffer(cmd->encodeBuffer, cmd->width * cmd->height * 3, 90, cmd->width, cmd->height, cmd->captureBuffer);
-			ri.CL_WriteAVIVideoFrame(cmd->encodeBuffer, frameSize);
+			glGenBuffers(1, &readback->pbo);
 		}
-		else
-		{
-			frameSize = cmd->width * cmd->height;
 
-			for(i = 0; i < frameSize; i++)	// Pack to 24bpp and swap R and B
-			{
-				cmd->encodeBuffer[i * 3] = cmd->captureBuffer[i * 3 + 2];
-				cmd->encodeBuffer[i * 3 + 1] = cmd->captureBuffer[i * 3 + 1];
-				cmd->encodeBuffer[i * 3 + 2] = cmd->captureBuffer[i * 3];
-			}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
 
-			ri.CL_WriteAVIVideoFrame(cmd->encodeBuffer, frameSize * 3);
+		if(readback->size != frameSize)
+		{
+			glBufferData(GL_PIXEL_PACK_BUFFER, frameSize, NULL, GL_STREAM_READ);
+			readback->size = frameSize;
 		}
+
+		readback->captureBuffer = cmd->captureBuffer;
+
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, cmd->width, cmd->height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+		readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 	}
 
 	return (const void *)(cmd + 1);
@@ -1309,7 +1438,7 @@ void GfxInfo_f(void)
 
 	if(glConfig.smpActive)
 	{
-		ri.Printf(PRINT_ALL, "Using dual processor acceleration\n");
+		ri.Printf(PRINT_ALL, "Using multi processor acceleration with %i frames\n", r_smpFrames->integer);
 	}
 
 	if(r_finish->integer)
@@ -1383,6 +1512,14 @@ void R_Register(void)
 	r_heatHazeFix = ri.Cvar_Get("r_heatHazeFix", "0", CVAR_CHEAT | CVAR_SHADER);
 	r_noMarksOnTrisurfs = ri.Cvar_Get("r_noMarksOnTrisurfs", "1", CVAR_CHEAT);
 	r_recompileShaders = ri.Cvar_Get( "r_recompileShaders", "0", CVAR_ARCHIVE );
+	r_lazyShaders = ri.Cvar_Get( "r_lazyShaders", "1", CVAR_ARCHIVE | CVAR_LATCH );
+	r_lazyShaderCompiles = ri.Cvar_Get( "r_lazyShaderCompiles", "2", CVAR_ARCHIVE );
+	r_clusteredLighting = ri.Cvar_Get("r_clusteredLighting", "1", CVAR_ARCHIVE | CVAR_LATCH);
+	r_shadowCache = ri.Cvar_Get("r_shadowCache", "1", CVAR_ARCHIVE | CVAR_LATCH);
+	r_shadowCacheSize = ri.Cvar_Get("r_shadowCacheSize", "96", CVAR_ARCHIVE | CVAR_LATCH);
+	r_instancing = ri.Cvar_Get("r_instancing", "1", CVAR_ARCHIVE | CVAR_LATCH);
+	r_leafArrayCulling = ri.Cvar_Get("r_leafArrayCulling", "1", CVAR_ARCHIVE);
+	r_cubeProbes = ri.Cvar_Get("r_cubeProbes", "1", CVAR_ARCHIVE);
 
 	r_forceFog = ri.Cvar_Get("r_forceFog", "0", CVAR_CHEAT /* | CVAR_LATCH */ );
 	AssertCvarRange(r_forceFog, 0.0f, 1.0f, qfalse);
@@ -1399,6 +1536,8 @@ void R_Register(void)
 	AssertCvarRange(r_forceAmbient, 0.0f, 0.3f, qfalse);
 
 	r_smp = ri.Cvar_Get("r_smp", "0", CVAR_ARCHIVE | CVAR_LATCH);
+	r_smpFrames = ri.Cvar_Get("r_smpFrames", "2", CVAR_ARCHIVE | CVAR_LATCH);
+	AssertCvarRange(r_smpFrames, 2, SMP_FRAMES, qtrue);
 
 	// temporary latched variables that can only change over a restart
 	r_displayRefresh = ri.Cvar_Get("r_displayRefresh", "0", CVAR_LATCH);
@@ -1461,9 +1600,12 @@ void R_Register(void)
 	r_vboLighting = ri.Cvar_Get("r_vboLighting", "1", CVAR_CHEAT);
 	r_vboModels = ri.Cvar_Get("r_vboModels", "1", CVAR_CHEAT);
 	r_vboOptimizeVertices = ri.Cvar_Get("r_vboOptimizeVertices", "1", CVAR_CHEAT | CVAR_LATCH);
+	r_vboOptimizeIndexes = ri.Cvar_Get("r_vboOptimizeIndexes", "1", CVAR_CHEAT | CVAR_LATCH);
 	r_vboVertexSkinning = ri.Cvar_Get("r_vboVertexSkinning", "1", CVAR_ARCHIVE | CVAR_LATCH);
 	r_vboDeformVertexes = ri.Cvar_Get("r_vboDeformVertexes", "0", CVAR_ARCHIVE | CVAR_LATCH);
 	r_vboSmoothNormals = ri.Cvar_Get("r_vboSmoothNormals", "1", CVAR_ARCHIVE | CVAR_LATCH);
+	r_cacheInteractions = ri.Cvar_Get("r_cacheInteractions", "1", CVAR_ARCHIVE);
+	r_cacheMaterials = ri.Cvar_Get("r_cacheMaterials", "1", CVAR_ARCHIVE);
 
 #if defined(USE_BSP_CLUSTERSURFACE_MERGING)
 	r_mergeClusterSurfaces = ri.Cvar_Get("r_mergeClusterSurfaces", "0", CVAR_CHEAT);
@@ -1473,6 +1615,7 @@ void R_Register(void)
 #endif
 
 	r_dynamicBspOcclusionCulling = ri.Cvar_Get("r_dynamicBspOcclusionCulling", "0", CVAR_ARCHIVE);
+	r_softwareOcclusionCulling = ri.Cvar_Get("r_softwareOcclusionCulling", "0", CVAR_ARCHIVE);
 	r_dynamicEntityOcclusionCulling = ri.Cvar_Get("r_dynamicEntityOcclusionCulling", "0", CVAR_CHEAT);
 	r_dynamicLightOcclusionCulling = ri.Cvar_Get("r_dynamicLightOcclusionCulling", "0", CVAR_CHEAT);
 	r_chcMaxPrevInvisNodesBatchSize = ri.Cvar_Get("r_chcMaxPrevInvisNodesBatchSize", "50", CVAR_CHEAT);
@@ -1497,6 +1640,7 @@ void R_Register(void)
 	r_hdrLightmapExposure = ri.Cvar_Get("r_hdrLightmapExposure", "1.0", CVAR_CHEAT | CVAR_LATCH);
 	r_hdrLightmapGamma = ri.Cvar_Get("r_hdrLightmapGamma", "1.7", CVAR_CHEAT | CVAR_LATCH);
 	r_hdrLightmapCompensate = ri.Cvar_Get("r_hdrLightmapCompensate", "1.0", CVAR_CHEAT | CVAR_LATCH);
+	r_hdrLightmapDDS = ri.Cvar_Get("r_hdrLightmapDDS", "1", CVAR_ARCHIVE | CVAR_LATCH);
 	r_hdrToneMappingOperator = ri.Cvar_Get("r_hdrToneMappingOperator", "1", CVAR_CHEAT | CVAR_SHADER);
 	r_hdrGamma = ri.Cvar_Get("r_hdrGamma", "1.1", CVAR_CHEAT | CVAR_SHADER);
 	r_hdrDebug = ri.Cvar_Get("r_hdrDebug", "0", CVAR_CHEAT);
@@ -1759,21 +1903,18 @@ void R_Init(void)
 
 	R_Register();
 
-	backEndData[0] = (backEndData_t *) ri.Hunk_Alloc(sizeof(*backEndData[0]), h_low);
-	backEndData[0]->polys = (srfPoly_t *) ri.Hunk_Alloc(r_maxPolys->integer * sizeof(srfPoly_t), h_low);
-	backEndData[0]->polyVerts = (polyVert_t *) ri.Hunk_Alloc(r_maxPolyVerts->integer * sizeof(polyVert_t), h_low);
-	backEndData[0]->polybuffers = (srfPolyBuffer_t *) ri.Hunk_Alloc(r_maxPolys->integer * sizeof(srfPolyBuffer_t), h_low);
-	
-	if(r_smp->integer)
+	for(i = 0; i < SMP_FRAMES; i++)
 	{
-		backEndData[1] = (backEndData_t *) ri.Hunk_Alloc(sizeof(*backEndData[1]), h_low);
-		backEndData[1]->polys = (srfPoly_t *) ri.Hunk_Alloc(r_maxPolys->integer * sizeof(srfPoly_t), h_low);
-		backEndData[1]->polyVerts = (polyVert_t *) ri.Hunk_Alloc(r_maxPolyVerts->integer * sizeof(polyVert_t), h_low);
-		backEndData[1]->polybuffers = (srfPolyBuffer_t *) ri.Hunk_Alloc(r_maxPolys->integer * sizeof(srfPolyBuffer_t), h_low);
-	}
-	else
-	{
-		backEndData[1] = NULL;
+		if(i > 0 && (!r_smp->integer || i >= r_smpFrames->integer))
+		{
+			backEndData[i] = NULL;
+			continue;
+		}
+
+		backEndData[i] = (backEndData_t *) ri.Hunk_Alloc(sizeof(*backEndData[i]), h_low);
+		backEndData[i]->polys = (srfPoly_t *) ri.Hunk_Alloc(r_maxPolys->integer * sizeof(srfPoly_t), h_low);
+		backEndData[i]->polyVerts = (polyVert_t *) ri.Hunk_Alloc(r_maxPolyVerts->integer * sizeof(polyVert_t), h_low);
+		backEndData[i]->polybuffers = (srfPolyBuffer_t *) ri.Hunk_Alloc(r_maxPolys->integer * sizeof(srfPolyBuffer_t), h_low);
 	}
 
 	R_ToggleSmpFrame();
@@ -2083,6 +2224,7 @@ void RE_Shutdown(qboolean destroyWindow)
 	{
 		R_SyncRenderThread();
 
+		R_ShutdownVideoFrames();
 		R_ShutdownImages();
 		R_ShutdownVBOs();
 		R_ShutdownFBOs();
@@ -2310,6 +2452,8 @@ refexport_t* GetRefAPI(int apiVersion, refimport_t * rimp)
 
 	// XreaL BEGIN
 	re.TakeVideoFrame = RE_TakeVideoFrame;
+	re.FinishVideoFrames = RE_FinishVideoFrames;
+	re.SaveJPGToBuffer = SaveJPGToBuffer;
 
 #if !defined(COMPAT_ET)
 	re.TakeScreenshotPNG = RB_TakeScreenshotPNG;
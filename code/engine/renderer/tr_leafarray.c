@@ -0,0 +1,274 @@
+/*
+===========================================================================
+Copyright (C) 2006-2011 Robert Beckebans <trebor_7@users.sourceforge.net>
+
+This file is part of XreaL source code.
+
+XreaL source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+XreaL source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with XreaL source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// tr_leafarray.c -- flat array of the world leafs for culling without walking the BSP tree
+#include "tr_local.h"
+
+/*
+Every leaf that has surfaces gets a slot in w->leafArrayNodes, in the order
+a front side first walk of the BSP tree would reach it. The bounds of four
+consecutive leafs are stored as one leafBoundsBlock_t so R_CullLeafArray
+tests a frustum plane or a box against four leafs at once.
+
+The recursive walks in tr_world.cpp and tr_bsp.c are still used when
+r_leafArrayCulling is 0 and by the coherent hierarchical culling.
+*/
+
+static int      numLeafArrayNodes;
+
+/*
+=================
+R_CountLeafArrayNodes
+=================
+*/
+static int R_CountLeafArrayNodes(world_t * w)
+{
+	int             i, numLeafs;
+	bspNode_t      *node;
+
+	numLeafs = 0;
+	for(i = w->numDecisionNodes, node = w->nodes + w->numDecisionNodes; i < w->numnodes; i++, node++)
+	{
+		if(node->contents != -1 && node->numMarkSurfaces)
+		{
+			numLeafs++;
+		}
+	}
+
+	return numLeafs;
+}
+
+/*
+=================
+R_AddLeafArrayNodes_r
+=================
+*/
+static void R_AddLeafArrayNodes_r(world_t * w, bspNode_t * node)
+{
+	leafBoundsBlock_t *block;
+	int             lane, j;
+
+	while(node->contents == -1)
+	{
+		R_AddLeafArrayNodes_r(w, node->children[0]);
+		node = node->children[1];
+	}
+
+	if(!node->numMarkSurfaces)
+	{
+		return;
+	}
+
+	block = &w->leafArrayBounds[numLeafArrayNodes >> 2];
+	lane = numLeafArrayNodes & 3;
+
+	for(j = 0; j < 3; j++)
+	{
+		block->mins[j][lane] = node->mins[j];
+		block->maxs[j][lane] = node->maxs[j];
+	}
+
+	w->leafArrayNodes[numLeafArrayNodes++] = node;
+}
+
+/*
+=================
+R_CreateLeafArray
+=================
+*/
+void R_CreateLeafArray(world_t * w)
+{
+	int             i, j, numLeafs;
+
+	w->numLeafArrayBlocks = 0;
+	w->leafArrayBounds = NULL;
+	w->leafArrayNodes = NULL;
+	w->leafArrayCulled = NULL;
+
+	numLeafs = R_CountLeafArrayNodes(w);
+	if(!numLeafs)
+	{
+		return;
+	}
+
+	w->numLeafArrayBlocks = (numLeafs + 3) >> 2;
+	w->leafArrayBounds = ri.Hunk_Alloc(w->numLeafArrayBlocks * sizeof(leafBoundsBlock_t), h_low);
+	w->leafArrayNodes = ri.Hunk_Alloc(w->numLeafArrayBlocks * 4 * sizeof(bspNode_t *), h_low);
+	w->leafArrayCulled = ri.Hunk_Alloc(w->numLeafArrayBlocks * 4 * sizeof(bspNode_t *), h_low);
+
+	// unused slots of the last block never intersect anything
+	for(i = numLeafs; i < w->numLeafArrayBlocks * 4; i++)
+	{
+		for(j = 0; j < 3; j++)
+		{
+			w->leafArrayBounds[i >> 2].mins[j][i & 3] = 99999;
+			w->leafArrayBounds[i >> 2].maxs[j][i & 3] = -99999;
+		}
+
+		w->leafArrayNodes[i] = NULL;
+	}
+
+	numLeafArrayNodes = 0;
+	R_AddLeafArrayNodes_r(w, w->nodes);
+
+	ri.Printf(PRINT_DEVELOPER, "...%i leafs in %i leaf array blocks\n", numLeafArrayNodes, w->numLeafArrayBlocks);
+}
+
+/*
+=================
+R_CullLeafArrayBlock
+
+Returns a bit for each leaf of the block that is on the front side of
+all planes and touches the box mins / maxs
+=================
+*/
+static int R_CullLeafArrayBlock(const leafBoundsBlock_t * block, const cplane_t * planes, int numPlanes, const vec3_t mins, const vec3_t maxs)
+{
+	int             i;
+
+#if id386_sse
+	__m128          _mask, _d;
+
+	_mask = _mm_cmpeq_ps(_mm_setzero_ps(), _mm_setzero_ps());
+
+	if(mins)
+	{
+		for(i = 0; i < 3; i++)
+		{
+			_mask = _mm_and_ps(_mask, _mm_cmple_ps(_mm_loadu_ps(block->mins[i]), _mm_set1_ps(maxs[i])));
+			_mask = _mm_and_ps(_mask, _mm_cmpge_ps(_mm_loadu_ps(block->maxs[i]), _mm_set1_ps(mins[i])));
+		}
+	}
+
+	for(i = 0; i < numPlanes; i++)
+	{
+		const cplane_t *p = &planes[i];
+
+		// distance of the box corner farthest along the plane normal
+		_d = _mm_mul_ps(_mm_set1_ps(p->normal[0]), _mm_loadu_ps(p->normal[0] >= 0 ? block->maxs[0] : block->mins[0]));
+		_d = _mm_add_ps(_d, _mm_mul_ps(_mm_set1_ps(p->normal[1]), _mm_loadu_ps(p->normal[1] >= 0 ? block->maxs[1] : block->mins[1])));
+		_d = _mm_add_ps(_d, _mm_mul_ps(_mm_set1_ps(p->normal[2]), _mm_loadu_ps(p->normal[2] >= 0 ? block->maxs[2] : block->mins[2])));
+
+		_mask = _mm_and_ps(_mask, _mm_cmpge_ps(_d, _mm_set1_ps(p->dist)));
+	}
+
+	return _mm_movemask_ps(_mask);
+#else
+	int             lane, bits;
+	float           d;
+
+	bits = 0;
+	for(lane = 0; lane < 4; lane++)
+	{
+		if(mins)
+		{
+			for(i = 0; i < 3; i++)
+			{
+				if(block->mins[i][lane] > maxs[i] || block->maxs[i][lane] < mins[i])
+				{
+					break;
+				}
+			}
+
+			if(i < 3)
+			{
+				continue;
+			}
+		}
+
+		for(i = 0; i < numPlanes; i++)
+		{
+			const cplane_t *p = &planes[i];
+
+			d = p->normal[0] * (p->normal[0] >= 0 ? block->maxs[0][lane] : block->mins[0][lane]) +
+				p->normal[1] * (p->normal[1] >= 0 ? block->maxs[1][lane] : block->mins[1][lane]) +
+				p->normal[2] * (p->normal[2] >= 0 ? block->maxs[2][lane] : block->mins[2][lane]);
+
+			if(d < p->dist)
+			{
+				break;
+			}
+		}
+
+		if(i == numPlanes)
+		{
+			bits |= 1 << lane;
+		}
+	}
+
+	return bits;
+#endif
+}
+
+/*
+=================
+R_CullLeafArray
+
+Collects the leafs of the world that are on the front side of all planes
+and touch the box mins / maxs into w->leafArrayCulled.
+planes and mins / maxs may be NULL, if pvs is set only leafs marked by
+R_MarkLeaves are collected.
+Returns the number of collected leafs.
+=================
+*/
+int R_CullLeafArray(world_t * w, const cplane_t * planes, int numPlanes, const vec3_t mins, const vec3_t maxs, qboolean pvs)
+{
+	int             i, lane, bits, numLeafs;
+	bspNode_t      *node;
+
+	if(!planes)
+	{
+		numPlanes = 0;
+	}
+
+	numLeafs = 0;
+	for(i = 0; i < w->numLeafArrayBlocks; i++)
+	{
+		bits = R_CullLeafArrayBlock(&w->leafArrayBounds[i], planes, numPlanes, mins, maxs);
+
+		for(lane = 0; bits; lane++, bits >>= 1)
+		{
+			if(!(bits & 1))
+			{
+				continue;
+			}
+
+			node = w->leafArrayNodes[i * 4 + lane];
+
+			if(!node)
+			{
+				continue;
+			}
+
+			// only chase the node pointer for leafs that survived the bounds tests
+			if(pvs && node->visCounts[tr.visIndex] != tr.visCounts[tr.visIndex])
+			{
+				continue;
+			}
+
+			w->leafArrayCulled[numLeafs++] = node;
+		}
+	}
+
+	tr.pc.c_leafArrayBlocks += w->numLeafArrayBlocks;
+
+	return numLeafs;
+}
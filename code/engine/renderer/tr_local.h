@@ -61,9 +61,10 @@ typedef unsigned short glIndex_t;
 #define BUFFER_OFFSET(i) ((char *)NULL + (i))
 
 // everything that is needed by the backend needs
-// to be double buffered to allow it to run in
-// parallel on a dual cpu machine
-#define	SMP_FRAMES		2
+// to be buffered per frame to allow it to run in
+// parallel on a multi cpu machine, r_smpFrames selects
+// how many of these frames are actually used
+#define	SMP_FRAMES		3
 
 #define	MAX_SHADERS				(1 << 12)
 #define SHADERS_MASK			(MAX_SHADERS -1)
@@ -111,7 +112,13 @@ typedef enum
 	RSPEEDS_SHADING_TIMES,
 	RSPEEDS_CHC,
 	RSPEEDS_NEAR_FAR,
-	RSPEEDS_DECALS
+	RSPEEDS_DECALS,
+	RSPEEDS_SMP,
+	RSPEEDS_SOFTWARE_OCCLUSION,
+	RSPEEDS_GLSL,
+	RSPEEDS_LIGHT_CLUSTERS,
+	RSPEEDS_SHADOW_CACHE,
+	RSPEEDS_INSTANCING
 } renderSpeeds_t;
 
 
@@ -342,6 +349,7 @@ typedef struct trRefLight_s
 
 	// local
 	qboolean        isStatic;	// loaded from the BSP entities lump
+	int             worldLightNum;	// index into tr.world->lights, only used by static lights
 	qboolean        noRadiosity;	// this is a pure realtime light that was not considered by XMap2
 	qboolean        additive;	// texture detail is lost tho when the lightmap is dark
 	vec3_t          origin;		// l.origin + rotated l.center
@@ -588,6 +596,8 @@ typedef struct IBO_s
 	uint32_t        indexesSize;	// amount of memory data allocated for all triangles in bytes
 	uint32_t		indexesNum;
 
+	float           acmr;			// average vertex cache misses per triangle
+
 //  uint32_t        ofsIndexes;
 } IBO_t;
 
@@ -819,12 +829,25 @@ typedef struct
 } expOperation_t;
 
 #define MAX_EXPRESSION_OPS	32
+
+#define EXP_DEPENDS_TIME	1	// changes every frame
+#define EXP_DEPENDS_ENTITY	2	// reads the parm registers of the current entity or light
+
 typedef struct
 {
 	expOperation_t  ops[MAX_EXPRESSION_OPS];
 	uint8_t         numOps;
 
 	qboolean        active;		// no parsing problems
+	int             dependencies;	// EXP_DEPENDS_* of the ops left by R_CompileExpression
+
+	// last result of RB_EvalExpression
+	qboolean        cacheValid;
+	int             cacheFrame;
+	float           cacheTime;
+	const void     *cacheEntity;
+	const void     *cacheLight;
+	float           cacheValue;
 } expression_t;
 
 typedef struct
@@ -1356,6 +1379,9 @@ typedef struct shaderProgram_s
 	int32_t         u_ShadowMap2;
 	int32_t         u_ShadowMap3;
 	int32_t         u_ShadowMap4;
+	int32_t         u_ClusterGridMap;
+	int32_t         u_ClusterIndexMap;
+	int32_t         u_ClusterLightMap;
 	int32_t         u_EnvironmentMap0;
 	int32_t         u_EnvironmentMap1;
 
@@ -1433,6 +1459,12 @@ typedef struct shaderProgram_s
 	GLint           u_ShadowParallelSplitDistances;
 	vec4_t          t_ShadowParallelSplitDistances;
 
+	GLint           u_ClusterTileScale;
+	vec4_t          t_ClusterTileScale;
+
+	GLint           u_ClusterDepthScale;
+	vec4_t          t_ClusterDepthScale;
+
 	int32_t         u_RefractionIndex;
 	float           t_RefractionIndex;
 
@@ -1523,6 +1555,8 @@ typedef struct shaderProgram_s
 
 	int32_t         u_BoneMatrix;
 
+	int32_t         u_InstanceData;
+
 	int32_t         u_Time;
 	float           t_Time;
 
@@ -1986,6 +2020,44 @@ static ID_INLINE void GLSL_SetUniform_ShadowParallelSplitDistances(shaderProgram
 	glUniform4f(program->u_ShadowParallelSplitDistances, v[0], v[1], v[2], v[3]);
 }
 
+static ID_INLINE void GLSL_SetUniform_ClusterTileScale(shaderProgram_t * program, const vec4_t v)
+{
+#if defined(USE_UNIFORM_FIREWALL)
+	if(Vector4Compare(program->t_ClusterTileScale, v))
+		return;
+
+	Vector4Copy(v, program->t_ClusterTileScale);
+#endif
+
+#if defined(LOG_GLSL_UNIFORMS)
+	if(r_logFile->integer)
+	{
+		GLimp_LogComment(va("--- GLSL_SetUniform_ClusterTileScale( program = %s, scale = ( %5.3f, %5.3f, %5.3f, %5.3f ) ) ---\n", program->name, v[0], v[1], v[2], v[3]));
+	}
+#endif
+
+	glUniform4f(program->u_ClusterTileScale, v[0], v[1], v[2], v[3]);
+}
+
+static ID_INLINE void GLSL_SetUniform_ClusterDepthScale(shaderProgram_t * program, const vec4_t v)
+{
+#if defined(USE_UNIFORM_FIREWALL)
+	if(Vector4Compare(program->t_ClusterDepthScale, v))
+		return;
+
+	Vector4Copy(v, program->t_ClusterDepthScale);
+#endif
+
+#if defined(LOG_GLSL_UNIFORMS)
+	if(r_logFile->integer)
+	{
+		GLimp_LogComment(va("--- GLSL_SetUniform_ClusterDepthScale( program = %s, scale = ( %5.3f, %5.3f, %5.3f, %5.3f ) ) ---\n", program->name, v[0], v[1], v[2], v[3]));
+	}
+#endif
+
+	glUniform4f(program->u_ClusterDepthScale, v[0], v[1], v[2], v[3]);
+}
+
 static ID_INLINE void GLSL_SetUniform_RefractionIndex(shaderProgram_t * program, float value)
 {
 #if defined(USE_UNIFORM_FIREWALL)
@@ -2489,6 +2561,8 @@ typedef struct
 
 	int             numInteractions;
 	struct interaction_s *interactions;
+
+	struct lightClusters_s *lightClusters;	// lights shaded by the clustered deferred pass, or NULL
 } viewParms_t;
 
 
@@ -2542,6 +2616,8 @@ typedef struct drawSurf_s
 	int16_t			fogNum;
 
 	surfaceType_t  *surface;	// any of surface*_t
+
+	int             numInstances;	// > 1 on the first surface of a run that can be drawn instanced
 } drawSurf_t;
 
 typedef enum
@@ -3013,11 +3089,32 @@ typedef struct
 // ydnar: optimization
 #define WORLD_MAX_SKY_NODES 32
 
+#define MAX_OCCLUDER_VERTS	32
+
+// large opaque convex world face rendered into the software occlusion buffer
+typedef struct
+{
+	vec3_t          bounds[2];
+	cplane_t        plane;
+	int             firstVert;	// into world_t::occluderVerts
+	int             numVerts;	// convex polygon outline
+	bspNode_t      *leaf;		// any leaf referencing the face, for PVS rejection
+} occluder_t;
+
+// bounds of four consecutive leafs of the leaf array,
+// stored as structure of arrays for SSE culling
+typedef struct
+{
+	float           mins[3][4];
+	float           maxs[3][4];
+} leafBoundsBlock_t;
+
 typedef struct
 {
 	char            name[MAX_QPATH];	// ie: maps/tim_dm2.bsp
 	char            baseName[MAX_QPATH];	// ie: tim_dm2
 
+	uint32_t        checksum;	// of the BSP file, keys the cache files derived from it
 	uint32_t        dataSize;
 
 	int             numShaders;
@@ -3036,6 +3133,12 @@ typedef struct
 	int             numSkyNodes;
 	bspNode_t     **skyNodes;	// ydnar: don't walk the entire bsp when rendering sky
 
+	// leafs with surfaces in BSP walk order, see tr_leafarray.c
+	int             numLeafArrayBlocks;
+	leafBoundsBlock_t *leafArrayBounds;
+	bspNode_t     **leafArrayNodes;	// numLeafArrayBlocks * 4, unused slots are NULL
+	bspNode_t     **leafArrayCulled;	// output of R_CullLeafArray
+
 	int             numVerts;
 	srfVert_t      *verts;
 	int             redundantVertsCalculationNeeded;
@@ -3048,6 +3151,10 @@ typedef struct
 	int             numTriangles;
 	srfTriangle_t  *triangles;
 
+	int             numOccluders;
+	occluder_t     *occluders;
+	vec3_t         *occluderVerts;
+
 //  int             numAreas;
 //  bspArea_t      *areas;
 
@@ -3490,6 +3597,7 @@ typedef struct
 
 	int				c_nodes;
 	int             c_leafs;
+	int             c_leafArrayBlocks;
 
 	int             c_slights;
 	int             c_slightSurfaces;
@@ -3507,7 +3615,17 @@ typedef struct
 	int				c_occlusionQueriesSaved;
 	int             c_CHCTime;
 
+	int             c_occluders, c_occluderTriangles;
+	int             c_occlusionBufferTests, c_occlusionBufferCulled;
+	int             c_occlusionBufferTime;
+
+	int             c_clusterViews, c_clusterLights, c_clusterIndexes, c_clusterOverflows;
+
+	int             c_instanceRuns, c_instanceSurfaces;
+
 	int             c_decalProjectors, c_decalTestSurfaces, c_decalClipSurfaces, c_decalSurfaces, c_decalSurfacesCreated;
+
+	int             c_smpStalls, c_smpStallMsec, c_smpFlushes;
 } frontEndCounters_t;
 
 #define	FOG_TABLE_SIZE		256
@@ -3622,9 +3740,52 @@ typedef struct
 	int				c_multiDrawPrimitives;
 	int				c_multiVboIndexes;
 
+	int             c_glslCompiles;
+	int             c_glslCompileTime;
+	int             c_glslFallbacks;
+
+	int             c_clusterPasses;
+
+	int             c_shadowCacheHits;
+	int             c_shadowCacheMisses;
+	int             c_shadowCacheComposites;
+	int             c_shadowCacheEvictions;
+	int             c_shadowCacheUncached;
+
+	int             c_instancedDraws;
+	int             c_instances;
+
 	int             msec;		// total msec for backend run
 } backEndCounters_t;
 
+// static lights keep the shadow cube map of their world casters in
+// a fixed pool of cube maps for each shadow LOD
+#define MAX_SHADOWCACHE_ENTRIES	64
+
+typedef struct shadowCacheEntry_s
+{
+	image_t        *image;
+	int             lod;
+	int             lightNum;	// index into tr.world->lights, -1 if empty
+	int             lastUsed;
+} shadowCacheEntry_t;
+
+typedef enum
+{
+	SHADOWCACHE_NONE,			// the current light was not looked up yet
+	SHADOWCACHE_UNCACHED,		// render all casters into the shadow map
+	SHADOWCACHE_STATIC,			// render the world casters into the cache entry
+	SHADOWCACHE_DYNAMIC,		// draw the entity casters over a copy of the cache entry
+	SHADOWCACHE_RESIDENT		// shade straight from the cache entry
+} shadowCachePass_t;
+
+typedef struct
+{
+	shadowCachePass_t pass;
+	shadowCacheEntry_t *entry;
+	qboolean        dynamicCasters;
+} shadowCacheState_t;
+
 // all state modified by the back end is seperated
 // from the front end state
 typedef struct
@@ -3637,6 +3798,7 @@ typedef struct
 	qboolean        isHyperspace;
 	trRefEntity_t  *currentEntity;
 	trRefLight_t   *currentLight;	// only used when lighting interactions
+	shadowCacheState_t shadowCache;	// where the shadow map of currentLight comes from
 	qboolean        skyRenderedThisView;	// flag for drawing sun
 
 	float			hdrAverageLuminance;
@@ -3656,6 +3818,55 @@ typedef struct
 	image_t        *cubemap;
 } cubemapProbe_t;
 
+#define OCCLUSION_BUFFER_WIDTH	256
+#define OCCLUSION_BUFFER_HEIGHT	128
+
+typedef struct
+{
+	float          *depth;		// farthest occluder depth per pixel
+	int             width, height;
+	matrix_t        viewProjectionMatrix;
+	int             viewCount;	// tr.viewCountNoReset of the view it was rendered for
+} occlusionBuffer_t;
+
+// the froxel grid of the clustered deferred lighting pass, all sizes are
+// powers of two because they end up as texture dimensions
+#define CLUSTER_TILES_X			16	// must be a multiple of 4
+#define CLUSTER_TILES_Y			8
+#define CLUSTER_SLICES			32
+#define MAX_CLUSTERS			(CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES)
+
+#define MAX_CLUSTER_LIGHTS		256
+#define CLUSTER_LIGHT_TEXELS	8	// width of the light texture, one row per light
+
+#define MAX_CLUSTER_INDEXES		16384
+#define CLUSTER_INDEX_WIDTH		256	// width of the light index texture
+
+#define MAX_LIGHT_CLUSTER_VIEWS	4	// per frame
+
+typedef struct lightClusters_s
+{
+	// view the grid is built for, in OpenGL eye space
+	float           zNear, zFar;
+	float           sliceScale;	// CLUSTER_SLICES / log(zFar / zNear)
+	float           sliceDepths[CLUSTER_SLICES + 1];
+	float           tileFactorsX[CLUSTER_TILES_X + 1];	// x = depth * factor on the tile borders
+	float           tileFactorsY[CLUSTER_TILES_Y + 1];
+	float           tileScalesX[CLUSTER_TILES_X + 1];	// 1 / length of the tile border plane normals
+	float           tileScalesY[CLUSTER_TILES_Y + 1];
+
+	int             numLights;
+	trRefLight_t   *lights[MAX_CLUSTER_LIGHTS];
+
+	// light lists of all clusters, sorted by cluster
+	unsigned short  clusterFirst[MAX_CLUSTERS];
+	unsigned short  clusterCount[MAX_CLUSTERS];
+	int             numIndexes;
+	unsigned short  lightIndexes[MAX_CLUSTER_INDEXES];
+
+	int             clusterPairs[MAX_CLUSTER_INDEXES];	// cluster << 8 | light, in binning order
+} lightClusters_t;
+
 
 #if defined(__cplusplus)
 class GLShader;
@@ -3690,7 +3901,7 @@ typedef struct
 	int             lightCount;	// incremented every time a dlight traverses the world
 	// and every R_MarkFragments call
 
-	int             smpFrame;	// toggles from 0 to 1 every endFrame
+	int             smpFrame;	// cycles through r_smpFrames every endFrame
 
 	int             frameSceneNum;	// zeroed at RE_BeginFrame
 
@@ -3737,8 +3948,13 @@ typedef struct
 //	image_t        *downScaleFBOImage_16x16;
 //	image_t        *downScaleFBOImage_4x4;
 //	image_t        *downScaleFBOImage_1x1;
+	image_t        *clusterGridImage;
+	image_t        *clusterIndexImage;
+	image_t        *clusterLightImage;
 	image_t        *shadowMapFBOImage[MAX_SHADOWMAPS];
 	image_t        *shadowCubeFBOImage[MAX_SHADOWMAPS];
+	shadowCacheEntry_t shadowCacheEntries[MAX_SHADOWCACHE_ENTRIES];
+	int             numShadowCacheEntries;
 	image_t        *sunShadowMapFBOImage[MAX_SHADOWMAPS];
 
 	// external images
@@ -3761,6 +3977,7 @@ typedef struct
 	FBO_t          *bloomRenderFBO[2];
 	FBO_t          *shadowMapFBO[MAX_SHADOWMAPS];
 	FBO_t          *sunShadowMapFBO[MAX_SHADOWMAPS];
+	FBO_t          *shadowCacheFBO;	// read side of the shadow cache copies
 
 	// vertex buffer objects
 	VBO_t          *unitCubeVBO;
@@ -3823,6 +4040,8 @@ typedef struct
 	frontEndCounters_t pc;
 	int             frontEndMsec;	// not in pc due to clearing issue
 
+	occlusionBuffer_t occlusionBuffer;
+
 	//
 	// put large tables at the end, so most elements will be
 	// within the +/32K indexed range on risc processors
@@ -3847,6 +4066,12 @@ typedef struct
 	growList_t		cubeProbes;		// all cubemaps in a linear growing list
 	vertexHash_t  **cubeHashTable;	// hash table for faster access
 
+	vec3_t          cubeProbeGridOrigin;	// uniform grid for the nearest probe lookups
+	float           cubeProbeGridCellSize;
+	int             cubeProbeGridBounds[3];
+	int            *cubeProbeGridCells;	// first probe of each cell in cubeProbeGridProbes
+	cubemapProbe_t **cubeProbeGridProbes;
+
 	// shader indexes from other modules will be looked up in tr.shaders[]
 	// shader indexes from drawsurfs will be looked up in sortedShaders[]
 	// lower indexed sortedShaders must be rendered first (opaque surfaces before translucent)
@@ -3952,6 +4177,14 @@ extern cvar_t  *r_compressNormalMaps;
 extern cvar_t  *r_heatHazeFix;
 extern cvar_t  *r_noMarksOnTrisurfs;
 extern cvar_t  *r_recompileShaders;
+extern cvar_t  *r_lazyShaders;
+extern cvar_t  *r_lazyShaderCompiles;
+extern cvar_t  *r_clusteredLighting;
+extern cvar_t  *r_shadowCache;
+extern cvar_t  *r_shadowCacheSize;
+extern cvar_t  *r_instancing;
+extern cvar_t  *r_leafArrayCulling;
+extern cvar_t  *r_cubeProbes;
 
 extern cvar_t  *r_norefresh;	// bypasses the ref rendering
 extern cvar_t  *r_drawentities;	// disable/enable entity rendering
@@ -4066,6 +4299,7 @@ extern cvar_t  *r_subdivisions;
 extern cvar_t  *r_stitchCurves;
 
 extern cvar_t  *r_smp;
+extern cvar_t  *r_smpFrames;
 extern cvar_t  *r_showSmp;
 extern cvar_t  *r_skipBackEnd;
 extern cvar_t  *r_skipLightBuffer;
@@ -4121,7 +4355,10 @@ extern cvar_t  *r_vboTriangles;
 extern cvar_t  *r_vboShadows;
 extern cvar_t  *r_vboLighting;
 extern cvar_t  *r_vboModels;
+extern cvar_t  *r_cacheInteractions;
+extern cvar_t  *r_cacheMaterials;
 extern cvar_t  *r_vboOptimizeVertices;
+extern cvar_t  *r_vboOptimizeIndexes;
 extern cvar_t  *r_vboVertexSkinning;
 extern cvar_t  *r_vboDeformVertexes;
 extern cvar_t  *r_vboSmoothNormals;
@@ -4138,6 +4375,7 @@ extern cvar_t  *r_parallaxMapping;
 extern cvar_t  *r_parallaxDepthScale;
 
 extern cvar_t  *r_dynamicBspOcclusionCulling;
+extern cvar_t  *r_softwareOcclusionCulling;
 extern cvar_t  *r_dynamicEntityOcclusionCulling;
 extern cvar_t  *r_dynamicLightOcclusionCulling;
 extern cvar_t  *r_chcMaxPrevInvisNodesBatchSize;
@@ -4155,6 +4393,7 @@ extern cvar_t  *r_hdrLightmap;
 extern cvar_t  *r_hdrLightmapExposure;
 extern cvar_t  *r_hdrLightmapGamma;
 extern cvar_t  *r_hdrLightmapCompensate;
+extern cvar_t  *r_hdrLightmapDDS;
 extern cvar_t  *r_hdrToneMappingOperator;
 extern cvar_t  *r_hdrGamma;
 extern cvar_t  *r_hdrDebug;
@@ -4388,6 +4627,8 @@ image_t        *R_CreateCubeImage(const char *name,
 image_t        *R_AllocImage(const char *name, qboolean linkIntoHashTable);
 void			R_UploadImage(const byte ** dataArray, int numData, image_t * image);
 
+image_t        *R_LoadDDSLightmap(const char *name);
+
 int				RE_GetTextureId(const char *name);
 
 
@@ -4434,7 +4675,10 @@ void			GLimp_ShutdownRenderThread(void);
 void           *GLimp_RendererSleep(void);
 void            GLimp_FrontEndSleep(void);
 void            GLimp_SyncRenderThread(void);
-void            GLimp_WakeRenderer(void *data);
+qboolean        GLimp_WaitRenderFence(int fence);
+int             GLimp_WakeRenderer(void *data);
+
+void            GLimp_ParallelFor(void (*function) (void *data, int index), void *data, int count);
 
 void            GLimp_LogComment(const char *comment);
 
@@ -4463,6 +4707,12 @@ typedef struct stageVars
 
 #define MAX_MULTIDRAW_PRIMITIVES	1000
 
+// entities sharing a model surface are drawn with one instanced draw call,
+// each instance passes its model matrix rows, ambient light, directed light
+// and light direction through the u_InstanceData uniform array
+#define MAX_INSTANCES				16
+#define INSTANCE_VECTORS			6
+
 typedef struct shaderCommands_s
 {
 	vec4_t          xyz[SHADER_MAX_VERTEXES];
@@ -4502,6 +4752,9 @@ typedef struct shaderCommands_s
 	qboolean        vboVertexSkinning;
 	matrix_t        boneMatrices[MAX_BONES];
 
+	int             numInstances;
+	vec4_t          instanceData[MAX_INSTANCES * INSTANCE_VECTORS];
+
 	// info extracted from current shader or backend mode
 	void            (*stageIteratorFunc) ();
 	void            (*stageIteratorFunc2) ();
@@ -4583,6 +4836,66 @@ void            R_ShutdownVBOs();
 /*
 ============================================================
 
+SOFTWARE OCCLUSION CULLING, tr_occlusion.c
+
+============================================================
+*/
+
+void            R_InitOcclusionBuffer(occlusionBuffer_t * ob, float *depth, int width, int height);
+void            R_ClearOcclusionBuffer(occlusionBuffer_t * ob, const matrix_t viewProjectionMatrix);
+void            R_RasterizeOccluderPolygon(occlusionBuffer_t * ob, int numVerts, const vec3_t * verts);
+qboolean        R_OcclusionBufferTestBounds(const occlusionBuffer_t * ob, const vec3_t mins, const vec3_t maxs);
+
+void            R_CreateOccluders(world_t * w);
+void            R_RenderOcclusionBuffer(void);
+qboolean        R_CullOccludedBounds(const vec3_t mins, const vec3_t maxs);
+
+/*
+============================================================
+
+LEAF ARRAY, tr_leafarray.c
+
+============================================================
+*/
+
+void            R_CreateLeafArray(world_t * w);
+int             R_CullLeafArray(world_t * w, const cplane_t * planes, int numPlanes, const vec3_t mins, const vec3_t maxs, qboolean pvs);
+
+/*
+============================================================
+
+CLUSTERED LIGHTING, tr_cluster.c
+
+============================================================
+*/
+
+void            R_ClearLightClusters(lightClusters_t * lc, const matrix_t projectionMatrix, float zNear, float zFar);
+qboolean        R_AddClusterLight(lightClusters_t * lc, const vec3_t center, float radius, trRefLight_t * light);
+void            R_FinishLightClusters(lightClusters_t * lc);
+
+lightClusters_t *R_SetupViewLightClusters(void);
+qboolean        R_AddLightToViewClusters(lightClusters_t * lc, trRefLight_t * light);
+
+/*
+============================================================
+
+SHADOW CACHE, tr_shadowcache.c
+
+============================================================
+*/
+
+void            R_ClearShadowCache(void);
+int             R_ShadowCacheResidency(void);
+
+qboolean        RB_BeginShadowCache(trRefLight_t * light, interaction_t * ia);
+qboolean        RB_NextShadowCachePass(void);
+void            RB_EndShadowCache(void);
+void            RB_CopyShadowCacheFace(trRefLight_t * light, int cubeSide);
+image_t        *RB_ShadowCubeImage(trRefLight_t * light);
+
+/*
+============================================================
+
 FLARES, tr_flares.c
 
 ============================================================
@@ -4739,6 +5052,9 @@ VBO_t          *R_CreateVBO2(const char *name, int numVertexes, srfVert_t * vert
 IBO_t          *R_CreateIBO(const char *name, byte * indexes, int indexesSize, vboUsage_t usage);
 IBO_t          *R_CreateIBO2(const char *name, int numTriangles, srfTriangle_t * triangles, vboUsage_t usage);
 
+void            R_OptimizeTrianglesForVertexCache(int numTriangles, srfTriangle_t * triangles);
+void            R_OptimizeVertexFetch(int numVerts, int numTriangles, srfTriangle_t * triangles, int *vertexOrder);
+
 void            R_BindVBO(VBO_t * vbo);
 void            R_BindNullVBO(void);
 
@@ -4887,6 +5203,7 @@ void            Tess_DeformGeometry();
 float           RB_EvalWaveForm(const waveForm_t * wf);
 float           RB_EvalWaveFormClamped(const waveForm_t * wf);
 float           RB_EvalExpression(const expression_t * exp, float defaultValue);
+void            R_CompileExpression(expression_t * exp, const char *shaderName);
 
 void            RB_CalcTexMatrix(const textureBundle_t * bundle, matrix_t matrix);
 
@@ -5013,9 +5330,7 @@ typedef struct
 	int             commandId;
 	int             width;
 	int             height;
-	byte           *captureBuffer;
-	byte           *encodeBuffer;
-	qboolean        motionJpeg;
+	byte           *captureBuffer;	// used for gamma correction
 } videoFrameCommand_t;
 
 typedef struct
@@ -5068,9 +5383,16 @@ typedef struct
 	srfDecal_t      decals[MAX_DECALS];
 
 	renderCommandList_t commands;
+
+	lightClusters_t lightClusters[MAX_LIGHT_CLUSTER_VIEWS];
+	int             numLightClusters;
+
+	int             fence;		// the render thread is done with this frame after passing it
+
+	backEndCounters_t pc;		// written by the back end when it swaps this frame
 } backEndData_t;
 
-extern backEndData_t *backEndData[SMP_FRAMES];	// the second one may not be allocated
+extern backEndData_t *backEndData[SMP_FRAMES];	// only r_smpFrames are allocated
 
 extern volatile renderCommandList_t *renderCommandList;
 
@@ -5081,6 +5403,7 @@ void           *R_GetCommandBuffer(int bytes);
 void            RB_ExecuteRenderCommands(const void *data);
 
 void            R_SyncRenderThread(void);
+void            R_WaitSmpFrame(int smpFrame);
 
 void            R_AddDrawViewCmd(void);
 
@@ -5109,10 +5432,13 @@ void            SavePNG(const char *name, const byte * pic, int width, int heigh
 
 // video stuff
 const void     *RB_TakeVideoFrameCmd(const void *data);
-void            RE_TakeVideoFrame(int width, int height, byte * captureBuffer, byte * encodeBuffer, qboolean motionJpeg);
+void            RB_FinishVideoFrames(void);
+void            RE_TakeVideoFrame(int width, int height, byte * captureBuffer);
+void            RE_FinishVideoFrames(void);
 
 // cubemap reflections stuff
 void            R_BuildCubeMaps(void);
+void            R_FreeCubeProbeGrid(void);
 void			R_FindTwoNearestCubeMaps(const vec3_t position, cubemapProbe_t **cubeProbeNearest, cubemapProbe_t **cubeProbeSecondNearest);
 
 void            FreeVertexHashTable(vertexHash_t ** hashTable);
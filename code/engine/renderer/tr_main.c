@@ -738,6 +738,12 @@ cullResult_t R_CullLocalBox(vec3_t localBounds[2])
 		}
 	}
 
+	// hidden behind the software rendered occluders
+	if(R_CullOccludedBounds(worldBounds[0], worldBounds[1]))
+	{
+		return CULL_OUT;
+	}
+
 	if(!anyClip)
 	{
 		// completely inside frustum
@@ -2410,10 +2416,23 @@ void R_AddDrawSurf(surfaceType_t * surface, shader_t * shader, int lightmapNum,
 	drawSurf->shaderNum = shader->sortedIndex;
 	drawSurf->lightmapNum = lightmapNum;
 	drawSurf->fogNum = fogNum;
+	drawSurf->numInstances = 0;
 
 	tr.refdef.numDrawSurfs++;
 }
 
+/*
+=================
+R_InstancingEnabled
+=================
+*/
+static qboolean R_InstancingEnabled(void)
+{
+	return glConfig2.drawInstancedAvailable && (r_precomputedLighting->integer || r_vertexLighting->integer);
+}
+
+static qboolean sortByInstance;	// set by R_SortDrawSurfs for DrawSurfCompare
+
 /*
 =================
 DrawSurfCompare
@@ -2448,6 +2467,13 @@ static int DrawSurfCompare(const void *a, const void *b)
 	else if(((drawSurf_t *) a)->entity != &tr.worldEntity && ((drawSurf_t *) b)->entity == &tr.worldEntity)
 		return 1;
 
+	// keep entities sharing a model surface next to each other so they can be instanced
+	else if(sortByInstance && ((drawSurf_t *) a)->entity != &tr.worldEntity && ((drawSurf_t *) a)->surface < ((drawSurf_t *) b)->surface)
+		return -1;
+
+	else if(sortByInstance && ((drawSurf_t *) a)->entity != &tr.worldEntity && ((drawSurf_t *) a)->surface > ((drawSurf_t *) b)->surface)
+		return 1;
+
 	else if(((drawSurf_t *) a)->entity < ((drawSurf_t *) b)->entity)
 		return -1;
 
@@ -2468,6 +2494,158 @@ static int DrawSurfCompare(const void *a, const void *b)
 }
 
 
+/*
+=================
+R_InstanceableDrawSurf
+
+Returns qtrue if the entity surface only needs Render_vertexLighting_DBS_entity,
+which can draw it together with the same surface of other entities
+=================
+*/
+static qboolean R_InstanceableDrawSurf(const drawSurf_t * drawSurf)
+{
+	trRefEntity_t  *ent;
+	shader_t       *shader;
+	shaderStage_t  *pStage;
+	int             i;
+
+	if(*drawSurf->surface != SF_VBO_MDVMESH && *drawSurf->surface != SF_VBO_MD5MESH)
+	{
+		return qfalse;
+	}
+
+	ent = drawSurf->entity;
+	if(ent == &tr.worldEntity || (ent->e.renderfx & RF_DEPTHHACK))
+	{
+		return qfalse;
+	}
+
+#if defined(USE_REFENTITY_ANIMATIONSYSTEM)
+	// skinned entities upload their own bone matrices
+	if(*drawSurf->surface == SF_VBO_MD5MESH && ent->e.skeleton.type == SK_ABSOLUTE)
+	{
+		return qfalse;
+	}
+#endif
+
+	if(drawSurf->fogNum > 0 || (drawSurf->lightmapNum >= 0 && !r_vertexLighting->integer))
+	{
+		return qfalse;
+	}
+
+	shader = tr.sortedShaders[drawSurf->shaderNum];
+	if(shader->sort > SS_OPAQUE || shader->entityMergable || !shader->numStages)
+	{
+		return qfalse;
+	}
+
+	for(i = 0; i < shader->numStages; i++)
+	{
+		pStage = shader->stages[i];
+
+		if(pStage->type != ST_DIFFUSEMAP && pStage->type != ST_COLLAPSE_lighting_DB && pStage->type != ST_COLLAPSE_lighting_DBS)
+		{
+			return qfalse;
+		}
+
+		// reflective specular picks the cube probes next to each entity
+		if(r_normalMapping->integer && tr.cubeHashTable != NULL && pStage->bundle[TB_NORMALMAP].image[0] != NULL)
+		{
+			return qfalse;
+		}
+	}
+
+	return qtrue;
+}
+
+/*
+=================
+R_SameInstanceDrawSurf
+
+Returns qtrue if b can be an instance of the run started by a
+=================
+*/
+static qboolean R_SameInstanceDrawSurf(const drawSurf_t * a, const drawSurf_t * b)
+{
+	const refEntity_t *ea = &a->entity->e;
+	const refEntity_t *eb = &b->entity->e;
+
+	if(a->surface != b->surface || a->shaderNum != b->shaderNum || a->lightmapNum != b->lightmapNum || a->fogNum != b->fogNum)
+	{
+		return qfalse;
+	}
+
+	if(b->entity == &tr.worldEntity || (eb->renderfx & RF_DEPTHHACK))
+	{
+		return qfalse;
+	}
+
+	// vertex animation and stage expressions are evaluated once for the whole run
+	if(ea->frame != eb->frame || ea->oldframe != eb->oldframe || ea->backlerp != eb->backlerp)
+	{
+		return qfalse;
+	}
+
+	if(ea->shaderTime != eb->shaderTime || memcmp(ea->shaderRGBA, eb->shaderRGBA, sizeof(ea->shaderRGBA)))
+	{
+		return qfalse;
+	}
+
+#if defined(USE_REFENTITY_ANIMATIONSYSTEM)
+	if(eb->skeleton.type == SK_ABSOLUTE)
+	{
+		return qfalse;
+	}
+#endif
+
+	return qtrue;
+}
+
+/*
+=================
+R_FindInstancedDrawSurfs
+
+Marks runs of sorted draw surfaces that show the same model surface
+with the same shader on different entities, the backend draws each
+run with a single instanced draw call
+=================
+*/
+static void R_FindInstancedDrawSurfs(void)
+{
+	drawSurf_t     *drawSurf;
+	int             i, numInstances;
+
+	if(!sortByInstance)
+	{
+		return;
+	}
+
+	for(i = 0; i < tr.viewParms.numDrawSurfs; i += numInstances)
+	{
+		drawSurf = &tr.viewParms.drawSurfs[i];
+		numInstances = 1;
+
+		if(!R_InstanceableDrawSurf(drawSurf))
+		{
+			continue;
+		}
+
+		while(numInstances < MAX_INSTANCES && i + numInstances < tr.viewParms.numDrawSurfs &&
+			  R_SameInstanceDrawSurf(drawSurf, drawSurf + numInstances))
+		{
+			numInstances++;
+		}
+
+		if(numInstances > 1)
+		{
+			drawSurf->numInstances = numInstances;
+
+			tr.pc.c_instanceRuns++;
+			tr.pc.c_instanceSurfaces += numInstances;
+		}
+	}
+}
+
 /*
 =================
 R_SortDrawSurfs
@@ -2511,8 +2689,11 @@ static void R_SortDrawSurfs(void)
 
 	// sort the drawsurfs by sort type, then orientation, then shader
 //  qsortFast(drawSurfs, numDrawSurfs, sizeof(drawSurf_t));
+	sortByInstance = R_InstancingEnabled();
 	qsort(tr.viewParms.drawSurfs, tr.viewParms.numDrawSurfs, sizeof(drawSurf_t), DrawSurfCompare);
 
+	R_FindInstancedDrawSurfs();
+
 	// check for any pass through drawing, which
 	// may cause another view to be rendered first
 	for(i = 0, drawSurf = tr.viewParms.drawSurfs; i < tr.viewParms.numDrawSurfs; i++, drawSurf++)
@@ -2817,6 +2998,9 @@ void R_AddLightInteractions()
 	bspNode_t     **leafs;
 	bspNode_t      *leaf;
 	link_t         *l, *sentinel;
+	lightClusters_t *lightClusters;
+
+	lightClusters = R_SetupViewLightClusters();
 
 	for(i = 0; i < tr.refdef.numLights; i++)
 	{
@@ -3004,6 +3188,13 @@ void R_AddLightInteractions()
 
 		if(r_deferredShading->integer && r_shadows->integer < SHADOWING_ESM16)
 		{
+			if(lightClusters && R_AddLightToViewClusters(lightClusters, light))
+			{
+				// shaded by the clustered lighting pass without any interactions
+				tr.pc.c_dlights++;
+				continue;
+			}
+
 			// add one fake interaction for this light
 			// because the renderer backend only loops through interactions
 			R_AddLightInteraction(light, NULL, NULL, CUBESIDE_CLIPALL, IA_DEFAULT);
@@ -3046,6 +3237,14 @@ void R_AddLightInteractions()
 			light->cull = CULL_OUT;
 		}
 	}
+
+	if(lightClusters)
+	{
+		R_FinishLightClusters(lightClusters);
+
+		tr.pc.c_clusterLights += lightClusters->numLights;
+		tr.pc.c_clusterIndexes += lightClusters->numIndexes;
+	}
 }
 
 void R_AddLightBoundsToVisBounds()
@@ -3426,6 +3625,7 @@ void R_RenderView(viewParms_t * parms)
 	}
 
 	tr.viewParms = *parms;
+	tr.viewParms.lightClusters = NULL;
 	tr.viewParms.frameSceneNum = tr.frameSceneNum;
 	tr.viewParms.frameCount = tr.frameCount;
 	tr.viewParms.viewCount = tr.viewCount;// % MAX_VIEWS;
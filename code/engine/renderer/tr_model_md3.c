@@ -295,6 +295,9 @@ qboolean R_LoadMD3(model_t * mod, int lod, void *buffer, int bufferSize, const c
 		int				vertexesNum;
 		int				f;
 
+		srfTriangle_t  *triangles;
+		int            *vertexOrder;
+
 		Com_InitGrowList(&vboSurfaces, 10);
 
 		for(i = 0, surf = mdvModel->surfaces; i < mdvModel->numSurfaces; i++, surf++)
@@ -375,7 +378,16 @@ qboolean R_LoadMD3(model_t * mod, int lod, void *buffer, int bufferSize, const c
 									   | ATTR_COLOR);
 									   */
 
-			vboSurf->ibo = R_CreateIBO2(va("staticMD3Mesh_IBO %s", surf->name), surf->numTriangles, surf->triangles, VBO_USAGE_STATIC);
+			// optimize the index and vertex order for the vertex cache, the surface itself keeps the original order
+			triangles = ri.Hunk_AllocateTempMemory(surf->numTriangles * sizeof(srfTriangle_t));
+			Com_Memcpy(triangles, surf->triangles, surf->numTriangles * sizeof(srfTriangle_t));
+
+			vertexOrder = ri.Hunk_AllocateTempMemory(surf->numVerts * sizeof(int));
+
+			R_OptimizeTrianglesForVertexCache(surf->numTriangles, triangles);
+			R_OptimizeVertexFetch(surf->numVerts, surf->numTriangles, triangles, vertexOrder);
+
+			vboSurf->ibo = R_CreateIBO2(va("staticMD3Mesh_IBO %s", surf->name), surf->numTriangles, triangles, VBO_USAGE_STATIC);
 
 
 			// create VBO
@@ -393,7 +405,7 @@ qboolean R_LoadMD3(model_t * mod, int lod, void *buffer, int bufferSize, const c
 				{
 					for(k = 0; k < 3; k++)
 					{
-						tmp[k] = surf->verts[f * vertexesNum + j].xyz[k];
+						tmp[k] = surf->verts[f * vertexesNum + vertexOrder[j]].xyz[k];
 					}
 					tmp[3] = 1;
 					Com_Memcpy(data + dataOfs, (vec_t *) tmp, sizeof(vec4_t));
@@ -412,7 +424,7 @@ qboolean R_LoadMD3(model_t * mod, int lod, void *buffer, int bufferSize, const c
 			{
 				for(k = 0; k < 2; k++)
 				{
-					tmp[k] = surf->st[j].st[k];
+					tmp[k] = surf->st[vertexOrder[j]].st[k];
 				}
 				tmp[2] = 0;
 				tmp[3] = 1;
@@ -428,7 +440,7 @@ qboolean R_LoadMD3(model_t * mod, int lod, void *buffer, int bufferSize, const c
 				{
 					for(k = 0; k < 3; k++)
 					{
-						tmp[k] = surf->verts[f * vertexesNum + j].tangent[k];
+						tmp[k] = surf->verts[f * vertexesNum + vertexOrder[j]].tangent[k];
 					}
 					tmp[3] = 1;
 					Com_Memcpy(data + dataOfs, (vec_t *) tmp, sizeof(vec4_t));
@@ -449,7 +461,7 @@ qboolean R_LoadMD3(model_t * mod, int lod, void *buffer, int bufferSize, const c
 				{
 					for(k = 0; k < 3; k++)
 					{
-						tmp[k] = surf->verts[f * vertexesNum + j].binormal[k];
+						tmp[k] = surf->verts[f * vertexesNum + vertexOrder[j]].binormal[k];
 					}
 					tmp[3] = 1;
 					Com_Memcpy(data + dataOfs, (vec_t *) tmp, sizeof(vec4_t));
@@ -470,7 +482,7 @@ qboolean R_LoadMD3(model_t * mod, int lod, void *buffer, int bufferSize, const c
 				{
 					for(k = 0; k < 3; k++)
 					{
-						tmp[k] = surf->verts[f * vertexesNum + j].normal[k];
+						tmp[k] = surf->verts[f * vertexesNum + vertexOrder[j]].normal[k];
 					}
 					tmp[3] = 1;
 					Com_Memcpy(data + dataOfs, (vec_t *) tmp, sizeof(vec4_t));
@@ -497,6 +509,8 @@ qboolean R_LoadMD3(model_t * mod, int lod, void *buffer, int bufferSize, const c
 			vboSurf->vbo->sizeNormals = sizeNormals;
 
 			ri.Hunk_FreeTempMemory(data);
+			ri.Hunk_FreeTempMemory(vertexOrder);
+			ri.Hunk_FreeTempMemory(triangles);
 		}
 
 		// move VBO surfaces list to hunk
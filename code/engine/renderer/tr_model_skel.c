@@ -199,6 +199,46 @@ qboolean AddTriangleToVBOTriangleList(growList_t * vboTriangles, skelTriangle_t
 	return qfalse;
 }
 
+/*
+=================
+OptimizeVBOTriangleList
+
+Stores the triangles in vertex cache friendly order in indexes
+and the order in which the vertices should be fed into the VBO in vertexOrder
+=================
+*/
+static void OptimizeVBOTriangleList(growList_t * vboTriangles, int numVerts, int *indexes, int *vertexOrder)
+{
+	int             j, k;
+	skelTriangle_t *tri;
+	srfTriangle_t  *triangles;
+
+	triangles = ri.Hunk_AllocateTempMemory(vboTriangles->currentElements * sizeof(srfTriangle_t));
+
+	for(j = 0; j < vboTriangles->currentElements; j++)
+	{
+		tri = Com_GrowListElement(vboTriangles, j);
+
+		for(k = 0; k < 3; k++)
+		{
+			triangles[j].indexes[k] = tri->indexes[k];
+		}
+	}
+
+	R_OptimizeTrianglesForVertexCache(vboTriangles->currentElements, triangles);
+	R_OptimizeVertexFetch(numVerts, vboTriangles->currentElements, triangles, vertexOrder);
+
+	for(j = 0; j < vboTriangles->currentElements; j++)
+	{
+		for(k = 0; k < 3; k++)
+		{
+			indexes[j * 3 + k] = triangles[j].indexes[k];
+		}
+	}
+
+	ri.Hunk_FreeTempMemory(triangles);
+}
+
 void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTriangles, md5Model_t * md5, md5Surface_t * surf, int skinIndex, int numBoneReferences, int boneReferences[MAX_BONES])
 {
 	int				j, k;
@@ -219,9 +259,8 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 	int             indexesNum;
 	byte           *indexes;
 	int             indexesSize;
-	int             indexesOfs;
 
-	skelTriangle_t  *tri;
+	int            *vertexOrder;
 
 	vec4_t          tmp;
 	int             index;
@@ -251,7 +290,6 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 
 	indexesSize = indexesNum * sizeof(int);
 	indexes = ri.Hunk_AllocateTempMemory(indexesSize);
-	indexesOfs = 0;
 
 	//ri.Printf(PRINT_ALL, "AddSurfaceToVBOSurfacesList( %i verts, %i tris )\n", surf->numVerts, vboTriangles->currentElements);
 
@@ -274,26 +312,16 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 	}
 	//ri.Printf(PRINT_ALL, "\n");
 
-	//for(j = 0, tri = surf->triangles; j < surf->numTriangles; j++, tri++)
-	for(j = 0; j < vboTriangles->currentElements; j++)
-	{
-		tri = Com_GrowListElement(vboTriangles, j);
-
-		for(k = 0; k < 3; k++)
-		{
-			index = tri->indexes[k];
-
-			Com_Memcpy(indexes + indexesOfs, &index, sizeof(int));
-			indexesOfs += sizeof(int);
-		}
-	}
+	// optimize the index and vertex order for the vertex cache
+	vertexOrder = ri.Hunk_AllocateTempMemory(vertexesNum * sizeof(int));
+	OptimizeVBOTriangleList(vboTriangles, vertexesNum, (int *)indexes, vertexOrder);
 
 	// feed vertex XYZ
 	for(j = 0; j < vertexesNum; j++)
 	{
 		for(k = 0; k < 3; k++)
 		{
-			tmp[k] = surf->verts[j].position[k];
+			tmp[k] = surf->verts[vertexOrder[j]].position[k];
 		}
 		tmp[3] = 1;
 		Com_Memcpy(data + dataOfs, (vec_t *) tmp, sizeof(vec4_t));
@@ -306,7 +334,7 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 	{
 		for(k = 0; k < 2; k++)
 		{
-			tmp[k] = surf->verts[j].texCoords[k];
+			tmp[k] = surf->verts[vertexOrder[j]].texCoords[k];
 		}
 		tmp[2] = 0;
 		tmp[3] = 1;
@@ -320,7 +348,7 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 	{
 		for(k = 0; k < 3; k++)
 		{
-			tmp[k] = surf->verts[j].tangent[k];
+			tmp[k] = surf->verts[vertexOrder[j]].tangent[k];
 		}
 		tmp[3] = 1;
 		Com_Memcpy(data + dataOfs, (vec_t *) tmp, sizeof(vec4_t));
@@ -333,7 +361,7 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 	{
 		for(k = 0; k < 3; k++)
 		{
-			tmp[k] = surf->verts[j].binormal[k];
+			tmp[k] = surf->verts[vertexOrder[j]].binormal[k];
 		}
 		tmp[3] = 1;
 		Com_Memcpy(data + dataOfs, (vec_t *) tmp, sizeof(vec4_t));
@@ -346,7 +374,7 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 	{
 		for(k = 0; k < 3; k++)
 		{
-			tmp[k] = surf->verts[j].normal[k];
+			tmp[k] = surf->verts[vertexOrder[j]].normal[k];
 		}
 		tmp[3] = 1;
 		Com_Memcpy(data + dataOfs, (vec_t *) tmp, sizeof(vec4_t));
@@ -363,8 +391,10 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 
 	// feed bone indices
 	ofsBoneIndexes = dataOfs;
-	for(j = 0, v = surf->verts; j < surf->numVerts; j++, v++)
+	for(j = 0; j < vertexesNum; j++)
 	{
+		v = &surf->verts[vertexOrder[j]];
+
 		for(k = 0; k < MAX_WEIGHTS; k++)
 		{
 			if(k < v->numWeights)
@@ -379,8 +409,10 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 
 	// feed bone weights
 	ofsBoneWeights = dataOfs;
-	for(j = 0, v = surf->verts; j < surf->numVerts; j++, v++)
+	for(j = 0; j < vertexesNum; j++)
 	{
+		v = &surf->verts[vertexOrder[j]];
+
 		for(k = 0; k < MAX_WEIGHTS; k++)
 		{
 			if(k < v->numWeights)
@@ -407,6 +439,7 @@ void AddSurfaceToVBOSurfacesList(growList_t * vboSurfaces, growList_t * vboTrian
 
 	vboSurf->ibo = R_CreateIBO(va("staticMD5Mesh_IBO %i", vboSurfaces->currentElements), indexes, indexesSize, VBO_USAGE_STATIC);
 
+	ri.Hunk_FreeTempMemory(vertexOrder);
 	ri.Hunk_FreeTempMemory(indexes);
 	ri.Hunk_FreeTempMemory(data);
 
@@ -439,9 +472,8 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 	int             indexesNum;
 	byte           *indexes;
 	int             indexesSize;
-	int             indexesOfs;
 
-	skelTriangle_t  *tri;
+	int            *vertexOrder;
 
 	vec4_t          tmp;
 	int             index;
@@ -486,7 +518,6 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 
 	indexesSize = indexesNum * sizeof(int);
 	indexes = ri.Hunk_AllocateTempMemory(indexesSize);
-	indexesOfs = 0;
 
 	//ri.Printf(PRINT_ALL, "AddSurfaceToVBOSurfacesList( %i verts, %i tris )\n", surf->numVerts, vboTriangles->currentElements);
 
@@ -509,24 +540,14 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 	}
 	//ri.Printf(PRINT_ALL, "\n");
 
-	//for(j = 0, tri = surf->triangles; j < surf->numTriangles; j++, tri++)
-	for(j = 0; j < vboTriangles->currentElements; j++)
-	{
-		tri = Com_GrowListElement(vboTriangles, j);
-
-		for(k = 0; k < 3; k++)
-		{
-			index = tri->indexes[k];
-
-			Com_Memcpy(indexes + indexesOfs, &index, sizeof(int));
-			indexesOfs += sizeof(int);
-		}
-	}
+	// optimize the index and vertex order for the vertex cache
+	vertexOrder = ri.Hunk_AllocateTempMemory(vertexesNum * sizeof(int));
+	OptimizeVBOTriangleList(vboTriangles, vertexesNum, (int *)indexes, vertexOrder);
 
 	// feed vertex XYZ
 	for(j = 0; j < vertexesNum; j++)
 	{
-		v = Com_GrowListElement(vboVertexes, j);
+		v = Com_GrowListElement(vboVertexes, vertexOrder[j]);
 
 		for(k = 0; k < 3; k++)
 		{
@@ -541,7 +562,7 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 	ofsTexCoords = dataOfs;
 	for(j = 0; j < vertexesNum; j++)
 	{
-		v = Com_GrowListElement(vboVertexes, j);
+		v = Com_GrowListElement(vboVertexes, vertexOrder[j]);
 
 		for(k = 0; k < 2; k++)
 		{
@@ -557,7 +578,7 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 	ofsTangents = dataOfs;
 	for(j = 0; j < vertexesNum; j++)
 	{
-		v = Com_GrowListElement(vboVertexes, j);
+		v = Com_GrowListElement(vboVertexes, vertexOrder[j]);
 
 		for(k = 0; k < 3; k++)
 		{
@@ -572,7 +593,7 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 	ofsBinormals = dataOfs;
 	for(j = 0; j < vertexesNum; j++)
 	{
-		v = Com_GrowListElement(vboVertexes, j);
+		v = Com_GrowListElement(vboVertexes, vertexOrder[j]);
 
 		for(k = 0; k < 3; k++)
 		{
@@ -587,7 +608,7 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 	ofsNormals = dataOfs;
 	for(j = 0; j < vertexesNum; j++)
 	{
-		v = Com_GrowListElement(vboVertexes, j);
+		v = Com_GrowListElement(vboVertexes, vertexOrder[j]);
 
 		for(k = 0; k < 3; k++)
 		{
@@ -610,7 +631,7 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 	ofsBoneIndexes = dataOfs;
 	for(j = 0; j < vertexesNum; j++)
 	{
-		v = Com_GrowListElement(vboVertexes, j);
+		v = Com_GrowListElement(vboVertexes, vertexOrder[j]);
 
 		for(k = 0; k < MAX_WEIGHTS; k++)
 		{
@@ -628,7 +649,7 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 	ofsBoneWeights = dataOfs;
 	for(j = 0; j < vertexesNum; j++)
 	{
-		v = Com_GrowListElement(vboVertexes, j);
+		v = Com_GrowListElement(vboVertexes, vertexOrder[j]);
 
 		for(k = 0; k < MAX_WEIGHTS; k++)
 		{
@@ -656,6 +677,7 @@ void AddSurfaceToVBOSurfacesList2(growList_t * vboSurfaces, growList_t * vboTria
 
 	vboSurf->ibo = R_CreateIBO(va("staticMD5Mesh_IBO %i", vboSurfaces->currentElements), indexes, indexesSize, VBO_USAGE_STATIC);
 
+	ri.Hunk_FreeTempMemory(vertexOrder);
 	ri.Hunk_FreeTempMemory(indexes);
 	ri.Hunk_FreeTempMemory(data);
 
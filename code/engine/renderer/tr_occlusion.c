@@ -0,0 +1,695 @@
+/*
+===========================================================================
+Copyright (C) 2006-2011 Robert Beckebans <trebor_7@users.sourceforge.net>
+
+This file is part of XreaL source code.
+
+XreaL source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+XreaL source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with XreaL source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// tr_occlusion.c -- software rasterized occlusion culling on the front end
+#include "tr_local.h"
+
+/*
+The occlusion buffer is a coarse depth buffer rendered on the CPU from the
+large opaque world faces that were selected as occluders at map load time.
+
+Everything in here is conservative:
+- an occluder is a convex polygon and only writes pixels that are completely
+  covered by it
+- it writes the farthest depth of its vertices
+- an occludee writes nothing and tests every pixel its screen rectangle touches
+  against its nearest depth
+
+so a box is only reported hidden if it is really hidden.
+
+None of the functions operating on an occlusionBuffer_t touch OpenGL.
+*/
+
+#define OCCLUSION_NEAR_DEPTH	1.0f	// geometry closer to the eye than this is never culled
+#define OCCLUSION_FAR_DEPTH		1e30f
+
+#define OCCLUDER_MIN_AREA		(64.0f * 64.0f)
+
+static float    occlusionDepth[OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT];
+
+/*
+=================
+R_InitOcclusionBuffer
+
+width must be a multiple of 4
+=================
+*/
+void R_InitOcclusionBuffer(occlusionBuffer_t * ob, float *depth, int width, int height)
+{
+	assert((width & 3) == 0);
+
+	Com_Memset(ob, 0, sizeof(*ob));
+
+	ob->depth = depth;
+	ob->width = width;
+	ob->height = height;
+	ob->viewCount = -1;
+}
+
+/*
+=================
+R_ClearOcclusionBuffer
+=================
+*/
+void R_ClearOcclusionBuffer(occlusionBuffer_t * ob, const matrix_t viewProjectionMatrix)
+{
+	int             i;
+
+	MatrixCopy(viewProjectionMatrix, ob->viewProjectionMatrix);
+
+	for(i = 0; i < ob->width * ob->height; i++)
+	{
+		ob->depth[i] = OCCLUSION_FAR_DEPTH;
+	}
+}
+
+/*
+=================
+R_ProjectOcclusionPoint
+
+Returns qfalse if the point is too close to or behind the eye
+=================
+*/
+static qboolean R_ProjectOcclusionPoint(const occlusionBuffer_t * ob, const vec3_t point, float *x, float *y, float *depth)
+{
+	vec4_t          in, clip;
+
+	VectorCopy(point, in);
+	in[3] = 1.0f;
+
+	MatrixTransform4(ob->viewProjectionMatrix, in, clip);
+
+	if(clip[3] < OCCLUSION_NEAR_DEPTH)
+	{
+		return qfalse;
+	}
+
+	*x = (clip[0] / clip[3] * 0.5f + 0.5f) * ob->width;
+	*y = (clip[1] / clip[3] * 0.5f + 0.5f) * ob->height;
+	*depth = clip[3];
+
+	return qtrue;
+}
+
+/*
+=================
+R_RasterizeOccluderPolygon
+
+The polygon must be convex
+=================
+*/
+void R_RasterizeOccluderPolygon(occlusionBuffer_t * ob, int numVerts, const vec3_t * verts)
+{
+	float           sx[MAX_OCCLUDER_VERTS], sy[MAX_OCCLUDER_VERTS], sz;
+	float           depth, area;
+	float           ea[MAX_OCCLUDER_VERTS], eb[MAX_OCCLUDER_VERTS], ec[MAX_OCCLUDER_VERTS], bias[MAX_OCCLUDER_VERTS];
+	float           minSX, maxSX, minSY, maxSY;
+	int             i, j, x, y;
+	int             minX, maxX, minY, maxY;
+	float          *row;
+
+	if(numVerts < 3 || numVerts > MAX_OCCLUDER_VERTS)
+	{
+		return;
+	}
+
+	depth = 0;
+	area = 0;
+	minSX = minSY = OCCLUSION_FAR_DEPTH;
+	maxSX = maxSY = -OCCLUSION_FAR_DEPTH;
+
+	for(i = 0; i < numVerts; i++)
+	{
+		// polygons crossing the near plane are rare for large occluders, just skip them
+		if(!R_ProjectOcclusionPoint(ob, verts[i], &sx[i], &sy[i], &sz))
+		{
+			return;
+		}
+
+		depth = max(depth, sz);
+
+		minSX = min(minSX, sx[i]);
+		maxSX = max(maxSX, sx[i]);
+		minSY = min(minSY, sy[i]);
+		maxSY = max(maxSY, sy[i]);
+	}
+
+	for(i = 0; i < numVerts; i++)
+	{
+		j = (i + 1) % numVerts;
+
+		area += sx[i] * sy[j] - sx[j] * sy[i];
+	}
+
+	if(area == 0)
+	{
+		return;
+	}
+
+	minX = max((int)floor(minSX), 0);
+	maxX = min((int)ceil(maxSX), ob->width - 1);
+	minY = max((int)floor(minSY), 0);
+	maxY = min((int)ceil(maxSY), ob->height - 1);
+
+	if(minX > maxX || minY > maxY)
+	{
+		return;
+	}
+
+	// E(x, y) = a * x + b * y + c for the edge i -> j, positive inside
+	// a pixel is completely inside an edge if E at its center is larger than
+	// the maximum the function can change over half a pixel
+	for(i = 0; i < numVerts; i++)
+	{
+		j = (i + 1) % numVerts;
+
+		ea[i] = sy[i] - sy[j];
+		eb[i] = sx[j] - sx[i];
+		ec[i] = sx[i] * sy[j] - sx[j] * sy[i];
+
+		if(area < 0)
+		{
+			ea[i] = -ea[i];
+			eb[i] = -eb[i];
+			ec[i] = -ec[i];
+		}
+
+		bias[i] = 0.5f * (fabs(ea[i]) + fabs(eb[i]));
+	}
+
+	minX &= ~3;
+
+	for(y = minY; y <= maxY; y++)
+	{
+		float           cy = y + 0.5f;
+
+		row = ob->depth + y * ob->width;
+
+#if id386_sse
+		{
+			__m128          _depth, _cx, _mask, _e, _old;
+
+			_depth = _mm_set1_ps(depth);
+
+			for(x = minX; x <= maxX; x += 4)
+			{
+				_cx = _mm_setr_ps(x + 0.5f, x + 1.5f, x + 2.5f, x + 3.5f);
+				_mask = _mm_cmpeq_ps(_cx, _cx);
+
+				for(i = 0; i < numVerts; i++)
+				{
+					_e = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ea[i]), _cx), _mm_set1_ps(eb[i] * cy + ec[i]));
+					_mask = _mm_and_ps(_mask, _mm_cmpge_ps(_e, _mm_set1_ps(bias[i])));
+				}
+
+				if(!_mm_movemask_ps(_mask))
+				{
+					continue;
+				}
+
+				_old = _mm_loadu_ps(row + x);
+				_e = _mm_min_ps(_old, _depth);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(_mask, _e), _mm_andnot_ps(_mask, _old)));
+			}
+		}
+#else
+		for(x = minX; x <= maxX; x++)
+		{
+			float           cx = x + 0.5f;
+
+			for(i = 0; i < numVerts; i++)
+			{
+				if(ea[i] * cx + eb[i] * cy + ec[i] < bias[i])
+				{
+					break;
+				}
+			}
+
+			if(i == numVerts && depth < row[x])
+			{
+				row[x] = depth;
+			}
+		}
+#endif
+	}
+}
+
+/*
+=================
+R_OcclusionBufferTestBounds
+
+Returns qtrue if the box is completely hidden behind the occluders
+=================
+*/
+qboolean R_OcclusionBufferTestBounds(const occlusionBuffer_t * ob, const vec3_t mins, const vec3_t maxs)
+{
+	int             i, x, y;
+	int             minX, maxX, minY, maxY;
+	float           minSX, maxSX, minSY, maxSY;
+	float           sx, sy, sz, nearest;
+	vec3_t          corner;
+	const float    *row;
+
+	minSX = minSY = OCCLUSION_FAR_DEPTH;
+	maxSX = maxSY = -OCCLUSION_FAR_DEPTH;
+	nearest = OCCLUSION_FAR_DEPTH;
+
+	for(i = 0; i < 8; i++)
+	{
+		corner[0] = (i & 1) ? maxs[0] : mins[0];
+		corner[1] = (i & 2) ? maxs[1] : mins[1];
+		corner[2] = (i & 4) ? maxs[2] : mins[2];
+
+		// the eye is inside or very close to the box
+		if(!R_ProjectOcclusionPoint(ob, corner, &sx, &sy, &sz))
+		{
+			return qfalse;
+		}
+
+		minSX = min(minSX, sx);
+		maxSX = max(maxSX, sx);
+		minSY = min(minSY, sy);
+		maxSY = max(maxSY, sy);
+		nearest = min(nearest, sz);
+	}
+
+	minX = max((int)floor(minSX), 0);
+	maxX = min((int)ceil(maxSX), ob->width - 1);
+	minY = max((int)floor(minSY), 0);
+	maxY = min((int)ceil(maxSY), ob->height - 1);
+
+	if(minX > maxX || minY > maxY)
+	{
+		// not on screen, leave this to the frustum culling
+		return qfalse;
+	}
+
+	// testing a few more pixels on the left is still conservative
+	minX &= ~3;
+
+	for(y = minY; y <= maxY; y++)
+	{
+		row = ob->depth + y * ob->width;
+
+#if id386_sse
+		{
+			__m128          _nearest = _mm_set1_ps(nearest);
+
+			for(x = minX; x <= maxX; x += 4)
+			{
+				if(_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(row + x), _nearest)))
+				{
+					return qfalse;
+				}
+			}
+		}
+#else
+		for(x = minX; x <= maxX; x++)
+		{
+			if(row[x] >= nearest)
+			{
+				return qfalse;
+			}
+		}
+#endif
+	}
+
+	return qtrue;
+}
+
+/*
+=================
+R_OccluderOutline
+
+Stores the convex outline of the face in outline and returns the number of outline
+vertices, or 0 if the face is not convex or too complex.
+
+Rasterizing the outline instead of the triangles avoids the gaps the conservative
+rasterization would leave along the inner triangle edges.
+=================
+*/
+#define MAX_OCCLUDER_FACE_VERTS	64
+
+static int R_OccluderOutline(const srfSurfaceFace_t * face, float area, vec3_t outline[MAX_OCCLUDER_VERTS])
+{
+	vec3_t          axis[2];
+	float           u[MAX_OCCLUDER_FACE_VERTS], v[MAX_OCCLUDER_FACE_VERTS];
+	int             sorted[MAX_OCCLUDER_FACE_VERTS];
+	int             hull[MAX_OCCLUDER_FACE_VERTS * 2];
+	int             i, j, k, t, lower;
+	float           hullArea;
+
+	if(face->numVerts < 3 || face->numVerts > MAX_OCCLUDER_FACE_VERTS)
+	{
+		return 0;
+	}
+
+	PerpendicularVector(axis[0], face->plane.normal);
+	CrossProduct(face->plane.normal, axis[0], axis[1]);
+
+	// sort the vertices along the face
+	for(i = 0; i < face->numVerts; i++)
+	{
+		u[i] = DotProduct(face->verts[i].xyz, axis[0]);
+		v[i] = DotProduct(face->verts[i].xyz, axis[1]);
+
+		for(j = i; j > 0; j--)
+		{
+			t = sorted[j - 1];
+			if(u[t] < u[i] || (u[t] == u[i] && v[t] <= v[i]))
+			{
+				break;
+			}
+			sorted[j] = t;
+		}
+		sorted[j] = i;
+	}
+
+	// monotone chain convex hull, counter clockwise around the face normal
+#define HULL_TURN(a, b, c) ((u[b] - u[a]) * (v[c] - v[a]) - (v[b] - v[a]) * (u[c] - u[a]))
+	k = 0;
+	for(i = 0; i < face->numVerts; i++)
+	{
+		while(k >= 2 && HULL_TURN(hull[k - 2], hull[k - 1], sorted[i]) <= 0)
+		{
+			k--;
+		}
+		hull[k++] = sorted[i];
+	}
+
+	lower = k + 1;
+	for(i = face->numVerts - 2; i >= 0; i--)
+	{
+		while(k >= lower && HULL_TURN(hull[k - 2], hull[k - 1], sorted[i]) <= 0)
+		{
+			k--;
+		}
+		hull[k++] = sorted[i];
+	}
+#undef HULL_TURN
+
+	// the last point is the first one again
+	k--;
+
+	if(k < 3 || k > MAX_OCCLUDER_VERTS)
+	{
+		return 0;
+	}
+
+	hullArea = 0;
+	for(i = 0; i < k; i++)
+	{
+		j = (i + 1) % k;
+
+		hullArea += 0.5f * (u[hull[i]] * v[hull[j]] - u[hull[j]] * v[hull[i]]);
+	}
+
+	// a concave face does not cover its whole hull
+	if(hullArea > area * 1.01f + 1.0f)
+	{
+		return 0;
+	}
+
+	for(i = 0; i < k; i++)
+	{
+		VectorCopy(face->verts[hull[i]].xyz, outline[i]);
+	}
+
+	return k;
+}
+
+/*
+=================
+R_IsOccluderSurface
+=================
+*/
+static int R_IsOccluderSurface(bspSurface_t * surf, vec3_t outline[MAX_OCCLUDER_VERTS])
+{
+	srfSurfaceFace_t *face;
+	shader_t       *shader;
+	srfTriangle_t  *tri;
+	vec3_t          d1, d2, cross;
+	float           area;
+	int             i;
+
+	if(*surf->data != SF_FACE)
+	{
+		return 0;
+	}
+
+	shader = surf->shader;
+	if(shader->sort != SS_OPAQUE || shader->translucent || shader->alphaTest || shader->isSky || shader->isPortal ||
+	   shader->polygonOffset || shader->numDeforms || shader->cullType != CT_FRONT_SIDED)
+	{
+		return 0;
+	}
+
+	face = (srfSurfaceFace_t *) surf->data;
+	if(face->plane.type == PLANE_NON_PLANAR)
+	{
+		return 0;
+	}
+
+	area = 0;
+	for(i = 0, tri = face->triangles; i < face->numTriangles; i++, tri++)
+	{
+		VectorSubtract(face->verts[tri->indexes[1]].xyz, face->verts[tri->indexes[0]].xyz, d1);
+		VectorSubtract(face->verts[tri->indexes[2]].xyz, face->verts[tri->indexes[0]].xyz, d2);
+		CrossProduct(d1, d2, cross);
+
+		area += 0.5f * VectorLength(cross);
+	}
+
+	if(area < OCCLUDER_MIN_AREA)
+	{
+		return 0;
+	}
+
+	return R_OccluderOutline(face, area, outline);
+}
+
+/*
+=================
+R_CreateOccluders
+
+Selects the large opaque world faces that are rendered into the occlusion buffer.
+Must be called after the leafs and submodels are loaded.
+=================
+*/
+void R_CreateOccluders(world_t * w)
+{
+	int             i, j, k;
+	int             numOccluders, numVerts;
+	int            *surfaceOccluders;
+	bspSurface_t   *surf;
+	bspNode_t      *leaf;
+	srfSurfaceFace_t *face;
+	occluder_t     *occ;
+	vec3_t          outline[MAX_OCCLUDER_VERTS];
+
+	w->numOccluders = 0;
+	w->occluders = NULL;
+	w->occluderVerts = NULL;
+
+	surfaceOccluders = ri.Hunk_AllocateTempMemory(w->numWorldSurfaces * sizeof(int));
+
+	numOccluders = 0;
+	numVerts = 0;
+	for(i = 0, surf = w->surfaces; i < w->numWorldSurfaces; i++, surf++)
+	{
+		k = R_IsOccluderSurface(surf, outline);
+		if(k)
+		{
+			surfaceOccluders[i] = numOccluders++;
+			numVerts += k;
+		}
+		else
+		{
+			surfaceOccluders[i] = -1;
+		}
+	}
+
+	if(numOccluders)
+	{
+		w->numOccluders = numOccluders;
+		w->occluders = ri.Hunk_Alloc(numOccluders * sizeof(occluder_t), h_low);
+		w->occluderVerts = ri.Hunk_Alloc(numVerts * sizeof(vec3_t), h_low);
+
+		numVerts = 0;
+		for(i = 0, surf = w->surfaces; i < w->numWorldSurfaces; i++, surf++)
+		{
+			if(surfaceOccluders[i] < 0)
+			{
+				continue;
+			}
+
+			face = (srfSurfaceFace_t *) surf->data;
+			occ = &w->occluders[surfaceOccluders[i]];
+
+			VectorCopy(face->bounds[0], occ->bounds[0]);
+			VectorCopy(face->bounds[1], occ->bounds[1]);
+			occ->plane = face->plane;
+			occ->firstVert = numVerts;
+			occ->numVerts = R_IsOccluderSurface(surf, outline);
+			occ->leaf = NULL;
+
+			for(j = 0; j < occ->numVerts; j++)
+			{
+				VectorCopy(outline[j], w->occluderVerts[numVerts]);
+				numVerts++;
+			}
+		}
+
+		// remember a leaf of every occluder so we can skip the ones outside the PVS
+		for(i = 0, leaf = w->nodes; i < w->numnodes; i++, leaf++)
+		{
+			if(leaf->contents == -1)
+			{
+				continue;
+			}
+
+			for(j = 0; j < leaf->numMarkSurfaces; j++)
+			{
+				k = leaf->markSurfaces[j] - w->surfaces;
+
+				if(k < 0 || k >= w->numWorldSurfaces || surfaceOccluders[k] < 0)
+				{
+					continue;
+				}
+
+				occ = &w->occluders[surfaceOccluders[k]];
+				if(!occ->leaf)
+				{
+					occ->leaf = leaf;
+				}
+			}
+		}
+	}
+
+	ri.Hunk_FreeTempMemory(surfaceOccluders);
+
+	ri.Printf(PRINT_DEVELOPER, "%i occluders with %i vertices\n", w->numOccluders, numVerts);
+}
+
+/*
+=================
+R_RenderOcclusionBuffer
+
+Renders the occluders of the current view, call after R_MarkLeaves
+=================
+*/
+void R_RenderOcclusionBuffer(void)
+{
+	int             i, j, r;
+	int             startTime;
+	occluder_t     *occ;
+	matrix_t        mvp;
+	occlusionBuffer_t *ob = &tr.occlusionBuffer;
+
+	if(!r_softwareOcclusionCulling->integer || !tr.world->numOccluders)
+	{
+		return;
+	}
+
+	// the virtual eye of a portal sits behind the portal geometry
+	if(tr.viewParms.isPortal)
+	{
+		return;
+	}
+
+	startTime = ri.Milliseconds();
+
+	if(!ob->depth)
+	{
+		R_InitOcclusionBuffer(ob, occlusionDepth, OCCLUSION_BUFFER_WIDTH, OCCLUSION_BUFFER_HEIGHT);
+	}
+
+	MatrixMultiply(tr.viewParms.projectionMatrix, tr.viewParms.world.modelViewMatrix, mvp);
+	R_ClearOcclusionBuffer(ob, mvp);
+
+	for(i = 0, occ = tr.world->occluders; i < tr.world->numOccluders; i++, occ++)
+	{
+		if(occ->leaf && occ->leaf->visCounts[tr.visIndex] != tr.visCounts[tr.visIndex])
+		{
+			continue;
+		}
+
+		// only the front side of the face is solid
+		if(DotProduct(tr.viewParms.orientation.origin, occ->plane.normal) - occ->plane.dist <= 0)
+		{
+			continue;
+		}
+
+		for(j = 0; j < FRUSTUM_PLANES; j++)
+		{
+			r = BoxOnPlaneSide(occ->bounds[0], occ->bounds[1], &tr.viewParms.frustums[0][j]);
+			if(r == 2)
+			{
+				break;
+			}
+		}
+
+		if(j != FRUSTUM_PLANES)
+		{
+			continue;
+		}
+
+		tr.pc.c_occluders++;
+
+		R_RasterizeOccluderPolygon(ob, occ->numVerts, &tr.world->occluderVerts[occ->firstVert]);
+
+		tr.pc.c_occluderTriangles += occ->numVerts - 2;
+	}
+
+	ob->viewCount = tr.viewCountNoReset;
+
+	tr.pc.c_occlusionBufferTime += ri.Milliseconds() - startTime;
+}
+
+/*
+=================
+R_CullOccludedBounds
+
+Tests world space bounds against the occlusion buffer of the current view
+=================
+*/
+qboolean R_CullOccludedBounds(const vec3_t mins, const vec3_t maxs)
+{
+	if(!r_softwareOcclusionCulling->integer || r_nocull->integer)
+	{
+		return qfalse;
+	}
+
+	if(tr.occlusionBuffer.viewCount != tr.viewCountNoReset)
+	{
+		return qfalse;
+	}
+
+	tr.pc.c_occlusionBufferTests++;
+
+	if(R_OcclusionBufferTestBounds(&tr.occlusionBuffer, mins, maxs))
+	{
+		tr.pc.c_occlusionBufferCulled++;
+		return qtrue;
+	}
+
+	return qfalse;
+}
@@ -26,7 +26,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "tr_types.h"
 
-#define	REF_API_VERSION		16
+#define	REF_API_VERSION		17
 
 // *INDENT-OFF*
 
@@ -109,7 +109,11 @@ typedef struct
 
 	void            (*RegisterFont) (const char *fontName, int pointSize, fontInfo_t * font);
 	// XreaL BEGIN
-	void            (*TakeVideoFrame) (int h, int w, byte * captureBuffer, byte * encodeBuffer, qboolean motionJpeg);
+	void            (*TakeVideoFrame) (int h, int w, byte * captureBuffer);
+	void            (*FinishVideoFrames) (void);
+
+	// thread safe, used by the video encoding threads of the client
+	int             (*SaveJPGToBuffer) (byte * buffer, size_t bufferSize, int quality, int imageWidth, int imageHeight, byte * imageBuffer);
 
 #if defined(USE_REFLIGHT)
 	void            (*AddRefLightToScene) (const refLight_t * light);
@@ -192,6 +196,7 @@ typedef struct
 	// a -1 return means the file does not exist
 	// NULL can be passed for buf to just determine existance
 	int             (*FS_FileIsInPAK) (const char *name, int *pChecksum);
+	int             (*FS_FileInPAKChecksum) (const char *name, int *pChecksum);
 	int             (*FS_ReadFile) (const char *name, void **buf);
 	void            (*FS_FreeFile) (void *buf);
 	char          **(*FS_ListFiles) (const char *name, const char *extension, int *numfilesfound);
@@ -209,7 +214,7 @@ typedef struct
 	void           *(*Sys_GetSystemHandles) (void);
 	
 	qboolean        (*CL_VideoRecording) (void);
-	void            (*CL_WriteAVIVideoFrame) (const byte * buffer, int size);
+	void            (*CL_WriteAVIVideoFrame) (const byte * buffer, int size);	// bottom up RGB rows without padding
 	// XreaL END
 
 	// input event handling
@@ -55,9 +55,13 @@ void R_ToggleSmpFrame(void)
 {
 	if(r_smp->integer)
 	{
-		// use the other buffers next frame, because another CPU
-		// may still be rendering into the current ones
-		tr.smpFrame ^= 1;
+		// use the next buffers in the ring, because another CPU
+		// may still be rendering from the current ones
+		tr.smpFrame = (tr.smpFrame + 1) % r_smpFrames->integer;
+
+		// the render thread may still be behind by r_smpFrames - 1 frames,
+		// wait until it has released the memory we are going to recycle
+		R_WaitSmpFrame(tr.smpFrame);
 	}
 	else
 	{
@@ -65,6 +69,7 @@ void R_ToggleSmpFrame(void)
 	}
 
 	backEndData[tr.smpFrame]->commands.used = 0;
+	backEndData[tr.smpFrame]->numLightClusters = 0;
 
 	r_firstSceneDrawSurf = 0;
 	r_firstSceneInteraction = 0;
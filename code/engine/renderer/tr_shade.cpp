@@ -69,6 +69,12 @@ void GLSL_InitGPUShaders(void)
 		gl_deferredLightingShader_projXYZ = new GLShader_deferredLighting_projXYZ();
 
 		gl_deferredLightingShader_directionalSun = new GLShader_deferredLighting_directionalSun();
+
+		// all unshadowed dynamic lights in a single pass
+		if(r_clusteredLighting->integer && glConfig2.textureFloatAvailable)
+		{
+			gl_deferredLightingShader_clustered = new GLShader_deferredLighting_clustered();
+		}
 	}
 	else
 	{
@@ -197,6 +203,12 @@ void GLSL_ShutdownGPUShaders(void)
 		gl_deferredLightingShader_omniXYZ = NULL;
 	}
 
+	if(gl_deferredLightingShader_clustered)
+	{
+		delete gl_deferredLightingShader_clustered;
+		gl_deferredLightingShader_clustered = NULL;
+	}
+
 	if(gl_depthToColorShader)
 	{
 		delete gl_depthToColorShader;
@@ -401,6 +413,20 @@ void Tess_DrawElements()
 				backEnd.pc.c_indexes += tess.multiDrawCounts[i];
 			}
 		}
+		else if(tess.numInstances > 1)
+		{
+			glDrawElementsInstanced(GL_TRIANGLES, tess.numIndexes, GL_INDEX_TYPE, BUFFER_OFFSET(0), tess.numInstances);
+
+			backEnd.pc.c_drawElements++;
+			backEnd.pc.c_instancedDraws++;
+			backEnd.pc.c_instances += tess.numInstances;
+
+			backEnd.pc.c_vboVertexes += tess.numVertexes * tess.numInstances;
+			backEnd.pc.c_vboIndexes += tess.numIndexes * tess.numInstances;
+
+			backEnd.pc.c_indexes += tess.numIndexes * tess.numInstances;
+			backEnd.pc.c_vertexes += tess.numVertexes * tess.numInstances;
+		}
 		else
 		{
 			glDrawElements(GL_TRIANGLES, tess.numIndexes, GL_INDEX_TYPE, BUFFER_OFFSET(0));
@@ -801,6 +827,9 @@ static void Render_vertexLighting_DBS_entity(int stage)
 
 	bool normalMapping = r_normalMapping->integer && (pStage->bundle[TB_NORMALMAP].image[0] != NULL);
 
+	// the entities of an instanced draw pass their transforms and light through u_InstanceData
+	bool instancing = glConfig2.drawInstancedAvailable && tess.numInstances > 1;
+
 	// choose right shader program ----------------------------------
 	gl_vertexLightingShader_DBS_entity->SetPortalClipping(backEnd.viewParms.isPortal);
 	gl_vertexLightingShader_DBS_entity->SetAlphaTesting((pStage->stateBits & GLS_ATEST_BITS) != 0);
@@ -813,7 +842,9 @@ static void Render_vertexLighting_DBS_entity(int stage)
 	gl_vertexLightingShader_DBS_entity->SetNormalMapping(normalMapping);
 	gl_vertexLightingShader_DBS_entity->SetParallaxMapping(normalMapping && r_parallaxMapping->integer && tess.surfaceShader->parallax);
 
-	gl_vertexLightingShader_DBS_entity->SetReflectiveSpecular(normalMapping && tr.cubeHashTable != NULL);
+	gl_vertexLightingShader_DBS_entity->SetReflectiveSpecular(normalMapping && tr.cubeHashTable != NULL && !instancing);
+
+	gl_vertexLightingShader_DBS_entity->SetInstancing(instancing);
 
 //	gl_vertexLightingShader_DBS_entity->SetMacro_TWOSIDED(tess.surfaceShader->cullType);
 
@@ -828,6 +859,11 @@ static void Render_vertexLighting_DBS_entity(int stage)
 		gl_vertexLightingShader_DBS_entity->SetUniform_BoneMatrix(MAX_BONES, tess.boneMatrices);
 	}
 
+	if(instancing)
+	{
+		gl_vertexLightingShader_DBS_entity->SetUniform_InstanceData(tess.numInstances, tess.instanceData);
+	}
+
 	// set uniforms
 	VectorCopy(backEnd.viewParms.orientation.origin, viewOrigin);	// in world space
 	VectorCopy(backEnd.currentEntity->ambientLight, ambientColor);
@@ -915,7 +951,7 @@ static void Render_vertexLighting_DBS_entity(int stage)
 		gl_vertexLightingShader_DBS_entity->SetUniform_SpecularTextureMatrix(tess.svars.texMatrices[TB_SPECULARMAP]);
 
 
-		if(tr.cubeHashTable != NULL)
+		if(tr.cubeHashTable != NULL && !instancing)
 		{
 			cubemapProbe_t *cubeProbeNearest;
 			cubemapProbe_t *cubeProbeSecondNearest;
@@ -1625,6 +1661,12 @@ static void Render_shadowFill(int stage)
 	stateBits = pStage->stateBits;
 	stateBits &= ~(GLS_SRCBLEND_BITS | GLS_DSTBLEND_BITS);
 
+	if(backEnd.shadowCache.pass == SHADOWCACHE_DYNAMIC)
+	{
+		// merge with the cached static casters, the blend equation is GL_MIN
+		stateBits |= GLS_SRCBLEND_ONE | GLS_DSTBLEND_ONE;
+	}
+
 	GL_State(stateBits);
 
 
@@ -1905,7 +1947,7 @@ static void Render_forwardLighting_DBS_omni(shaderStage_t * diffuseStage,
 	if(shadowCompare)
 	{
 		GL_SelectTexture(5);
-		GL_Bind(tr.shadowCubeFBOImage[light->shadowLOD]);
+		GL_Bind(RB_ShadowCubeImage(light));
 	}
 
 	// bind u_RandomMap
@@ -4453,6 +4495,7 @@ void Tess_End()
 	}
 
 	tess.vboVertexSkinning = qfalse;
+	tess.numInstances = 0;
 
 	// clear shader so we can tell we don't have any unclosed surfaces
 	tess.multiDrawPrimitives = 0;
@@ -216,9 +216,103 @@ static float GetOpValue(const expOperation_t * op)
 	return value;
 }
 
-float RB_EvalExpression(const expression_t * exp, float defaultValue)
+static float EvalTableOp(int tableIndex, float value1)
+{
+	shaderTable_t  *table;
+	int             numValues;
+	float           index;
+	float           lerp;
+	int             oldIndex;
+	int             newIndex;
+
+	table = tr.shaderTables[tableIndex];
+
+	numValues = table->numValues;
+
+	index = value1 * numValues;	// float index into the table?s elements
+	lerp = index - floor(index);	// being inbetween two elements of the table
+
+	oldIndex = (int)index;
+	newIndex = (int)index + 1;
+
+	if(table->clamp)
+	{
+		// clamp indices to table-range
+		Q_clamp(oldIndex, 0, numValues - 1);
+		Q_clamp(newIndex, 0, numValues - 1);
+	}
+	else
+	{
+		// wrap around indices
+		oldIndex %= numValues;
+		newIndex %= numValues;
+	}
+
+	if(table->snap)
+	{
+		// use fixed value
+		return table->values[oldIndex];
+	}
+
+	// lerp value
+	return table->values[oldIndex] + ((table->values[newIndex] - table->values[oldIndex]) * lerp);
+}
+
+static float EvalBinaryOp(opcode_t type, float value1, float value2)
+{
+	switch (type)
+	{
+		case OP_LAND:
+			return value1 && value2;
+
+		case OP_LOR:
+			return value1 || value2;
+
+		case OP_GE:
+			return value1 >= value2;
+
+		case OP_LE:
+			return value1 <= value2;
+
+		case OP_LEQ:
+			return value1 == value2;
+
+		case OP_LNE:
+			return value1 != value2;
+
+		case OP_ADD:
+			return value1 + value2;
+
+		case OP_SUB:
+			return value1 - value2;
+
+		case OP_DIV:
+			if(value2 == 0)
+			{
+				// don't divide by zero
+				return value1;
+			}
+			return value1 / value2;
+
+		case OP_MOD:
+			return (float)((int)value1 % (int)value2);
+
+		case OP_MUL:
+			return value1 * value2;
+
+		case OP_LT:
+			return value1 < value2;
+
+		case OP_GT:
+			return value1 > value2;
+
+		default:
+			return 0;
+	}
+}
+
+static float RB_InterpretExpression(const expression_t * exp, float defaultValue)
 {
-#if 1
 	int             i;
 	expOperation_t  op;
 	expOperation_t  ops[MAX_EXPRESSION_OPS];
@@ -233,11 +327,6 @@ float RB_EvalExpression(const expression_t * exp, float defaultValue)
 	value1 = 0;
 	value2 = 0;
 
-	if(!exp || !exp->active)
-	{
-		return defaultValue;
-	}
-
 	// http://www.qiksearch.com/articles/cs/postfix-evaluation/
 	// http://www.kyz.uklinux.net/evaluate/
 
@@ -301,13 +390,6 @@ float RB_EvalExpression(const expression_t * exp, float defaultValue)
 
 			case OP_TABLE:
 			{
-				shaderTable_t  *table;
-				int             numValues;
-				float           index;
-				float           lerp;
-				int             oldIndex;
-				int             newIndex;
-
 				if(numOps < 1)
 				{
 					ri.Printf(PRINT_ALL, "WARNING: shader %s has numOps < 1 for table operator\n", tess.surfaceShader->name);
@@ -317,41 +399,9 @@ float RB_EvalExpression(const expression_t * exp, float defaultValue)
 				value1 = GetOpValue(&ops[numOps - 1]);
 				numOps--;
 
-				table = tr.shaderTables[(int)op.value];
+				value = EvalTableOp((int)op.value, value1);
 
-				numValues = table->numValues;
-
-				index = value1 * numValues;	// float index into the table?s elements
-				lerp = index - floor(index);	// being inbetween two elements of the table
-
-				oldIndex = (int)index;
-				newIndex = (int)index + 1;
-
-				if(table->clamp)
-				{
-					// clamp indices to table-range
-					Q_clamp(oldIndex, 0, numValues - 1);
-					Q_clamp(newIndex, 0, numValues - 1);
-				}
-				else
-				{
-					// wrap around indices
-					oldIndex %= numValues;
-					newIndex %= numValues;
-				}
-
-				if(table->snap)
-				{
-					// use fixed value
-					value = table->values[oldIndex];
-				}
-				else
-				{
-					// lerp value
-					value = table->values[oldIndex] + ((table->values[newIndex] - table->values[oldIndex]) * lerp);
-				}
-
-				//ri.Printf(PRINT_ALL, "%s: %i %i %f\n", table->name, oldIndex, newIndex, value);
+				//ri.Printf(PRINT_ALL, "%s: %f\n", tr.shaderTables[(int)op.value]->name, value);
 
 				// push result
 				op.type = OP_NUM;
@@ -375,72 +425,7 @@ float RB_EvalExpression(const expression_t * exp, float defaultValue)
 				value1 = GetOpValue(&ops[numOps - 1]);
 				numOps--;
 
-				switch (op.type)
-				{
-					case OP_LAND:
-						value = value1 && value2;
-						break;
-
-					case OP_LOR:
-						value = value1 || value2;
-						break;
-
-					case OP_GE:
-						value = value1 >= value2;
-						break;
-
-					case OP_LE:
-						value = value1 <= value2;
-						break;
-
-					case OP_LEQ:
-						value = value1 == value2;
-						break;
-
-					case OP_LNE:
-						value = value1 != value2;
-						break;
-
-					case OP_ADD:
-						value = value1 + value2;
-						break;
-
-					case OP_SUB:
-						value = value1 - value2;
-						break;
-
-					case OP_DIV:
-						if(value2 == 0)
-						{
-							// don't divide by zero
-							value = value1;
-						}
-						else
-						{
-							value = value1 / value2;
-						}
-						break;
-
-					case OP_MOD:
-						value = (float)((int)value1 % (int)value2);
-						break;
-
-					case OP_MUL:
-						value = value1 * value2;
-						break;
-
-					case OP_LT:
-						value = value1 < value2;
-						break;
-
-					case OP_GT:
-						value = value1 > value2;
-						break;
-
-					default:
-						value = value1 = value2 = 0;
-						break;
-				}
+				value = EvalBinaryOp(op.type, value1, value2);
 
 				//ri.Printf(PRINT_ALL, "%s: %f %f %f\n", opStrings[op.type].s, value, value1, value2);
 
@@ -454,11 +439,243 @@ float RB_EvalExpression(const expression_t * exp, float defaultValue)
 	}
 
 	return GetOpValue(&ops[0]);
+}
+
+/*
+RB_EvalExpression is called for every batch so the result is memoized in the
+expression until the frame, the time or, for expressions reading the parm
+registers, the current entity or light changes
+*/
+float RB_EvalExpression(const expression_t * exp, float defaultValue)
+{
+#if 1
+	expression_t   *cache;
+
+	if(!exp || !exp->active)
+	{
+		return defaultValue;
+	}
+
+	// constant folded by R_CompileExpression
+	if(!exp->dependencies && exp->numOps == 1 && exp->ops[0].type == OP_NUM)
+	{
+		return exp->ops[0].value;
+	}
+
+	// the memo is not part of the material description
+	cache = (expression_t *) exp;
+
+	if(cache->cacheValid && cache->cacheFrame == backEnd.viewParms.frameCount && cache->cacheTime == backEnd.refdef.floatTime &&
+	   (!(exp->dependencies & EXP_DEPENDS_ENTITY) ||
+		(cache->cacheEntity == backEnd.currentEntity && cache->cacheLight == backEnd.currentLight)))
+	{
+		return cache->cacheValue;
+	}
+
+	cache->cacheValue = RB_InterpretExpression(exp, defaultValue);
+	cache->cacheFrame = backEnd.viewParms.frameCount;
+	cache->cacheTime = backEnd.refdef.floatTime;
+	cache->cacheEntity = backEnd.currentEntity;
+	cache->cacheLight = backEnd.currentLight;
+	cache->cacheValid = qtrue;
+
+	return cache->cacheValue;
 #else
 	return defaultValue;
 #endif
 }
 
+typedef struct
+{
+	int             firstOp;	// first op of this operand in the output program
+	qboolean        constant;
+	float           value;
+} expOperand_t;
+
+static qboolean IsConstantOp(opcode_t type)
+{
+	return type == OP_NUM || type == OP_FRAGMENTSHADERS || type == OP_FRAMEBUFFEROBJECTS;
+}
+
+static void PushConstantOperand(expression_t * exp, expOperand_t * operand, int firstOp, float value)
+{
+	exp->numOps = firstOp;
+	exp->ops[exp->numOps].type = OP_NUM;
+	exp->ops[exp->numOps].value = value;
+	exp->numOps++;
+
+	operand->firstOp = firstOp;
+	operand->constant = qtrue;
+	operand->value = value;
+}
+
+/*
+=================
+R_CompileExpression
+
+Folds constant subexpressions of a parsed postfix expression, removes
+operations that can't change the result like "x * 1" or "x + 0" and records
+which inputs the remaining program reads.
+=================
+*/
+void R_CompileExpression(expression_t * exp, const char *shaderName)
+{
+	int             i;
+	expOperation_t  op;
+	expOperation_t  ops[MAX_EXPRESSION_OPS];
+	int             numOps;
+	expOperand_t    stack[MAX_EXPRESSION_OPS];
+	int             numStack;
+	expOperand_t   *a, *b;
+	extern const opstring_t opStrings[];
+
+	exp->dependencies = 0;
+	exp->cacheValid = qfalse;
+
+	if(!exp->active || !exp->numOps)
+	{
+		return;
+	}
+
+	numOps = exp->numOps;
+	Com_Memcpy(ops, exp->ops, numOps * sizeof(ops[0]));
+
+	exp->numOps = 0;
+	numStack = 0;
+
+	for(i = 0; i < numOps; i++)
+	{
+		op = ops[i];
+
+		if(op.type == OP_BAD)
+		{
+			exp->active = qfalse;
+			return;
+		}
+
+		if(op.type == OP_NEG || op.type == OP_TABLE)
+		{
+			if(numStack < 1)
+			{
+				ri.Printf(PRINT_WARNING, "WARNING: shader %s has numOps < 1 for %s operator\n", shaderName,
+						  op.type == OP_NEG ? "unary -" : "table");
+				exp->active = qfalse;
+				return;
+			}
+
+			a = &stack[numStack - 1];
+
+			if(a->constant)
+			{
+				PushConstantOperand(exp, a, a->firstOp, op.type == OP_NEG ? -a->value : EvalTableOp((int)op.value, a->value));
+			}
+			else
+			{
+				exp->ops[exp->numOps++] = op;
+			}
+		}
+		else if(op.type < OP_NUM)
+		{
+			// binary operator
+			if(numStack < 2)
+			{
+				ri.Printf(PRINT_WARNING, "WARNING: shader %s has numOps < 2 for binary operator %s\n", shaderName, opStrings[op.type].s);
+				exp->active = qfalse;
+				return;
+			}
+
+			a = &stack[numStack - 2];
+			b = &stack[numStack - 1];
+			numStack--;
+
+			if(a->constant && b->constant && !(op.type == OP_MOD && (int)b->value == 0))
+			{
+				PushConstantOperand(exp, a, a->firstOp, EvalBinaryOp(op.type, a->value, b->value));
+			}
+			else if((b->constant && b->value == 0 && (op.type == OP_MUL || op.type == OP_LAND)) ||
+					(a->constant && a->value == 0 && (op.type == OP_MUL || op.type == OP_LAND)))
+			{
+				PushConstantOperand(exp, a, a->firstOp, 0);
+			}
+			else if((b->constant && b->value != 0 && op.type == OP_LOR) || (a->constant && a->value != 0 && op.type == OP_LOR))
+			{
+				PushConstantOperand(exp, a, a->firstOp, 1);
+			}
+			else if(b->constant && ((b->value == 0 && (op.type == OP_ADD || op.type == OP_SUB)) ||
+									(b->value == 1 && (op.type == OP_MUL || op.type == OP_DIV))))
+			{
+				// drop the neutral right operand
+				exp->numOps = b->firstOp;
+			}
+			else if(a->constant && ((a->value == 0 && op.type == OP_ADD) || (a->value == 1 && op.type == OP_MUL)))
+			{
+				// drop the neutral left operand, the right one becomes the result
+				memmove(&exp->ops[a->firstOp], &exp->ops[b->firstOp], (exp->numOps - b->firstOp) * sizeof(exp->ops[0]));
+				exp->numOps -= b->firstOp - a->firstOp;
+				a->constant = qfalse;
+			}
+			else
+			{
+				exp->ops[exp->numOps++] = op;
+				a->constant = qfalse;
+			}
+		}
+		else if(IsConstantOp(op.type))
+		{
+			stack[numStack].firstOp = exp->numOps;
+			numStack++;
+
+			PushConstantOperand(exp, &stack[numStack - 1], exp->numOps, GetOpValue(&op));
+		}
+		else
+		{
+			// variable operand
+			stack[numStack].firstOp = exp->numOps;
+			stack[numStack].constant = qfalse;
+			stack[numStack].value = 0;
+			numStack++;
+
+			exp->ops[exp->numOps++] = op;
+		}
+	}
+
+	// record the inputs of what is left after folding
+	for(i = 0; i < exp->numOps; i++)
+	{
+		switch (exp->ops[i].type)
+		{
+			case OP_NUM:
+			case OP_NEG:
+			case OP_TABLE:
+			case OP_FRAGMENTSHADERS:
+			case OP_FRAMEBUFFEROBJECTS:
+				break;
+
+			case OP_PARM0:
+			case OP_PARM1:
+			case OP_PARM2:
+			case OP_PARM3:
+			case OP_PARM4:
+			case OP_PARM5:
+			case OP_PARM6:
+			case OP_PARM7:
+			case OP_PARM8:
+			case OP_PARM9:
+			case OP_PARM10:
+			case OP_PARM11:
+				exp->dependencies |= EXP_DEPENDS_ENTITY;
+				break;
+
+			default:
+				if(exp->ops[i].type >= OP_NUM)
+				{
+					exp->dependencies |= EXP_DEPENDS_TIME;
+				}
+				break;
+		}
+	}
+}
+
 /*
 ====================================================================
 
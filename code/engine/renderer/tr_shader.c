@@ -879,6 +879,8 @@ static void ParseExpression(char **text, expression_t * exp)
 	// everything went ok
 	exp->active = qtrue;
 
+	R_CompileExpression(exp, shader.name);
+
 #if 0
 	ri.Printf(PRINT_ALL, "postfix:\n");
 	for(i = 0; i < exp->numOps; i++)
@@ -6032,566 +6034,827 @@ void R_ShaderExp_f(void)
 
 /*
 ====================
-ScanAndLoadShaderGuides
+MATERIAL DATABASE
+
+The compressed text of every guide and material file that comes from a pak is
+stored in MATERIALDB_FILE together with the offsets of the guides, tables and
+shaders it defines, keyed by the file name and the content checksum of its pak.
+Files found in there don't have to be read, compressed and tokenized again.
+Loose files are always parsed from text so new and overriding materials
+show up without rebuilding anything.
+
+The database holds text, not tokens, and guides are not resolved ahead of time.
+ParseShader and the guide instantiation work on COM_ParseExt text, so every
+R_FindShader miss still tokenizes and parses the shader as before. What the
+database saves is reading, compressing and scanning the files at init; the
+per-shader cost at level load is unchanged. There is no offline build step
+either, the engine writes the database itself when it finds it out of date.
+====================
+*/
+#define	MAX_GUIDE_FILES		1024
+#define	MAX_SHADER_FILES	4096
 
-Finds and loads all .guide files, combining them into
-a single large text block that can be scanned for shader template names
-=====================
+#define MATERIALDB_FILE		"materials.mdb"
+#define MATERIALDB_IDENT	(('B' << 24) + ('D' << 16) + ('M' << 8) + 'X')
+#define MATERIALDB_VERSION	1
+
+typedef enum
+{
+	MTR_SHADER,
+	MTR_GUIDE,
+	MTR_TABLE
+} materialEntryType_t;
+
+typedef struct
+{
+	int             type;
+	int             offset;		// points behind the keyword into the compressed file text
+} materialEntry_t;
+
+typedef struct
+{
+	char            name[MAX_QPATH];
+	int             checksum;	// of the pak holding the file, 0 for loose files
+	char           *text;
+	int             textLength;	// including the trailing zero
+	int             numEntries;
+	materialEntry_t *entries;
+	struct materialDBRecord_s *record;	// NULL if the file is parsed from text
+} materialFile_t;
+
+// record header in the database, followed by numEntries entries and the text
+typedef struct materialDBRecord_s
+{
+	char            name[MAX_QPATH];
+	int             checksum;
+	int             textLength;
+	int             numEntries;
+} materialDBRecord_t;
+
+static void    *s_materialDB;
+static materialDBRecord_t **s_materialDBRecords;
+static int      s_materialDBNumRecords;
+static int      s_materialDBNextRecord;
+static int      s_materialDBNumUsed;
+static qboolean s_materialDBChanged;
+
+static materialFile_t *s_materialFiles;
+static int      s_numMaterialFiles;
+
+static int R_MaterialDBRecordSize(int textLength, int numEntries)
+{
+	return sizeof(materialDBRecord_t) + numEntries * sizeof(materialEntry_t) + ((textLength + 3) & ~3);
+}
+
+/*
+====================
+R_BeginMaterialDB
+====================
 */
-#define	MAX_GUIDE_FILES	1024
-static void ScanAndLoadGuideFiles(void)
+static void R_BeginMaterialDB(void)
 {
-	char          **guideFiles;
-	char           *buffers[MAX_GUIDE_FILES];
-	char           *p;
-	int             numGuides;
+	int             length;
 	int             i;
-	char           *oldp, *token, *hashMem;
-	int             guideTextHashTableSizes[MAX_GUIDETEXT_HASH], hash, size;
-	char            filename[MAX_QPATH];
-	long            sum = 0;
-
-	ri.Printf(PRINT_ALL, "----- ScanAndLoadGuideFiles -----\n");
+	int             ofs;
+	int            *header;
+	char           *text;
+	materialDBRecord_t *record;
 
-	s_guideText = NULL;
-	Com_Memset(guideTextHashTableSizes, 0, sizeof(guideTextHashTableSizes));
-	Com_Memset(guideTextHashTable, 0, sizeof(guideTextHashTable));
+	s_materialDB = NULL;
+	s_materialDBRecords = NULL;
+	s_materialDBNumRecords = 0;
+	s_materialDBNextRecord = 0;
+	s_materialDBNumUsed = 0;
+	s_materialDBChanged = qfalse;
 
-	// scan for guide files
-	guideFiles = ri.FS_ListFiles("guides", ".guide", &numGuides);
+	s_materialFiles = Com_Allocate((MAX_GUIDE_FILES + MAX_SHADER_FILES) * sizeof(materialFile_t));
+	s_numMaterialFiles = 0;
 
-	if(!guideFiles || !numGuides)
+	if(!r_cacheMaterials->integer)
 	{
-		ri.Printf(PRINT_WARNING, "WARNING: no shader guide files found\n");
 		return;
 	}
 
-	if(numGuides > MAX_GUIDE_FILES)
+	length = ri.FS_ReadFile(MATERIALDB_FILE, &s_materialDB);
+
+	if(!s_materialDB)
 	{
-		numGuides = MAX_GUIDE_FILES;
+		s_materialDBChanged = qtrue;
+		return;
 	}
 
-	// build single large buffer
-	for(i = 0; i < numGuides; i++)
-	{
-		Com_sprintf(filename, sizeof(filename), "guides/%s", guideFiles[i]);
+	header = (int *)s_materialDB;
 
-		sum += ri.FS_ReadFile(filename, NULL);
+	if(length < (int)(3 * sizeof(int)) || LittleLong(header[0]) != MATERIALDB_IDENT || LittleLong(header[1]) != MATERIALDB_VERSION ||
+	   LittleLong(header[2]) < 0 || LittleLong(header[2]) > MAX_GUIDE_FILES + MAX_SHADER_FILES)
+	{
+		ri.Printf(PRINT_WARNING, "WARNING: %s is outdated, rebuilding\n", MATERIALDB_FILE);
+		ri.FS_FreeFile(s_materialDB);
+		s_materialDB = NULL;
+		s_materialDBChanged = qtrue;
+		return;
 	}
-	s_guideText = ri.Hunk_Alloc(sum + numGuides * 2, h_low);
 
-	// load in reverse order, so doubled templates are overriden properly
-	for(i = numGuides - 1; i >= 0; i--)
+	s_materialDBNumRecords = LittleLong(header[2]);
+	s_materialDBRecords = Com_Allocate((s_materialDBNumRecords + 1) * sizeof(materialDBRecord_t *));
+
+	ofs = 3 * sizeof(int);
+	for(i = 0; i < s_materialDBNumRecords; i++)
 	{
-		Com_sprintf(filename, sizeof(filename), "guides/%s", guideFiles[i]);
+		int             textLength, numEntries;
+
+		record = (materialDBRecord_t *) ((byte *) s_materialDB + ofs);
+
+		if(ofs + (int)sizeof(materialDBRecord_t) > length)
+		{
+			break;
+		}
+
+		textLength = LittleLong(record->textLength);
+		numEntries = LittleLong(record->numEntries);
+
+		if(textLength <= 0 || numEntries < 0 || textLength > length || numEntries > length ||
+		   ofs + R_MaterialDBRecordSize(textLength, numEntries) > length)
+		{
+			break;
+		}
 
-		ri.Printf(PRINT_DEVELOPER, "...loading '%s'\n", filename);
-		sum += ri.FS_ReadFile(filename, (void **)&buffers[i]);
-		if(!buffers[i])
+		text = (char *)(record + 1) + numEntries * sizeof(materialEntry_t);
+		if(text[textLength - 1] != '\0')
 		{
-			ri.Error(ERR_DROP, "Couldn't load %s", filename);
+			break;
 		}
 
-		strcat(s_guideText, "\n");
-		p = &s_guideText[strlen(s_guideText)];
-		strcat(s_guideText, buffers[i]);
-		ri.FS_FreeFile(buffers[i]);
-		buffers[i] = p;
-		Com_Compress(p);
+		s_materialDBRecords[i] = record;
+		ofs += R_MaterialDBRecordSize(textLength, numEntries);
 	}
 
-	size = 0;
-	//
-	for(i = 0; i < numGuides; i++)
+	if(i != s_materialDBNumRecords)
 	{
-		Com_sprintf(filename, sizeof(filename), "guides/%s", guideFiles[i]);
+		ri.Printf(PRINT_WARNING, "WARNING: %s is corrupt, rebuilding\n", MATERIALDB_FILE);
+		s_materialDBNumRecords = 0;
+		s_materialDBChanged = qtrue;
+	}
+}
 
-		Com_BeginParseSession(filename);
+/*
+====================
+R_FindMaterialDBRecord
 
-		// pointer to the first shader file
-		p = buffers[i];
+The file lists come in the same order as the last time
+so the next record is usually the one we are looking for
+====================
+*/
+static materialDBRecord_t *R_FindMaterialDBRecord(const char *name, int checksum)
+{
+	int             i, j;
+	materialDBRecord_t *record;
 
-		// look for label
-		while(1)
+	for(i = 0; i < s_materialDBNumRecords; i++)
+	{
+		j = (s_materialDBNextRecord + i) % s_materialDBNumRecords;
+		record = s_materialDBRecords[j];
+
+		if(LittleLong(record->checksum) == checksum && !Q_strncmp(record->name, name, sizeof(record->name)))
 		{
-			token = Com_ParseExt(&p, qtrue);
-			if(token[0] == 0)
-			{
-				break;
-			}
+			s_materialDBNextRecord = j + 1;
+			s_materialDBNumUsed++;
+			return record;
+		}
+	}
 
-			if(Q_stricmp(token, "guide") && Q_stricmp(token, "inlineGuide"))
-			{
-				Com_ParseWarning("expected guide or inlineGuide found '%s'\n", token);
-				break;
-			}
+	return NULL;
+}
 
-			// parse guide name
-			token = Com_ParseExt(&p, qtrue);
+/*
+====================
+R_EndMaterialDB
 
-			//ri.Printf(PRINT_ALL, "guide: '%s'\n", token);
+Writes the database again if any pak file was missing from it
+====================
+*/
+static void R_EndMaterialDB(void)
+{
+	int             i, j;
+	int             size;
+	int             numRecords;
+	byte           *buffer, *p;
+	materialFile_t *file;
+	materialDBRecord_t *record;
+	materialEntry_t *entry;
 
-			hash = generateHashValue(token, MAX_GUIDETEXT_HASH);
-			guideTextHashTableSizes[hash]++;
-			size++;
+	if(s_materialDBNumUsed != s_materialDBNumRecords)
+	{
+		// records of files that are gone
+		s_materialDBChanged = qtrue;
+	}
 
-			// skip parameters
-			token = Com_ParseExt(&p, qtrue);
-			if(Q_stricmp(token, "("))
-			{
-				Com_ParseWarning("expected ( found '%s'\n", token);
-				break;
-			}
+	if(r_cacheMaterials->integer && s_materialDBChanged)
+	{
+		size = 3 * sizeof(int);
+		numRecords = 0;
 
-			while(1)
+		for(i = 0, file = s_materialFiles; i < s_numMaterialFiles; i++, file++)
+		{
+			if(file->checksum)
 			{
-				token = Com_ParseExt(&p, qtrue);
+				size += R_MaterialDBRecordSize(file->textLength, file->numEntries);
+				numRecords++;
+			}
+		}
 
-				if(!token[0])
-					break;
+		buffer = ri.Hunk_AllocateTempMemory(size);
+		Com_Memset(buffer, 0, size);
 
-				if(!Q_stricmp(token, ")"))
-					break;
-			}
+		((int *)buffer)[0] = LittleLong(MATERIALDB_IDENT);
+		((int *)buffer)[1] = LittleLong(MATERIALDB_VERSION);
+		((int *)buffer)[2] = LittleLong(numRecords);
+		p = buffer + 3 * sizeof(int);
 
-			if(Q_stricmp(token, ")"))
+		for(i = 0, file = s_materialFiles; i < s_numMaterialFiles; i++, file++)
+		{
+			if(!file->checksum)
 			{
-				Com_ParseWarning("expected ) found '%s'\n", token);
-				break;
+				continue;
 			}
 
-			// skip guide body
-			Com_SkipBracedSection(&p);
+			record = (materialDBRecord_t *) p;
+			Q_strncpyz(record->name, file->name, sizeof(record->name));
+			record->checksum = LittleLong(file->checksum);
+			record->textLength = LittleLong(file->textLength);
+			record->numEntries = LittleLong(file->numEntries);
 
-			// if we passed the pointer to the next shader file
-			if(i < numGuides - 1)
+			entry = (materialEntry_t *) (record + 1);
+			for(j = 0; j < file->numEntries; j++, entry++)
 			{
-				if(p > buffers[i + 1])
-				{
-					break;
-				}
+				entry->type = LittleLong(file->entries[j].type);
+				entry->offset = LittleLong(file->entries[j].offset);
 			}
+
+			// the files are joined by line breaks in the hunk
+			Com_Memcpy(entry, file->text, file->textLength - 1);
+
+			p += R_MaterialDBRecordSize(file->textLength, file->numEntries);
+		}
+
+		ri.Printf(PRINT_ALL, "...writing %s with %i files\n", MATERIALDB_FILE, numRecords);
+		ri.FS_WriteFile(MATERIALDB_FILE, buffer, size);
+
+		ri.Hunk_FreeTempMemory(buffer);
+	}
+
+	for(i = 0; i < s_numMaterialFiles; i++)
+	{
+		if(s_materialFiles[i].entries)
+		{
+			Com_Dealloc(s_materialFiles[i].entries);
 		}
 	}
 
-	size += MAX_GUIDETEXT_HASH;
+	Com_Dealloc(s_materialFiles);
+	s_materialFiles = NULL;
+	s_numMaterialFiles = 0;
 
-	hashMem = ri.Hunk_Alloc(size * sizeof(char *), h_low);
+	if(s_materialDBRecords)
+	{
+		Com_Dealloc(s_materialDBRecords);
+		s_materialDBRecords = NULL;
+	}
 
-	for(i = 0; i < MAX_GUIDETEXT_HASH; i++)
+	if(s_materialDB)
 	{
-		guideTextHashTable[i] = (char **)hashMem;
-		hashMem = ((char *)hashMem) + ((guideTextHashTableSizes[i] + 1) * sizeof(char *));
+		ri.FS_FreeFile(s_materialDB);
+		s_materialDB = NULL;
 	}
+}
 
-	Com_Memset(guideTextHashTableSizes, 0, sizeof(guideTextHashTableSizes));
-	//
-	for(i = 0; i < numGuides; i++)
+static qboolean SkipGuideParameters(char **text)
+{
+	char           *token;
+
+	token = Com_ParseExt(text, qtrue);
+	if(Q_stricmp(token, "("))
+	{
+		Com_ParseWarning("expected ( found '%s'\n", token);
+		return qfalse;
+	}
+
+	while(1)
 	{
-		Com_sprintf(filename, sizeof(filename), "guides/%s", guideFiles[i]);
+		token = Com_ParseExt(text, qtrue);
 
-		Com_BeginParseSession(filename);
+		if(!token[0])
+			break;
 
-		// pointer to the first shader file
-		p = buffers[i];
+		if(!Q_stricmp(token, ")"))
+			break;
+	}
 
-		// look for label
-		while(1)
+	if(Q_stricmp(token, ")"))
+	{
+		Com_ParseWarning("expected ) found '%s'\n", token);
+		return qfalse;
+	}
+
+	return qtrue;
+}
+
+/*
+====================
+IndexMaterialText
+
+Finds the guides, tables and shaders in the compressed text of a single file.
+Returns the number of entries, pass NULL to only count them.
+====================
+*/
+static int IndexMaterialText(char *text, materialEntry_t * entries, qboolean guideFile)
+{
+	char           *p, *oldp, *token;
+	int             numEntries;
+	int             type, offset;
+
+	numEntries = 0;
+
+	// look for label
+	p = text;
+	while(1)
+	{
+		oldp = p;
+		token = Com_ParseExt(&p, qtrue);
+		if(token[0] == 0)
 		{
-			token = Com_ParseExt(&p, qtrue);
-			if(token[0] == 0)
-			{
-				break;
-			}
+			break;
+		}
 
+		if(guideFile)
+		{
 			if(Q_stricmp(token, "guide") && Q_stricmp(token, "inlineGuide"))
 			{
 				Com_ParseWarning("expected guide or inlineGuide found '%s'\n", token);
 				break;
 			}
 
-			// parse guide name
-			oldp = p;
-			token = Com_ParseExt(&p, qtrue);
-
-			//ri.Printf(PRINT_ALL, "...hashing guide '%s'\n", token);
+			type = MTR_GUIDE;
+			offset = p - text;
+		}
+		// shader tables
+		else if(!Q_stricmp(token, "table"))
+		{
+			type = MTR_TABLE;
+			offset = p - text;
+		}
+		// support shader templates
+		else if(!Q_stricmp(token, "guide"))
+		{
+			type = MTR_GUIDE;
+			offset = p - text;
+		}
+		else
+		{
+			type = MTR_SHADER;
+			offset = oldp - text;
+		}
 
-			hash = generateHashValue(token, MAX_GUIDETEXT_HASH);
-			guideTextHashTable[hash][guideTextHashTableSizes[hash]++] = oldp;
+		if(entries)
+		{
+			entries[numEntries].type = type;
+			entries[numEntries].offset = offset;
+		}
+		numEntries++;
 
-			// skip parameters
+		if(guideFile)
+		{
+			// skip guide name, parameters and body
 			token = Com_ParseExt(&p, qtrue);
-			if(Q_stricmp(token, "("))
+
+			if(!SkipGuideParameters(&p))
 			{
-				Com_ParseWarning("expected ( found '%s'\n", token);
 				break;
 			}
 
-			while(1)
-			{
-				token = Com_ParseExt(&p, qtrue);
-
-				if(!token[0])
-					break;
-
-				if(!Q_stricmp(token, ")"))
-					break;
-			}
+			Com_SkipBracedSection(&p);
+		}
+		else if(type == MTR_GUIDE)
+		{
+			// skip shader name, guide name and parameters
+			token = Com_ParseExt(&p, qtrue);
+			token = Com_ParseExt(&p, qtrue);
 
-			if(Q_stricmp(token, ")"))
+			if(!SkipGuideParameters(&p))
 			{
-				Com_ParseWarning("expected ) found '%s'\n", token);
 				break;
 			}
-
-			// skip guide body
-			Com_SkipBracedSection(&p);
-
-			// if we passed the pointer to the next shader file
-			if(i < numGuides - 1)
+		}
+		else
+		{
+			if(type == MTR_TABLE)
 			{
-				if(p > buffers[i + 1])
-				{
-					break;
-				}
+				// skip table name
+				token = Com_ParseExt(&p, qtrue);
 			}
+
+			Com_SkipBracedSection(&p);
 		}
 	}
 
-	// free up memory
-	ri.FS_FreeFileList(guideFiles);
+	return numEntries;
 }
 
 /*
 ====================
-ScanAndLoadShaderFiles
+LoadMaterialFiles
 
-Finds and loads all .shader files, combining them into
-a single large text block that can be scanned for shader names
-=====================
+Combines the compressed text of the given files into a single large text
+block and indexes it, using the database for files that come from paks
+====================
 */
-#define	MAX_SHADER_FILES	4096
-static void ScanAndLoadShaderFiles(void)
+static materialFile_t *LoadMaterialFiles(const char *path, char **fileNames, int numFiles, qboolean guideFiles, char **textOut)
 {
-	char          **shaderFiles;
-	char           *buffers[MAX_SHADER_FILES];
-	char           *p;
-	int             numShaderFiles;
-	int             i;
-	char           *oldp, *token, *hashMem;
-	int             shaderTextHashTableSizes[MAX_SHADERTEXT_HASH], hash, size;
-	char            filename[MAX_QPATH];
-	long            sum = 0;
+	int             i, j;
+	long            sum;
+	char           *text, *p;
+	char           *buffer;
+	materialFile_t *files, *file;
+	materialDBRecord_t *record;
+	materialEntry_t *entry;
+	int             numCached;
 
-	ri.Printf(PRINT_ALL, "----- ScanAndLoadShaderFiles -----\n");
+	files = &s_materialFiles[s_numMaterialFiles];
+	s_numMaterialFiles += numFiles;
 
-	// scan for shader files
-#if defined(COMPAT_Q3A) || defined(COMPAT_ET)
-	shaderFiles = ri.FS_ListFiles("scripts", ".shader", &numShaderFiles);
-#else
-	shaderFiles = ri.FS_ListFiles("materials", ".mtr", &numShaderFiles);
-#endif
+	Com_Memset(files, 0, numFiles * sizeof(materialFile_t));
 
-	if(!shaderFiles || !numShaderFiles)
+	sum = 0;
+	for(i = 0, file = files; i < numFiles; i++, file++)
 	{
-		ri.Printf(PRINT_WARNING, "WARNING: no shader files found\n");
-		return;
-	}
+		Com_sprintf(file->name, sizeof(file->name), "%s/%s", path, fileNames[i]);
 
-	if(numShaderFiles > MAX_SHADER_FILES)
-	{
-		numShaderFiles = MAX_SHADER_FILES;
-	}
+		if(ri.FS_FileInPAKChecksum(file->name, &file->checksum) != 1)
+		{
+			file->checksum = 0;
+		}
 
-	// build single large buffer
-	for(i = 0; i < numShaderFiles; i++)
-	{
-#if defined(COMPAT_Q3A) || defined(COMPAT_ET)
-		Com_sprintf(filename, sizeof(filename), "scripts/%s", shaderFiles[i]);
-#else
-		Com_sprintf(filename, sizeof(filename), "materials/%s", shaderFiles[i]);
-#endif
+		if(file->checksum && s_materialDBNumRecords)
+		{
+			file->record = R_FindMaterialDBRecord(file->name, file->checksum);
+		}
+
+		if(file->record)
+		{
+			file->textLength = LittleLong(file->record->textLength);
+		}
+		else
+		{
+			file->textLength = ri.FS_ReadFile(file->name, NULL) + 1;
+
+			if(file->checksum)
+			{
+				s_materialDBChanged = qtrue;
+			}
+		}
 
-		sum += ri.FS_ReadFile(filename, NULL);
+		sum += file->textLength;
 	}
-	s_shaderText = ri.Hunk_Alloc(sum + numShaderFiles * 2, h_low);
+
+	text = ri.Hunk_Alloc(sum + 1, h_low);
 
 	// load in reverse order, so doubled shaders are overriden properly
-	for(i = numShaderFiles - 1; i >= 0; i--)
+	numCached = 0;
+	p = text;
+	for(i = numFiles - 1; i >= 0; i--)
 	{
-#if defined(COMPAT_Q3A) || defined(COMPAT_ET)
-		Com_sprintf(filename, sizeof(filename), "scripts/%s", shaderFiles[i]);
-#else
-		Com_sprintf(filename, sizeof(filename), "materials/%s", shaderFiles[i]);
-#endif
+		file = &files[i];
+		file->text = p;
 
-		ri.Printf(PRINT_DEVELOPER, "...loading '%s'\n", filename);
-		sum += ri.FS_ReadFile(filename, (void **)&buffers[i]);
-		if(!buffers[i])
+		if(file->record)
 		{
-			ri.Error(ERR_DROP, "Couldn't load %s", filename);
-		}
+			record = file->record;
 
-		strcat(s_shaderText, "\n");
-		p = &s_shaderText[strlen(s_shaderText)];
-		strcat(s_shaderText, buffers[i]);
-		ri.FS_FreeFile(buffers[i]);
-		buffers[i] = p;
-		Com_Compress(p);
-	}
+			file->numEntries = LittleLong(record->numEntries);
+			if(file->numEntries)
+			{
+				file->entries = Com_Allocate(file->numEntries * sizeof(materialEntry_t));
+			}
 
-	Com_Memset(shaderTextHashTableSizes, 0, sizeof(shaderTextHashTableSizes));
-	size = 0;
-	for(i = 0; i < numShaderFiles; i++)
-	{
-#if defined(COMPAT_Q3A) || defined(COMPAT_ET)
-		Com_sprintf(filename, sizeof(filename), "scripts/%s", shaderFiles[i]);
-#else
-		Com_sprintf(filename, sizeof(filename), "materials/%s", shaderFiles[i]);
-#endif
-		Com_BeginParseSession(filename);
+			entry = (materialEntry_t *) (record + 1);
+			for(j = 0; j < file->numEntries; j++, entry++)
+			{
+				file->entries[j].type = LittleLong(entry->type);
+				file->entries[j].offset = LittleLong(entry->offset);
 
-		// pointer to the first shader file
-		p = buffers[i];
+				if(file->entries[j].offset < 0 || file->entries[j].offset >= file->textLength)
+				{
+					ri.Error(ERR_DROP, "%s: bad entry for '%s'", MATERIALDB_FILE, file->name);
+				}
+			}
 
-		// look for label
-		while(1)
+			Com_Memcpy(p, entry, file->textLength);
+			numCached++;
+		}
+		else
 		{
-			token = Com_ParseExt(&p, qtrue);
-			if(token[0] == 0)
+			ri.Printf(PRINT_DEVELOPER, "...loading '%s'\n", file->name);
+
+			ri.FS_ReadFile(file->name, (void **)&buffer);
+			if(!buffer)
 			{
-				break;
+				ri.Error(ERR_DROP, "Couldn't load %s", file->name);
 			}
 
-			// skip shader tables
-			if(!Q_stricmp(token, "table"))
-			{
-				// skip table name
-				token = Com_ParseExt(&p, qtrue);
+			Q_strncpyz(p, buffer, file->textLength);
+			ri.FS_FreeFile(buffer);
 
-				Com_SkipBracedSection(&p);
-			}
-			// support shader templates
-			else if(!Q_stricmp(token, "guide"))
+			Com_Compress(p);
+			file->textLength = strlen(p) + 1;
+
+			Com_BeginParseSession(file->name);
+			file->numEntries = IndexMaterialText(p, NULL, guideFiles);
+
+			if(file->numEntries)
 			{
-				// parse shader name
-				token = Com_ParseExt(&p, qtrue);
+				file->entries = Com_Allocate(file->numEntries * sizeof(materialEntry_t));
+				IndexMaterialText(p, file->entries, guideFiles);
+			}
+		}
 
-				//ri.Printf(PRINT_ALL, "...guided '%s'\n", token);
+		p += file->textLength;
+	}
 
-				hash = generateHashValue(token, MAX_SHADERTEXT_HASH);
-				shaderTextHashTableSizes[hash]++;
-				size++;
+	// join the files so the whole block can be searched linearly
+	for(i = 1; i < numFiles; i++)
+	{
+		files[i].text[files[i].textLength - 1] = '\n';
+	}
 
-				// skip guide name
-				token = Com_ParseExt(&p, qtrue);
+	ri.Printf(PRINT_DEVELOPER, "...%i of %i files from %s\n", numCached, numFiles, MATERIALDB_FILE);
 
-				// skip parameters
-				token = Com_ParseExt(&p, qtrue);
-				if(Q_stricmp(token, "("))
-				{
-					Com_ParseWarning("expected ( found '%s'\n", token);
-					break;
-				}
+	*textOut = text;
+	return files;
+}
 
-				while(1)
-				{
-					token = Com_ParseExt(&p, qtrue);
+/*
+====================
+ParseShaderTable
+====================
+*/
+static void ParseShaderTable(char **text)
+{
+	char           *token;
+	int             depth;
+	float           values[FUNCTABLE_SIZE];
+	int             numValues;
+	shaderTable_t  *tb;
+	qboolean        alreadyCreated;
+	int             hash;
 
-					if(!token[0])
-						break;
+	Com_Memset(&table, 0, sizeof(table));
 
-					if(!Q_stricmp(token, ")"))
-						break;
-				}
+	token = Com_ParseExt(text, qtrue);
+	Q_strncpyz(table.name, token, sizeof(table.name));
 
-				if(Q_stricmp(token, ")"))
-				{
-					Com_ParseWarning("expected ) found '%s'\n", token);
-					break;
-				}
-			}
-			else
-			{
-				hash = generateHashValue(token, MAX_SHADERTEXT_HASH);
-				shaderTextHashTableSizes[hash]++;
-				size++;
+	// check if already created
+	alreadyCreated = qfalse;
+	hash = generateHashValue(table.name, MAX_SHADERTABLE_HASH);
+	for(tb = shaderTableHashTable[hash]; tb; tb = tb->next)
+	{
+		if(Q_stricmp(tb->name, table.name) == 0)
+		{
+			// match found
+			alreadyCreated = qtrue;
+			break;
+		}
+	}
 
-				Com_SkipBracedSection(&p);
-			}
+	depth = 0;
+	numValues = 0;
+	do
+	{
+		token = Com_ParseExt(text, qtrue);
 
-			// if we passed the pointer to the next shader file
-			if(i < numShaderFiles - 1)
+		if(!Q_stricmp(token, "snap"))
+		{
+			table.snap = qtrue;
+		}
+		else if(!Q_stricmp(token, "clamp"))
+		{
+			table.clamp = qtrue;
+		}
+		else if(token[0] == '{')
+		{
+			depth++;
+		}
+		else if(token[0] == '}')
+		{
+			depth--;
+		}
+		else if(token[0] == ',')
+		{
+			continue;
+		}
+		else
+		{
+			if(numValues == FUNCTABLE_SIZE)
 			{
-				if(p > buffers[i + 1])
-				{
-					break;
-				}
+				ri.Printf(PRINT_WARNING, "WARNING: FUNCTABLE_SIZE hit\n");
+				break;
 			}
+			values[numValues++] = atof(token);
 		}
+	} while(depth && *text);
+
+	if(!alreadyCreated)
+	{
+		ri.Printf(PRINT_DEVELOPER, "...generating '%s'\n", table.name);
+		GeneratePermanentShaderTable(values, numValues);
 	}
+}
 
-	size += MAX_SHADERTEXT_HASH;
+/*
+====================
+ScanAndLoadShaderGuides
 
-	hashMem = ri.Hunk_Alloc(size * sizeof(char *), h_low);
+Finds and loads all .guide files, combining them into
+a single large text block that can be scanned for shader template names
+=====================
+*/
+static void ScanAndLoadGuideFiles(void)
+{
+	char          **guideFiles;
+	materialFile_t *files;
+	char           *p;
+	int             numGuides;
+	int             i, j;
+	char           *token, *hashMem;
+	int             guideTextHashTableSizes[MAX_GUIDETEXT_HASH], hash, size;
 
-	for(i = 0; i < MAX_SHADERTEXT_HASH; i++)
+	ri.Printf(PRINT_ALL, "----- ScanAndLoadGuideFiles -----\n");
+
+	s_guideText = NULL;
+	Com_Memset(guideTextHashTableSizes, 0, sizeof(guideTextHashTableSizes));
+	Com_Memset(guideTextHashTable, 0, sizeof(guideTextHashTable));
+
+	// scan for guide files
+	guideFiles = ri.FS_ListFiles("guides", ".guide", &numGuides);
+
+	if(!guideFiles || !numGuides)
 	{
-		shaderTextHashTable[i] = (char **)hashMem;
-		hashMem = ((char *)hashMem) + ((shaderTextHashTableSizes[i] + 1) * sizeof(char *));
+		ri.Printf(PRINT_WARNING, "WARNING: no shader guide files found\n");
+		return;
 	}
 
-	Com_Memset(shaderTextHashTableSizes, 0, sizeof(shaderTextHashTableSizes));
-	//
-	for(i = 0; i < numShaderFiles; i++)
+	if(numGuides > MAX_GUIDE_FILES)
 	{
-#if defined(COMPAT_Q3A) || defined(COMPAT_ET)
-		Com_sprintf(filename, sizeof(filename), "scripts/%s", shaderFiles[i]);
-#else
-		Com_sprintf(filename, sizeof(filename), "materials/%s", shaderFiles[i]);
-#endif
-		Com_BeginParseSession(filename);
+		numGuides = MAX_GUIDE_FILES;
+	}
 
-		// pointer to the first shader file
-		p = buffers[i];
+	// build single large buffer
+	files = LoadMaterialFiles("guides", guideFiles, numGuides, qtrue, &s_guideText);
 
-		// look for label
-		while(1)
+	// later files override earlier ones
+	size = 0;
+	for(i = numGuides - 1; i >= 0; i--)
+	{
+		for(j = 0; j < files[i].numEntries; j++)
 		{
-			oldp = p;
+			// parse guide name
+			p = files[i].text + files[i].entries[j].offset;
 			token = Com_ParseExt(&p, qtrue);
-			if(token[0] == 0)
-			{
-				break;
-			}
 
-			// parse shader tables
-			if(!Q_stricmp(token, "table"))
-			{
-				int             depth;
-				float           values[FUNCTABLE_SIZE];
-				int             numValues;
-				shaderTable_t  *tb;
-				qboolean        alreadyCreated;
+			hash = generateHashValue(token, MAX_GUIDETEXT_HASH);
+			guideTextHashTableSizes[hash]++;
+			size++;
+		}
+	}
 
-				Com_Memset(&table, 0, sizeof(table));
+	size += MAX_GUIDETEXT_HASH;
 
-				token = Com_ParseExt(&p, qtrue);
-				Q_strncpyz(table.name, token, sizeof(table.name));
+	hashMem = ri.Hunk_Alloc(size * sizeof(char *), h_low);
 
-				// check if already created
-				alreadyCreated = qfalse;
-				hash = generateHashValue(table.name, MAX_SHADERTABLE_HASH);
-				for(tb = shaderTableHashTable[hash]; tb; tb = tb->next)
-				{
-					if(Q_stricmp(tb->name, table.name) == 0)
-					{
-						// match found
-						alreadyCreated = qtrue;
-						break;
-					}
-				}
+	for(i = 0; i < MAX_GUIDETEXT_HASH; i++)
+	{
+		guideTextHashTable[i] = (char **)hashMem;
+		hashMem = ((char *)hashMem) + ((guideTextHashTableSizes[i] + 1) * sizeof(char *));
+	}
 
-				depth = 0;
-				numValues = 0;
-				do
-				{
-					token = Com_ParseExt(&p, qtrue);
+	Com_Memset(guideTextHashTableSizes, 0, sizeof(guideTextHashTableSizes));
+	for(i = numGuides - 1; i >= 0; i--)
+	{
+		for(j = 0; j < files[i].numEntries; j++)
+		{
+			p = files[i].text + files[i].entries[j].offset;
+			token = Com_ParseExt(&p, qtrue);
 
-					if(!Q_stricmp(token, "snap"))
-					{
-						table.snap = qtrue;
-					}
-					else if(!Q_stricmp(token, "clamp"))
-					{
-						table.clamp = qtrue;
-					}
-					else if(token[0] == '{')
-					{
-						depth++;
-					}
-					else if(token[0] == '}')
-					{
-						depth--;
-					}
-					else if(token[0] == ',')
-					{
-						continue;
-					}
-					else
-					{
-						if(numValues == FUNCTABLE_SIZE)
-						{
-							ri.Printf(PRINT_WARNING, "WARNING: FUNCTABLE_SIZE hit\n");
-							break;
-						}
-						values[numValues++] = atof(token);
-					}
-				} while(depth && p);
+			//ri.Printf(PRINT_ALL, "...hashing guide '%s'\n", token);
 
-				if(!alreadyCreated)
-				{
-					ri.Printf(PRINT_DEVELOPER, "...generating '%s'\n", table.name);
-					GeneratePermanentShaderTable(values, numValues);
-				}
-			}
-			// support shader templates
-			else if(!Q_stricmp(token, "guide"))
-			{
-				// parse shader name
-				oldp = p;
-				token = Com_ParseExt(&p, qtrue);
+			hash = generateHashValue(token, MAX_GUIDETEXT_HASH);
+			guideTextHashTable[hash][guideTextHashTableSizes[hash]++] = files[i].text + files[i].entries[j].offset;
+		}
+	}
 
-				//ri.Printf(PRINT_ALL, "...guided '%s'\n", token);
+	// free up memory
+	ri.FS_FreeFileList(guideFiles);
+}
 
-				hash = generateHashValue(token, MAX_SHADERTEXT_HASH);
-				shaderTextHashTable[hash][shaderTextHashTableSizes[hash]++] = oldp;
+/*
+====================
+ScanAndLoadShaderFiles
 
-				// skip guide name
-				token = Com_ParseExt(&p, qtrue);
+Finds and loads all .shader files, combining them into
+a single large text block that can be scanned for shader names
+=====================
+*/
+static void ScanAndLoadShaderFiles(void)
+{
+	char          **shaderFiles;
+	materialFile_t *files;
+	materialEntry_t *entry;
+	char           *p;
+	int             numShaderFiles;
+	int             i, j;
+	char           *token, *hashMem;
+	int             shaderTextHashTableSizes[MAX_SHADERTEXT_HASH], hash, size;
 
-				// skip parameters
-				token = Com_ParseExt(&p, qtrue);
-				if(Q_stricmp(token, "("))
-				{
-					Com_ParseWarning("expected ( found '%s'\n", token);
-					break;
-				}
+	ri.Printf(PRINT_ALL, "----- ScanAndLoadShaderFiles -----\n");
 
-				while(1)
-				{
-					token = Com_ParseExt(&p, qtrue);
+	// scan for shader files
+#if defined(COMPAT_Q3A) || defined(COMPAT_ET)
+	shaderFiles = ri.FS_ListFiles("scripts", ".shader", &numShaderFiles);
+#else
+	shaderFiles = ri.FS_ListFiles("materials", ".mtr", &numShaderFiles);
+#endif
 
-					if(!token[0])
-						break;
+	if(!shaderFiles || !numShaderFiles)
+	{
+		ri.Printf(PRINT_WARNING, "WARNING: no shader files found\n");
+		return;
+	}
 
-					if(!Q_stricmp(token, ")"))
-						break;
-				}
+	if(numShaderFiles > MAX_SHADER_FILES)
+	{
+		numShaderFiles = MAX_SHADER_FILES;
+	}
 
-				if(Q_stricmp(token, ")"))
-				{
-					Com_ParseWarning("expected ) found '%s'\n", token);
-					break;
-				}
-			}
-			else
-			{
-				hash = generateHashValue(token, MAX_SHADERTEXT_HASH);
-				shaderTextHashTable[hash][shaderTextHashTableSizes[hash]++] = oldp;
+	// build single large buffer
+#if defined(COMPAT_Q3A) || defined(COMPAT_ET)
+	files = LoadMaterialFiles("scripts", shaderFiles, numShaderFiles, qfalse, &s_shaderText);
+#else
+	files = LoadMaterialFiles("materials", shaderFiles, numShaderFiles, qfalse, &s_shaderText);
+#endif
 
-				// skip shaderbody
-				Com_SkipBracedSection(&p);
+	// later files override earlier ones
+	Com_Memset(shaderTextHashTableSizes, 0, sizeof(shaderTextHashTableSizes));
+	size = 0;
+	for(i = numShaderFiles - 1; i >= 0; i--)
+	{
+		for(j = 0, entry = files[i].entries; j < files[i].numEntries; j++, entry++)
+		{
+			if(entry->type == MTR_TABLE)
+			{
+				continue;
 			}
 
-			// if we passed the pointer to the next shader file
-			if(i < numShaderFiles - 1)
+			// parse shader name
+			p = files[i].text + entry->offset;
+			token = Com_ParseExt(&p, qtrue);
+
+			hash = generateHashValue(token, MAX_SHADERTEXT_HASH);
+			shaderTextHashTableSizes[hash]++;
+			size++;
+		}
+	}
+
+	size += MAX_SHADERTEXT_HASH;
+
+	hashMem = ri.Hunk_Alloc(size * sizeof(char *), h_low);
+
+	for(i = 0; i < MAX_SHADERTEXT_HASH; i++)
+	{
+		shaderTextHashTable[i] = (char **)hashMem;
+		hashMem = ((char *)hashMem) + ((shaderTextHashTableSizes[i] + 1) * sizeof(char *));
+	}
+
+	Com_Memset(shaderTextHashTableSizes, 0, sizeof(shaderTextHashTableSizes));
+	for(i = numShaderFiles - 1; i >= 0; i--)
+	{
+		Com_BeginParseSession(files[i].name);
+
+		for(j = 0, entry = files[i].entries; j < files[i].numEntries; j++, entry++)
+		{
+			p = files[i].text + entry->offset;
+
+			// parse shader tables
+			if(entry->type == MTR_TABLE)
 			{
-				if(p > buffers[i + 1])
-				{
-					break;
-				}
+				ParseShaderTable(&p);
+				continue;
 			}
+
+			token = Com_ParseExt(&p, qtrue);
+
+			//ri.Printf(PRINT_ALL, "...hashing '%s'\n", token);
+
+			hash = generateHashValue(token, MAX_SHADERTEXT_HASH);
+			shaderTextHashTable[hash][shaderTextHashTableSizes[hash]++] = files[i].text + entry->offset;
 		}
 	}
 
@@ -6666,9 +6929,13 @@ void R_InitShaders(void)
 
 	CreateInternalShaders();
 
+	R_BeginMaterialDB();
+
 	ScanAndLoadGuideFiles();
 
 	ScanAndLoadShaderFiles();
 
+	R_EndMaterialDB();
+
 	CreateExternalShaders();
 }
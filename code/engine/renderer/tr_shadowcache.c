@@ -0,0 +1,355 @@
+/*
+===========================================================================
+Copyright (C) 2006-2011 Robert Beckebans <trebor_7@users.sourceforge.net>
+
+This file is part of XreaL source code.
+
+XreaL source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+XreaL source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with XreaL source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// tr_shadowcache.c -- shadow cube maps of static lights that survive across frames
+#include "tr_local.h"
+
+/*
+The world casters of a static omni light never move, so its shadow cube map
+only has to be rendered again when the light changes its shadow LOD or gets
+evicted from the cache. The cube maps live in tr.shadowCacheEntries, a fixed
+pool created by R_InitImages with a handful of cube maps for each LOD.
+
+The backend asks RB_BeginShadowCache once per light which shadow passes it
+has to run:
+
+SHADOWCACHE_STATIC    the world casters are rendered into the cache entry
+SHADOWCACHE_DYNAMIC   the cache entry is copied into the shadow map of the
+                      light's LOD and the entity casters are drawn over it
+SHADOWCACHE_RESIDENT  nothing to render, lighting samples the cache entry
+SHADOWCACHE_UNCACHED  the light doesn't use the cache
+
+A miss with entity casters runs STATIC followed by DYNAMIC.
+
+All shadow map formats store values that grow with the distance to the light
+except for the negative warp of EVSM, so dynamic casters are merged with
+GL_MIN blending instead of a depth test against the static casters.
+*/
+
+static int      shadowCacheFrame;
+
+/*
+=================
+R_ClearShadowCache
+
+Forgets all cached shadow maps, the world lights they belonged to are gone
+=================
+*/
+void R_ClearShadowCache(void)
+{
+	int             i;
+
+	for(i = 0; i < tr.numShadowCacheEntries; i++)
+	{
+		tr.shadowCacheEntries[i].lightNum = -1;
+		tr.shadowCacheEntries[i].lastUsed = 0;
+	}
+}
+
+/*
+=================
+R_ShadowCacheResidency
+
+Returns the number of cache entries holding a shadow map
+=================
+*/
+int R_ShadowCacheResidency(void)
+{
+	int             i;
+	int             numResident;
+
+	numResident = 0;
+	for(i = 0; i < tr.numShadowCacheEntries; i++)
+	{
+		if(tr.shadowCacheEntries[i].lightNum >= 0)
+		{
+			numResident++;
+		}
+	}
+
+	return numResident;
+}
+
+/*
+=================
+RB_ShadowCacheCanComposite
+=================
+*/
+static qboolean RB_ShadowCacheCanComposite(void)
+{
+	// EVSM stores -exp(-c * depth)^2 which shrinks with the distance
+	return !(r_shadows->integer == SHADOWING_EVSM32 && !r_evsmPostProcess->integer);
+}
+
+/*
+=================
+RB_FindShadowCacheEntry
+
+Returns the entry of the light or the least recently used entry of its LOD
+=================
+*/
+static shadowCacheEntry_t *RB_FindShadowCacheEntry(trRefLight_t * light, qboolean * hit)
+{
+	int             i;
+	shadowCacheEntry_t *entry, *best;
+
+	*hit = qfalse;
+
+	best = NULL;
+	for(i = 0, entry = tr.shadowCacheEntries; i < tr.numShadowCacheEntries; i++, entry++)
+	{
+		if(entry->lod != light->shadowLOD)
+		{
+			continue;
+		}
+
+		if(entry->lightNum == light->worldLightNum)
+		{
+			*hit = qtrue;
+			return entry;
+		}
+
+		if(!best || entry->lastUsed < best->lastUsed)
+		{
+			best = entry;
+		}
+	}
+
+	return best;
+}
+
+/*
+=================
+RB_BeginShadowCache
+
+Decides how the shadow map of the light is produced, ia is the first
+interaction of the light.
+Returns qtrue if the shadow passes can be skipped.
+=================
+*/
+qboolean RB_BeginShadowCache(trRefLight_t * light, interaction_t * ia)
+{
+	shadowCacheState_t *sc = &backEnd.shadowCache;
+	shader_t       *shader;
+	qboolean        hit;
+
+	sc->pass = SHADOWCACHE_UNCACHED;
+	sc->entry = NULL;
+	sc->dynamicCasters = qfalse;
+
+	if(!tr.numShadowCacheEntries || !tr.shadowCacheFBO)
+	{
+		return qfalse;
+	}
+
+	if(!light->isStatic || light->l.rlType != RL_OMNI || light->l.noShadows || light->l.inverseShadows || light->shadowLOD < 0)
+	{
+		return qfalse;
+	}
+
+	// shadow fill clips against the portal plane
+	if(backEnd.viewParms.isPortal)
+	{
+		backEnd.pc.c_shadowCacheUncached++;
+		return qfalse;
+	}
+
+	// use the same caster rejection as the shadow passes
+	for(; ia; ia = ia->next)
+	{
+		shader = ia->surfaceShader;
+
+		if(!shader || ia->type == IA_LIGHTONLY)
+		{
+			continue;
+		}
+
+		if(shader->isSky || shader->sort > SS_OPAQUE || shader->noShadows)
+		{
+			continue;
+		}
+
+		if(ia->entity->e.renderfx & (RF_NOSHADOW | RF_DEPTHHACK))
+		{
+			continue;
+		}
+
+		if(ia->entity != &tr.worldEntity)
+		{
+			sc->dynamicCasters = qtrue;
+		}
+		else if(shader->numDeforms)
+		{
+			// the world geometry moves
+			sc->dynamicCasters = qfalse;
+			backEnd.pc.c_shadowCacheUncached++;
+			return qfalse;
+		}
+	}
+
+	if(sc->dynamicCasters && !RB_ShadowCacheCanComposite())
+	{
+		sc->dynamicCasters = qfalse;
+		backEnd.pc.c_shadowCacheUncached++;
+		return qfalse;
+	}
+
+	sc->entry = RB_FindShadowCacheEntry(light, &hit);
+	if(!sc->entry)
+	{
+		// no cube maps for this LOD
+		sc->dynamicCasters = qfalse;
+		backEnd.pc.c_shadowCacheUncached++;
+		return qfalse;
+	}
+
+	sc->entry->lastUsed = ++shadowCacheFrame;
+
+	if(hit)
+	{
+		backEnd.pc.c_shadowCacheHits++;
+	}
+	else
+	{
+		if(sc->entry->lightNum >= 0)
+		{
+			backEnd.pc.c_shadowCacheEvictions++;
+		}
+
+		sc->entry->lightNum = light->worldLightNum;
+		backEnd.pc.c_shadowCacheMisses++;
+
+		sc->pass = SHADOWCACHE_STATIC;
+		return qfalse;
+	}
+
+	if(sc->dynamicCasters)
+	{
+		backEnd.pc.c_shadowCacheComposites++;
+		sc->pass = SHADOWCACHE_DYNAMIC;
+		return qfalse;
+	}
+
+	sc->pass = SHADOWCACHE_RESIDENT;
+	return qtrue;
+}
+
+/*
+=================
+RB_NextShadowCachePass
+
+Called after all cube sides of a shadow pass have been rendered.
+Returns qtrue if another shadow pass follows.
+=================
+*/
+qboolean RB_NextShadowCachePass(void)
+{
+	shadowCacheState_t *sc = &backEnd.shadowCache;
+
+	switch (sc->pass)
+	{
+		case SHADOWCACHE_STATIC:
+		{
+			if(sc->dynamicCasters)
+			{
+				backEnd.pc.c_shadowCacheComposites++;
+				sc->pass = SHADOWCACHE_DYNAMIC;
+				return qtrue;
+			}
+
+			sc->pass = SHADOWCACHE_RESIDENT;
+			break;
+		}
+
+		case SHADOWCACHE_DYNAMIC:
+		{
+			glBlendEquation(GL_FUNC_ADD);
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	return qfalse;
+}
+
+/*
+=================
+RB_EndShadowCache
+
+Called after the lighting of the current light
+=================
+*/
+void RB_EndShadowCache(void)
+{
+	shadowCacheState_t *sc = &backEnd.shadowCache;
+
+	sc->pass = SHADOWCACHE_NONE;
+	sc->entry = NULL;
+	sc->dynamicCasters = qfalse;
+}
+
+/*
+=================
+RB_CopyShadowCacheFace
+
+Fills the bound shadow map face with the cached static casters and
+prepares the blending for the entity casters
+=================
+*/
+void RB_CopyShadowCacheFace(trRefLight_t * light, int cubeSide)
+{
+	shadowCacheState_t *sc = &backEnd.shadowCache;
+	int             size;
+
+	size = shadowMapResolutions[light->shadowLOD];
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, tr.shadowCacheFBO->frameBuffer);
+	glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubeSide,
+						   sc->entry->image->texnum, 0);
+
+	glBlitFramebuffer(0, 0, size, size, 0, 0, size, size, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, glState.currentFBO->frameBuffer);
+
+	// the entity casters only test against each other
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	glBlendEquation(GL_MIN);
+}
+
+/*
+=================
+RB_ShadowCubeImage
+
+Returns the shadow cube map lighting has to sample for the light
+=================
+*/
+image_t        *RB_ShadowCubeImage(trRefLight_t * light)
+{
+	if(backEnd.shadowCache.pass == SHADOWCACHE_RESIDENT)
+	{
+		return backEnd.shadowCache.entry->image;
+	}
+
+	return tr.shadowCubeFBOImage[light->shadowLOD];
+}
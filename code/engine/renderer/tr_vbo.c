@@ -331,6 +331,408 @@ VBO_t          *R_CreateVBO2(const char *name, int numVertexes, srfVert_t * vert
 	return vbo;
 }
 
+/*
+===============================================================================
+
+VERTEX CACHE OPTIMIZATION
+
+Triangle reordering for the post-transform vertex cache after Tom Forsyth's
+"Linear-Speed Vertex Cache Optimisation" and a vertex fetch reorder that
+renumbers the vertices in the order they are first used by the triangles.
+
+Both only depend on the input so they always produce the same output.
+
+===============================================================================
+*/
+
+#define VERTEXCACHE_SIZE			32	// modelled LRU cache used for the scoring
+#define VERTEXCACHE_FIFO_SIZE		16	// simulated FIFO cache used for the ACMR statistics
+#define VERTEXCACHE_MAX_VALENCE		32
+
+#define VERTEXCACHE_DECAY_POWER		1.5f
+#define VERTEXCACHE_LAST_TRI_SCORE	0.75f
+#define VERTEXCACHE_VALENCE_SCALE	2.0f
+#define VERTEXCACHE_VALENCE_POWER	0.5f
+
+typedef struct
+{
+	int             cachePos;
+	int             numActiveTriangles;
+	int             firstTriangle;	// into the adjacency list
+	float           score;
+} cacheVertex_t;
+
+static float    vertexCacheScores[VERTEXCACHE_SIZE];
+static float    vertexValenceScores[VERTEXCACHE_MAX_VALENCE];
+static qboolean vertexScoresInitialized;
+
+static int IntCompare(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+============
+R_InitVertexCacheScores
+============
+*/
+static void R_InitVertexCacheScores(void)
+{
+	int             i;
+
+	for(i = 0; i < VERTEXCACHE_SIZE; i++)
+	{
+		if(i < 3)
+		{
+			// the last triangle gets a fixed score so it does not matter which of its vertices is used
+			vertexCacheScores[i] = VERTEXCACHE_LAST_TRI_SCORE;
+		}
+		else
+		{
+			vertexCacheScores[i] = pow(1.0f - (float)(i - 3) / (VERTEXCACHE_SIZE - 3), VERTEXCACHE_DECAY_POWER);
+		}
+	}
+
+	for(i = 0; i < VERTEXCACHE_MAX_VALENCE; i++)
+	{
+		vertexValenceScores[i] = i ? VERTEXCACHE_VALENCE_SCALE * pow(i, -VERTEXCACHE_VALENCE_POWER) : 0;
+	}
+
+	vertexScoresInitialized = qtrue;
+}
+
+/*
+============
+R_VertexCacheScore
+============
+*/
+static float R_VertexCacheScore(const cacheVertex_t * v)
+{
+	float           score;
+
+	if(!v->numActiveTriangles)
+	{
+		// no triangles left to add
+		return -1.0f;
+	}
+
+	score = v->cachePos < 0 ? 0 : vertexCacheScores[v->cachePos];
+
+	// bonus for vertices with few triangles left so lone triangles are not left behind
+	score += vertexValenceScores[min(v->numActiveTriangles, VERTEXCACHE_MAX_VALENCE - 1)];
+
+	return score;
+}
+
+/*
+============
+R_OptimizeTrianglesForVertexCache
+
+Reorders the triangles in place, the vertex indexes are not changed
+============
+*/
+void R_OptimizeTrianglesForVertexCache(int numTriangles, srfTriangle_t * triangles)
+{
+	int             i, j, k, n;
+	int             numIndexes, numVerts;
+	int            *indexes, *uniqueIndexes, *adjacency;
+	int            *order;
+	qboolean       *added;
+	float          *triangleScores;
+	cacheVertex_t  *verts, *v;
+	srfTriangle_t  *sorted;
+	int             cache[VERTEXCACHE_SIZE + 3];
+	int             cacheSize, newCacheSize;
+	int             newCache[VERTEXCACHE_SIZE + 3];
+	int             bestTriangle, nextTriangle;
+	float           bestScore;
+
+	if(!r_vboOptimizeIndexes->integer || numTriangles < 2)
+	{
+		return;
+	}
+
+	if(!vertexScoresInitialized)
+	{
+		R_InitVertexCacheScores();
+	}
+
+	numIndexes = numTriangles * 3;
+
+	// map the vertex indexes to a compact range so large shared vertex buffers don't cost anything
+	uniqueIndexes = ri.Hunk_AllocateTempMemory(numIndexes * sizeof(int));
+	for(i = 0; i < numTriangles; i++)
+	{
+		for(j = 0; j < 3; j++)
+		{
+			uniqueIndexes[i * 3 + j] = triangles[i].indexes[j];
+		}
+	}
+
+	qsort(uniqueIndexes, numIndexes, sizeof(int), IntCompare);
+
+	for(i = 1, numVerts = 1; i < numIndexes; i++)
+	{
+		if(uniqueIndexes[i] != uniqueIndexes[numVerts - 1])
+		{
+			uniqueIndexes[numVerts++] = uniqueIndexes[i];
+		}
+	}
+
+	indexes = ri.Hunk_AllocateTempMemory(numIndexes * sizeof(int));
+	for(i = 0; i < numTriangles; i++)
+	{
+		for(j = 0; j < 3; j++)
+		{
+			indexes[i * 3 + j] = (int *)bsearch(&triangles[i].indexes[j], uniqueIndexes, numVerts, sizeof(int), IntCompare) - uniqueIndexes;
+		}
+	}
+
+	// build the vertex to triangle adjacency
+	verts = ri.Hunk_AllocateTempMemory(numVerts * sizeof(cacheVertex_t));
+	Com_Memset(verts, 0, numVerts * sizeof(cacheVertex_t));
+
+	for(i = 0; i < numIndexes; i++)
+	{
+		verts[indexes[i]].numActiveTriangles++;
+	}
+
+	for(i = 0, n = 0; i < numVerts; i++)
+	{
+		verts[i].firstTriangle = n;
+		verts[i].cachePos = -1;
+		n += verts[i].numActiveTriangles;
+		verts[i].numActiveTriangles = 0;
+	}
+
+	adjacency = ri.Hunk_AllocateTempMemory(numIndexes * sizeof(int));
+	for(i = 0; i < numIndexes; i++)
+	{
+		v = &verts[indexes[i]];
+		adjacency[v->firstTriangle + v->numActiveTriangles++] = i / 3;
+	}
+
+	for(i = 0; i < numVerts; i++)
+	{
+		verts[i].score = R_VertexCacheScore(&verts[i]);
+	}
+
+	triangleScores = ri.Hunk_AllocateTempMemory(numTriangles * sizeof(float));
+	added = ri.Hunk_AllocateTempMemory(numTriangles * sizeof(qboolean));
+
+	bestTriangle = -1;
+	bestScore = -1;
+	for(i = 0; i < numTriangles; i++)
+	{
+		added[i] = qfalse;
+		triangleScores[i] = verts[indexes[i * 3 + 0]].score + verts[indexes[i * 3 + 1]].score + verts[indexes[i * 3 + 2]].score;
+
+		if(triangleScores[i] > bestScore)
+		{
+			bestScore = triangleScores[i];
+			bestTriangle = i;
+		}
+	}
+
+	order = ri.Hunk_AllocateTempMemory(numTriangles * sizeof(int));
+
+	cacheSize = 0;
+	nextTriangle = 0;
+	for(n = 0; n < numTriangles; n++)
+	{
+		if(bestTriangle < 0)
+		{
+			// nothing in the cache touches a triangle that is left, start with the next one in the input order
+			while(added[nextTriangle])
+			{
+				nextTriangle++;
+			}
+			bestTriangle = nextTriangle;
+		}
+
+		order[n] = bestTriangle;
+		added[bestTriangle] = qtrue;
+
+		// the vertices of the new triangle move to the front of the LRU cache
+		newCacheSize = 0;
+		for(j = 0; j < 3; j++)
+		{
+			k = indexes[bestTriangle * 3 + j];
+			v = &verts[k];
+
+			newCache[newCacheSize++] = k;
+
+			// remove the triangle from the active ones of the vertex
+			for(i = 0; i < v->numActiveTriangles; i++)
+			{
+				if(adjacency[v->firstTriangle + i] == bestTriangle)
+				{
+					adjacency[v->firstTriangle + i] = adjacency[v->firstTriangle + v->numActiveTriangles - 1];
+					v->numActiveTriangles--;
+					break;
+				}
+			}
+		}
+
+		for(i = 0; i < cacheSize; i++)
+		{
+			k = cache[i];
+			if(k != newCache[0] && k != newCache[1] && k != newCache[2])
+			{
+				newCache[newCacheSize++] = k;
+			}
+		}
+
+		// update the scores of everything that was or is in the cache
+		bestTriangle = -1;
+		bestScore = -1;
+		for(i = 0; i < newCacheSize; i++)
+		{
+			v = &verts[newCache[i]];
+			v->cachePos = i < VERTEXCACHE_SIZE ? i : -1;
+			v->score = R_VertexCacheScore(v);
+		}
+
+		for(i = 0; i < newCacheSize; i++)
+		{
+			v = &verts[newCache[i]];
+
+			for(j = 0; j < v->numActiveTriangles; j++)
+			{
+				k = adjacency[v->firstTriangle + j];
+
+				triangleScores[k] = verts[indexes[k * 3 + 0]].score + verts[indexes[k * 3 + 1]].score + verts[indexes[k * 3 + 2]].score;
+
+				// the lower triangle number wins ties so the result does not depend on the cache order
+				if(triangleScores[k] > bestScore || (triangleScores[k] == bestScore && k < bestTriangle))
+				{
+					bestScore = triangleScores[k];
+					bestTriangle = k;
+				}
+			}
+		}
+
+		cacheSize = min(newCacheSize, VERTEXCACHE_SIZE);
+		Com_Memcpy(cache, newCache, cacheSize * sizeof(int));
+	}
+
+	sorted = ri.Hunk_AllocateTempMemory(numTriangles * sizeof(srfTriangle_t));
+	for(i = 0; i < numTriangles; i++)
+	{
+		sorted[i] = triangles[order[i]];
+	}
+	Com_Memcpy(triangles, sorted, numTriangles * sizeof(srfTriangle_t));
+
+	ri.Hunk_FreeTempMemory(sorted);
+	ri.Hunk_FreeTempMemory(order);
+	ri.Hunk_FreeTempMemory(added);
+	ri.Hunk_FreeTempMemory(triangleScores);
+	ri.Hunk_FreeTempMemory(adjacency);
+	ri.Hunk_FreeTempMemory(verts);
+	ri.Hunk_FreeTempMemory(indexes);
+	ri.Hunk_FreeTempMemory(uniqueIndexes);
+}
+
+/*
+============
+R_OptimizeVertexFetch
+
+Renumbers the vertices 0 .. numVerts - 1 in the order they are first referenced.
+vertexOrder receives the old index of every new vertex, unreferenced vertices go last.
+============
+*/
+void R_OptimizeVertexFetch(int numVerts, int numTriangles, srfTriangle_t * triangles, int *vertexOrder)
+{
+	int             i, j, n;
+	int            *remap;
+
+	if(!r_vboOptimizeIndexes->integer)
+	{
+		for(i = 0; i < numVerts; i++)
+		{
+			vertexOrder[i] = i;
+		}
+		return;
+	}
+
+	remap = ri.Hunk_AllocateTempMemory(numVerts * sizeof(int));
+	for(i = 0; i < numVerts; i++)
+	{
+		remap[i] = -1;
+	}
+
+	n = 0;
+	for(i = 0; i < numTriangles; i++)
+	{
+		for(j = 0; j < 3; j++)
+		{
+			if(remap[triangles[i].indexes[j]] < 0)
+			{
+				vertexOrder[n] = triangles[i].indexes[j];
+				remap[triangles[i].indexes[j]] = n++;
+			}
+
+			triangles[i].indexes[j] = remap[triangles[i].indexes[j]];
+		}
+	}
+
+	for(i = 0; i < numVerts; i++)
+	{
+		if(remap[i] < 0)
+		{
+			vertexOrder[n++] = i;
+		}
+	}
+
+	ri.Hunk_FreeTempMemory(remap);
+}
+
+/*
+============
+R_CalcACMR
+
+Average number of simulated vertex cache misses per triangle
+============
+*/
+static float R_CalcACMR(int numIndexes, const glIndex_t * indexes)
+{
+	int             i, j;
+	int             cache[VERTEXCACHE_FIFO_SIZE];
+	int             cachePos, misses;
+
+	if(!indexes || numIndexes < 3)
+	{
+		return 0;
+	}
+
+	for(i = 0; i < VERTEXCACHE_FIFO_SIZE; i++)
+	{
+		cache[i] = -1;
+	}
+
+	cachePos = 0;
+	misses = 0;
+	for(i = 0; i < numIndexes; i++)
+	{
+		for(j = 0; j < VERTEXCACHE_FIFO_SIZE; j++)
+		{
+			if(cache[j] == (int)indexes[i])
+			{
+				break;
+			}
+		}
+
+		if(j == VERTEXCACHE_FIFO_SIZE)
+		{
+			cache[cachePos] = indexes[i];
+			cachePos = (cachePos + 1) % VERTEXCACHE_FIFO_SIZE;
+			misses++;
+		}
+	}
+
+	return (float)misses / (numIndexes / 3);
+}
+
 /*
 ============
 R_CreateIBO
@@ -369,6 +771,7 @@ IBO_t          *R_CreateIBO(const char *name, byte * indexes, int indexesSize, v
 	Q_strncpyz(ibo->name, name, sizeof(ibo->name));
 
 	ibo->indexesSize = indexesSize;
+	ibo->acmr = R_CalcACMR(indexesSize / sizeof(glIndex_t), (const glIndex_t *)indexes);
 
 	glGenBuffers(1, &ibo->indexesVBO);
 
@@ -450,6 +853,7 @@ IBO_t          *R_CreateIBO2(const char *name, int numTriangles, srfTriangle_t *
 
 	ibo->indexesSize = indexesSize;
 	ibo->indexesNum = numTriangles * 3;
+	ibo->acmr = R_CalcACMR(numTriangles * 3, (const glIndex_t *)indexes);
 
 	glGenBuffers(1, &ibo->indexesVBO);
 
@@ -743,6 +1147,8 @@ void R_VBOList_f(void)
 	IBO_t          *ibo;
 	int             vertexesSize = 0;
 	int             indexesSize = 0;
+	float           cacheMisses = 0;
+	int             numTriangles = 0;
 
 	ri.Printf(PRINT_ALL, " size          name\n");
 	ri.Printf(PRINT_ALL, "----------------------------------------------------------\n");
@@ -787,10 +1193,16 @@ void R_VBOList_f(void)
 	{
 		ibo = (IBO_t *) Com_GrowListElement(&tr.ibos, i);
 
-		ri.Printf(PRINT_ALL, "%d.%02d MB %s\n", ibo->indexesSize / (1024 * 1024),
-				  (ibo->indexesSize % (1024 * 1024)) * 100 / (1024 * 1024), ibo->name);
+		ri.Printf(PRINT_ALL, "%d.%02d MB %s ACMR %.3f\n", ibo->indexesSize / (1024 * 1024),
+				  (ibo->indexesSize % (1024 * 1024)) * 100 / (1024 * 1024), ibo->name, ibo->acmr);
 
 		indexesSize += ibo->indexesSize;
+
+		if(ibo->acmr > 0)
+		{
+			cacheMisses += ibo->acmr * (ibo->indexesSize / sizeof(glIndex_t) / 3);
+			numTriangles += ibo->indexesSize / sizeof(glIndex_t) / 3;
+		}
 	}
 
 	ri.Printf(PRINT_ALL, " %i total VBOs\n", tr.vbos.currentElements);
@@ -800,4 +1212,6 @@ void R_VBOList_f(void)
 	ri.Printf(PRINT_ALL, " %i total IBOs\n", tr.ibos.currentElements);
 	ri.Printf(PRINT_ALL, " %d.%02d MB total triangle indices memory\n", indexesSize / (1024 * 1024),
 			  (indexesSize % (1024 * 1024)) * 100 / (1024 * 1024));
+	ri.Printf(PRINT_ALL, " %.3f average ACMR ( %i entries FIFO vertex cache )\n", numTriangles ? cacheMisses / numTriangles : 0,
+			  VERTEXCACHE_FIFO_SIZE);
 }
@@ -586,6 +586,12 @@ static void R_RecursiveWorldNode(bspNode_t * node, int planeBits, int decalBits)
 			}
 		}
 
+		// the surface bounds are hidden behind the software rendered occluders
+		if(R_CullOccludedBounds(node->surfMins, node->surfMaxs))
+		{
+			return;
+		}
+
 		InsertLink(&node->visChain, &tr.traversalStack);
 
 		// ydnar: cull decals
@@ -628,6 +634,56 @@ static void R_RecursiveWorldNode(bspNode_t * node, int planeBits, int decalBits)
 	
 }
 
+/*
+================
+R_LeafArrayWorldNodes
+
+Same as R_RecursiveWorldNode(tr.world->nodes, FRUSTUM_CLIPALL, decalBits) but
+only the leafs are tested and linked into tr.traversalStack
+================
+*/
+static void R_LeafArrayWorldNodes(int decalBits)
+{
+	int             i, j, numLeafs;
+	int             leafDecalBits;
+	bspNode_t      *node;
+
+	numLeafs = R_CullLeafArray(tr.world, r_nocull->integer ? NULL : tr.viewParms.frustums[0], FRUSTUM_PLANES, NULL, NULL, qtrue);
+
+	for(i = 0; i < numLeafs; i++)
+	{
+		node = tr.world->leafArrayCulled[i];
+
+		// the surface bounds are hidden behind the software rendered occluders
+		if(R_CullOccludedBounds(node->surfMins, node->surfMaxs))
+		{
+			continue;
+		}
+
+		InsertLink(&node->visChain, &tr.traversalStack);
+
+		// ydnar: cull decals
+		leafDecalBits = decalBits;
+		if(leafDecalBits)
+		{
+			for(j = 0; j < tr.refdef.numDecalProjectors; j++)
+			{
+				if(leafDecalBits & (1 << j))
+				{
+					// test decal bounds against node surface bounds
+					if(tr.refdef.decalProjectors[j].shader == NULL ||
+					   !R_TestDecalBoundingBox(&tr.refdef.decalProjectors[j], node->surfMins, node->surfMaxs))
+					{
+						leafDecalBits &= ~(1 << j);
+					}
+				}
+			}
+		}
+
+		R_AddLeafSurfaces(node, leafDecalBits);
+	}
+}
+
 /*
 ================
 R_RecursiveInteractionNode
@@ -721,6 +777,49 @@ static void R_RecursiveInteractionNode(bspNode_t * node, trRefLight_t * light, i
 }
 
 
+/*
+================
+R_LeafArrayInteractionNodes
+
+Same as R_RecursiveInteractionNode(tr.world->nodes, light, FRUSTUM_CLIPALL)
+but the leafs are tested against the light bounds instead of walking
+down the split planes
+================
+*/
+static void R_LeafArrayInteractionNodes(trRefLight_t * light)
+{
+	int             i, c, numLeafs;
+	const cplane_t *planes;
+	bspNode_t      *node;
+	bspSurface_t  **mark;
+
+	// Tr3B - even surfaces that belong to nodes that are outside of the view frustum
+	// can cast shadows into the view frustum
+	if(!r_nocull->integer && r_shadows->integer <= SHADOWING_BLOB)
+	{
+		planes = tr.viewParms.frustums[0];
+	}
+	else
+	{
+		planes = NULL;
+	}
+
+	numLeafs = R_CullLeafArray(tr.world, planes, FRUSTUM_PLANES, light->worldBounds[0], light->worldBounds[1], qtrue);
+
+	for(i = 0; i < numLeafs; i++)
+	{
+		node = tr.world->leafArrayCulled[i];
+
+		mark = node->markSurfaces;
+		c = node->numMarkSurfaces;
+		while(c--)
+		{
+			R_AddInteractionSurface(*mark, light);
+			mark++;
+		}
+	}
+}
+
 /*
 ===============
 R_PointInLeaf
@@ -2326,6 +2425,9 @@ void R_AddWorldSurfaces(void)
 		// determine which leaves are in the PVS / areamask
 		R_MarkLeaves();
 
+		// render the occluders of the visible leaves on the CPU
+		R_RenderOcclusionBuffer();
+
 		// update the bsp nodes with the dynamic occlusion query results
 		// FIXME: SMP
 		if(!glConfig.smpActive && glConfig2.occlusionQueryBits && glConfig.driverType != GLDRV_MESA && r_dynamicBspOcclusionCulling->integer)
@@ -2339,7 +2441,14 @@ void R_AddWorldSurfaces(void)
 			ClearLink(&tr.occlusionQueryList);
 
 			// update visbounds and add surfaces that weren't cached with VBOs
-			R_RecursiveWorldNode(tr.world->nodes, FRUSTUM_CLIPALL, tr.refdef.decalBits);
+			if(r_leafArrayCulling->integer && tr.world->numLeafArrayBlocks)
+			{
+				R_LeafArrayWorldNodes(tr.refdef.decalBits);
+			}
+			else
+			{
+				R_RecursiveWorldNode(tr.world->nodes, FRUSTUM_CLIPALL, tr.refdef.decalBits);
+			}
 		}
 
 		// ydnar: add decal surfaces
@@ -2400,7 +2509,14 @@ void R_AddWorldInteractions(trRefLight_t * light)
 
 	// perform frustum culling and add all the potentially visible surfaces
 	tr.lightCount++;
-	R_RecursiveInteractionNode(tr.world->nodes, light, FRUSTUM_CLIPALL);
+	if(r_leafArrayCulling->integer && tr.world->numLeafArrayBlocks)
+	{
+		R_LeafArrayInteractionNodes(light);
+	}
+	else
+	{
+		R_RecursiveInteractionNode(tr.world->nodes, light, FRUSTUM_CLIPALL);
+	}
 }
 
 /*
@@ -876,6 +876,52 @@ static void GLimp_InitExtensions(void)
 			ri.Printf(PRINT_DEVELOPER, "...GL_EXT_framebuffer_blit not found\n");
 		}
 
+		// GL_ARB_draw_instanced
+		glConfig2.drawInstancedAvailable = qfalse;
+		if(glConfig.driverType == GLDRV_OPENGL3 || GLimp_HaveExtension("GL_ARB_draw_instanced"))
+		{
+			if(!r_instancing->integer)
+			{
+				ri.Printf(PRINT_DEVELOPER, "...ignoring GL_ARB_draw_instanced\n");
+			}
+			else if(!glDrawElementsInstanced)
+			{
+				ri.Printf(PRINT_DEVELOPER, "...GL_ARB_draw_instanced has no glDrawElementsInstanced\n");
+			}
+			else if(glConfig2.maxVertexUniforms < 16 * 10 + MAX_INSTANCES * INSTANCE_VECTORS * 4)
+			{
+				ri.Printf(PRINT_DEVELOPER, "...not enough vertex uniforms for GL_ARB_draw_instanced\n");
+			}
+			else
+			{
+				glConfig2.drawInstancedAvailable = qtrue;
+				ri.Printf(PRINT_DEVELOPER, "...using GL_ARB_draw_instanced\n");
+			}
+		}
+		else
+		{
+			ri.Printf(PRINT_DEVELOPER, "...GL_ARB_draw_instanced not found\n");
+		}
+
+		// GL_ARB_texture_compression_bptc
+		glConfig2.textureCompressionBPTCAvailable = qfalse;
+		if(glConfig.driverType == GLDRV_OPENGL3 || GLimp_HaveExtension("GL_ARB_texture_compression_bptc"))
+		{
+			if(!r_ext_compressed_textures->integer)
+			{
+				ri.Printf(PRINT_DEVELOPER, "...ignoring GL_ARB_texture_compression_bptc\n");
+			}
+			else
+			{
+				glConfig2.textureCompressionBPTCAvailable = qtrue;
+				ri.Printf(PRINT_DEVELOPER, "...using GL_ARB_texture_compression_bptc\n");
+			}
+		}
+		else
+		{
+			ri.Printf(PRINT_DEVELOPER, "...GL_ARB_texture_compression_bptc not found\n");
+		}
+
 		// GL_GREMEDY_string_marker
 		if(GLimp_HaveExtension("GL_GREMEDY_string_marker"))
 		{
@@ -1103,12 +1149,32 @@ SMP acceleration
 ===========================================================
 */
 
-static SDL_mutex *smpMutex = NULL;
-static SDL_cond *renderCommandsEvent = NULL;
-static SDL_cond *renderCompletedEvent = NULL;
+/*
+The front end and the render thread share a single producer / single consumer
+ring of command lists. The front end only blocks when it wants to reuse the
+memory of a frame the render thread has not retired yet (GLimp_WaitRenderFence)
+or when it needs the OpenGL context for itself (GLimp_SyncRenderThread).
+*/
+static void    *volatile smpQueue[SMP_FRAMES];
+static SDL_atomic_t smpQueueHead;	// command lists issued by the front end
+static SDL_atomic_t smpQueueTail;	// command lists retired by the render thread
+static SDL_sem *renderCommandsEvent = NULL;
+static SDL_sem *renderCompletedEvent = NULL;
+static qboolean smpFrontEndHasContext;
+static qboolean smpRenderThreadBusy;
 static void     (*renderThreadFunction) (void) = NULL;
 static SDL_Thread *renderThread = NULL;
 
+/*
+===============
+GLimp_AtomicGet
+===============
+*/
+static int GLimp_AtomicGet(SDL_atomic_t * a)
+{
+	return SDL_AtomicAdd(a, 0);
+}
+
 /*
 ===============
 GLimp_SetCurrentContext
@@ -1153,15 +1219,7 @@ qboolean GLimp_SpawnRenderThread(void (*function) (void))
 		GLimp_ShutdownRenderThread();
 	}
 
-	smpMutex = SDL_CreateMutex();
-	if(smpMutex == NULL)
-	{
-		ri.Printf(PRINT_WARNING, "smpMutex creation failed: %s\n", SDL_GetError());
-		GLimp_ShutdownRenderThread();
-		return qfalse;
-	}
-
-	renderCommandsEvent = SDL_CreateCond();
+	renderCommandsEvent = SDL_CreateSemaphore(0);
 	if(renderCommandsEvent == NULL)
 	{
 		ri.Printf(PRINT_WARNING, "renderCommandsEvent creation failed: %s\n", SDL_GetError());
@@ -1169,7 +1227,7 @@ qboolean GLimp_SpawnRenderThread(void (*function) (void))
 		return qfalse;
 	}
 
-	renderCompletedEvent = SDL_CreateCond();
+	renderCompletedEvent = SDL_CreateSemaphore(0);
 	if(renderCompletedEvent == NULL)
 	{
 		ri.Printf(PRINT_WARNING, "renderCompletedEvent creation failed: %s\n", SDL_GetError());
@@ -1177,6 +1235,11 @@ qboolean GLimp_SpawnRenderThread(void (*function) (void))
 		return qfalse;
 	}
 
+	SDL_AtomicSet(&smpQueueHead, 0);
+	SDL_AtomicSet(&smpQueueTail, 0);
+	smpFrontEndHasContext = qtrue;
+	smpRenderThreadBusy = qfalse;
+
 	renderThreadFunction = function;
 	renderThread = SDL_CreateThread(GLimp_RenderThreadWrapper, "render thread", NULL);
 	if(renderThread == NULL)
@@ -1202,61 +1265,95 @@ void GLimp_ShutdownRenderThread(void)
 		SDL_WaitThread(renderThread, NULL);
 		renderThread = NULL;
 		glConfig.smpActive = qfalse;
-	}
 
-	if(smpMutex != NULL)
-	{
-		SDL_DestroyMutex(smpMutex);
-		smpMutex = NULL;
+		GLimp_SetCurrentContext(qtrue);
+		smpFrontEndHasContext = qtrue;
 	}
 
 	if(renderCommandsEvent != NULL)
 	{
-		SDL_DestroyCond(renderCommandsEvent);
+		SDL_DestroySemaphore(renderCommandsEvent);
 		renderCommandsEvent = NULL;
 	}
 
 	if(renderCompletedEvent != NULL)
 	{
-		SDL_DestroyCond(renderCompletedEvent);
+		SDL_DestroySemaphore(renderCompletedEvent);
 		renderCompletedEvent = NULL;
 	}
 
 	renderThreadFunction = NULL;
 }
 
-static volatile void *smpData = NULL;
-static volatile qboolean smpDataReady;
-
 /*
 ===============
 GLimp_RendererSleep
+
+Retires the previously executed command list and waits for the next one
 ===============
 */
 void           *GLimp_RendererSleep(void)
 {
-	void           *data = NULL;
+	void           *data;
+	int             tail;
 
-	GLimp_SetCurrentContext(qfalse);
+	if(smpRenderThreadBusy)
+	{
+		tail = GLimp_AtomicGet(&smpQueueTail);
+
+		// give the context away if nothing else is queued,
+		// the front end may want to sync with us
+		if(GLimp_AtomicGet(&smpQueueHead) == tail + 1)
+		{
+			GLimp_SetCurrentContext(qfalse);
+			smpRenderThreadBusy = qfalse;
+		}
+
+		// after this, the front end can reuse the memory of the retired frame
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicAdd(&smpQueueTail, 1);
+		SDL_SemPost(renderCompletedEvent);
+	}
+
+	SDL_SemWait(renderCommandsEvent);
+	SDL_MemoryBarrierAcquire();
 
-	SDL_LockMutex(smpMutex);
+	data = smpQueue[GLimp_AtomicGet(&smpQueueTail) % SMP_FRAMES];
+
+	if(!smpRenderThreadBusy)
 	{
-		smpData = NULL;
-		smpDataReady = qfalse;
+		GLimp_SetCurrentContext(qtrue);
+		smpRenderThreadBusy = qtrue;
+	}
+
+	return data;
+}
 
-		// after this, the front end can exit GLimp_FrontEndSleep
-		SDL_CondSignal(renderCompletedEvent);
+/*
+===============
+GLimp_WaitRenderFence
 
-		while(!smpDataReady)
-			SDL_CondWait(renderCommandsEvent, smpMutex);
+Blocks until the render thread has retired the command list identified by fence.
+Returns qtrue if the front end had to wait.
+===============
+*/
+qboolean GLimp_WaitRenderFence(int fence)
+{
+	qboolean        stalled = qfalse;
 
-		data = (void *)smpData;
+	// the counters only grow, so compare the difference to survive wrapping
+	while(GLimp_AtomicGet(&smpQueueTail) - fence < 0)
+	{
+		stalled = qtrue;
+		SDL_SemWait(renderCompletedEvent);
 	}
-	SDL_UnlockMutex(smpMutex);
 
-	GLimp_SetCurrentContext(qtrue);
+	// drop the wakeups of frames nobody waited for
+	while(SDL_SemTryWait(renderCompletedEvent) == 0);
 
-	return data;
+	SDL_MemoryBarrierAcquire();
+
+	return stalled;
 }
 
 /*
@@ -1267,46 +1364,57 @@ GLimp_SyncRenderThread
 void GLimp_SyncRenderThread(void)
 {
 	GLimp_FrontEndSleep();
-
-	GLimp_SetCurrentContext(qtrue);
 }
 
 /*
 ===============
 GLimp_FrontEndSleep
+
+Waits until all issued command lists are retired and takes over the context
 ===============
 */
 void GLimp_FrontEndSleep(void)
 {
-	SDL_LockMutex(smpMutex);
+	GLimp_WaitRenderFence(GLimp_AtomicGet(&smpQueueHead));
+
+	if(!smpFrontEndHasContext)
 	{
-		while(smpData)
-			SDL_CondWait(renderCompletedEvent, smpMutex);
+		GLimp_SetCurrentContext(qtrue);
+		smpFrontEndHasContext = qtrue;
 	}
-	SDL_UnlockMutex(smpMutex);
-
-	GLimp_SetCurrentContext(qtrue);
 }
 
 /*
 ===============
 GLimp_WakeRenderer
+
+Queues a command list for the render thread and returns the fence
+that will be signaled after it was executed
 ===============
 */
-void GLimp_WakeRenderer(void *data)
+int GLimp_WakeRenderer(void *data)
 {
-	GLimp_SetCurrentContext(qfalse);
+	int             head;
 
-	SDL_LockMutex(smpMutex);
+	if(smpFrontEndHasContext)
 	{
-		assert(smpData == NULL);
-		smpData = data;
-		smpDataReady = qtrue;
-
-		// after this, the renderer can continue through GLimp_RendererSleep
-		SDL_CondSignal(renderCommandsEvent);
+		GLimp_SetCurrentContext(qfalse);
+		smpFrontEndHasContext = qfalse;
 	}
-	SDL_UnlockMutex(smpMutex);
+
+	head = GLimp_AtomicGet(&smpQueueHead);
+
+	// never overwrite a slot the render thread did not pick up yet
+	GLimp_WaitRenderFence(head - SMP_FRAMES + 1);
+
+	smpQueue[head % SMP_FRAMES] = data;
+
+	// after this, the renderer can continue through GLimp_RendererSleep
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicAdd(&smpQueueHead, 1);
+	SDL_SemPost(renderCommandsEvent);
+
+	return head + 1;
 }
 
 #else
@@ -1344,8 +1452,101 @@ void GLimp_FrontEndSleep(void)
 {
 }
 
-void GLimp_WakeRenderer(void *data)
+qboolean GLimp_WaitRenderFence(int fence)
 {
+	return qfalse;
 }
 
-#endif
\ No newline at end of file
+int GLimp_WakeRenderer(void *data)
+{
+	return 0;
+}
+
+#endif
+
+/*
+===========================================================
+
+PARALLEL JOBS
+
+===========================================================
+*/
+
+#define MAX_PARALLEL_THREADS	16
+
+typedef struct
+{
+	void            (*function) (void *data, int index);
+	void           *data;
+	int             count;
+	SDL_atomic_t    next;
+} parallelJob_t;
+
+/*
+===============
+GLimp_ParallelWorker
+===============
+*/
+static int GLimp_ParallelWorker(void *arg)
+{
+	parallelJob_t  *job = (parallelJob_t *) arg;
+	int             index;
+
+	while((index = SDL_AtomicAdd(&job->next, 1)) < job->count)
+	{
+		job->function(job->data, index);
+	}
+
+	return 0;
+}
+
+/*
+===============
+GLimp_ParallelFor
+
+Calls function for every index in [0, count) spread over all CPU cores and
+returns after all calls finished. The main thread takes part in the work.
+function must not touch the GL context, the file system or anything else
+that is not thread safe.
+===============
+*/
+void GLimp_ParallelFor(void (*function) (void *data, int index), void *data, int count)
+{
+	parallelJob_t   job;
+	SDL_Thread     *threads[MAX_PARALLEL_THREADS];
+	int             i, numThreads;
+
+	if(count <= 0)
+	{
+		return;
+	}
+
+	job.function = function;
+	job.data = data;
+	job.count = count;
+	SDL_AtomicSet(&job.next, 0);
+
+	numThreads = SDL_GetCPUCount() - 1;
+	if(numThreads > count - 1)
+		numThreads = count - 1;
+	if(numThreads > MAX_PARALLEL_THREADS)
+		numThreads = MAX_PARALLEL_THREADS;
+
+	for(i = 0; i < numThreads; i++)
+	{
+		threads[i] = SDL_CreateThread(GLimp_ParallelWorker, "parallel worker", &job);
+		if(threads[i] == NULL)
+		{
+			// the remaining workers pick up the slack
+			break;
+		}
+	}
+	numThreads = i;
+
+	GLimp_ParallelWorker(&job);
+
+	for(i = 0; i < numThreads; i++)
+	{
+		SDL_WaitThread(threads[i], NULL);
+	}
+}
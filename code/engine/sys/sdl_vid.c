@@ -84,8 +84,14 @@ void GLimp_FrontEndSleep(void)
 {
 }
 
-void GLimp_WakeRenderer(void *data)
+qboolean GLimp_WaitRenderFence(int fence)
 {
+	return qfalse;
+}
+
+int GLimp_WakeRenderer(void *data)
+{
+	return 0;
 }
 
 
@@ -402,6 +402,10 @@ typedef struct
 	int             maxColorAttachments;
 	qboolean        framebufferPackedDepthStencilAvailable;
 	qboolean        framebufferBlitAvailable;
+
+	qboolean        drawInstancedAvailable;
+
+	qboolean        textureCompressionBPTCAvailable;
 } glconfig2_t;
 // XreaL END
 
@@ -35,6 +35,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
 #include <unistd.h>
+#include <sys/time.h>
 #endif
 
 #ifdef NeXT
@@ -329,6 +330,34 @@ double I_FloatTime(void)
 #endif
 }
 
+/*
+================
+I_PreciseTime
+
+seconds with sub millisecond resolution, only useful for differences
+================
+*/
+double I_PreciseTime(void)
+{
+#ifdef WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER   counter;
+
+	if(!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&counter);
+
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timeval  tp;
+
+	gettimeofday(&tp, NULL);
+
+	return tp.tv_sec + tp.tv_usec / 1000000.0;
+#endif
+}
+
 void Q_getwd(char *out)
 {
 	int             i = 0;
@@ -79,30 +79,337 @@ int GetThreadWork(void)
 }
 
 
+/*
+=============================================================================
+
+WORK STEALING
+
+RunThreadsOnIndividual gives every thread its own range of work items.
+A thread takes small chunks from the front of its range, when it runs dry
+it steals the back half of the biggest range that is left. begin and end
+of a range share one 64 bit word so the owner and the thieves both update
+it with a single compare and swap, no lock is taken.
+
+RunThreadsOnIndividualSorted sorts the work items by falling cost and deals
+them to the threads like cards, so all threads start with expensive items
+and only cheap items are left to steal at the end.
+
+Neither keeps the order of the work items. Work where the later items use
+the results of the earlier ones, like the vis flow passes that go from the
+cheapest portal on, has to use RunThreadsOnIndividualOrdered, which hands
+the items out one by one through GetThreadWork.
+
+=============================================================================
+*/
+
+#ifdef WIN32
+#include <windows.h>
+
+typedef LONGLONG workRange_t;
+typedef LONG    workCounter_t;
+
+#define WorkRangeCompareAndSwap(ptr, old, new)	(InterlockedCompareExchange64((ptr), (new), (old)) == (old))
+#define WorkCounterAdd(ptr, n)					InterlockedExchangeAdd((ptr), (n))
+#else
+typedef long long workRange_t;
+typedef int     workCounter_t;
+
+#define WorkRangeCompareAndSwap(ptr, old, new)	__sync_bool_compare_and_swap((ptr), (old), (new))
+#define WorkCounterAdd(ptr, n)					__sync_fetch_and_add((ptr), (n))
+#endif
+
+#define	MAX_WORK_CHUNK		16
+
+#define	WORK_RANGE(begin, end)	(((workRange_t)(end) << 32) | (workRange_t)(unsigned int)(begin))
+#define	WORK_BEGIN(range)		((int)((range) & 0xFFFFFFFF))
+#define	WORK_END(range)			((int)((range) >> 32))
+
+typedef struct
+{
+	volatile workRange_t range;
+	char            pad[64 - sizeof(workRange_t)];	// one cache line per thread
+} workQueue_t;
+
+static workQueue_t workQueues[MAX_THREADS];
+static int      numWorkQueues;
+static int     *workOrder;		// work items in the order of the ranges, NULL for 0 .. workcount - 1
+static volatile workCounter_t workDone;
+
 void            (*workfunction) (int);
 
+/*
+=============
+TakeThreadWork
+
+Takes a chunk from the front of the range of the thread
+=============
+*/
+static qboolean TakeThreadWork(workQueue_t * queue, int *begin, int *end)
+{
+	workRange_t     range;
+	int             b, e, n;
+
+	while(1)
+	{
+		range = queue->range;
+		b = WORK_BEGIN(range);
+		e = WORK_END(range);
+
+		if(b >= e)
+			return qfalse;
+
+		// big chunks while there is a lot left, single items at the end
+		n = (e - b) / 8;
+		if(n < 1)
+			n = 1;
+		if(n > MAX_WORK_CHUNK)
+			n = MAX_WORK_CHUNK;
+
+		if(WorkRangeCompareAndSwap(&queue->range, range, WORK_RANGE(b + n, e)))
+		{
+			*begin = b;
+			*end = b + n;
+			return qtrue;
+		}
+	}
+}
+
+/*
+=============
+StealThreadWork
+
+Moves the back half of the biggest range of another thread to the range of the thread
+=============
+*/
+static qboolean StealThreadWork(workQueue_t * queue)
+{
+	workQueue_t    *victim;
+	workRange_t     range, best;
+	int             i, b, e, n, bestSize;
+
+	while(1)
+	{
+		victim = NULL;
+		best = 0;
+		bestSize = 0;
+
+		for(i = 0; i < numWorkQueues; i++)
+		{
+			range = workQueues[i].range;
+			if(WORK_END(range) - WORK_BEGIN(range) > bestSize)
+			{
+				victim = &workQueues[i];
+				best = range;
+				bestSize = WORK_END(range) - WORK_BEGIN(range);
+			}
+		}
+
+		if(!victim)
+			return qfalse;
+
+		b = WORK_BEGIN(best);
+		e = WORK_END(best);
+		n = (e - b + 1) / 2;
+
+		if(WorkRangeCompareAndSwap(&victim->range, best, WORK_RANGE(b, e - n)))
+		{
+			// only fails on a torn read, nobody else changes an empty range
+			do
+			{
+				range = queue->range;
+			} while(!WorkRangeCompareAndSwap(&queue->range, range, WORK_RANGE(e - n, e)));
+
+			return qtrue;
+		}
+	}
+}
+
+/*
+=============
+ThreadWorkDone
+
+Updates the pacifier after a chunk of work was done
+=============
+*/
+static void ThreadWorkDone(int count)
+{
+	int             done;
+	int             f;
+
+	done = WorkCounterAdd(&workDone, count) + count;
+
+	// same steps as GetThreadWork
+	f = 10 * (done - 1) / workcount;
+	if(f <= oldf)
+		return;
+
+	ThreadLock();
+	while(oldf < f)
+	{
+		oldf++;
+		if(pacifier)
+		{
+			Sys_Printf("%i...", oldf);
+			fflush(stdout);		/* ydnar */
+		}
+	}
+	ThreadUnlock();
+}
+
 void ThreadWorkerFunction(int threadnum)
 {
-	int             work;
+	workQueue_t    *queue = &workQueues[threadnum];
+	int             begin, end, i;
 
 	while(1)
 	{
-		work = GetThreadWork();
-		if(work == -1)
-			break;
+		if(!TakeThreadWork(queue, &begin, &end))
+		{
+			if(!StealThreadWork(queue))
+				break;
+			continue;
+		}
+
+		for(i = begin; i < end; i++)
+		{
 //Sys_Printf ("thread %i, work %i\n", threadnum, work);
+			workfunction(workOrder ? workOrder[i] : i);
+		}
+
+		ThreadWorkDone(end - begin);
+	}
+}
+
+/*
+=============
+SetupThreadWork
+
+Splits the work items into one range per thread
+=============
+*/
+static void SetupThreadWork(int workcnt)
+{
+	int             i;
+
+	numWorkQueues = numthreads;
+	if(numWorkQueues < 1)
+		numWorkQueues = 1;
+	if(numWorkQueues > MAX_THREADS)
+		Error("numthreads > MAX_THREADS");
+
+	for(i = 0; i < numWorkQueues; i++)
+		workQueues[i].range = WORK_RANGE((long long)workcnt * i / numWorkQueues, (long long)workcnt * (i + 1) / numWorkQueues);
+
+	workDone = 0;
+}
+
+static void ThreadWorkerOrdered(int threadnum)
+{
+	int             work;
+
+	while((work = GetThreadWork()) != -1)
+	{
 		workfunction(work);
 	}
 }
 
+/*
+=============
+RunThreadsOnIndividualOrdered
+
+Hands out the work items one by one from 0 to workcnt - 1, for work where
+the later items profit from the results of the earlier ones
+=============
+*/
+void RunThreadsOnIndividualOrdered(int workcnt, qboolean showpacifier, void (*func) (int))
+{
+	if(numthreads == -1)
+		ThreadSetDefault();
+	workfunction = func;
+	RunThreadsOn(workcnt, showpacifier, ThreadWorkerOrdered);
+}
+
 void RunThreadsOnIndividual(int workcnt, qboolean showpacifier, void (*func) (int))
 {
 	if(numthreads == -1)
 		ThreadSetDefault();
 	workfunction = func;
+	workOrder = NULL;
+	SetupThreadWork(workcnt);
 	RunThreadsOn(workcnt, showpacifier, ThreadWorkerFunction);
 }
 
+static int      (*workcost) (int);
+
+static int CompareWorkCost(const void *a, const void *b)
+{
+	int             ca, cb;
+
+	ca = workcost(*(const int *)a);
+	cb = workcost(*(const int *)b);
+
+	if(ca != cb)
+		return cb - ca;
+
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+=============
+RunThreadsOnIndividualSorted
+
+Like RunThreadsOnIndividual, cost returns the relative cost of a work item
+=============
+*/
+void RunThreadsOnIndividualSorted(int workcnt, qboolean showpacifier, void (*func) (int), int (*cost) (int))
+{
+	int            *sorted;
+	int             i, t, first;
+
+	if(numthreads == -1)
+		ThreadSetDefault();
+
+	SetupThreadWork(workcnt);
+
+	if(workcnt <= 0 || numWorkQueues == 1)
+	{
+		// a single thread just works from the front to the back
+		workOrder = NULL;
+	}
+	else
+	{
+		sorted = safe_malloc(workcnt * sizeof(*sorted));
+		workOrder = safe_malloc(workcnt * sizeof(*workOrder));
+
+		for(i = 0; i < workcnt; i++)
+			sorted[i] = i;
+
+		workcost = cost;
+		qsort(sorted, workcnt, sizeof(*sorted), CompareWorkCost);
+
+		// item i goes to thread i % numWorkQueues
+		first = 0;
+		for(t = 0; t < numWorkQueues; t++)
+		{
+			workQueues[t].range = WORK_RANGE(first, first + (workcnt - t + numWorkQueues - 1) / numWorkQueues);
+
+			for(i = t; i < workcnt; i += numWorkQueues)
+				workOrder[first++] = sorted[i];
+		}
+
+		free(sorted);
+	}
+
+	workfunction = func;
+	RunThreadsOn(workcnt, showpacifier, ThreadWorkerFunction);
+
+	if(workOrder)
+	{
+		free(workOrder);
+		workOrder = NULL;
+	}
+}
+
 
 /*
 ===================================================================
@@ -26,6 +26,8 @@ extern int      numthreads;
 void            ThreadSetDefault(void);
 int             GetThreadWork(void);
 void            RunThreadsOnIndividual(int workcnt, qboolean showpacifier, void (*func) (int));
+void            RunThreadsOnIndividualSorted(int workcnt, qboolean showpacifier, void (*func) (int), int (*cost) (int));
+void            RunThreadsOnIndividualOrdered(int workcnt, qboolean showpacifier, void (*func) (int));
 void            RunThreadsOn(int workcnt, qboolean showpacifier, void (*func) (int));
 void            ThreadLock(void);
 void            ThreadUnlock(void);
@@ -44,6 +44,74 @@ functions
 
 ------------------------------------------------------------------------------- */
 
+#define MAX_BSP_PHASES			32
+
+static const char *bspPhaseNames[MAX_BSP_PHASES];
+static double   bspPhaseTimes[MAX_BSP_PHASES];
+static int      numBSPPhases;
+static double   bspPhaseStart;
+
+
+
+/*
+EndBSPPhase()
+adds the time since the last phase ended to the named phase
+*/
+
+static void EndBSPPhase(const char *name)
+{
+	int             i;
+	double          now;
+
+
+	now = I_PreciseTime();
+
+	for(i = 0; i < numBSPPhases; i++)
+	{
+		if(!strcmp(bspPhaseNames[i], name))
+			break;
+	}
+
+	if(i == numBSPPhases && numBSPPhases < MAX_BSP_PHASES)
+	{
+		bspPhaseNames[i] = name;
+		bspPhaseTimes[i] = 0;
+		numBSPPhases++;
+	}
+
+	if(i < numBSPPhases)
+		bspPhaseTimes[i] += now - bspPhaseStart;
+
+	bspPhaseStart = now;
+}
+
+
+
+/*
+PrintBSPPhases()
+prints the time spent in each phase of the bsp stage
+*/
+
+static void PrintBSPPhases(void)
+{
+	int             i;
+	double          total;
+
+
+	Sys_Printf("--- BSP Timings ---\n");
+
+	total = 0;
+	for(i = 0; i < numBSPPhases; i++)
+	{
+		Sys_Printf("%9.2f seconds %s\n", bspPhaseTimes[i], bspPhaseNames[i]);
+		total += bspPhaseTimes[i];
+	}
+
+	Sys_Printf("%9.2f seconds total\n", total);
+}
+
+
+
 /*
 ProcessAdvertisements()
 copies advertisement info into the BSP structures
@@ -480,12 +548,16 @@ void ProcessWorldModel(void)
 
 	/* check for patches with adjacent edges that need to lod together */
 	PatchMapDrawSurfs(e);
+	EndBSPPhase("patches");
 
 	/* build an initial bsp tree using all of the sides of all of the structural brushes */
 	faces = MakeStructuralBSPFaceList(entities[0].brushes);
 	tree = FaceBSP(faces, qtrue);
+	EndBSPPhase("face bsp");
 	MakeTreePortals(tree);
+	EndBSPPhase("portals");
 	FilterStructuralBrushesIntoTree(e, tree);
+	EndBSPPhase("filter brushes");
 
 #if 0
 	if(drawBSP)
@@ -501,21 +573,27 @@ void ProcessWorldModel(void)
 	{
 		/* rebuild a better bsp tree using only the sides that are visible from the inside */
 		FillOutside(tree->headnode);
+		EndBSPPhase("flood");
 
 		/* chop the sides to the convex hull of their visible fragments, giving us the smallest polygons */
 		ClipSidesIntoTree(e, tree);
+		EndBSPPhase("clip sides");
 
 		/* build a visible face tree */
 		faces = MakeVisibleBSPFaceList(entities[0].brushes);
 		FreeTree(tree);
 		tree = FaceBSP(faces, qtrue);
+		EndBSPPhase("face bsp");
 		MakeTreePortals(tree);
+		EndBSPPhase("portals");
 		FilterStructuralBrushesIntoTree(e, tree);
+		EndBSPPhase("filter brushes");
 		leaked = qfalse;
 
 		/* ydnar: flood again for skybox */
 		if(skyboxPresent)
 			FloodEntities(tree);
+		EndBSPPhase("flood");
 	}
 	else
 	{
@@ -540,9 +618,11 @@ void ProcessWorldModel(void)
 			exit(0);
 		}
 		leaked = qtrue;
+		EndBSPPhase("flood");
 
 		/* chop the sides to the convex hull of their visible fragments, giving us the smallest polygons */
 		ClipSidesIntoTree(e, tree);
+		EndBSPPhase("clip sides");
 	}
 
 #if 1
@@ -558,21 +638,25 @@ void ProcessWorldModel(void)
 	NumberClusters(tree);
 	if(!leaked)
 		WritePortalFile(tree);
+	EndBSPPhase("portal file");
 
 	/* flood from entities */
 	FloodAreas(tree);
+	EndBSPPhase("flood");
 
 	/* create drawsurfs for triangle models */
 	AddTriangleModels(e);
 
 	/* create drawsurfs for surface models */
 	AddEntitySurfaceModels(e);
+	EndBSPPhase("models");
 
 	/* generate bsp brushes from map brushes */
 	EmitBrushes(e->brushes, &e->firstBrush, &e->numBrushes);
 
 	/* add references to the detail brushes */
 	FilterDetailBrushesIntoTree(e, tree);
+	EndBSPPhase("filter brushes");
 
 	/* drawsurfs that cross fog boundaries will need to be split along the fog boundary */
 	if(!nofog)
@@ -581,22 +665,27 @@ void ProcessWorldModel(void)
 	/* subdivide each drawsurf as required by shader tesselation */
 	if(!nosubdivide)
 		SubdivideFaceSurfaces(e, tree);
+	EndBSPPhase("fog and subdivision");
 
 	/* add in any vertexes required to fix t-junctions */
 	if(!notjunc)
 		FixTJunctions(e);
+	EndBSPPhase("tjunctions");
 
 	/* ydnar: classify the surfaces */
 	ClassifyEntitySurfaces(e);
+	EndBSPPhase("classify surfaces");
 
 	/* ydnar: project decals */
 	MakeEntityDecals(e);
+	EndBSPPhase("decals");
 
 	/* ydnar: meta surfaces */
 	MakeEntityMetaTriangles(e);
 	SmoothMetaTriangles();
 	FixMetaTJunctions();
 	MergeMetaTriangles();
+	EndBSPPhase("meta surfaces");
 
 	/* ydnar: debug portals */
 	if(debugPortals)
@@ -678,6 +767,7 @@ void ProcessWorldModel(void)
 #endif
 
 	FreeTree(tree);
+	EndBSPPhase("emit surfaces");
 }
 
 
@@ -805,7 +895,10 @@ void ProcessModels(void)
 			if(mapEntityNum == 0)
 				ProcessWorldModel();
 			else
+			{
 				ProcessSubModel();
+				EndBSPPhase("submodels");
+			}
 
 			/* potentially turn off the deluge of text */
 			verbose = verboseEntities;
@@ -820,6 +913,7 @@ void ProcessModels(void)
 
 	/* vortex: emit meta stats */
 	EmitMetaStats();
+	EndBSPPhase("emit surfaces");
 }
 
 
@@ -1101,6 +1195,20 @@ int BSPMain(int argc, char **argv)
 			Sys_Printf("Alternate BSP splitting (by 27) enabled\n");
 			bspAlternateSplitWeights = qtrue;
 		}
+		else if(!strcmp(argv[i], "-exactsplits"))
+		{
+			Sys_Printf("Testing every split plane, building the face BSP on one thread\n");
+			exactSplits = qtrue;
+		}
+		else if(!strcmp(argv[i], "-splitsamples"))
+		{
+			splitSamples = atoi(argv[i + 1]);
+			i++;
+			if(splitSamples <= 0)
+				Sys_Printf("Testing every split plane\n");
+			else
+				Sys_Printf("Testing up to %d split planes per BSP node\n", splitSamples);
+		}
 		else if(!strcmp(argv[i], "-deep"))
 		{
 			Sys_Printf("Deep BSP tree generation enabled\n");
@@ -1157,8 +1265,13 @@ int BSPMain(int argc, char **argv)
 		return 0;
 	}
 
+	/* time the phases from here on */
+	numBSPPhases = 0;
+	bspPhaseStart = I_PreciseTime();
+
 	/* load shaders */
 	LoadShaderInfo();
+	EndBSPPhase("load shaders");
 
 	/* load original file from temp spot in case it was renamed by the editor on the way in */
 	if(strlen(tempSource) > 0)
@@ -1168,9 +1281,11 @@ int BSPMain(int argc, char **argv)
 
 	/* div0: inject command line parameters */
 	InjectCommandLine(argv, 1, argc - 1);
+	EndBSPPhase("load map");
 
 	/* ydnar: decal setup */
 	ProcessDecals();
+	EndBSPPhase("decals");
 
 	/* process world and submodels */
 	ProcessModels();
@@ -1186,6 +1301,9 @@ int BSPMain(int argc, char **argv)
 
 	/* finish and write bsp */
 	EndBSPFile();
+	EndBSPPhase("write bsp");
+
+	PrintBSPPhases();
 
 	/* remove temp map source file if appropriate */
 	if(strlen(tempSource) > 0)
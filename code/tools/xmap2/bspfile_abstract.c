@@ -36,6 +36,12 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 /* dependencies */
 #include "q3map2.h"
 
+#ifdef Q_UNIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
 
 
 
@@ -247,6 +253,158 @@ void SwapBSPFile(void)
 
 
 
+/* -------------------------------------------------------------------------------
+
+mapped bsp files
+
+the loaders read the lumps straight out of a private mapping of the file, so
+reading a bsp doesn't need a second copy of it next to the converted arrays.
+the pages are only backed by the file and the os can drop them again as soon
+as a lump is converted. the header is swapped in place, which copies just its
+own page. every lump is checked against the file length before it is read.
+
+------------------------------------------------------------------------------- */
+
+static void    *bspFileBuffer;
+static int      bspFileLength;
+static qboolean bspFileMapped;
+
+#ifdef WIN32
+static HANDLE   bspFileMapping;
+#endif
+
+
+
+/*
+MapBSPFile()
+maps a bsp file into memory until UnmapBSPFile(), loads it where it can't be mapped
+*/
+
+void           *MapBSPFile(const char *filename, int headerSize)
+{
+	/* only one bsp file is read at a time */
+	UnmapBSPFile();
+
+#if defined( Q_UNIX )
+	{
+		int             fd;
+		struct stat     st;
+		void           *buffer;
+
+
+		fd = open(filename, O_RDONLY);
+		if(fd >= 0)
+		{
+			if(fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= INT_MAX)
+			{
+				buffer = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+				if(buffer != MAP_FAILED)
+				{
+					bspFileBuffer = buffer;
+					bspFileLength = st.st_size;
+					bspFileMapped = qtrue;
+				}
+			}
+			close(fd);
+		}
+	}
+#elif defined( WIN32 )
+	{
+		HANDLE          file;
+		LARGE_INTEGER   size;
+
+
+		file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(file != INVALID_HANDLE_VALUE)
+		{
+			if(GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart <= 0x7FFFFFFF)
+			{
+				bspFileMapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+				if(bspFileMapping != NULL)
+				{
+					bspFileBuffer = MapViewOfFile(bspFileMapping, FILE_MAP_COPY, 0, 0, 0);
+					if(bspFileBuffer != NULL)
+					{
+						bspFileLength = (int)size.QuadPart;
+						bspFileMapped = qtrue;
+					}
+					else
+					{
+						CloseHandle(bspFileMapping);
+						bspFileMapping = NULL;
+					}
+				}
+			}
+			CloseHandle(file);
+		}
+	}
+#endif
+
+	/* fall back to reading the whole file */
+	if(!bspFileMapped)
+		bspFileLength = LoadFile(filename, &bspFileBuffer);
+
+	/* dummy check */
+	if(bspFileLength < headerSize)
+		Error("%s is too short for a bsp file (%d bytes)", filename, bspFileLength);
+
+	return bspFileBuffer;
+}
+
+
+
+/*
+UnmapBSPFile()
+releases the file mapped by MapBSPFile()
+*/
+
+void UnmapBSPFile(void)
+{
+	if(bspFileBuffer == NULL)
+		return;
+
+	if(bspFileMapped)
+	{
+#if defined( Q_UNIX )
+		munmap(bspFileBuffer, bspFileLength);
+#elif defined( WIN32 )
+		UnmapViewOfFile(bspFileBuffer);
+		CloseHandle(bspFileMapping);
+		bspFileMapping = NULL;
+#endif
+	}
+	else
+		free(bspFileBuffer);
+
+	bspFileBuffer = NULL;
+	bspFileLength = 0;
+	bspFileMapped = qfalse;
+}
+
+
+
+/*
+CheckLump()
+makes sure a lump lies within the bsp file it is read from
+*/
+
+static void CheckLump(bspHeader_t * header, int lump)
+{
+	int             length, offset;
+
+
+	/* only headers of a mapped file are checked */
+	if((void *)header != bspFileBuffer)
+		return;
+
+	length = header->lumps[lump].length;
+	offset = header->lumps[lump].offset;
+	if(length < 0 || offset < 0 || offset > bspFileLength - length)
+		Error("Lump %d (%d bytes at %d) is outside of the bsp file (%d bytes)", lump, length, offset, bspFileLength);
+}
+
+
+
 /*
 GetLumpElements()
 gets the number of elements in a bsp lump
@@ -254,6 +412,8 @@ gets the number of elements in a bsp lump
 
 int GetLumpElements(bspHeader_t * header, int lump, int size)
 {
+	CheckLump(header, lump);
+
 	/* check for odd size */
 	if(header->lumps[lump].length % size)
 	{
@@ -294,6 +454,8 @@ int CopyLump(bspHeader_t * header, int lump, void *dest, int size)
 	int             length, offset;
 
 
+	CheckLump(header, lump);
+
 	/* get lump length and offset */
 	length = header->lumps[lump].length;
 	offset = header->lumps[lump].offset;
@@ -326,6 +488,37 @@ int CopyLump_Allocate(bspHeader_t * header, int lump, void **dest, int size, int
 }
 
 
+/*
+BeginLump()
+starts a lump of an outgoing bsp file, its data is written with SafeWrite() until EndLump()
+*/
+
+void BeginLump(FILE * file, bspHeader_t * header, int lumpNum)
+{
+	header->lumps[lumpNum].offset = LittleLong(ftell(file));
+	header->lumps[lumpNum].length = 0;
+}
+
+
+
+/*
+EndLump()
+sets the length of the lump from what was written since BeginLump() and pads it to 4 bytes
+*/
+
+void EndLump(FILE * file, bspHeader_t * header, int lumpNum)
+{
+	int             length;
+	static const byte pad[4] = { 0, 0, 0, 0 };
+
+
+	length = ftell(file) - LittleLong(header->lumps[lumpNum].offset);
+	header->lumps[lumpNum].length = LittleLong(length);
+	SafeWrite(file, pad, ((length + 3) & ~3) - length);
+}
+
+
+
 /*
 AddLump()
 adds a lump to an outgoing bsp file
@@ -333,16 +526,37 @@ adds a lump to an outgoing bsp file
 
 void AddLump(FILE * file, bspHeader_t * header, int lumpNum, const void *data, int length)
 {
-	bspLump_t      *lump;
+	BeginLump(file, header, lumpNum);
+	SafeWrite(file, data, length);
+	EndLump(file, header, lumpNum);
+}
 
 
-	/* add lump to bsp file header */
-	lump = &header->lumps[lumpNum];
-	lump->offset = LittleLong(ftell(file));
-	lump->length = LittleLong(length);
 
-	/* write lump to file */
-	SafeWrite(file, data, (length + 3) & ~3);
+/*
+AddLightmapLump()
+adds the lightmap lump to an outgoing bsp file, a page at a time when -light
+left them in the output lightmaps instead of bspLightBytes
+*/
+
+void AddLightmapLump(FILE * file, bspHeader_t * header, int lumpNum)
+{
+	int             i, pageSize;
+
+
+	/* loaded from a bsp or empty */
+	if(bspLightBytes != NULL || numBSPLightBytes <= 0)
+	{
+		AddLump(file, header, lumpNum, bspLightBytes, numBSPLightBytes);
+		return;
+	}
+
+	pageSize = game->lightmapSize * game->lightmapSize * 3;
+
+	BeginLump(file, header, lumpNum);
+	for(i = 0; i < numBSPLightBytes / pageSize; i++)
+		SafeWrite(file, BSPLightmapPage(i), pageSize);
+	EndLump(file, header, lumpNum);
 }
 
 
@@ -389,9 +603,12 @@ void WriteBSPFile(const char *filename)
 	game->write(tempname);
 	SwapBSPFile();
 
-	/* replace existing bsp file */
-	remove(filename);
-	rename(tempname, filename);
+	/* replace existing bsp file, in one step where the os allows it */
+	if(rename(tempname, filename) != 0)
+	{
+		remove(filename);
+		rename(tempname, filename);
+	}
 }
 
 
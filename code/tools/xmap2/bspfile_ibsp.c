@@ -115,32 +115,30 @@ static void CopyBrushSidesLump(ibspHeader_t * header)
 
 static void AddBrushSidesLump(FILE * file, ibspHeader_t * header)
 {
-	int             i, size;
+	int             i, j;
 	bspBrushSide_t *in;
-	ibspBrushSide_t *buffer, *out;
+	ibspBrushSide_t buffer[LUMP_BLOCK_ELEMENTS], *out;
 
 
-	/* allocate output buffer */
-	size = numBSPBrushSides * sizeof(*buffer);
-	buffer = safe_malloc(size);
-	memset(buffer, 0, size);
+	BeginLump(file, (bspHeader_t *) header, LUMP_BRUSHSIDES);
 
-	/* convert */
+	/* convert and write a block at a time */
 	in = bspBrushSides;
-	out = buffer;
-	for(i = 0; i < numBSPBrushSides; i++)
+	for(i = 0; i < numBSPBrushSides; i += j)
 	{
-		out->planeNum = in->planeNum;
-		out->shaderNum = in->shaderNum;
-		in++;
-		out++;
+		memset(buffer, 0, sizeof(buffer));
+		out = buffer;
+		for(j = 0; j < LUMP_BLOCK_ELEMENTS && i + j < numBSPBrushSides; j++)
+		{
+			out->planeNum = in->planeNum;
+			out->shaderNum = in->shaderNum;
+			in++;
+			out++;
+		}
+		SafeWrite(file, buffer, j * sizeof(*buffer));
 	}
 
-	/* write lump */
-	AddLump(file, (bspHeader_t *) header, LUMP_BRUSHSIDES, buffer, size);
-
-	/* free buffer */
-	free(buffer);
+	EndLump(file, (bspHeader_t *) header, LUMP_BRUSHSIDES);
 }
 
 
@@ -229,52 +227,50 @@ static void CopyDrawSurfacesLump(ibspHeader_t * header)
 
 static void AddDrawSurfacesLump(FILE * file, ibspHeader_t * header)
 {
-	int             i, size;
+	int             i, j;
 	bspDrawSurface_t *in;
-	ibspDrawSurface_t *buffer, *out;
+	ibspDrawSurface_t buffer[LUMP_BLOCK_ELEMENTS], *out;
 
 
-	/* allocate output buffer */
-	size = numBSPDrawSurfaces * sizeof(*buffer);
-	buffer = safe_malloc(size);
-	memset(buffer, 0, size);
+	BeginLump(file, (bspHeader_t *) header, LUMP_SURFACES);
 
-	/* convert */
+	/* convert and write a block at a time */
 	in = bspDrawSurfaces;
-	out = buffer;
-	for(i = 0; i < numBSPDrawSurfaces; i++)
+	for(i = 0; i < numBSPDrawSurfaces; i += j)
 	{
-		out->shaderNum = in->shaderNum;
-		out->fogNum = in->fogNum;
-		out->surfaceType = in->surfaceType;
-		out->firstVert = in->firstVert;
-		out->numVerts = in->numVerts;
-		out->firstIndex = in->firstIndex;
-		out->numIndexes = in->numIndexes;
-
-		out->lightmapNum = in->lightmapNum[0];
-		out->lightmapX = in->lightmapX[0];
-		out->lightmapY = in->lightmapY[0];
-		out->lightmapWidth = in->lightmapWidth;
-		out->lightmapHeight = in->lightmapHeight;
-
-		VectorCopy(in->lightmapOrigin, out->lightmapOrigin);
-		VectorCopy(in->lightmapVecs[0], out->lightmapVecs[0]);
-		VectorCopy(in->lightmapVecs[1], out->lightmapVecs[1]);
-		VectorCopy(in->lightmapVecs[2], out->lightmapVecs[2]);
-
-		out->patchWidth = in->patchWidth;
-		out->patchHeight = in->patchHeight;
-
-		in++;
-		out++;
+		memset(buffer, 0, sizeof(buffer));
+		out = buffer;
+		for(j = 0; j < LUMP_BLOCK_ELEMENTS && i + j < numBSPDrawSurfaces; j++)
+		{
+			out->shaderNum = in->shaderNum;
+			out->fogNum = in->fogNum;
+			out->surfaceType = in->surfaceType;
+			out->firstVert = in->firstVert;
+			out->numVerts = in->numVerts;
+			out->firstIndex = in->firstIndex;
+			out->numIndexes = in->numIndexes;
+
+			out->lightmapNum = in->lightmapNum[0];
+			out->lightmapX = in->lightmapX[0];
+			out->lightmapY = in->lightmapY[0];
+			out->lightmapWidth = in->lightmapWidth;
+			out->lightmapHeight = in->lightmapHeight;
+
+			VectorCopy(in->lightmapOrigin, out->lightmapOrigin);
+			VectorCopy(in->lightmapVecs[0], out->lightmapVecs[0]);
+			VectorCopy(in->lightmapVecs[1], out->lightmapVecs[1]);
+			VectorCopy(in->lightmapVecs[2], out->lightmapVecs[2]);
+
+			out->patchWidth = in->patchWidth;
+			out->patchHeight = in->patchHeight;
+
+			in++;
+			out++;
+		}
+		SafeWrite(file, buffer, j * sizeof(*buffer));
 	}
 
-	/* write lump */
-	AddLump(file, (bspHeader_t *) header, LUMP_SURFACES, buffer, size);
-
-	/* free buffer */
-	free(buffer);
+	EndLump(file, (bspHeader_t *) header, LUMP_SURFACES);
 }
 
 
@@ -329,44 +325,42 @@ static void CopyDrawVertsLump(ibspHeader_t * header)
 
 static void AddDrawVertsLump(FILE * file, ibspHeader_t * header)
 {
-	int             i, size;
+	int             i, j;
 	bspDrawVert_t  *in;
-	ibspDrawVert_t *buffer, *out;
+	ibspDrawVert_t  buffer[LUMP_BLOCK_ELEMENTS], *out;
 
 
-	/* allocate output buffer */
-	size = numBSPDrawVerts * sizeof(*buffer);
-	buffer = safe_malloc(size);
-	memset(buffer, 0, size);
+	BeginLump(file, (bspHeader_t *) header, LUMP_DRAWVERTS);
 
-	/* convert */
+	/* convert and write a block at a time */
 	in = bspDrawVerts;
-	out = buffer;
-	for(i = 0; i < numBSPDrawVerts; i++)
+	for(i = 0; i < numBSPDrawVerts; i += j)
 	{
-		VectorCopy(in->xyz, out->xyz);
-		out->st[0] = in->st[0];
-		out->st[1] = in->st[1];
+		memset(buffer, 0, sizeof(buffer));
+		out = buffer;
+		for(j = 0; j < LUMP_BLOCK_ELEMENTS && i + j < numBSPDrawVerts; j++)
+		{
+			VectorCopy(in->xyz, out->xyz);
+			out->st[0] = in->st[0];
+			out->st[1] = in->st[1];
 
-		out->lightmap[0] = in->lightmap[0][0];
-		out->lightmap[1] = in->lightmap[0][1];
+			out->lightmap[0] = in->lightmap[0][0];
+			out->lightmap[1] = in->lightmap[0][1];
 
-		VectorCopy(in->normal, out->normal);
+			VectorCopy(in->normal, out->normal);
 
-		out->color[0] = in->lightColor[0][0];
-		out->color[1] = in->lightColor[0][1];
-		out->color[2] = in->lightColor[0][2];
-		out->color[3] = in->lightColor[0][3];
+			out->color[0] = in->lightColor[0][0];
+			out->color[1] = in->lightColor[0][1];
+			out->color[2] = in->lightColor[0][2];
+			out->color[3] = in->lightColor[0][3];
 
-		in++;
-		out++;
+			in++;
+			out++;
+		}
+		SafeWrite(file, buffer, j * sizeof(*buffer));
 	}
 
-	/* write lump */
-	AddLump(file, (bspHeader_t *) header, LUMP_DRAWVERTS, buffer, size);
-
-	/* free buffer */
-	free(buffer);
+	EndLump(file, (bspHeader_t *) header, LUMP_DRAWVERTS);
 }
 
 
@@ -420,38 +414,38 @@ static void CopyLightGridLumps(ibspHeader_t * header)
 
 static void AddLightGridLumps(FILE * file, ibspHeader_t * header)
 {
-	int             i;
+	size_t          i, j;
 	bspGridPoint_t *in;
-	ibspGridPoint_t *buffer, *out;
+	ibspGridPoint_t buffer[LUMP_BLOCK_ELEMENTS], *out;
 
 
 	/* dummy check */
 	if(bspGridPoints == NULL)
 		return;
 
-	/* allocate temporary buffer */
-	buffer = safe_malloc(numBSPGridPoints * sizeof(*out));
+	BeginLump(file, (bspHeader_t *) header, LUMP_LIGHTGRID);
 
-	/* convert */
+	/* convert and write a block at a time */
 	in = bspGridPoints;
-	out = buffer;
-	for(i = 0; i < numBSPGridPoints; i++)
+	for(i = 0; i < numBSPGridPoints; i += j)
 	{
-		VectorCopy(in->ambient[0], out->ambient);
-		VectorCopy(in->directed[0], out->directed);
+		memset(buffer, 0, sizeof(buffer));
+		out = buffer;
+		for(j = 0; j < LUMP_BLOCK_ELEMENTS && i + j < numBSPGridPoints; j++)
+		{
+			VectorCopy(in->ambient[0], out->ambient);
+			VectorCopy(in->directed[0], out->directed);
 
-		out->latLong[0] = in->latLong[0];
-		out->latLong[1] = in->latLong[1];
+			out->latLong[0] = in->latLong[0];
+			out->latLong[1] = in->latLong[1];
 
-		in++;
-		out++;
+			in++;
+			out++;
+		}
+		SafeWrite(file, buffer, (int)(j * sizeof(*buffer)));
 	}
 
-	/* write lumps */
-	AddLump(file, (bspHeader_t *) header, LUMP_LIGHTGRID, buffer, (numBSPGridPoints * sizeof(*out)));
-
-	/* free buffer (ydnar 2002-10-22: [bug 641] thanks Rap70r! */
-	free(buffer);
+	EndLump(file, (bspHeader_t *) header, LUMP_LIGHTGRID);
 }
 
 /*
@@ -464,8 +458,8 @@ void LoadIBSPFile(const char *filename)
 	ibspHeader_t   *header;
 
 
-	/* load the file header */
-	LoadFile(filename, (void **)&header);
+	/* map the file, the lumps are converted straight out of it */
+	header = MapBSPFile(filename, sizeof(*header));
 
 	/* swap the header (except the first 4 bytes) */
 	SwapBlock((int *)((byte *) header + sizeof(int)), sizeof(*header) - sizeof(int));
@@ -529,8 +523,8 @@ void LoadIBSPFile(const char *filename)
 	else
 		numBSPAds = 0;
 
-	/* free the file buffer */
-	free(header);
+	/* release the file */
+	UnmapBSPFile();
 }
 
 
@@ -581,7 +575,7 @@ void WriteIBSPFile(const char *filename)
 	AddDrawVertsLump(file, header);
 	AddDrawSurfacesLump(file, header);
 	AddLump(file, (bspHeader_t *) header, LUMP_VISIBILITY, bspVisBytes, numBSPVisBytes);
-	AddLump(file, (bspHeader_t *) header, LUMP_LIGHTMAPS, bspLightBytes, numBSPLightBytes);
+	AddLightmapLump(file, (bspHeader_t *) header, LUMP_LIGHTMAPS);
 	AddLightGridLumps(file, header);
 	AddLump(file, (bspHeader_t *) header, LUMP_ENTITIES, bspEntData, bspEntDataSize);
 	AddLump(file, (bspHeader_t *) header, LUMP_FOGS, bspFogs, numBSPFogs * sizeof(bspFog_t));
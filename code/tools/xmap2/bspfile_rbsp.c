@@ -88,13 +88,14 @@ rbspHeader_t;
 
 static void CopyLightGridLumps(rbspHeader_t * header)
 {
-	int             i;
+	int             i, numGridPoints;
 	unsigned short *inArray;
 	bspGridPoint_t *in, *out;
 
 
 	/* get count */
 	numBSPGridPoints = GetLumpElements((bspHeader_t *) header, LUMP_LIGHTARRAY, sizeof(*inArray));
+	numGridPoints = GetLumpElements((bspHeader_t *) header, LUMP_LIGHTGRID, sizeof(*in));
 
 	/* allocate buffer */
 	bspGridPoints = safe_malloc(numBSPGridPoints * sizeof(*bspGridPoints));
@@ -106,6 +107,9 @@ static void CopyLightGridLumps(rbspHeader_t * header)
 	out = bspGridPoints;
 	for(i = 0; i < numBSPGridPoints; i++)
 	{
+		if(*inArray >= numGridPoints)
+			Error("CopyLightGridLumps: grid array index %d out of range (%d grid points)", *inArray, numGridPoints);
+
 		memcpy(out, &in[*inArray], sizeof(*in));
 		inArray++;
 		out++;
@@ -216,8 +220,8 @@ void LoadRBSPFile(const char *filename)
 	rbspHeader_t   *header;
 
 
-	/* load the file header */
-	LoadFile(filename, (void **)&header);
+	/* map the file, the lumps are converted straight out of it */
+	header = MapBSPFile(filename, sizeof(*header));
 
 	/* swap the header (except the first 4 bytes) */
 	SwapBlock((int *)((byte *) header + sizeof(int)), sizeof(*header) - sizeof(int));
@@ -281,8 +285,8 @@ void LoadRBSPFile(const char *filename)
 
 	CopyLightGridLumps(header);
 
-	/* free the file buffer */
-	free(header);
+	/* release the file */
+	UnmapBSPFile();
 }
 
 
@@ -333,7 +337,7 @@ void WriteRBSPFile(const char *filename)
 	AddLump(file, (bspHeader_t *) header, LUMP_DRAWVERTS, bspDrawVerts, numBSPDrawVerts * sizeof(bspDrawVerts[0]));
 	AddLump(file, (bspHeader_t *) header, LUMP_SURFACES, bspDrawSurfaces, numBSPDrawSurfaces * sizeof(bspDrawSurfaces[0]));
 	AddLump(file, (bspHeader_t *) header, LUMP_VISIBILITY, bspVisBytes, numBSPVisBytes);
-	AddLump(file, (bspHeader_t *) header, LUMP_LIGHTMAPS, bspLightBytes, numBSPLightBytes);
+	AddLightmapLump(file, (bspHeader_t *) header, LUMP_LIGHTMAPS);
 	AddLightGridLumps(file, header);
 	AddLump(file, (bspHeader_t *) header, LUMP_ENTITIES, bspEntData, bspEntDataSize);
 	AddLump(file, (bspHeader_t *) header, LUMP_FOGS, bspFogs, numBSPFogs * sizeof(bspFog_t));
@@ -114,32 +114,30 @@ static void CopyBrushSidesLump(xbspHeader_t * header)
 
 static void AddBrushSidesLump(FILE * file, xbspHeader_t * header)
 {
-	int             i, size;
+	int             i, j;
 	bspBrushSide_t *in;
-	xbspBrushSide_t *buffer, *out;
+	xbspBrushSide_t buffer[LUMP_BLOCK_ELEMENTS], *out;
 
 
-	/* allocate output buffer */
-	size = numBSPBrushSides * sizeof(*buffer);
-	buffer = safe_malloc(size);
-	memset(buffer, 0, size);
+	BeginLump(file, (bspHeader_t *) header, LUMP_BRUSHSIDES);
 
-	/* convert */
+	/* convert and write a block at a time */
 	in = bspBrushSides;
-	out = buffer;
-	for(i = 0; i < numBSPBrushSides; i++)
+	for(i = 0; i < numBSPBrushSides; i += j)
 	{
-		out->planeNum = in->planeNum;
-		out->shaderNum = in->shaderNum;
-		in++;
-		out++;
+		memset(buffer, 0, sizeof(buffer));
+		out = buffer;
+		for(j = 0; j < LUMP_BLOCK_ELEMENTS && i + j < numBSPBrushSides; j++)
+		{
+			out->planeNum = in->planeNum;
+			out->shaderNum = in->shaderNum;
+			in++;
+			out++;
+		}
+		SafeWrite(file, buffer, j * sizeof(*buffer));
 	}
 
-	/* write lump */
-	AddLump(file, (bspHeader_t *) header, LUMP_BRUSHSIDES, buffer, size);
-
-	/* free buffer */
-	free(buffer);
+	EndLump(file, (bspHeader_t *) header, LUMP_BRUSHSIDES);
 }
 
 
@@ -228,52 +226,50 @@ static void CopyDrawSurfacesLump(xbspHeader_t * header)
 
 static void AddDrawSurfacesLump(FILE * file, xbspHeader_t * header)
 {
-	int             i, size;
+	int             i, j;
 	bspDrawSurface_t *in;
-	xbspDrawSurface_t *buffer, *out;
+	xbspDrawSurface_t buffer[LUMP_BLOCK_ELEMENTS], *out;
 
 
-	/* allocate output buffer */
-	size = numBSPDrawSurfaces * sizeof(*buffer);
-	buffer = safe_malloc(size);
-	memset(buffer, 0, size);
+	BeginLump(file, (bspHeader_t *) header, LUMP_SURFACES);
 
-	/* convert */
+	/* convert and write a block at a time */
 	in = bspDrawSurfaces;
-	out = buffer;
-	for(i = 0; i < numBSPDrawSurfaces; i++)
+	for(i = 0; i < numBSPDrawSurfaces; i += j)
 	{
-		out->shaderNum = in->shaderNum;
-		out->fogNum = in->fogNum;
-		out->surfaceType = in->surfaceType;
-		out->firstVert = in->firstVert;
-		out->numVerts = in->numVerts;
-		out->firstIndex = in->firstIndex;
-		out->numIndexes = in->numIndexes;
-
-		out->lightmapNum = in->lightmapNum[0];
-		out->lightmapX = in->lightmapX[0];
-		out->lightmapY = in->lightmapY[0];
-		out->lightmapWidth = in->lightmapWidth;
-		out->lightmapHeight = in->lightmapHeight;
-
-		VectorCopy(in->lightmapOrigin, out->lightmapOrigin);
-		VectorCopy(in->lightmapVecs[0], out->lightmapVecs[0]);
-		VectorCopy(in->lightmapVecs[1], out->lightmapVecs[1]);
-		VectorCopy(in->lightmapVecs[2], out->lightmapVecs[2]);
-
-		out->patchWidth = in->patchWidth;
-		out->patchHeight = in->patchHeight;
-
-		in++;
-		out++;
+		memset(buffer, 0, sizeof(buffer));
+		out = buffer;
+		for(j = 0; j < LUMP_BLOCK_ELEMENTS && i + j < numBSPDrawSurfaces; j++)
+		{
+			out->shaderNum = in->shaderNum;
+			out->fogNum = in->fogNum;
+			out->surfaceType = in->surfaceType;
+			out->firstVert = in->firstVert;
+			out->numVerts = in->numVerts;
+			out->firstIndex = in->firstIndex;
+			out->numIndexes = in->numIndexes;
+
+			out->lightmapNum = in->lightmapNum[0];
+			out->lightmapX = in->lightmapX[0];
+			out->lightmapY = in->lightmapY[0];
+			out->lightmapWidth = in->lightmapWidth;
+			out->lightmapHeight = in->lightmapHeight;
+
+			VectorCopy(in->lightmapOrigin, out->lightmapOrigin);
+			VectorCopy(in->lightmapVecs[0], out->lightmapVecs[0]);
+			VectorCopy(in->lightmapVecs[1], out->lightmapVecs[1]);
+			VectorCopy(in->lightmapVecs[2], out->lightmapVecs[2]);
+
+			out->patchWidth = in->patchWidth;
+			out->patchHeight = in->patchHeight;
+
+			in++;
+			out++;
+		}
+		SafeWrite(file, buffer, j * sizeof(*buffer));
 	}
 
-	/* write lump */
-	AddLump(file, (bspHeader_t *) header, LUMP_SURFACES, buffer, size);
-
-	/* free buffer */
-	free(buffer);
+	EndLump(file, (bspHeader_t *) header, LUMP_SURFACES);
 }
 
 
@@ -339,53 +335,51 @@ static void CopyDrawVertsLump(xbspHeader_t * header)
 
 static void AddDrawVertsLump(FILE * file, xbspHeader_t * header)
 {
-	int             i, size;
+	int             i, j;
 	bspDrawVert_t  *in;
-	xbspDrawVert_t *buffer, *out;
+	xbspDrawVert_t  buffer[LUMP_BLOCK_ELEMENTS], *out;
 
 
-	/* allocate output buffer */
-	size = numBSPDrawVerts * sizeof(*buffer);
-	buffer = safe_malloc(size);
-	memset(buffer, 0, size);
+	BeginLump(file, (bspHeader_t *) header, LUMP_DRAWVERTS);
 
-	/* convert */
+	/* convert and write a block at a time */
 	in = bspDrawVerts;
-	out = buffer;
-	for(i = 0; i < numBSPDrawVerts; i++)
+	for(i = 0; i < numBSPDrawVerts; i += j)
 	{
-		VectorCopy(in->xyz, out->xyz);
-		out->st[0] = in->st[0];
-		out->st[1] = in->st[1];
+		memset(buffer, 0, sizeof(buffer));
+		out = buffer;
+		for(j = 0; j < LUMP_BLOCK_ELEMENTS && i + j < numBSPDrawVerts; j++)
+		{
+			VectorCopy(in->xyz, out->xyz);
+			out->st[0] = in->st[0];
+			out->st[1] = in->st[1];
 
-		out->lightmap[0] = in->lightmap[0][0];
-		out->lightmap[1] = in->lightmap[0][1];
+			out->lightmap[0] = in->lightmap[0][0];
+			out->lightmap[1] = in->lightmap[0][1];
 
-		VectorCopy(in->normal, out->normal);
+			VectorCopy(in->normal, out->normal);
 
-		out->paintColor[0] = in->paintColor[0];
-		out->paintColor[1] = in->paintColor[1];
-		out->paintColor[2] = in->paintColor[2];
-		out->paintColor[3] = in->paintColor[3];
+			out->paintColor[0] = in->paintColor[0];
+			out->paintColor[1] = in->paintColor[1];
+			out->paintColor[2] = in->paintColor[2];
+			out->paintColor[3] = in->paintColor[3];
 
-		out->lightColor[0] = in->lightColor[0][0];
-		out->lightColor[1] = in->lightColor[0][1];
-		out->lightColor[2] = in->lightColor[0][2];
-		out->lightColor[3] = in->lightColor[0][3];
+			out->lightColor[0] = in->lightColor[0][0];
+			out->lightColor[1] = in->lightColor[0][1];
+			out->lightColor[2] = in->lightColor[0][2];
+			out->lightColor[3] = in->lightColor[0][3];
 
-		out->lightDirection[0] = in->lightDirection[0][0];
-		out->lightDirection[1] = in->lightDirection[0][1];
-		out->lightDirection[2] = in->lightDirection[0][2];
+			out->lightDirection[0] = in->lightDirection[0][0];
+			out->lightDirection[1] = in->lightDirection[0][1];
+			out->lightDirection[2] = in->lightDirection[0][2];
 
-		in++;
-		out++;
+			in++;
+			out++;
+		}
+		SafeWrite(file, buffer, j * sizeof(*buffer));
 	}
 
-	/* write lump */
-	AddLump(file, (bspHeader_t *) header, LUMP_DRAWVERTS, buffer, size);
-
-	/* free buffer */
-	free(buffer);
+	EndLump(file, (bspHeader_t *) header, LUMP_DRAWVERTS);
 }
 
 
@@ -439,38 +433,38 @@ static void CopyLightGridLumps(xbspHeader_t * header)
 
 static void AddLightGridLumps(FILE * file, xbspHeader_t * header)
 {
-	int             i;
+	size_t          i, j;
 	bspGridPoint_t *in;
-	xbspGridPoint_t *buffer, *out;
+	xbspGridPoint_t buffer[LUMP_BLOCK_ELEMENTS], *out;
 
 
 	/* dummy check */
 	if(bspGridPoints == NULL)
 		return;
 
-	/* allocate temporary buffer */
-	buffer = safe_malloc(numBSPGridPoints * sizeof(*out));
+	BeginLump(file, (bspHeader_t *) header, LUMP_LIGHTGRID);
 
-	/* convert */
+	/* convert and write a block at a time */
 	in = bspGridPoints;
-	out = buffer;
-	for(i = 0; i < numBSPGridPoints; i++)
+	for(i = 0; i < numBSPGridPoints; i += j)
 	{
-		VectorCopy(in->ambient[0], out->ambient);
-		VectorCopy(in->directed[0], out->directed);
+		memset(buffer, 0, sizeof(buffer));
+		out = buffer;
+		for(j = 0; j < LUMP_BLOCK_ELEMENTS && i + j < numBSPGridPoints; j++)
+		{
+			VectorCopy(in->ambient[0], out->ambient);
+			VectorCopy(in->directed[0], out->directed);
 
-		out->latLong[0] = in->latLong[0];
-		out->latLong[1] = in->latLong[1];
+			out->latLong[0] = in->latLong[0];
+			out->latLong[1] = in->latLong[1];
 
-		in++;
-		out++;
+			in++;
+			out++;
+		}
+		SafeWrite(file, buffer, (int)(j * sizeof(*buffer)));
 	}
 
-	/* write lumps */
-	AddLump(file, (bspHeader_t *) header, LUMP_LIGHTGRID, buffer, (numBSPGridPoints * sizeof(*out)));
-
-	/* free buffer (ydnar 2002-10-22: [bug 641] thanks Rap70r! */
-	free(buffer);
+	EndLump(file, (bspHeader_t *) header, LUMP_LIGHTGRID);
 }
 
 /*
@@ -483,8 +477,8 @@ void LoadXBSPFile(const char *filename)
 	xbspHeader_t   *header;
 
 
-	/* load the file header */
-	LoadFile(filename, (void **)&header);
+	/* map the file, the lumps are converted straight out of it */
+	header = MapBSPFile(filename, sizeof(*header));
 
 	/* swap the header (except the first 4 bytes) */
 	SwapBlock((int *)((byte *) header + sizeof(int)), sizeof(*header) - sizeof(int));
@@ -542,8 +536,8 @@ void LoadXBSPFile(const char *filename)
 
 	CopyLightGridLumps(header);
 
-	/* free the file buffer */
-	free(header);
+	/* release the file */
+	UnmapBSPFile();
 }
 
 
@@ -594,7 +588,7 @@ void WriteXBSPFile(const char *filename)
 	AddDrawVertsLump(file, header);
 	AddDrawSurfacesLump(file, header);
 	AddLump(file, (bspHeader_t *) header, LUMP_VISIBILITY, bspVisBytes, numBSPVisBytes);
-	AddLump(file, (bspHeader_t *) header, LUMP_LIGHTMAPS, bspLightBytes, numBSPLightBytes);
+	AddLightmapLump(file, (bspHeader_t *) header, LUMP_LIGHTMAPS);
 	AddLightGridLumps(file, header);
 	AddLump(file, (bspHeader_t *) header, LUMP_ENTITIES, bspEntData, bspEntDataSize);
 	AddLump(file, (bspHeader_t *) header, LUMP_FOGS, bspFogs, numBSPFogs * sizeof(bspFog_t));
@@ -0,0 +1,389 @@
+/* -------------------------------------------------------------------------------
+
+Copyright (C) 1999-2007 id Software, Inc. and contributors.
+For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+This file is part of GtkRadiant.
+
+GtkRadiant is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+GtkRadiant is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with GtkRadiant; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+----------------------------------------------------------------------------------
+
+This code has been altered significantly from its original form, to support
+several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define CACHE_C
+
+
+
+/* dependencies */
+#include "q3map2.h"
+
+
+
+/* -------------------------------------------------------------------------------
+
+build cache
+
+-vis and -light -cache keep the results of their expensive passes in a file
+next to the bsp, keyed by a hash of everything a result was computed from.
+the next compile of the edited map finds the unchanged results by their key
+and only computes the rest. entries that weren't looked up or added again are
+dropped when the file is written back, so the cache never outgrows the map.
+
+------------------------------------------------------------------------------- */
+
+#define CACHE_IDENT				(('F'<<24)+('C'<<16)+('B'<<8)+'X')
+#define CACHE_VERSION			1
+#define GROW_CACHE_ENTRIES		1024
+
+typedef struct
+{
+	int             ident;
+	int             version;
+	int             numEntries;
+}
+cacheHeader_t;
+
+typedef struct
+{
+	cacheKey_t      key;
+	int             size;
+	qboolean        used;
+	byte           *data;
+}
+cacheEntry_t;
+
+static char     cacheName[1024];
+static byte    *cacheBuffer;
+
+/* loaded from the file, sorted by key and never reallocated while the threads look them up */
+static int      numCacheEntries, maxCacheEntries;
+static cacheEntry_t *cacheEntries;
+
+/* added during this compile */
+static int      numAddedCacheEntries, maxAddedCacheEntries;
+static cacheEntry_t *addedCacheEntries;
+
+
+
+/*
+HashData()
+fnv-1a over a block of memory
+*/
+
+cacheKey_t HashData(cacheKey_t hash, const void *data, int size)
+{
+	int             i;
+	const byte     *b;
+
+
+	b = (const byte *)data;
+	for(i = 0; i < size; i++)
+		hash = (hash ^ b[i]) * 1099511628211ULL;
+	return hash;
+}
+
+
+
+/*
+HashString()
+hashes a string including its terminator, so "ab" "c" differs from "a" "bc"
+*/
+
+cacheKey_t HashString(cacheKey_t hash, const char *s)
+{
+	if(s == NULL)
+		s = "";
+	return HashData(hash, s, strlen(s) + 1);
+}
+
+
+
+/*
+HashMix()
+scrambles a hash before it is summed up with others, sums don't depend on the
+order of the hashed items
+*/
+
+cacheKey_t HashMix(cacheKey_t hash)
+{
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+
+
+/*
+CompareCacheEntries()
+sorts the loaded entries by key for FindCacheEntry
+*/
+
+static int CompareCacheEntries(const void *a, const void *b)
+{
+	cacheKey_t      ka, kb;
+
+
+	ka = ((const cacheEntry_t *)a)->key;
+	kb = ((const cacheEntry_t *)b)->key;
+	if(ka < kb)
+		return -1;
+	if(ka > kb)
+		return 1;
+	return 0;
+}
+
+
+
+/*
+AllocCacheEntry()
+returns a new entry at the end of a list
+*/
+
+static cacheEntry_t *AllocCacheEntry(cacheEntry_t ** entries, int *numEntries, int *maxEntries)
+{
+	cacheEntry_t   *temp;
+
+
+	/* enough space? */
+	if(*numEntries >= *maxEntries)
+	{
+		*maxEntries += GROW_CACHE_ENTRIES;
+		temp = safe_malloc(*maxEntries * sizeof(*temp));
+		if(*entries != NULL)
+		{
+			memcpy(temp, *entries, *numEntries * sizeof(*temp));
+			free(*entries);
+		}
+		*entries = temp;
+	}
+
+	temp = &(*entries)[(*numEntries)++];
+	memset(temp, 0, sizeof(*temp));
+	return temp;
+}
+
+
+
+/*
+OpenCache()
+loads the entries of a cache file, a missing or stale file gives an empty cache
+*/
+
+void OpenCache(const char *filename)
+{
+	int             i, length, size;
+	byte           *in, *end;
+	cacheHeader_t  *header;
+	cacheEntry_t   *entry;
+	cacheKey_t      key;
+
+
+	CloseCache();
+
+	strcpy(cacheName, filename);
+
+	/* load the file */
+	length = TryLoadFile(cacheName, (void **)&cacheBuffer);
+	if(length < (int)sizeof(cacheHeader_t))
+	{
+		Sys_Printf("Creating %s\n", cacheName);
+		return;
+	}
+
+	header = (cacheHeader_t *) cacheBuffer;
+	if(header->ident != CACHE_IDENT || header->version != CACHE_VERSION)
+	{
+		Sys_Printf("WARNING: %s is not a cache of this version, recreating it\n", cacheName);
+		return;
+	}
+
+	/* the entries point into the file buffer */
+	in = cacheBuffer + sizeof(cacheHeader_t);
+	end = cacheBuffer + length;
+	for(i = 0; i < header->numEntries; i++)
+	{
+		/* a cut off file keeps the complete entries */
+		if(end - in < (int)(sizeof(key) + sizeof(size)))
+			break;
+		memcpy(&key, in, sizeof(key));
+		memcpy(&size, in + sizeof(key), sizeof(size));
+		in += sizeof(key) + sizeof(size);
+		if(size < 0 || end - in < size)
+			break;
+
+		entry = AllocCacheEntry(&cacheEntries, &numCacheEntries, &maxCacheEntries);
+		entry->key = key;
+		entry->size = size;
+		entry->data = in;
+		in += size;
+	}
+
+	qsort(cacheEntries, numCacheEntries, sizeof(*cacheEntries), CompareCacheEntries);
+
+	Sys_Printf("%9d entries in %s\n", numCacheEntries, cacheName);
+}
+
+
+
+/*
+FindCacheEntry()
+returns the data stored under key and keeps it for the next compile, NULL if there is none
+*/
+
+const void     *FindCacheEntry(cacheKey_t key, int *size)
+{
+	cacheEntry_t    search, *entry;
+
+
+	search.key = key;
+	entry = bsearch(&search, cacheEntries, numCacheEntries, sizeof(*cacheEntries), CompareCacheEntries);
+	if(entry == NULL)
+		return NULL;
+
+	/* other threads only ever set it too */
+	entry->used = qtrue;
+	if(size != NULL)
+		*size = entry->size;
+	return entry->data;
+}
+
+
+
+/*
+AddCacheEntry()
+stores a copy of data under key, safe to call from the worker threads
+*/
+
+void AddCacheEntry(cacheKey_t key, const void *data, int size)
+{
+	byte           *copy;
+	cacheEntry_t   *entry;
+
+
+	if(cacheName[0] == '\0')
+		return;
+
+	copy = safe_malloc(size > 0 ? size : 1);
+	memcpy(copy, data, size);
+
+	ThreadLock();
+	entry = AllocCacheEntry(&addedCacheEntries, &numAddedCacheEntries, &maxAddedCacheEntries);
+	entry->key = key;
+	entry->size = size;
+	entry->used = qtrue;
+	entry->data = copy;
+	ThreadUnlock();
+}
+
+
+
+/*
+WriteCacheEntries()
+writes the used entries of a list, returns their number
+*/
+
+static int WriteCacheEntries(FILE * file, cacheEntry_t * entries, int numEntries)
+{
+	int             i, numWritten;
+	cacheEntry_t   *entry;
+
+
+	numWritten = 0;
+	for(i = 0, entry = entries; i < numEntries; i++, entry++)
+	{
+		if(!entry->used)
+			continue;
+
+		if(file != NULL)
+		{
+			fwrite(&entry->key, sizeof(entry->key), 1, file);
+			fwrite(&entry->size, sizeof(entry->size), 1, file);
+			fwrite(entry->data, entry->size, 1, file);
+		}
+		numWritten++;
+	}
+
+	return numWritten;
+}
+
+
+
+/*
+CloseCache()
+writes the entries of this compile back to the file and frees the cache
+*/
+
+void CloseCache(void)
+{
+	int             i, numWritten;
+	FILE           *file;
+	char            tempName[1024];
+	cacheHeader_t   header;
+
+
+	if(cacheName[0] == '\0')
+		return;
+
+	/* count the entries to keep */
+	numWritten = WriteCacheEntries(NULL, cacheEntries, numCacheEntries) +
+		WriteCacheEntries(NULL, addedCacheEntries, numAddedCacheEntries);
+
+	/* write a new file and only replace the old one when it's complete */
+	snprintf(tempName, sizeof(tempName), "%s.tmp", cacheName);
+	file = fopen(tempName, "wb");
+	if(file == NULL)
+		Sys_Printf("WARNING: couldn't write %s\n", tempName);
+	else
+	{
+		header.ident = CACHE_IDENT;
+		header.version = CACHE_VERSION;
+		header.numEntries = numWritten;
+		fwrite(&header, sizeof(header), 1, file);
+		WriteCacheEntries(file, cacheEntries, numCacheEntries);
+		WriteCacheEntries(file, addedCacheEntries, numAddedCacheEntries);
+
+		if(fclose(file) == 0)
+		{
+			remove(cacheName);
+			if(rename(tempName, cacheName) == 0)
+				Sys_Printf("%9d entries written to %s\n", numWritten, cacheName);
+			else
+				Sys_Printf("WARNING: couldn't rename %s to %s\n", tempName, cacheName);
+		}
+		else
+			Sys_Printf("WARNING: couldn't write %s\n", tempName);
+	}
+
+	/* free it all, the loaded entries point into the file buffer */
+	for(i = 0; i < numAddedCacheEntries; i++)
+		free(addedCacheEntries[i].data);
+	free(addedCacheEntries);
+	free(cacheEntries);
+	free(cacheBuffer);
+	addedCacheEntries = cacheEntries = NULL;
+	cacheBuffer = NULL;
+	numAddedCacheEntries = maxAddedCacheEntries = numCacheEntries = maxCacheEntries = 0;
+	cacheName[0] = '\0';
+}
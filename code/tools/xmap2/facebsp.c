@@ -77,27 +77,120 @@ void FreeBspFace(face_t * f)
 
 
 
+/*
+CountFaceList()
+counts bsp faces in the linked list
+*/
+
+int CountFaceList(face_t * list)
+{
+	int             c;
+
+
+	c = 0;
+	for(; list != NULL; list = list->next)
+		c++;
+	return c;
+}
+
+
+
+/* a distinct plane of the faces at a node */
+typedef struct
+{
+	int             planenum;
+	face_t         *face;			/* first face on the plane */
+	int             facing;			/* faces on the plane */
+	int             priority;		/* highest priority of its faces */
+	qboolean        candidate;
+	int             value;
+}
+splitPlane_t;
+
+/* a subtree that is built by a worker thread */
+typedef struct
+{
+	node_t         *node;
+	face_t         *list;
+	int             numFaces;
+	int             numNodes, numLeafs;
+}
+faceTreeTask_t;
+
+#define FACE_TREE_TASKS			64		/* roughly the number of subtrees built on the worker threads */
+#define MIN_FACE_TREE_TASK_FACES	64
+
+static int      faceTreeTaskFaces;		/* subtrees with fewer faces are left to the worker threads */
+static int      numFaceTreeTasks, maxFaceTreeTasks;
+static faceTreeTask_t *faceTreeTasks;
+
+
+
+/*
+BoundedWindingOnPlaneSide()
+WindingOnPlaneSide() that first tests the winding bounds, the bounds
+test has twice the epsilon so float rounding can't change the result
+*/
+
+static int BoundedWindingOnPlaneSide(winding_t * w, vec3_t mins, vec3_t maxs, plane_t * plane)
+{
+	int             i;
+	double          d, front, back;
+
+
+	front = back = -plane->dist;
+	for(i = 0; i < 3; i++)
+	{
+		d = plane->normal[i];
+		if(d >= 0)
+		{
+			front += d * mins[i];
+			back += d * maxs[i];
+		}
+		else
+		{
+			front += d * maxs[i];
+			back += d * mins[i];
+		}
+	}
+
+	/* front is the closest distance, back the farthest */
+	if(front > 2 * ON_EPSILON)
+		return SIDE_FRONT;
+	if(back < -2 * ON_EPSILON)
+		return SIDE_BACK;
+
+	return WindingOnPlaneSide(w, plane->normal, plane->dist);
+}
+
+
+
 /*
 SelectSplitPlaneNum()
 finds the best split plane for this node
+faces on the same plane score the same apart from their priority, so every plane is only tested once.
+with more than splitSamples planes only an even sample of them and the hint planes are tested.
+planeCounters holds the plane use counts of a subtree built by a worker thread
 */
 
-static void SelectSplitPlaneNum(node_t * node, face_t * list, int *splitPlaneNum, int *compileFlags)
+static void SelectSplitPlaneNum(node_t * node, face_t * list, int *splitPlaneNum, int *compileFlags, int *planeCounters)
 {
 	face_t         *split;
-	face_t         *check;
 	face_t         *bestSplit;
 	int             splits, facing, front, back;
 	int             side;
 	plane_t        *plane;
 	int             value, bestValue;
-	int             i;
+	int             i, j;
 	vec3_t          normal;
 	float           dist;
 	int             planenum;
 	float           sizeBias;
-	//int				checks;
-	int				frontC, backC, splitsC, facingC;
+	int             numFaces, numPlanes, hashSize, hash;
+	int            *hashTable, *facePlanes;
+	face_t        **faces;
+	vec3_t         *faceMins, *faceMaxs;
+	splitPlane_t   *planes, *sp;
 
 
 	/* ydnar: set some defaults */
@@ -126,42 +219,97 @@ static void SelectSplitPlaneNum(node_t * node, face_t * list, int *splitPlaneNum
 	}
 #endif
 
-	/* pick one of the face planes */
-	bestValue = -99999;
-	bestSplit = list;
+	/* nothing, we have a leaf */
+	numFaces = CountFaceList(list);
+	if(numFaces == 0)
+		return;
 
-	//checks = 0;
+	/* gather the faces and their distinct planes */
+	faces = safe_malloc(numFaces * sizeof(*faces));
+	facePlanes = safe_malloc(numFaces * sizeof(*facePlanes));
+	faceMins = safe_malloc(numFaces * sizeof(*faceMins));
+	faceMaxs = safe_malloc(numFaces * sizeof(*faceMaxs));
+	planes = safe_malloc(numFaces * sizeof(*planes));
 
-#if 1
-	// div0: this check causes detail/structural mixes
-	//for(split = list; split; split = split->next)
-	//	split->checked = qfalse;
+	for(hashSize = 64; hashSize < numFaces * 2; hashSize <<= 1);
+	hashTable = safe_malloc(hashSize * sizeof(*hashTable));
+	memset(hashTable, -1, hashSize * sizeof(*hashTable));
 
-#if defined(DEBUG_SPLITS)
-	Sys_FPrintf(SYS_VRB, "split scores: [");
-#endif
-	for(split = list; split; split = split->next)
+	numPlanes = 0;
+	for(i = 0, split = list; split; i++, split = split->next)
 	{
-		//if(split->checked)
-		//	continue;
+		faces[i] = split;
+
+		ClearBounds(faceMins[i], faceMaxs[i]);
+		for(j = 0; j < split->w->numpoints; j++)
+			AddPointToBounds(split->w->p[j], faceMins[i], faceMaxs[i]);
+
+		/* both sides of a plane pair can show up, so hash the full plane number */
+		for(hash = split->planenum & (hashSize - 1); hashTable[hash] >= 0; hash = (hash + 1) & (hashSize - 1))
+		{
+			if(planes[hashTable[hash]].planenum == split->planenum)
+				break;
+		}
 
-		//checks++;
+		if(hashTable[hash] < 0)
+		{
+			sp = &planes[numPlanes];
+			sp->planenum = split->planenum;
+			sp->face = split;
+			sp->facing = 0;
+			sp->priority = split->priority;
+			sp->candidate = qfalse;
+			hashTable[hash] = numPlanes++;
+		}
+
+		sp = &planes[hashTable[hash]];
+		sp->facing++;
+		if(split->priority > sp->priority)
+			sp->priority = split->priority;
+
+		facePlanes[i] = hashTable[hash];
+	}
 
-		plane = &mapplanes[split->planenum];
+	free(hashTable);
+
+	/* pick the planes to test */
+	if(exactSplits || splitSamples <= 0 || numPlanes <= splitSamples)
+	{
+		for(i = 0; i < numPlanes; i++)
+			planes[i].candidate = qtrue;
+	}
+	else
+	{
+		for(i = 0; i < splitSamples; i++)
+			planes[(int)((double)i * numPlanes / splitSamples)].candidate = qtrue;
+
+		/* hints are placed by the mapper, so never skip them */
+		for(i = 0; i < numPlanes; i++)
+		{
+			if(planes[i].priority > 0)
+				planes[i].candidate = qtrue;
+		}
+	}
+
+	/* score the planes */
+	for(i = 0; i < numPlanes; i++)
+	{
+		sp = &planes[i];
+		if(!sp->candidate)
+			continue;
+
+		plane = &mapplanes[sp->planenum];
 		splits = 0;
-		facing = 0;
+		facing = sp->facing;
 		front = 0;
 		back = 0;
 
-		for(check = list; check; check = check->next)
+		for(j = 0; j < numFaces; j++)
 		{
-			if(check->planenum == split->planenum)
-			{
-				facing++;
-				//check->checked = qtrue;   // won't need to test this plane again
+			if(facePlanes[j] == i)
 				continue;
-			}
-			side = WindingOnPlaneSide(check->w, plane->normal, plane->dist);
+
+			side = BoundedWindingOnPlaneSide(faces[j]->w, faceMins[j], faceMaxs[j], plane);
 			if(side == SIDE_CROSS)
 			{
 				splits++;
@@ -182,6 +330,8 @@ static void SelectSplitPlaneNum(node_t * node, face_t * list, int *splitPlaneNum
 			value = 0;//20000;
 			value -= abs(front - back);	// prefer centered planes
 			value -= plane->counter;	// if we've already used this plane sometime in the past try not to use it again 
+			if(planeCounters)
+				value -= planeCounters[sp->planenum];
 			value += facing * 5;		// if we're going to have alot of other surfs use this plane, we want to get it in quickly.
 			value -= splits * 5;		// more splits = bad
 			//value += sizeBias * 10;		// we want a huge score bias based on plane size
@@ -201,7 +351,7 @@ static void SelectSplitPlaneNum(node_t * node, face_t * list, int *splitPlaneNum
 				vec_t           dist;
 
 				// create temporary winding to draw the split plane
-				w = CopyWinding(split->w);
+				w = CopyWinding(sp->face->w);
 
 				// clip by all the parents
 				for(n = node->parent; n && w;)
@@ -242,7 +392,23 @@ static void SelectSplitPlaneNum(node_t * node, face_t * list, int *splitPlaneNum
 			}
 		}
 
-		value += split->priority;	// prioritize hints higher
+		sp->value = value;
+	}
+
+	/* pick one of the face planes */
+	bestValue = -99999;
+	bestSplit = list;
+
+#if defined(DEBUG_SPLITS)
+	Sys_FPrintf(SYS_VRB, "split scores: [");
+#endif
+	for(i = 0; i < numFaces; i++)
+	{
+		sp = &planes[facePlanes[i]];
+		if(!sp->candidate)
+			continue;
+
+		value = sp->value + faces[i]->priority;	// prioritize hints higher
 
 		#if defined(DEBUG_SPLITS)
 		Sys_FPrintf(SYS_VRB, " %d", value);
@@ -251,26 +417,23 @@ static void SelectSplitPlaneNum(node_t * node, face_t * list, int *splitPlaneNum
 		if(value > bestValue)
 		{
 			bestValue = value;
-			bestSplit = split;
-			
-			frontC = front;
-			backC = back;
-			splitsC = splits;
-			facingC = facing;
+			bestSplit = faces[i];
 		}
 	}
 #if defined(DEBUG_SPLITS)
 	Sys_FPrintf(SYS_VRB, "]\n");
 #endif
 
-#endif
+	free(faces);
+	free(facePlanes);
+	free(faceMins);
+	free(faceMaxs);
+	free(planes);
 
 	/* nothing, we have a leaf */
 	if(bestValue == -99999)
 		return;
 
-	//Sys_FPrintf(SYS_VRB, "F: %9d B:%9d S:%9d FA:%9d\n", frontC, backC, splitsC, facingC);
-
 	/* set best split data */
 	*splitPlaneNum = bestSplit->planenum;
 	*compileFlags = bestSplit->compileFlags;
@@ -285,27 +448,16 @@ static void SelectSplitPlaneNum(node_t * node, face_t * list, int *splitPlaneNum
 #endif
 
 	if(*splitPlaneNum > -1)
-		mapplanes[*splitPlaneNum].counter++;
+	{
+		if(planeCounters)
+			planeCounters[*splitPlaneNum]++;
+		else
+			mapplanes[*splitPlaneNum].counter++;
+	}
 }
 
 
 
-/*
-CountFaceList()
-counts bsp faces in the linked list
-*/
-
-int CountFaceList(face_t * list)
-{
-	int             c;
-
-
-	c = 0;
-	for(; list != NULL; list = list->next)
-		c++;
-	return c;
-}
-
 static tree_t  *drawTree = NULL;
 static void DrawTreeNodes_r(node_t * node)
 {
@@ -374,12 +526,45 @@ static void DrawAll(void)
 }
 
 
+
+/*
+AddFaceTreeTask()
+leaves a subtree to the worker threads
+*/
+
+static void AddFaceTreeTask(node_t * node, face_t * list, int numFaces)
+{
+	faceTreeTask_t *temp;
+
+
+	if(numFaceTreeTasks >= maxFaceTreeTasks)
+	{
+		maxFaceTreeTasks += FACE_TREE_TASKS;
+		temp = safe_malloc(maxFaceTreeTasks * sizeof(*temp));
+		if(faceTreeTasks != NULL)
+		{
+			memcpy(temp, faceTreeTasks, numFaceTreeTasks * sizeof(*temp));
+			free(faceTreeTasks);
+		}
+		faceTreeTasks = temp;
+	}
+
+	temp = &faceTreeTasks[numFaceTreeTasks++];
+	temp->node = node;
+	temp->list = list;
+	temp->numFaces = numFaces;
+	temp->numNodes = 0;
+	temp->numLeafs = 0;
+}
+
+
 /*
 BuildFaceTree_r()
 recursively builds the bsp, splitting on face planes
+task and planeCounters are set when a worker thread builds the subtree
 */
 
-void BuildFaceTree_r(node_t * node, face_t * list)
+static void BuildFaceTree_r(node_t * node, face_t * list, faceTreeTask_t * task, int *planeCounters)
 {
 	face_t         *split;
 	face_t         *next;
@@ -401,15 +586,25 @@ void BuildFaceTree_r(node_t * node, face_t * list)
 	Sys_FPrintf(SYS_VRB, "faces left = %d\n", i);
 #endif
 
+	/* leave small subtrees to the worker threads */
+	if(task == NULL && i <= faceTreeTaskFaces)
+	{
+		AddFaceTreeTask(node, list, i);
+		return;
+	}
+
 	/* select the best split plane */
-	SelectSplitPlaneNum(node, list, &splitPlaneNum, &compileFlags);
+	SelectSplitPlaneNum(node, list, &splitPlaneNum, &compileFlags, planeCounters);
 
 	/* if we don't have any more faces, this is a leaf */
 	if(splitPlaneNum == -1)
 	{
 		node->planenum = PLANENUM_LEAF;
 		node->has_structural_children = qfalse;
-		c_faceLeafs++;
+		if(task != NULL)
+			task->numLeafs++;
+		else
+			c_faceLeafs++;
 		return;
 	}
 
@@ -498,7 +693,10 @@ void BuildFaceTree_r(node_t * node, face_t * list)
 		VectorCopy(node->mins, node->children[i]->mins);
 		VectorCopy(node->maxs, node->children[i]->maxs);
 
-		c_faceNodes++;
+		if(task != NULL)
+			task->numNodes++;
+		else
+			c_faceNodes++;
 	}
 
 	for(i = 0; i < 3; i++)
@@ -528,7 +726,7 @@ void BuildFaceTree_r(node_t * node, face_t * list)
 
 	for(i = 0; i < 2; i++)
 	{
-		BuildFaceTree_r(node->children[i], childLists[i]);
+		BuildFaceTree_r(node->children[i], childLists[i], task, planeCounters);
 		node->has_structural_children |= node->children[i]->has_structural_children;
 	}
 
@@ -542,6 +740,64 @@ void BuildFaceTree_r(node_t * node, face_t * list)
 }
 
 
+
+/*
+BuildFaceTreeTask()
+builds a subtree on a worker thread
+the subtree counts its plane uses on its own, so the tree doesn't depend on the thread timing
+*/
+
+static void BuildFaceTreeTask(int taskNum)
+{
+	faceTreeTask_t *task;
+	int            *planeCounters;
+
+
+	task = &faceTreeTasks[taskNum];
+
+	planeCounters = safe_malloc(nummapplanes * sizeof(*planeCounters));
+	memset(planeCounters, 0, nummapplanes * sizeof(*planeCounters));
+
+	BuildFaceTree_r(task->node, task->list, task, planeCounters);
+
+	free(planeCounters);
+}
+
+
+
+/*
+FaceTreeTaskCost()
+larger subtrees go first
+*/
+
+static int FaceTreeTaskCost(int taskNum)
+{
+	return faceTreeTasks[taskNum].numFaces;
+}
+
+
+
+/*
+UpdateStructuralChildren_r()
+the nodes above the worker thread subtrees were done before their children
+*/
+
+static qboolean UpdateStructuralChildren_r(node_t * node)
+{
+	if(node->planenum == PLANENUM_LEAF)
+		return node->has_structural_children;
+
+	node->has_structural_children = !(node->compileFlags & C_DETAIL) && !node->opaque;
+	if(UpdateStructuralChildren_r(node->children[0]))
+		node->has_structural_children = qtrue;
+	if(UpdateStructuralChildren_r(node->children[1]))
+		node->has_structural_children = qtrue;
+
+	return node->has_structural_children;
+}
+
+
+
 /*
 ================
 FaceBSP
@@ -589,7 +845,32 @@ tree_t         *FaceBSP(face_t * list, qboolean drawDebug)
 	}
 #endif
 
-	BuildFaceTree_r(tree->headnode, list);
+	/* the top of the tree is built here, the subtrees below it on the worker threads */
+	faceTreeTaskFaces = count / FACE_TREE_TASKS;
+	if(exactSplits || drawBSP || faceTreeTaskFaces < MIN_FACE_TREE_TASK_FACES)
+		faceTreeTaskFaces = -1;
+
+	BuildFaceTree_r(tree->headnode, list, NULL, NULL);
+
+	if(numFaceTreeTasks > 0)
+	{
+		Sys_FPrintf(SYS_VRB, "%9d subtrees\n", numFaceTreeTasks);
+
+		RunThreadsOnIndividualSorted(numFaceTreeTasks, qfalse, BuildFaceTreeTask, FaceTreeTaskCost);
+
+		for(i = 0; i < numFaceTreeTasks; i++)
+		{
+			c_faceNodes += faceTreeTasks[i].numNodes;
+			c_faceLeafs += faceTreeTasks[i].numLeafs;
+		}
+
+		UpdateStructuralChildren_r(tree->headnode);
+
+		free(faceTreeTasks);
+		faceTreeTasks = NULL;
+		numFaceTreeTasks = 0;
+		maxFaceTreeTasks = 0;
+	}
 
 	Sys_FPrintf(SYS_VRB, "%9d nodes\n", c_faceNodes);
 	Sys_FPrintf(SYS_VRB, "%9d leafs\n", c_faceLeafs);
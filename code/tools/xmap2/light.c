@@ -1795,6 +1795,195 @@ void SetupGrid(void)
 
 
 
+/*
+TracePreviewGrid()
+traces every second grid point along each axis for the preview
+*/
+
+static void TracePreviewGrid(int num)
+{
+	int             x, y, z, w, h;
+
+
+	/* get coarse grid coordinates */
+	w = (gridBounds[0] + 1) / 2;
+	h = (gridBounds[1] + 1) / 2;
+	z = num / (w * h);
+	num -= z * (w * h);
+	y = num / w;
+	x = num - y * w;
+
+	TraceGrid((((z * 2) * gridBounds[1]) + (y * 2)) * gridBounds[0] + (x * 2));
+}
+
+
+
+/*
+FillPreviewGrid()
+copies the traced preview grid points to the points between them
+*/
+
+static void FillPreviewGrid(void)
+{
+	int             x, y, z, num;
+
+
+	for(z = 0; z < gridBounds[2]; z++)
+	{
+		for(y = 0; y < gridBounds[1]; y++)
+		{
+			for(x = 0; x < gridBounds[0]; x++)
+			{
+				if(!((x | y | z) & 1))
+					continue;
+
+				num = ((z * gridBounds[1]) + y) * gridBounds[0] + x;
+				memcpy(&bspGridPoints[num],
+					   &bspGridPoints[(((z & ~1) * gridBounds[1]) + (y & ~1)) * gridBounds[0] + (x & ~1)], sizeof(*bspGridPoints));
+			}
+		}
+	}
+}
+
+
+
+/*
+PreviewLightWorld()
+lights the world quickly without subsampling, dirt and floodlight on a coarse
+grid and writes the bsp, then puts everything back for the full quality pass
+*/
+
+static void PreviewLightWorld(void)
+{
+	int             i, lightmapNum, oldLightSamples, numPreviewGridPoints;
+	qboolean        oldDirty, oldFloodlighty;
+	rawGridPoint_t *rawGrid;
+	bspGridPoint_t *bspGrid;
+	rawLightmap_t  *lm;
+	int           **clusters;
+	byte           *styles;
+
+
+	/* note it */
+	Sys_Printf("\n--- Preview ---\n");
+
+	/* turn off the slow parts */
+	previewing = qtrue;
+	oldLightSamples = lightSamples;
+	oldDirty = dirty;
+	oldFloodlighty = floodlighty;
+	lightSamples = 1;
+	dirty = qfalse;
+	floodlighty = qfalse;
+
+	/* the lights keep the grid envelopes, the surface envelopes would delete the grid only lights before the real grid */
+	if(noGridLighting)
+		SetupEnvelopes(qfalse, fast);
+
+	/* trace a coarse grid, TraceGrid adds to the raw grid points */
+	rawGrid = NULL;
+	bspGrid = NULL;
+	if(!noGridLighting)
+	{
+		rawGrid = safe_malloc(numRawGridPoints * sizeof(*rawGrid));
+		memcpy(rawGrid, rawGridPoints, numRawGridPoints * sizeof(*rawGrid));
+		bspGrid = safe_malloc(numBSPGridPoints * sizeof(*bspGrid));
+		memcpy(bspGrid, bspGridPoints, numBSPGridPoints * sizeof(*bspGrid));
+
+		numPreviewGridPoints = ((gridBounds[0] + 1) / 2) * ((gridBounds[1] + 1) / 2) * ((gridBounds[2] + 1) / 2);
+
+		Sys_Printf("--- TraceGrid ---\n");
+		inGrid = qtrue;
+		RunThreadsOnIndividual(numPreviewGridPoints, qtrue, TracePreviewGrid);
+		inGrid = qfalse;
+		FillPreviewGrid();
+	}
+
+	/* the filter pass floods luxel clusters and the lights add styles */
+	clusters = safe_malloc(numRawLightmaps * sizeof(*clusters));
+	styles = safe_malloc(numRawLightmaps * MAX_LIGHTMAPS);
+	for(i = 0; i < numRawLightmaps; i++)
+	{
+		lm = &rawLightmaps[i];
+		clusters[i] = safe_malloc(lm->sw * lm->sh * sizeof(int));
+		memcpy(clusters[i], lm->superClusters, lm->sw * lm->sh * sizeof(int));
+		memcpy(&styles[i * MAX_LIGHTMAPS], lm->styles, MAX_LIGHTMAPS);
+	}
+
+	/* light the luxels and vertexes */
+	Sys_Printf("--- IlluminateRawLightmap ---\n");
+	RunThreadsOnIndividualSorted(numRawLightmaps, qtrue, IlluminateRawLightmap, RawLightmapCost);
+
+	StitchSurfaceLightmaps();
+
+	Sys_Printf("--- IlluminateVertexes ---\n");
+	RunThreadsOnIndividual(numBSPDrawSurfaces, qtrue, IlluminateVertexes);
+
+	/* write the preview */
+	StoreSurfaceLightmaps();
+	UnparseEntities();
+	Sys_Printf("Writing %s\n", source);
+	WriteBSPFile(source);
+
+	/* put back the lightmaps */
+	for(i = 0; i < numRawLightmaps; i++)
+	{
+		lm = &rawLightmaps[i];
+		memcpy(lm->superClusters, clusters[i], lm->sw * lm->sh * sizeof(int));
+		memcpy(lm->styles, &styles[i * MAX_LIGHTMAPS], MAX_LIGHTMAPS);
+		free(clusters[i]);
+
+		/* styled lightmaps only exist after a light of the style hit them */
+		for(lightmapNum = 1; lightmapNum < MAX_LIGHTMAPS; lightmapNum++)
+		{
+			if(lm->styles[lightmapNum] != LS_NONE)
+				continue;
+			free(lm->superLuxels[lightmapNum]);
+			free(lm->bspLuxels[lightmapNum]);
+			free(lm->radLuxels[lightmapNum]);
+			lm->superLuxels[lightmapNum] = NULL;
+			lm->bspLuxels[lightmapNum] = NULL;
+			lm->radLuxels[lightmapNum] = NULL;
+		}
+
+		if(lm->superDeluxels != NULL)
+			memset(lm->superDeluxels, 0, lm->sw * lm->sh * SUPER_DELUXEL_SIZE * sizeof(float));
+	}
+	free(clusters);
+	free(styles);
+
+	/* IlluminateVertexes adds to the vertex luxels */
+	for(lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++)
+	{
+		memset(vertexLuxels[lightmapNum], 0, numBSPDrawVerts * VERTEX_LUXEL_SIZE * sizeof(float));
+		if(deluxemap)
+			memset(vertexDeluxels[lightmapNum], 0, numBSPDrawVerts * VERTEX_DELUXEL_SIZE * sizeof(float));
+	}
+
+	/* put back the grid */
+	if(!noGridLighting)
+	{
+		memcpy(rawGridPoints, rawGrid, numRawGridPoints * sizeof(*rawGrid));
+		memcpy(bspGridPoints, bspGrid, numBSPGridPoints * sizeof(*bspGrid));
+		free(rawGrid);
+		free(bspGrid);
+		gridEnvelopeCulled = 0;
+		gridBoundsCulled = 0;
+	}
+
+	/* restore settings */
+	numLuxelsIlluminated = 0;
+	numVertsIlluminated = 0;
+	lightSamples = oldLightSamples;
+	dirty = oldDirty;
+	floodlighty = oldFloodlighty;
+	previewing = qfalse;
+
+	Sys_Printf("\n--- Full quality ---\n");
+}
+
+
+
 /*
 LightWorld()
 does what it says...
@@ -1872,12 +2061,27 @@ void LightWorld(void)
 	Sys_Printf("%9d diffuse (area) lights\n", numDiffuseLights);
 	Sys_Printf("%9d sun/sky lights\n", numSunLights);
 
-	/* calculate lightgrid */
+	/* ydnar: set up light envelopes */
 	if(!noGridLighting)
-	{
-		/* ydnar: set up light envelopes */
 		SetupEnvelopes(qtrue, fastgrid);
 
+	/* slight optimization to remove a sqrt */
+	subdivideThreshold *= subdivideThreshold;
+
+	/* map the world luxels */
+	Sys_Printf("--- MapRawLightmap ---\n");
+	RunThreadsOnIndividualSorted(numRawLightmaps, qtrue, MapRawLightmap, RawLightmapCost);
+	Sys_Printf("%9d luxels\n", numLuxels);
+	Sys_Printf("%9d luxels mapped\n", numLuxelsMapped);
+	Sys_Printf("%9d luxels occluded\n", numLuxelsOccluded);
+
+	/* write a quick preview before the full quality lighting */
+	if(progressive)
+		PreviewLightWorld();
+
+	/* calculate lightgrid */
+	if(!noGridLighting)
+	{
 		Sys_Printf("--- TraceGrid ---\n");
 		inGrid = qtrue;
 		RunThreadsOnIndividual(numRawGridPoints, qtrue, TraceGrid);
@@ -1889,21 +2093,11 @@ void LightWorld(void)
 		Sys_FPrintf(SYS_VRB, "%9d grid points bounds culled\n", gridBoundsCulled);
 	}
 
-	/* slight optimization to remove a sqrt */
-	subdivideThreshold *= subdivideThreshold;
-
-	/* map the world luxels */
-	Sys_Printf("--- MapRawLightmap ---\n");
-	RunThreadsOnIndividual(numRawLightmaps, qtrue, MapRawLightmap);
-	Sys_Printf("%9d luxels\n", numLuxels);
-	Sys_Printf("%9d luxels mapped\n", numLuxelsMapped);
-	Sys_Printf("%9d luxels occluded\n", numLuxelsOccluded);
-
 	/* dirty them up */
 	if(dirty)
 	{
 		Sys_Printf("--- DirtyRawLightmap ---\n");
-		RunThreadsOnIndividual(numRawLightmaps, qtrue, DirtyRawLightmap);
+		RunThreadsOnIndividualSorted(numRawLightmaps, qtrue, DirtyRawLightmap, RawLightmapCost);
 	}
 
 	/* floodlight pass */
@@ -1919,8 +2113,10 @@ void LightWorld(void)
 	lightsClusterCulled = 0;
 
 	Sys_Printf("--- IlluminateRawLightmap ---\n");
-	RunThreadsOnIndividual(numRawLightmaps, qtrue, IlluminateRawLightmap);
+	RunThreadsOnIndividualSorted(numRawLightmaps, qtrue, IlluminateRawLightmap, RawLightmapCost);
 	Sys_Printf("%9d luxels illuminated\n", numLuxelsIlluminated);
+	if(useCache)
+		Sys_Printf("%9d raw lightmaps from cache\n", numRawLightmapsCached);
 
 	StitchSurfaceLightmaps();
 
@@ -1934,6 +2130,37 @@ void LightWorld(void)
 	Sys_FPrintf(SYS_VRB, "%9d lights bounds culled\n", lightsBoundsCulled);
 	Sys_FPrintf(SYS_VRB, "%9d lights cluster culled\n", lightsClusterCulled);
 
+	/* photon mapped radiosity does all bounces at once */
+	if(bounce > 0 && numBouncePhotons > 0)
+	{
+		/* store off the bsp of the direct pass */
+		StoreSurfaceLightmaps();
+		UnparseEntities();
+		Sys_Printf("Writing %s\n", source);
+		WriteBSPFile(source);
+
+		/* note it */
+		Sys_Printf("\n--- Radiosity (%d bounces, %d photons) ---\n", bounce, numBouncePhotons);
+
+		/* flag bouncing */
+		bouncing = qtrue;
+		VectorClear(ambientColor);
+		floodlighty = qfalse;
+
+		/* the grid has no surfels to gather photons */
+		if(bouncegrid)
+			Sys_Printf("WARNING: -bouncegrid is ignored with -photons\n");
+
+		PhotonBounce();
+
+		StitchSurfaceLightmaps();
+
+		Sys_Printf("--- IlluminateVertexes ---\n");
+		RunThreadsOnIndividual(numBSPDrawSurfaces, qtrue, IlluminateVertexes);
+		Sys_Printf("%9d vertexes illuminated\n", numVertsIlluminated);
+		return;
+	}
+
 	/* radiosity */
 	b = 1;
 	bt = bounce;
@@ -1986,7 +2213,7 @@ void LightWorld(void)
 		lightsClusterCulled = 0;
 
 		Sys_Printf("--- IlluminateRawLightmap ---\n");
-		RunThreadsOnIndividual(numRawLightmaps, qtrue, IlluminateRawLightmap);
+		RunThreadsOnIndividualSorted(numRawLightmaps, qtrue, IlluminateRawLightmap, RawLightmapCost);
 		Sys_Printf("%9d luxels illuminated\n", numLuxelsIlluminated);
 		Sys_Printf("%9d vertexes illuminated\n", numVertsIlluminated);
 
@@ -2374,6 +2601,12 @@ int LightMain(int argc, char **argv)
 			Sys_Printf("Only computing sunlight\n");
 		}
 
+		else if(!strcmp(argv[i], "-progressive"))
+		{
+			progressive = qtrue;
+			Sys_Printf("Writing a quick preview before the full quality lighting\n");
+		}
+
 		else if(!strcmp(argv[i], "-bounceonly"))
 		{
 			bounceOnly = qtrue;
@@ -2413,6 +2646,34 @@ int LightMain(int argc, char **argv)
 			Sys_Printf("Phong shading enabled\n");
 		}
 
+		else if(!strcmp(argv[i], "-photons"))
+		{
+			numBouncePhotons = atoi(argv[i + 1]);
+			if(numBouncePhotons < 0)
+				numBouncePhotons = 0;
+			else if(numBouncePhotons > 0)
+				Sys_Printf("Photon mapped radiosity enabled with %d photons\n", numBouncePhotons);
+			i++;
+		}
+
+		else if(!strcmp(argv[i], "-photongather"))
+		{
+			photonGather = atoi(argv[i + 1]);
+			if(photonGather < 1)
+				photonGather = 1;
+			Sys_Printf("Gathering the nearest %d photons\n", photonGather);
+			i++;
+		}
+
+		else if(!strcmp(argv[i], "-photonradius"))
+		{
+			photonRadius = atof(argv[i + 1]);
+			if(photonRadius < 1.0f)
+				photonRadius = 1.0f;
+			Sys_Printf("Gathering photons within %f units\n", photonRadius);
+			i++;
+		}
+
 		else if(!strcmp(argv[i], "-bouncegrid"))
 		{
 			bouncegrid = qtrue;
@@ -2443,6 +2704,12 @@ int LightMain(int argc, char **argv)
 			Sys_Printf("Faster mode enabled\n");
 		}
 
+		else if(!strcmp(argv[i], "-cache"))
+		{
+			useCache = qtrue;
+			Sys_Printf("Reusing the raw lightmaps of the last compile\n");
+		}
+
 		else if(!strcmp(argv[i], "-fastgrid"))
 		{
 			fastgrid = qtrue;
@@ -2592,6 +2859,11 @@ int LightMain(int argc, char **argv)
 			noSurfaces = qtrue;
 			Sys_Printf("Not tracing against surfaces\n");
 		}
+		else if(!strcmp(argv[i], "-nobvh"))
+		{
+			noTraceBVH = qtrue;
+			Sys_Printf("Tracing through the trace node tree only\n");
+		}
 		else if(!strcmp(argv[i], "-dump"))
 		{
 			dump = qtrue;
@@ -2772,9 +3044,15 @@ int LightMain(int argc, char **argv)
 	/* initialize the surface facet tracing */
 	SetupTraceNodes();
 
+	/* load the raw lightmaps of the last compile */
+	OpenLightCache(argc, argv);
+
 	/* light the world */
 	LightWorld();
 
+	/* write the raw lightmaps of this compile */
+	CloseLightCache();
+
 	/* ydnar: store off lightmaps */
 	StoreSurfaceLightmaps();
 
@@ -814,6 +814,40 @@ void RadLightForPatch(int num, int lightmapNum, rawLightmap_t * lm, shaderInfo_t
 
 
 
+/*
+RadSurfaceBounces()
+returns qtrue if light bounces off a given surface
+*/
+
+static qboolean RadSurfaceBounces(int num)
+{
+	int             contentFlags, surfaceFlags, compileFlags;
+	bspDrawSurface_t *ds;
+	shaderInfo_t   *si;
+
+
+	/* get drawsurface and shader info */
+	ds = &bspDrawSurfaces[num];
+	si = surfaceInfos[num].si;
+
+	/* find nodraw bit */
+	contentFlags = surfaceFlags = compileFlags = 0;
+	ApplySurfaceParm("nodraw", &contentFlags, &surfaceFlags, &compileFlags);
+
+	// jal : avoid bouncing on trans surfaces
+	ApplySurfaceParm("trans", &contentFlags, &surfaceFlags, &compileFlags);
+
+	/* early outs? */
+	if(si->bounceScale <= 0.0f || (si->compileFlags & C_SKY) || si->autosprite ||
+	   (bspShaders[ds->shaderNum].contentFlags & contentFlags) || (bspShaders[ds->shaderNum].surfaceFlags & surfaceFlags) ||
+	   (si->compileFlags & compileFlags))
+		return qfalse;
+
+	return qtrue;
+}
+
+
+
 /*
 RadLight()
 creates unbounced diffuse lights for a given surface
@@ -823,7 +857,6 @@ void RadLight(int num)
 {
 	int             lightmapNum;
 	float           scale, subdivide;
-	int             contentFlags, surfaceFlags, compileFlags;
 	bspDrawSurface_t *ds;
 	surfaceInfo_t  *info;
 	rawLightmap_t  *lm;
@@ -838,17 +871,8 @@ void RadLight(int num)
 	si = info->si;
 	scale = si->bounceScale;
 
-	/* find nodraw bit */
-	contentFlags = surfaceFlags = compileFlags = 0;
-	ApplySurfaceParm("nodraw", &contentFlags, &surfaceFlags, &compileFlags);
-
-	// jal : avoid bouncing on trans surfaces
-	ApplySurfaceParm("trans", &contentFlags, &surfaceFlags, &compileFlags);
-
 	/* early outs? */
-	if(scale <= 0.0f || (si->compileFlags & C_SKY) || si->autosprite ||
-	   (bspShaders[ds->shaderNum].contentFlags & contentFlags) || (bspShaders[ds->shaderNum].surfaceFlags & surfaceFlags) ||
-	   (si->compileFlags & compileFlags))
+	if(!RadSurfaceBounces(num))
 		return;
 
 	/* determine how much we need to chop up the surface */
@@ -948,3 +972,841 @@ void RadCreateDiffuseLights(void)
 	Sys_FPrintf(SYS_VRB, "%8d patch diffuse lights\n", numPatchDiffuseLights);
 	Sys_FPrintf(SYS_VRB, "%8d triangle diffuse lights\n", numTriangleDiffuseLights);
 }
+
+
+
+/* -------------------------------------------------------------------------------
+
+photon mapped radiosity
+
+-bounce with -photons doesn't turn the lit surfaces into area lights for every
+bounce. every lightmapped luxel becomes a surfel with the light of the direct
+pass on it. the surfels shoot photons in proportion to the light they bounce,
+the photons are traced through the trace nodes and land on other surfels,
+where they are stored and bounce on until all bounces are done or russian
+roulette ends them. every surfel then gathers its nearest photons from a
+kd-tree, so the cost depends on the number of photons and not on the number
+of bounces. only the unstyled lightmaps bounce.
+
+------------------------------------------------------------------------------- */
+
+#define PHOTON_CHUNK_SURFELS	256
+#define PHOTON_SURFACE_EPSILON	4.0f
+#define PHOTON_NUDGE			1.0f
+#define PHOTON_TREE_STACK		64
+#define MAX_PHOTON_GATHER		1024
+
+typedef struct photonSurfel_s
+{
+	vec3_t          origin, normal;
+	vec3_t          reflect;	/* fraction of the arriving light that bounces off */
+	vec3_t          light;		/* direct light on the luxel, the gathered bounced light after PhotonGather */
+	vec3_t          dir;		/* where the bounced light comes from */
+	float           area;
+}
+photonSurfel_t;
+
+typedef struct photon_s
+{
+	vec3_t          origin, dir, power;
+}
+photon_t;
+
+typedef struct photonChunk_s
+{
+	int             numPhotons;
+	photon_t       *photons;
+}
+photonChunk_t;
+
+/* balanced kd-tree, the median of each range is its node */
+typedef struct photonTree_s
+{
+	int             numPoints, stride;
+	const byte     *points;	/* each point starts with its origin */
+	int            *indexes;
+	byte           *axes;
+}
+photonTree_t;
+
+typedef struct photonGather_s
+{
+	const photonSurfel_t *surfel;
+	const photonSurfel_t *surfels;
+	const vec_t    *dir;
+	int             numFound, maxFound, found[MAX_PHOTON_GATHER];
+	float           radiusSquared, distSquared[MAX_PHOTON_GATHER];
+}
+photonGather_t;
+
+static int      numPhotonSurfels;
+static photonSurfel_t *photonSurfels;
+static int     *luxelPhotonSurfels, *firstLuxelPhotonSurfels;
+static float    photonSurfelRadius, photonPower;
+static photonTree_t photonSurfelTree, photonTree;
+static int      numPhotonChunks;
+static photonChunk_t *photonChunks;
+static int      numPhotons;
+static photon_t *photons;
+
+#define PHOTON_TREE_POINT( tree, n )	((const float *) ((tree)->points + (tree)->indexes[ n ] * (tree)->stride))
+
+
+
+/*
+PhotonRandom()
+xorshift, every surfel seeds its own so the photons don't depend on the threads
+*/
+
+static float PhotonRandom(unsigned int *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return (*seed >> 8) * (1.0f / 16777216.0f);
+}
+
+
+
+/*
+PhotonDirection()
+picks a cosine weighted direction over the hemisphere of a normal
+*/
+
+static void PhotonDirection(const vec3_t normal, unsigned int *seed, vec3_t dir)
+{
+	int             i;
+	float           angle, r, x, y, z;
+	vec3_t          forward, right, up;
+
+
+	angle = PhotonRandom(seed) * 2.0f * Q_PI;
+	r = PhotonRandom(seed);
+	x = cos(angle) * sqrt(r);
+	y = sin(angle) * sqrt(r);
+	z = sqrt(1.0f - r);
+
+	VectorCopy(normal, forward);
+	MakeNormalVectors(forward, right, up);
+	for(i = 0; i < 3; i++)
+		dir[i] = right[i] * x + up[i] * y + normal[i] * z;
+}
+
+
+
+/*
+SelectPhotonTreeMedian()
+moves the kth point of a range into place along an axis, the smaller ones in front of it
+*/
+
+static void SelectPhotonTreeMedian(photonTree_t * tree, int lo, int hi, int k, int axis)
+{
+	int             i, lt, gt, temp;
+	float           pivot, value;
+
+
+	while(hi - lo > 1)
+	{
+		/* three way partition, the points of a plane share a lot of coordinates */
+		pivot = PHOTON_TREE_POINT(tree, (lo + hi) / 2)[axis];
+		lt = lo;
+		gt = hi;
+		i = lo;
+		while(i < gt)
+		{
+			value = PHOTON_TREE_POINT(tree, i)[axis];
+			if(value < pivot)
+			{
+				temp = tree->indexes[lt];
+				tree->indexes[lt++] = tree->indexes[i];
+				tree->indexes[i++] = temp;
+			}
+			else if(value > pivot)
+			{
+				temp = tree->indexes[--gt];
+				tree->indexes[gt] = tree->indexes[i];
+				tree->indexes[i] = temp;
+			}
+			else
+				i++;
+		}
+
+		if(k < lt)
+			hi = lt;
+		else if(k >= gt)
+			lo = gt;
+		else
+			return;
+	}
+}
+
+
+
+/*
+BuildPhotonTree_r()
+splits a range of points along its longest axis
+*/
+
+static void BuildPhotonTree_r(photonTree_t * tree, int lo, int hi)
+{
+	int             i, mid, axis;
+	vec3_t          mins, maxs;
+
+
+	if(hi <= lo)
+		return;
+
+	ClearBounds(mins, maxs);
+	for(i = lo; i < hi; i++)
+		AddPointToBounds(PHOTON_TREE_POINT(tree, i), mins, maxs);
+
+	axis = 0;
+	for(i = 1; i < 3; i++)
+	{
+		if(maxs[i] - mins[i] > maxs[axis] - mins[axis])
+			axis = i;
+	}
+
+	mid = (lo + hi) / 2;
+	SelectPhotonTreeMedian(tree, lo, hi, mid, axis);
+	tree->axes[mid] = axis;
+
+	BuildPhotonTree_r(tree, lo, mid);
+	BuildPhotonTree_r(tree, mid + 1, hi);
+}
+
+
+
+/*
+BuildPhotonTree()
+builds a kd-tree over an array of structs that start with their origin
+*/
+
+static void BuildPhotonTree(photonTree_t * tree, const void *points, int stride, int numPoints)
+{
+	int             i;
+
+
+	tree->numPoints = numPoints;
+	tree->stride = stride;
+	tree->points = points;
+	tree->indexes = safe_malloc((numPoints + 1) * sizeof(*tree->indexes));
+	tree->axes = safe_malloc(numPoints + 1);
+	for(i = 0; i < numPoints; i++)
+		tree->indexes[i] = i;
+
+	BuildPhotonTree_r(tree, 0, numPoints);
+}
+
+
+
+/*
+FreePhotonTree()
+*/
+
+static void FreePhotonTree(photonTree_t * tree)
+{
+	free(tree->indexes);
+	free(tree->axes);
+	memset(tree, 0, sizeof(*tree));
+}
+
+
+
+/*
+SearchPhotonTree()
+calls visit for the points closer than the radius, visit returns the squared radius to keep searching with
+*/
+
+static void SearchPhotonTree(photonTree_t * tree, const vec3_t origin, float radiusSquared,
+							 float (*visit) (int index, float distSquared, void *data), void *data)
+{
+	int             lo, hi, mid, stackSize;
+	int             stackLo[PHOTON_TREE_STACK], stackHi[PHOTON_TREE_STACK];
+	float           stackDistSquared[PHOTON_TREE_STACK], d, distSquared;
+	const float    *point;
+	vec3_t          delta;
+
+
+	stackLo[0] = 0;
+	stackHi[0] = tree->numPoints;
+	stackDistSquared[0] = 0.0f;
+	stackSize = 1;
+
+	while(stackSize > 0)
+	{
+		stackSize--;
+		lo = stackLo[stackSize];
+		hi = stackHi[stackSize];
+		if(hi <= lo || stackDistSquared[stackSize] >= radiusSquared)
+			continue;
+
+		mid = (lo + hi) / 2;
+		point = PHOTON_TREE_POINT(tree, mid);
+		VectorSubtract(origin, point, delta);
+		distSquared = DotProduct(delta, delta);
+		if(distSquared < radiusSquared)
+			radiusSquared = visit(tree->indexes[mid], distSquared, data);
+
+		/* the far side first, so the near side is searched before it */
+		d = delta[tree->axes[mid]];
+		stackLo[stackSize] = d < 0.0f ? mid + 1 : lo;
+		stackHi[stackSize] = d < 0.0f ? hi : mid;
+		stackDistSquared[stackSize] = d * d;
+		stackSize++;
+
+		stackLo[stackSize] = d < 0.0f ? lo : mid + 1;
+		stackHi[stackSize] = d < 0.0f ? mid : hi;
+		stackDistSquared[stackSize] = 0.0f;
+		stackSize++;
+	}
+}
+
+
+
+/*
+VisitPhotonSurfel()
+keeps the nearest surfel a photon can land on
+*/
+
+static float VisitPhotonSurfel(int index, float distSquared, void *data)
+{
+	photonGather_t *gather;
+	const photonSurfel_t *surfel;
+	vec3_t          delta;
+
+
+	gather = (photonGather_t *) data;
+	surfel = &gather->surfels[index];
+
+	/* the photon has to arrive from the front on the plane of the surfel */
+	VectorSubtract(gather->surfel->origin, surfel->origin, delta);
+	if(DotProduct(surfel->normal, gather->dir) >= 0.0f || fabs(DotProduct(delta, surfel->normal)) > PHOTON_SURFACE_EPSILON)
+		return gather->radiusSquared;
+
+	gather->found[0] = index;
+	gather->numFound = 1;
+	gather->radiusSquared = distSquared;
+	return distSquared;
+}
+
+
+
+/*
+FindPhotonSurfel()
+returns the surfel at the point a photon hit, -1 if it hit something without a lightmap
+*/
+
+static int FindPhotonSurfel(const vec3_t hit, const vec3_t dir)
+{
+	photonSurfel_t  point;
+	photonGather_t  gather;
+
+
+	VectorCopy(hit, point.origin);
+	gather.surfel = &point;
+	gather.surfels = photonSurfels;
+	gather.dir = dir;
+	gather.numFound = 0;
+	gather.radiusSquared = photonSurfelRadius * photonSurfelRadius;
+
+	SearchPhotonTree(&photonSurfelTree, hit, gather.radiusSquared, VisitPhotonSurfel, &gather);
+	if(gather.numFound == 0)
+		return -1;
+	return gather.found[0];
+}
+
+
+
+/*
+SetupPhotonSurfels()
+creates a surfel for every lightmapped luxel with the light of the direct pass
+*/
+
+static void SetupPhotonSurfels(void)
+{
+	int             i, j, x, y, sx, sy, numLuxels, numMapped;
+	float           reflectScale, *radLuxel, *origin, *normal;
+	vec3_t          reflect;
+	rawLightmap_t  *lm;
+	surfaceInfo_t  *info;
+	photonSurfel_t *surfel;
+
+
+	/* one luxel of the direct pass gives this much bounced light per unit of color */
+	reflectScale = RADIOSITY_VALUE * 0.375f * formFactorValueScale * bounceScale * (1.0f / 255.0f) * (1.0f / 255.0f);
+
+	/* count the luxels */
+	firstLuxelPhotonSurfels = safe_malloc((numRawLightmaps + 1) * sizeof(int));
+	numLuxels = 0;
+	for(i = 0; i < numRawLightmaps; i++)
+	{
+		firstLuxelPhotonSurfels[i] = numLuxels;
+		numLuxels += rawLightmaps[i].w * rawLightmaps[i].h;
+	}
+	firstLuxelPhotonSurfels[i] = numLuxels;
+
+	luxelPhotonSurfels = safe_malloc((numLuxels + 1) * sizeof(int));
+	photonSurfels = safe_malloc((numLuxels + 1) * sizeof(*photonSurfels));
+	memset(photonSurfels, 0, (numLuxels + 1) * sizeof(*photonSurfels));
+	numPhotonSurfels = 0;
+	photonSurfelRadius = 0.0f;
+	photonPower = 0.0f;
+
+	for(i = 0; i < numRawLightmaps; i++)
+	{
+		lm = &rawLightmaps[i];
+
+		/* the raw lightmap's surfaces share its luxels, so they share their color too */
+		VectorClear(reflect);
+		for(j = 0; j < lm->numLightSurfaces; j++)
+		{
+			info = &surfaceInfos[lightSurfaces[lm->firstLightSurface + j]];
+			if(RadSurfaceBounces(lightSurfaces[lm->firstLightSurface + j]))
+				VectorMA(reflect, info->si->bounceScale * reflectScale, info->si->averageColor, reflect);
+		}
+		if(lm->numLightSurfaces > 0)
+			VectorScale(reflect, 1.0f / lm->numLightSurfaces, reflect);
+
+		if(lm->actualSampleSize > photonSurfelRadius)
+			photonSurfelRadius = lm->actualSampleSize;
+
+		for(y = 0; y < lm->h; y++)
+		{
+			for(x = 0; x < lm->w; x++)
+			{
+				luxelPhotonSurfels[firstLuxelPhotonSurfels[i] + y * lm->w + x] = -1;
+
+				/* unused luxels and lightmaps without radiosity storage */
+				if(lm->superLuxels[0] == NULL || lm->radLuxels[0] == NULL)
+					continue;
+				radLuxel = RAD_LUXEL(0, x, y);
+				if(radLuxel[0] < 0.0f)
+					continue;
+
+				/* average the mapped super luxels */
+				surfel = &photonSurfels[numPhotonSurfels];
+				numMapped = 0;
+				for(sy = y * superSample; sy < (y + 1) * superSample; sy++)
+				{
+					for(sx = x * superSample; sx < (x + 1) * superSample; sx++)
+					{
+						if(*SUPER_CLUSTER(sx, sy) < 0)
+							continue;
+						origin = SUPER_ORIGIN(sx, sy);
+						normal = SUPER_NORMAL(sx, sy);
+						VectorAdd(surfel->origin, origin, surfel->origin);
+						VectorAdd(surfel->normal, normal, surfel->normal);
+						numMapped++;
+					}
+				}
+				if(numMapped == 0)
+					continue;
+				VectorScale(surfel->origin, 1.0f / numMapped, surfel->origin);
+				if(VectorNormalize(surfel->normal) == 0.0f)
+				{
+					memset(surfel, 0, sizeof(*surfel));
+					continue;
+				}
+
+				VectorCopy(reflect, surfel->reflect);
+				VectorCopy(radLuxel, surfel->light);
+				surfel->area = lm->actualSampleSize * lm->actualSampleSize * numMapped / (superSample * superSample);
+
+				/* the light the surfel bounces off */
+				photonPower += RGBTOGRAY(surfel->light) * RGBTOGRAY(surfel->reflect) * surfel->area;
+
+				luxelPhotonSurfels[firstLuxelPhotonSurfels[i] + y * lm->w + x] = numPhotonSurfels;
+				numPhotonSurfels++;
+			}
+		}
+	}
+}
+
+
+
+/*
+EmitPhotons()
+shoots the photons of a chunk of surfels and follows them through all bounces
+*/
+
+static void EmitPhotons(int chunkNum)
+{
+	int             i, j, n, b, surfelNum, hitNum, maxPhotons;
+	unsigned int    seed;
+	float           expected, survive;
+	vec3_t          origin, normal, dir, color;
+	photonSurfel_t *surfel, *hit;
+	photonChunk_t  *chunk;
+	photon_t       *photon;
+	trace_t         trace;
+
+
+	chunk = &photonChunks[chunkNum];
+	maxPhotons = 0;
+
+	/* setup trace */
+	trace.testOcclusion = !noTrace;
+	trace.forceSunlight = qfalse;
+	trace.recvShadows = WORLDSPAWN_RECV_SHADOWS;
+	trace.numSurfaces = 0;
+	trace.surfaces = NULL;
+	trace.numLights = 0;
+	trace.lights = NULL;
+	trace.twoSided = qfalse;
+	trace.inhibitRadius = DEFAULT_INHIBIT_RADIUS;
+	trace.testAll = qtrue;
+	trace.cluster = 0;
+
+	for(surfelNum = chunkNum * PHOTON_CHUNK_SURFELS;
+		surfelNum < numPhotonSurfels && surfelNum < (chunkNum + 1) * PHOTON_CHUNK_SURFELS; surfelNum++)
+	{
+		surfel = &photonSurfels[surfelNum];
+
+		/* share the photons by the light the surfels bounce */
+		expected = RGBTOGRAY(surfel->light) * RGBTOGRAY(surfel->reflect) * surfel->area * numBouncePhotons / photonPower;
+		if(expected <= 0.0f)
+			continue;
+
+		seed = (unsigned int)HashMix(surfelNum + 1) | 1;
+		n = (int)(expected + PhotonRandom(&seed));
+
+		for(i = 0; i < n; i++)
+		{
+			/* every photon carries the same share of the total light */
+			for(j = 0; j < 3; j++)
+				color[j] = surfel->light[j] * surfel->reflect[j] * surfel->area / expected;
+			VectorCopy(surfel->origin, origin);
+			VectorCopy(surfel->normal, normal);
+
+			for(b = 0; b < bounce; b++)
+			{
+				/* trace to the next surface */
+				PhotonDirection(normal, &seed, dir);
+				VectorMA(origin, PHOTON_NUDGE, normal, trace.origin);
+				VectorMA(trace.origin, MAX_WORLD_COORD * 2.0f, dir, trace.end);
+				SetupTrace(&trace);
+				VectorSet(trace.color, 1.0f, 1.0f, 1.0f);
+				TraceLine(&trace);
+				if(!trace.opaque && !trace.passSolid)
+					break;
+
+				hitNum = FindPhotonSurfel(trace.hit, dir);
+				if(hitNum < 0)
+					break;
+				hit = &photonSurfels[hitNum];
+
+				/* store it */
+				if(chunk->numPhotons >= maxPhotons)
+				{
+					maxPhotons = maxPhotons * 2 + 64;
+					photon = safe_malloc(maxPhotons * sizeof(*photon));
+					if(chunk->photons != NULL)
+					{
+						memcpy(photon, chunk->photons, chunk->numPhotons * sizeof(*photon));
+						free(chunk->photons);
+					}
+					chunk->photons = photon;
+				}
+				photon = &chunk->photons[chunk->numPhotons++];
+				VectorCopy(trace.hit, photon->origin);
+				VectorCopy(dir, photon->dir);
+				VectorCopy(color, photon->power);
+
+				/* russian roulette */
+				survive = hit->reflect[0];
+				if(hit->reflect[1] > survive)
+					survive = hit->reflect[1];
+				if(hit->reflect[2] > survive)
+					survive = hit->reflect[2];
+				if(survive > 1.0f)
+					survive = 1.0f;
+				if(survive <= 0.0f || PhotonRandom(&seed) >= survive)
+					break;
+
+				for(j = 0; j < 3; j++)
+					color[j] *= hit->reflect[j] / survive;
+				VectorCopy(trace.hit, origin);
+				VectorCopy(hit->normal, normal);
+			}
+		}
+	}
+}
+
+
+
+/*
+VisitGatherPhoton()
+keeps the nearest photons arriving on the front of a surfel in a max heap
+*/
+
+static float VisitGatherPhoton(int index, float distSquared, void *data)
+{
+	int             i, child, temp;
+	float           tempDist;
+	photonGather_t *gather;
+	const photon_t *photon;
+	vec3_t          delta;
+
+
+	gather = (photonGather_t *) data;
+	photon = &photons[index];
+
+	/* only photons on the surfel's plane arriving from its front */
+	VectorSubtract(photon->origin, gather->surfel->origin, delta);
+	if(DotProduct(photon->dir, gather->surfel->normal) >= 0.0f ||
+	   fabs(DotProduct(delta, gather->surfel->normal)) > PHOTON_SURFACE_EPSILON)
+		return gather->radiusSquared;
+
+	/* add it to the heap */
+	if(gather->numFound < gather->maxFound)
+	{
+		i = gather->numFound++;
+		while(i > 0 && gather->distSquared[(i - 1) / 2] < distSquared)
+		{
+			gather->found[i] = gather->found[(i - 1) / 2];
+			gather->distSquared[i] = gather->distSquared[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		gather->found[i] = index;
+		gather->distSquared[i] = distSquared;
+
+		if(gather->numFound == gather->maxFound)
+			gather->radiusSquared = gather->distSquared[0];
+		return gather->radiusSquared;
+	}
+
+	/* replace the farthest one */
+	i = 0;
+	for(;;)
+	{
+		child = i * 2 + 1;
+		if(child >= gather->numFound)
+			break;
+		if(child + 1 < gather->numFound && gather->distSquared[child + 1] > gather->distSquared[child])
+			child++;
+		if(gather->distSquared[child] <= distSquared)
+			break;
+		temp = gather->found[child];
+		tempDist = gather->distSquared[child];
+		gather->found[i] = temp;
+		gather->distSquared[i] = tempDist;
+		i = child;
+	}
+	gather->found[i] = index;
+	gather->distSquared[i] = distSquared;
+
+	gather->radiusSquared = gather->distSquared[0];
+	return gather->radiusSquared;
+}
+
+
+
+/*
+GatherPhotons()
+estimates the bounced light on a chunk of surfels from their nearest photons
+*/
+
+static void GatherPhotons(int chunkNum)
+{
+	int             i, surfelNum;
+	float           area, brightness;
+	photonSurfel_t *surfel;
+	photonGather_t *gather;
+	photon_t       *photon;
+
+
+	gather = safe_malloc(sizeof(*gather));
+	for(surfelNum = chunkNum * PHOTON_CHUNK_SURFELS;
+		surfelNum < numPhotonSurfels && surfelNum < (chunkNum + 1) * PHOTON_CHUNK_SURFELS; surfelNum++)
+	{
+		surfel = &photonSurfels[surfelNum];
+
+		gather->surfel = surfel;
+		gather->numFound = 0;
+		gather->maxFound = photonGather < MAX_PHOTON_GATHER ? photonGather : MAX_PHOTON_GATHER;
+		gather->radiusSquared = photonRadius * photonRadius;
+		SearchPhotonTree(&photonTree, surfel->origin, gather->radiusSquared, VisitGatherPhoton, gather);
+
+		/* the light arriving on the disc the photons were found on */
+		VectorClear(surfel->light);
+		VectorClear(surfel->dir);
+		if(gather->numFound == 0)
+			continue;
+
+		for(i = 0; i < gather->numFound; i++)
+		{
+			photon = &photons[gather->found[i]];
+			VectorAdd(surfel->light, photon->power, surfel->light);
+			VectorMA(surfel->dir, -RGBTOGRAY(photon->power), photon->dir, surfel->dir);
+		}
+
+		area = Q_PI * gather->radiusSquared;
+		VectorScale(surfel->light, 1.0f / area, surfel->light);
+
+		/* deluxemap direction, weighted like bounced lights */
+		brightness = RGBTOGRAY(surfel->light) * (1.0f / 255.0f) * 0.25f;
+		if(brightness < 0.00390625f)
+			brightness = 0.00390625f;
+		if(VectorNormalize(surfel->dir) == 0.0f)
+			VectorCopy(surfel->normal, surfel->dir);
+		VectorScale(surfel->dir, brightness, surfel->dir);
+	}
+	free(gather);
+}
+
+
+
+/*
+StorePhotonLight()
+replaces the light of a raw lightmap with the bounced light of its surfels
+*/
+
+static void StorePhotonLight(int rawLightmapNum)
+{
+	int             x, y, sx, sy, lx, ly, lightmapNum, surfelNum, samples;
+	int            *surfelNums;
+	float          *luxel, *deluxel;
+	vec3_t          color, dir;
+	rawLightmap_t  *lm;
+	photonSurfel_t *surfel;
+
+
+	lm = &rawLightmaps[rawLightmapNum];
+	surfelNums = &luxelPhotonSurfels[firstLuxelPhotonSurfels[rawLightmapNum]];
+
+	for(y = 0; y < lm->h; y++)
+	{
+		for(x = 0; x < lm->w; x++)
+		{
+			/* luxels without a surfel were filled from their neighbors in the direct pass */
+			VectorClear(color);
+			VectorClear(dir);
+			surfelNum = surfelNums[y * lm->w + x];
+			if(surfelNum >= 0)
+			{
+				VectorCopy(photonSurfels[surfelNum].light, color);
+				VectorCopy(photonSurfels[surfelNum].dir, dir);
+			}
+			else
+			{
+				samples = 0;
+				for(ly = y - 1; ly <= y + 1; ly++)
+				{
+					for(lx = x - 1; lx <= x + 1; lx++)
+					{
+						if(lx < 0 || ly < 0 || lx >= lm->w || ly >= lm->h || surfelNums[ly * lm->w + lx] < 0)
+							continue;
+						surfel = &photonSurfels[surfelNums[ly * lm->w + lx]];
+						VectorAdd(color, surfel->light, color);
+						VectorAdd(dir, surfel->dir, dir);
+						samples++;
+					}
+				}
+				if(samples > 0)
+				{
+					VectorScale(color, 1.0f / samples, color);
+					VectorScale(dir, 1.0f / samples, dir);
+				}
+			}
+
+			for(sy = y * superSample; sy < (y + 1) * superSample; sy++)
+			{
+				for(sx = x * superSample; sx < (x + 1) * superSample; sx++)
+				{
+					/* styles don't bounce, keep their sample counts */
+					for(lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++)
+					{
+						if(lm->superLuxels[lightmapNum] == NULL)
+							continue;
+						luxel = SUPER_LUXEL(lightmapNum, sx, sy);
+						if(lightmapNum == 0 && luxel[3] > 0.0f)
+						{
+							VectorCopy(color, luxel);
+							luxel[3] = 1.0f;
+						}
+						else
+							VectorClear(luxel);
+					}
+
+					if(deluxemap)
+					{
+						deluxel = SUPER_DELUXEL(sx, sy);
+						VectorCopy(dir, deluxel);
+					}
+				}
+			}
+		}
+	}
+}
+
+
+
+/*
+PhotonBounce()
+lights the lightmaps with all bounces of the light of the direct pass
+*/
+
+void PhotonBounce(void)
+{
+	int             i, n;
+
+
+	/* only the lightmaps bounce, the area lights of the direct pass are done */
+	RadFreeLights();
+
+	Sys_Printf("--- PhotonSurfels ---\n");
+	SetupPhotonSurfels();
+	Sys_Printf("%9d surfels\n", numPhotonSurfels);
+	if(numPhotonSurfels == 0 || photonPower <= 0.0f)
+	{
+		Sys_Printf("No diffuse light to calculate, ending radiosity.\n");
+		free(photonSurfels);
+		free(luxelPhotonSurfels);
+		free(firstLuxelPhotonSurfels);
+		return;
+	}
+	BuildPhotonTree(&photonSurfelTree, photonSurfels, sizeof(*photonSurfels), numPhotonSurfels);
+
+	/* shoot the photons */
+	Sys_Printf("--- EmitPhotons ---\n");
+	numPhotonChunks = (numPhotonSurfels + PHOTON_CHUNK_SURFELS - 1) / PHOTON_CHUNK_SURFELS;
+	photonChunks = safe_malloc(numPhotonChunks * sizeof(*photonChunks));
+	memset(photonChunks, 0, numPhotonChunks * sizeof(*photonChunks));
+	RunThreadsOnIndividual(numPhotonChunks, qtrue, EmitPhotons);
+
+	/* join the chunks in surfel order */
+	numPhotons = 0;
+	for(i = 0; i < numPhotonChunks; i++)
+		numPhotons += photonChunks[i].numPhotons;
+	photons = safe_malloc((numPhotons + 1) * sizeof(*photons));
+	for(i = 0, n = 0; i < numPhotonChunks; i++)
+	{
+		if(photonChunks[i].photons == NULL)
+			continue;
+		memcpy(&photons[n], photonChunks[i].photons, photonChunks[i].numPhotons * sizeof(*photons));
+		n += photonChunks[i].numPhotons;
+		free(photonChunks[i].photons);
+	}
+	free(photonChunks);
+	photonChunks = NULL;
+	Sys_Printf("%9d photons stored\n", numPhotons);
+
+	/* gather them */
+	Sys_Printf("--- GatherPhotons ---\n");
+	BuildPhotonTree(&photonTree, photons, sizeof(*photons), numPhotons);
+	RunThreadsOnIndividual(numPhotonChunks, qtrue, GatherPhotons);
+	RunThreadsOnIndividual(numRawLightmaps, qfalse, StorePhotonLight);
+
+	/* free it all */
+	FreePhotonTree(&photonTree);
+	FreePhotonTree(&photonSurfelTree);
+	free(photons);
+	free(photonSurfels);
+	free(luxelPhotonSurfels);
+	free(firstLuxelPhotonSurfels);
+	photons = NULL;
+	photonSurfels = NULL;
+	numPhotons = 0;
+	numPhotonSurfels = 0;
+}
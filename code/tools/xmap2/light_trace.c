@@ -36,6 +36,13 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 /* dependencies */
 #include "q3map2.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define TRACE_SSE				1
+#include <xmmintrin.h>
+#else
+#define TRACE_SSE				0
+#endif
+
 
 
 #define Vector2Copy( a, b )		((b)[ 0 ] = (a)[ 0 ], (b)[ 1 ] = (a)[ 1 ])
@@ -59,6 +66,23 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 #define TRACE_LEAF				-1
 #define TRACE_LEAF_SOLID		-2
 
+#define BARY_EPSILON			0.01f
+#define ASLF_EPSILON			0.0001f	/* so to not get double shadows */
+#define COPLANAR_EPSILON		0.25f	//% 0.000001f
+#define NEAR_SHADOW_EPSILON		1.5f	//% 1.25f
+#define SELF_SHADOW_EPSILON		0.5f
+
+#define GROW_BVH_NODES			16384
+#define GROW_BVH_PACKETS		32768
+
+#define BVH_WIDTH				4	// children of a bvh node and triangles of a packet, one sse register
+#define BVH_BINS				16
+#define BVH_MAX_DEPTH			48	// deeper branches are split at the median
+#define BVH_STACK				256		// enough for the median splits of 2^31 triangles below BVH_MAX_DEPTH
+
+#define MAX_TRACE_HITS			64	// sky and translucent hits in front of the nearest opaque hit
+#define TRACE_SOLID_EPSILON		0.25f
+
 typedef struct traceVert_s
 {
 	vec3_t          xyz;
@@ -100,6 +124,35 @@ typedef struct traceNode_s
 }
 traceNode_t;
 
+typedef struct traceBVHNode_s
+{
+	float           mins[3][BVH_WIDTH], maxs[3][BVH_WIDTH];
+	int             numChildren;
+	int             children[BVH_WIDTH];	// >= 0 bvh node, < 0 packet -1 - child
+}
+traceBVHNode_t;
+
+typedef struct traceBVHPacket_s
+{
+	float           origin[3][BVH_WIDTH], edge1[3][BVH_WIDTH], edge2[3][BVH_WIDTH];
+	int             triangles[BVH_WIDTH];	// -1 for unused lanes
+}
+traceBVHPacket_t;
+
+typedef struct traceBVHPrim_s
+{
+	vec3_t          mins, maxs, center;
+	int             triangleNum;
+}
+traceBVHPrim_t;
+
+typedef struct traceHit_s
+{
+	int             triangleNum;
+	float           depth, u, v;
+}
+traceHit_t;
+
 
 int             noDrawContentFlags, noDrawSurfaceFlags, noDrawCompileFlags;
 
@@ -116,6 +169,15 @@ int             headNodeNum = 0, skyboxNodeNum = 0, maxTraceDepth = 0, numTraceL
 int             numTraceNodes = 0, maxTraceNodes = 0;
 traceNode_t    *traceNodes = NULL;
 
+int             numTraceBVHNodes = 0, maxTraceBVHNodes = 0;
+traceBVHNode_t *traceBVHNodes = NULL;
+
+int             numTraceBVHPackets = 0, maxTraceBVHPackets = 0;
+traceBVHPacket_t *traceBVHPackets = NULL;
+
+int             headBVHNodeNum = -1;
+static int      bvhSortAxis;
+
 
 
 /* -------------------------------------------------------------------------------
@@ -909,6 +971,189 @@ static int TriangulateTraceNode_r(int nodeNum)
 
 
 
+/* -------------------------------------------------------------------------------
+
+occluder hashes for the light cache
+
+with -cache every shadow casting triangle and world brush is hashed before the
+triangles are clipped into the trace nodes. a raw lightmap only reuses its
+cached luxels when the hash of the occluders in reach of its lights is the same
+as in the last compile, no matter how the rest of the map changed.
+
+------------------------------------------------------------------------------- */
+
+typedef struct traceOccluder_s
+{
+	vec3_t          mins, maxs;
+	cacheKey_t      hash;
+	int             surfaceNum;	/* the surfaceNum of the trace info, for the self shadowing test */
+}
+traceOccluder_t;
+
+#define GROW_TRACE_OCCLUDERS	8192
+
+static int      numTraceOccluders = 0, maxTraceOccluders = 0;
+static traceOccluder_t *traceOccluders = NULL;
+
+
+
+/*
+AllocTraceOccluder()
+returns a new occluder with cleared bounds
+*/
+
+static traceOccluder_t *AllocTraceOccluder(void)
+{
+	traceOccluder_t *temp;
+
+
+	/* enough space? */
+	if(numTraceOccluders >= maxTraceOccluders)
+	{
+		maxTraceOccluders += GROW_TRACE_OCCLUDERS;
+		temp = safe_malloc(maxTraceOccluders * sizeof(*temp));
+		if(traceOccluders != NULL)
+		{
+			memcpy(temp, traceOccluders, numTraceOccluders * sizeof(*temp));
+			free(traceOccluders);
+		}
+		traceOccluders = temp;
+	}
+
+	temp = &traceOccluders[numTraceOccluders++];
+	ClearBounds(temp->mins, temp->maxs);
+	temp->surfaceNum = -1;
+	return temp;
+}
+
+
+
+/*
+AddTraceOccluder()
+hashes an unclipped trace winding and the trace info it belongs to
+*/
+
+static void AddTraceOccluder(traceWinding_t * tw, int nodeNum)
+{
+	int             i;
+	traceInfo_t    *ti;
+	traceOccluder_t *occluder;
+	cacheKey_t      hash;
+
+
+	if(!useCache)
+		return;
+
+	ti = &traceInfos[tw->infoNum];
+
+	hash = HashData(CACHE_HASH_INIT, tw->v, tw->numVerts * sizeof(tw->v[0]));
+	hash = HashString(hash, ti->si->shader);
+	hash = HashData(hash, &ti->si->compileFlags, sizeof(ti->si->compileFlags));
+	hash = HashData(hash, &ti->castShadows, sizeof(ti->castShadows));
+	hash = HashData(hash, &ti->skipGrid, sizeof(ti->skipGrid));
+	i = (nodeNum == skyboxNodeNum);
+	hash = HashData(hash, &i, sizeof(i));
+
+	occluder = AllocTraceOccluder();
+	for(i = 0; i < tw->numVerts; i++)
+		AddPointToBounds(tw->v[i].xyz, occluder->mins, occluder->maxs);
+	occluder->hash = hash;
+	occluder->surfaceNum = ti->surfaceNum;
+}
+
+
+
+/*
+AddBrushOccluders()
+hashes the world brushes, they make the solid leafs that stop traces
+*/
+
+static void AddBrushOccluders(void)
+{
+	int             i, j, axis;
+	bspBrush_t     *brush;
+	bspBrushSide_t *side;
+	bspPlane_t     *plane;
+	traceOccluder_t *occluder;
+	cacheKey_t      hash;
+
+
+	if(!useCache)
+		return;
+
+	for(i = 0; i < bspModels[0].numBSPBrushes; i++)
+	{
+		brush = &bspBrushes[bspModels[0].firstBSPBrush + i];
+		occluder = AllocTraceOccluder();
+
+		/* a brush without a bevel on an axis reaches across the world on it */
+		VectorSet(occluder->mins, -MAX_WORLD_COORD, -MAX_WORLD_COORD, -MAX_WORLD_COORD);
+		VectorSet(occluder->maxs, MAX_WORLD_COORD, MAX_WORLD_COORD, MAX_WORLD_COORD);
+
+		hash = HashString(CACHE_HASH_INIT, bspShaders[brush->shaderNum].shader);
+		hash = HashData(hash, &bspShaders[brush->shaderNum].contentFlags, sizeof(int));
+		for(j = 0; j < brush->numSides; j++)
+		{
+			side = &bspBrushSides[brush->firstSide + j];
+			plane = &bspPlanes[side->planeNum];
+			hash = HashData(hash, plane->normal, sizeof(plane->normal));
+			hash = HashData(hash, &plane->dist, sizeof(plane->dist));
+
+			/* axial sides bound the brush */
+			for(axis = 0; axis < 3; axis++)
+			{
+				if(plane->normal[axis] == 1.0f)
+					occluder->maxs[axis] = plane->dist;
+				else if(plane->normal[axis] == -1.0f)
+					occluder->mins[axis] = -plane->dist;
+			}
+		}
+		occluder->hash = hash;
+	}
+}
+
+
+
+/*
+HashTraceOccluders()
+hashes the occluders touching a box, the sum doesn't depend on their order
+*/
+
+cacheKey_t HashTraceOccluders(const vec3_t mins, const vec3_t maxs, int numSurfaces, const int *surfaces)
+{
+	int             i, j, self;
+	traceOccluder_t *occluder;
+	cacheKey_t      hash;
+
+
+	hash = 0;
+	for(i = 0, occluder = traceOccluders; i < numTraceOccluders; i++, occluder++)
+	{
+		if(occluder->mins[0] > maxs[0] || occluder->maxs[0] < mins[0] ||
+		   occluder->mins[1] > maxs[1] || occluder->maxs[1] < mins[1] ||
+		   occluder->mins[2] > maxs[2] || occluder->maxs[2] < mins[2])
+			continue;
+
+		/* the surfaces of the lightmap don't shadow themselves */
+		self = 0;
+		for(j = 0; j < numSurfaces && occluder->surfaceNum >= 0; j++)
+		{
+			if(occluder->surfaceNum == surfaces[j])
+			{
+				self = 1;
+				break;
+			}
+		}
+
+		hash += HashMix(occluder->hash + self);
+	}
+
+	return hash;
+}
+
+
+
+
 /* -------------------------------------------------------------------------------
 
 shadow casting item setup (triangles, patches, entities)
@@ -1033,6 +1278,7 @@ static void PopulateWithBSPModel(bspModel_t * model, matrix_t transform)
 						MatrixTransformPoint2(transform, tw.v[0].xyz);
 						MatrixTransformPoint2(transform, tw.v[1].xyz);
 						MatrixTransformPoint2(transform, tw.v[2].xyz);
+						AddTraceOccluder(&tw, nodeNum);
 						FilterTraceWindingIntoNodes_r(&tw, nodeNum);
 
 						/* make second triangle */
@@ -1045,6 +1291,7 @@ static void PopulateWithBSPModel(bspModel_t * model, matrix_t transform)
 						MatrixTransformPoint2(transform, tw.v[0].xyz);
 						MatrixTransformPoint2(transform, tw.v[1].xyz);
 						MatrixTransformPoint2(transform, tw.v[2].xyz);
+						AddTraceOccluder(&tw, nodeNum);
 						FilterTraceWindingIntoNodes_r(&tw, nodeNum);
 					}
 				}
@@ -1072,6 +1319,7 @@ static void PopulateWithBSPModel(bspModel_t * model, matrix_t transform)
 					MatrixTransformPoint2(transform, tw.v[0].xyz);
 					MatrixTransformPoint2(transform, tw.v[1].xyz);
 					MatrixTransformPoint2(transform, tw.v[2].xyz);
+					AddTraceOccluder(&tw, nodeNum);
 					FilterTraceWindingIntoNodes_r(&tw, nodeNum);
 				}
 				break;
@@ -1160,6 +1408,7 @@ static void PopulateWithPicoModel(int castShadows, picoModel_t * model, matrix_t
 				Vector2Copy(st, tw.v[k].st);
 				MatrixTransformPoint2(transform, tw.v[k].xyz);
 			}
+			AddTraceOccluder(&tw, headNodeNum);
 			FilterTraceWindingIntoNodes_r(&tw, headNodeNum);
 		}
 	}
@@ -1188,6 +1437,9 @@ static void PopulateTraceNodes(void)
 	MatrixIdentity(transform);
 	PopulateWithBSPModel(&bspModels[0], transform);
 
+	/* the world brushes make the solid leafs */
+	AddBrushOccluders();
+
 	/* walk each entity list */
 	for(i = 1; i < numEntities; i++)
 	{
@@ -1310,166 +1562,706 @@ static void PopulateTraceNodes(void)
 
 /* -------------------------------------------------------------------------------
 
-trace initialization
+bounding volume hierarchy
+
+the trace triangles of the world are also sorted into a bvh with 4 children
+per node, built with the surface area heuristic. a ray tests the bounds of all
+children of a node and 4 triangles of a leaf packet at once. the trace node
+tree is still used to find solid leafs and for traces the bvh can't finish.
+
+the simd width is used across the children and triangles of one ray only,
+rays are still traced one at a time. there is no packet traversal of
+coherent luxel rays, and the speedup has not been measured on a full map
+yet. use -nobvh to time and compare against the old tracer.
 
 ------------------------------------------------------------------------------- */
 
 /*
-SetupTraceNodes() - ydnar
-creates a balanced bsp with axis-aligned splits for efficient raytracing
+AllocTraceBVHNode()
+allocates a new bvh node
 */
 
-void SetupTraceNodes(void)
+static int AllocTraceBVHNode(void)
 {
-	/* note it */
-	Sys_FPrintf(SYS_VRB, "--- SetupTraceNodes ---\n");
+	traceBVHNode_t *temp;
 
-	/* find nodraw bit */
-	noDrawContentFlags = noDrawSurfaceFlags = noDrawCompileFlags = 0;
-	ApplySurfaceParm("nodraw", &noDrawContentFlags, &noDrawSurfaceFlags, &noDrawCompileFlags);
 
-	/* create the baseline raytracing tree from the bsp tree */
-	headNodeNum = SetupTraceNodes_r(0);
+	/* enough space? */
+	if(numTraceBVHNodes >= maxTraceBVHNodes)
+	{
+		/* reallocate more room */
+		maxTraceBVHNodes += GROW_BVH_NODES;
+		temp = safe_malloc(maxTraceBVHNodes * sizeof(traceBVHNode_t));
+		if(traceBVHNodes != NULL)
+		{
+			memcpy(temp, traceBVHNodes, numTraceBVHNodes * sizeof(traceBVHNode_t));
+			free(traceBVHNodes);
+		}
+		traceBVHNodes = temp;
+	}
 
-	/* create outside node for skybox surfaces */
-	skyboxNodeNum = AllocTraceNode();
+	/* add the node */
+	memset(&traceBVHNodes[numTraceBVHNodes], 0, sizeof(traceBVHNode_t));
+	numTraceBVHNodes++;
 
-	/* populate the tree with triangles from the world and shadow casting entities */
-	PopulateTraceNodes();
+	/* return the count */
+	return (numTraceBVHNodes - 1);
+}
 
-	/* create the raytracing bsp */
-#if 1
-	// Tr3B: this requires ridiculous much memory
-	if(loMem == qfalse)
-	{
-		SubdivideTraceNode_r(headNodeNum, 0);
-		SubdivideTraceNode_r(skyboxNodeNum, 0);
-	}
-#endif
 
-	/* create triangles from the trace windings */
-	TriangulateTraceNode_r(headNodeNum);
-	TriangulateTraceNode_r(skyboxNodeNum);
 
-	/* emit some stats */
-	//% Sys_FPrintf( SYS_VRB, "%9d original triangles\n", numOriginalTriangles );
-	Sys_FPrintf(SYS_VRB, "%9d trace windings (%.2fMB)\n", numTraceWindings,
-				(float)(numTraceWindings * sizeof(*traceWindings)) / (1024.0f * 1024.0f));
-	Sys_FPrintf(SYS_VRB, "%9d trace triangles (%.2fMB)\n", numTraceTriangles,
-				(float)(numTraceTriangles * sizeof(*traceTriangles)) / (1024.0f * 1024.0f));
-	Sys_FPrintf(SYS_VRB, "%9d trace nodes (%.2fMB)\n", numTraceNodes,
-				(float)(numTraceNodes * sizeof(*traceNodes)) / (1024.0f * 1024.0f));
-	Sys_FPrintf(SYS_VRB, "%9d leaf nodes (%.2fMB)\n", numTraceLeafNodes,
-				(float)(numTraceLeafNodes * sizeof(*traceNodes)) / (1024.0f * 1024.0f));
-	//% Sys_FPrintf( SYS_VRB, "%9d average triangles per leaf node\n", numTraceTriangles / numTraceLeafNodes );
-	Sys_FPrintf(SYS_VRB, "%9d average windings per leaf node\n", numTraceWindings / (numTraceLeafNodes + 1));
-	Sys_FPrintf(SYS_VRB, "%9d max trace depth\n", maxTraceDepth);
+/*
+AddTraceBVHPacket()
+packs up to 4 trace triangles into a leaf packet
+*/
 
-	/* free trace windings */
-	free(traceWindings);
-	numTraceWindings = 0;
-	maxTraceWindings = 0;
-	deadWinding = -1;
+static int AddTraceBVHPacket(traceBVHPrim_t * prims, int numPrims)
+{
+	int             i, j;
+	traceBVHPacket_t *packet;
+	traceTriangle_t *tt;
+	void           *temp;
 
-	/* debug code: write out trace triangles to an alias obj file */
-#if 0
-	{
-		int             i, j;
-		FILE           *file;
-		char            filename[1024];
-		traceWinding_t *tw;
 
+	/* enough space? */
+	if(numTraceBVHPackets >= maxTraceBVHPackets)
+	{
+		/* allocate more room */
+		maxTraceBVHPackets += GROW_BVH_PACKETS;
+		temp = safe_malloc(maxTraceBVHPackets * sizeof(*traceBVHPackets));
+		if(traceBVHPackets != NULL)
+		{
+			memcpy(temp, traceBVHPackets, numTraceBVHPackets * sizeof(*traceBVHPackets));
+			free(traceBVHPackets);
+		}
+		traceBVHPackets = (traceBVHPacket_t *) temp;
+	}
 
-		/* open the file */
-		strcpy(filename, source);
-		StripExtension(filename);
-		strcat(filename, ".lin");
-		Sys_Printf("Opening light trace file %s...\n", filename);
-		file = fopen(filename, "w");
-		if(file == NULL)
-			Error("Error opening %s for writing", filename);
+	/* unused lanes have no area and never hit */
+	packet = &traceBVHPackets[numTraceBVHPackets];
+	memset(packet, 0, sizeof(*packet));
 
-		/* walk node list */
-		for(i = 0; i < numTraceWindings; i++)
+	for(i = 0; i < BVH_WIDTH; i++)
+	{
+		if(i >= numPrims)
 		{
-			tw = &traceWindings[i];
-			for(j = 0; j < tw->numVerts + 1; j++)
-				fprintf(file, "%f %f %f\n",
-						tw->v[j % tw->numVerts].xyz[0], tw->v[j % tw->numVerts].xyz[1], tw->v[j % tw->numVerts].xyz[2]);
+			packet->triangles[i] = -1;
+			continue;
 		}
 
-		/* close it */
-		fclose(file);
+		tt = &traceTriangles[prims[i].triangleNum];
+		packet->triangles[i] = prims[i].triangleNum;
+		for(j = 0; j < 3; j++)
+		{
+			packet->origin[j][i] = tt->v[0].xyz[j];
+			packet->edge1[j][i] = tt->edge1[j];
+			packet->edge2[j][i] = tt->edge2[j];
+		}
 	}
-#endif
+
+	/* return the packet number */
+	return numTraceBVHPackets++;
 }
 
 
 
-/* -------------------------------------------------------------------------------
+/*
+CompareTraceBVHPrims()
+sorts bvh primitives along bvhSortAxis
+*/
+
+static int CompareTraceBVHPrims(const void *a, const void *b)
+{
+	float           ca, cb;
+
+	ca = ((const traceBVHPrim_t *)a)->center[bvhSortAxis];
+	cb = ((const traceBVHPrim_t *)b)->center[bvhSortAxis];
+
+	if(ca < cb)
+		return -1;
+	if(ca > cb)
+		return 1;
+	return 0;
+}
 
-raytracer
 
-------------------------------------------------------------------------------- */
 
 /*
-TraceTriangle()
-based on code written by william 'spog' joseph
-based on code originally written by tomas moller and ben trumbore, journal of graphics tools, 2(1):21-28, 1997
+BoundsArea()
+returns half the surface area of a box
 */
 
-#define BARY_EPSILON			0.01f
-#define ASLF_EPSILON			0.0001f	/* so to not get double shadows */
-#define COPLANAR_EPSILON		0.25f	//% 0.000001f
-#define NEAR_SHADOW_EPSILON		1.5f	//% 1.25f
-#define SELF_SHADOW_EPSILON		0.5f
-
-qboolean TraceTriangle(traceInfo_t * ti, traceTriangle_t * tt, trace_t * trace)
+static float BoundsArea(vec3_t mins, vec3_t maxs)
 {
-	int             i;
-	float           tvec[3], pvec[3], qvec[3];
-	float           det, invDet, depth;
-	float           u, v, w, s, t;
-	int             is, it;
-	byte           *pixel;
-	float           shadow;
-	shaderInfo_t   *si;
+	vec3_t          size;
 
+	if(mins[0] > maxs[0])
+		return 0.0f;
 
-	/* don't double-trace against sky */
-	si = ti->si;
-	if(trace->compileFlags & si->compileFlags & C_SKY)
-		return qfalse;
+	VectorSubtract(maxs, mins, size);
+	return size[0] * size[1] + size[1] * size[2] + size[2] * size[0];
+}
 
-	/* receive shadows from worldspawn group only */
-	if(trace->recvShadows == 1)
-	{
-		if(ti->castShadows != 1)
-			return qfalse;
-	}
 
-	/* receive shadows from same group and worldspawn group */
+
+/*
+SplitTraceBVHPrims()
+partitions the primitives with the surface area heuristic, returns the number of primitives in front
+*/
+
+static int SplitTraceBVHPrims(traceBVHPrim_t * prims, int numPrims, int depth)
+{
+	int             i, j, axis, bin, bestAxis, bestBin, left, counts[BVH_BINS], rightCounts[BVH_BINS];
+	float           scale, cost, bestCost, rightAreas[BVH_BINS];
+	vec3_t          cmins, cmaxs, size, mins, maxs, binMins[BVH_BINS], binMaxs[BVH_BINS];
+	traceBVHPrim_t  temp;
+
+
+	/* get the bounds of the centers */
+	ClearBounds(cmins, cmaxs);
+	for(i = 0; i < numPrims; i++)
+		AddPointToBounds(prims[i].center, cmins, cmaxs);
+	VectorSubtract(cmaxs, cmins, size);
+
+	bestAxis = -1;
+	bestBin = 0;
+	bestCost = 0;
+
+	/* try the bins of all axes */
+	for(axis = 0; axis < 3 && depth < BVH_MAX_DEPTH; axis++)
+	{
+		if(size[axis] <= 0.0f)
+			continue;
+		scale = BVH_BINS / size[axis];
+
+		for(bin = 0; bin < BVH_BINS; bin++)
+		{
+			counts[bin] = 0;
+			ClearBounds(binMins[bin], binMaxs[bin]);
+		}
+
+		for(i = 0; i < numPrims; i++)
+		{
+			bin = (prims[i].center[axis] - cmins[axis]) * scale;
+			if(bin >= BVH_BINS)
+				bin = BVH_BINS - 1;
+			counts[bin]++;
+			AddPointToBounds(prims[i].mins, binMins[bin], binMaxs[bin]);
+			AddPointToBounds(prims[i].maxs, binMins[bin], binMaxs[bin]);
+		}
+
+		/* sweep from the back */
+		ClearBounds(mins, maxs);
+		for(bin = BVH_BINS - 1, j = 0; bin > 0; bin--)
+		{
+			j += counts[bin];
+			AddPointToBounds(binMins[bin], mins, maxs);
+			AddPointToBounds(binMaxs[bin], mins, maxs);
+			rightCounts[bin] = j;
+			rightAreas[bin] = BoundsArea(mins, maxs);
+		}
+
+		/* sweep from the front, splitting behind bin */
+		ClearBounds(mins, maxs);
+		for(bin = 0, j = 0; bin < BVH_BINS - 1; bin++)
+		{
+			j += counts[bin];
+			AddPointToBounds(binMins[bin], mins, maxs);
+			AddPointToBounds(binMaxs[bin], mins, maxs);
+
+			if(j == 0 || rightCounts[bin + 1] == 0)
+				continue;
+
+			cost = BoundsArea(mins, maxs) * j + rightAreas[bin + 1] * rightCounts[bin + 1];
+			if(bestAxis < 0 || cost < bestCost)
+			{
+				bestAxis = axis;
+				bestBin = bin;
+				bestCost = cost;
+			}
+		}
+	}
+
+	/* too deep or all centers in one bin, split at the median of the longest axis */
+	if(bestAxis < 0)
+	{
+		bvhSortAxis = 0;
+		if(size[1] > size[bvhSortAxis])
+			bvhSortAxis = 1;
+		if(size[2] > size[bvhSortAxis])
+			bvhSortAxis = 2;
+
+		qsort(prims, numPrims, sizeof(*prims), CompareTraceBVHPrims);
+		return numPrims / 2;
+	}
+
+	/* partition */
+	scale = BVH_BINS / size[bestAxis];
+	left = 0;
+	for(i = 0; i < numPrims; i++)
+	{
+		bin = (prims[i].center[bestAxis] - cmins[bestAxis]) * scale;
+		if(bin >= BVH_BINS)
+			bin = BVH_BINS - 1;
+
+		if(bin <= bestBin)
+		{
+			temp = prims[left];
+			prims[left] = prims[i];
+			prims[i] = temp;
+			left++;
+		}
+	}
+
+	return left;
+}
+
+
+
+/*
+BuildTraceBVH_r()
+creates a bvh node with up to 4 children from the primitives
+*/
+
+static int BuildTraceBVH_r(traceBVHPrim_t * prims, int numPrims, int depth)
+{
+	int             i, j, k, best, split, nodeNum, numRanges;
+	int             firsts[BVH_WIDTH], counts[BVH_WIDTH], children[BVH_WIDTH];
+	vec3_t          mins[BVH_WIDTH], maxs[BVH_WIDTH];
+	traceBVHNode_t *node;
+
+
+	/* split the biggest range until there are 4 */
+	firsts[0] = 0;
+	counts[0] = numPrims;
+	numRanges = 1;
+
+	while(numRanges < BVH_WIDTH)
+	{
+		best = -1;
+		for(i = 0; i < numRanges; i++)
+		{
+			if(counts[i] > BVH_WIDTH && (best < 0 || counts[i] > counts[best]))
+				best = i;
+		}
+		if(best < 0)
+			break;
+
+		split = SplitTraceBVHPrims(prims + firsts[best], counts[best], depth);
+
+		firsts[numRanges] = firsts[best] + split;
+		counts[numRanges] = counts[best] - split;
+		counts[best] = split;
+		numRanges++;
+	}
+
+	/* create children, small ranges become packets */
+	for(i = 0; i < numRanges; i++)
+	{
+		ClearBounds(mins[i], maxs[i]);
+		for(j = firsts[i]; j < firsts[i] + counts[i]; j++)
+		{
+			AddPointToBounds(prims[j].mins, mins[i], maxs[i]);
+			AddPointToBounds(prims[j].maxs, mins[i], maxs[i]);
+		}
+
+		if(counts[i] <= BVH_WIDTH)
+			children[i] = -1 - AddTraceBVHPacket(prims + firsts[i], counts[i]);
+		else
+			children[i] = BuildTraceBVH_r(prims + firsts[i], counts[i], depth + 1);
+	}
+
+	/* the children may have reallocated the node list */
+	nodeNum = AllocTraceBVHNode();
+	node = &traceBVHNodes[nodeNum];
+
+	node->numChildren = numRanges;
+	for(i = 0; i < BVH_WIDTH; i++)
+	{
+		k = i < numRanges ? i : 0;
+		node->children[i] = children[k];
+		for(j = 0; j < 3; j++)
+		{
+			node->mins[j][i] = mins[k][j];
+			node->maxs[j][i] = maxs[k][j];
+		}
+	}
+
+	return nodeNum;
+}
+
+
+
+/*
+CollectTraceBVHPrims_r()
+counts the trace triangles in the leafs below a trace node, copies them to prims if it isn't NULL
+*/
+
+static int CollectTraceBVHPrims_r(int nodeNum, traceBVHPrim_t * prims)
+{
+	int             i, j, count;
+	vec3_t          corner;
+	traceNode_t    *node;
+	traceTriangle_t *tt;
+	static const float corners[3][2] = {
+		{-BARY_EPSILON, -BARY_EPSILON},
+		{1.0f + 2.0f * BARY_EPSILON, -BARY_EPSILON},
+		{-BARY_EPSILON, 1.0f + 2.0f * BARY_EPSILON}
+	};
+
+
+	/* dummy check */
+	if(nodeNum < 0 || nodeNum >= numTraceNodes)
+		return 0;
+
+	/* get node */
+	node = &traceNodes[nodeNum];
+
+	/* is this a decision node? */
+	if(node->type >= 0)
+	{
+		count = CollectTraceBVHPrims_r(node->children[0], prims);
+		return count + CollectTraceBVHPrims_r(node->children[1], prims ? prims + count : NULL);
+	}
+
+	/* TraceLine_r never tests the triangles of solid leafs */
+	if(node->type == TRACE_LEAF_SOLID)
+		return 0;
+
+	/* copy the triangles */
+	if(prims != NULL)
+	{
+		for(i = 0; i < node->numItems; i++)
+		{
+			tt = &traceTriangles[node->items[i]];
+
+			/* TraceTriangle accepts hits up to BARY_EPSILON outside of the edges */
+			ClearBounds(prims[i].mins, prims[i].maxs);
+			for(j = 0; j < 3; j++)
+			{
+				VectorMA(tt->v[0].xyz, corners[j][0], tt->edge1, corner);
+				VectorMA(corner, corners[j][1], tt->edge2, corner);
+				AddPointToBounds(corner, prims[i].mins, prims[i].maxs);
+			}
+			VectorAdd(prims[i].mins, prims[i].maxs, prims[i].center);
+			VectorScale(prims[i].center, 0.5f, prims[i].center);
+			prims[i].triangleNum = node->items[i];
+		}
+	}
+
+	return node->numItems;
+}
+
+
+
+/*
+SetupTraceBVH()
+builds the bvh from the triangles of the trace node tree, the skybox node is not included
+*/
+
+static void SetupTraceBVH(void)
+{
+	int             numPrims;
+	traceBVHPrim_t *prims;
+
+
+	/* note it */
+	Sys_FPrintf(SYS_VRB, "--- SetupTraceBVH ---\n");
+
+	numPrims = CollectTraceBVHPrims_r(headNodeNum, NULL);
+	if(numPrims == 0)
+		return;
+
+	prims = safe_malloc(numPrims * sizeof(*prims));
+	CollectTraceBVHPrims_r(headNodeNum, prims);
+
+	headBVHNodeNum = BuildTraceBVH_r(prims, numPrims, 0);
+
+	free(prims);
+
+	/* emit some stats */
+	Sys_FPrintf(SYS_VRB, "%9d bvh nodes (%.2fMB)\n", numTraceBVHNodes,
+				(float)(numTraceBVHNodes * sizeof(*traceBVHNodes)) / (1024.0f * 1024.0f));
+	Sys_FPrintf(SYS_VRB, "%9d bvh packets (%.2fMB)\n", numTraceBVHPackets,
+				(float)(numTraceBVHPackets * sizeof(*traceBVHPackets)) / (1024.0f * 1024.0f));
+}
+
+
+
+/* -------------------------------------------------------------------------------
+
+trace initialization
+
+------------------------------------------------------------------------------- */
+
+/*
+SetupTraceNodes() - ydnar
+creates a balanced bsp with axis-aligned splits for efficient raytracing
+*/
+
+void SetupTraceNodes(void)
+{
+	/* note it */
+	Sys_FPrintf(SYS_VRB, "--- SetupTraceNodes ---\n");
+
+	/* find nodraw bit */
+	noDrawContentFlags = noDrawSurfaceFlags = noDrawCompileFlags = 0;
+	ApplySurfaceParm("nodraw", &noDrawContentFlags, &noDrawSurfaceFlags, &noDrawCompileFlags);
+
+	/* create the baseline raytracing tree from the bsp tree */
+	headNodeNum = SetupTraceNodes_r(0);
+
+	/* create outside node for skybox surfaces */
+	skyboxNodeNum = AllocTraceNode();
+
+	/* populate the tree with triangles from the world and shadow casting entities */
+	PopulateTraceNodes();
+
+	/* create the raytracing bsp */
+#if 1
+	// Tr3B: this requires ridiculous much memory
+	if(loMem == qfalse)
+	{
+		SubdivideTraceNode_r(headNodeNum, 0);
+		SubdivideTraceNode_r(skyboxNodeNum, 0);
+	}
+#endif
+
+	/* create triangles from the trace windings */
+	TriangulateTraceNode_r(headNodeNum);
+	TriangulateTraceNode_r(skyboxNodeNum);
+
+	/* sort the triangles into the bvh */
+	if(!noTraceBVH)
+		SetupTraceBVH();
+
+	/* emit some stats */
+	//% Sys_FPrintf( SYS_VRB, "%9d original triangles\n", numOriginalTriangles );
+	Sys_FPrintf(SYS_VRB, "%9d trace windings (%.2fMB)\n", numTraceWindings,
+				(float)(numTraceWindings * sizeof(*traceWindings)) / (1024.0f * 1024.0f));
+	Sys_FPrintf(SYS_VRB, "%9d trace triangles (%.2fMB)\n", numTraceTriangles,
+				(float)(numTraceTriangles * sizeof(*traceTriangles)) / (1024.0f * 1024.0f));
+	Sys_FPrintf(SYS_VRB, "%9d trace nodes (%.2fMB)\n", numTraceNodes,
+				(float)(numTraceNodes * sizeof(*traceNodes)) / (1024.0f * 1024.0f));
+	Sys_FPrintf(SYS_VRB, "%9d leaf nodes (%.2fMB)\n", numTraceLeafNodes,
+				(float)(numTraceLeafNodes * sizeof(*traceNodes)) / (1024.0f * 1024.0f));
+	//% Sys_FPrintf( SYS_VRB, "%9d average triangles per leaf node\n", numTraceTriangles / numTraceLeafNodes );
+	Sys_FPrintf(SYS_VRB, "%9d average windings per leaf node\n", numTraceWindings / (numTraceLeafNodes + 1));
+	Sys_FPrintf(SYS_VRB, "%9d max trace depth\n", maxTraceDepth);
+
+	/* free trace windings */
+	free(traceWindings);
+	numTraceWindings = 0;
+	maxTraceWindings = 0;
+	deadWinding = -1;
+
+	/* debug code: write out trace triangles to an alias obj file */
+#if 0
+	{
+		int             i, j;
+		FILE           *file;
+		char            filename[1024];
+		traceWinding_t *tw;
+
+
+		/* open the file */
+		strcpy(filename, source);
+		StripExtension(filename);
+		strcat(filename, ".lin");
+		Sys_Printf("Opening light trace file %s...\n", filename);
+		file = fopen(filename, "w");
+		if(file == NULL)
+			Error("Error opening %s for writing", filename);
+
+		/* walk node list */
+		for(i = 0; i < numTraceWindings; i++)
+		{
+			tw = &traceWindings[i];
+			for(j = 0; j < tw->numVerts + 1; j++)
+				fprintf(file, "%f %f %f\n",
+						tw->v[j % tw->numVerts].xyz[0], tw->v[j % tw->numVerts].xyz[1], tw->v[j % tw->numVerts].xyz[2]);
+		}
+
+		/* close it */
+		fclose(file);
+	}
+#endif
+}
+
+
+
+/* -------------------------------------------------------------------------------
+
+raytracer
+
+------------------------------------------------------------------------------- */
+
+/*
+TraceTriangleReceives()
+returns qfalse if the trace doesn't receive shadows from the triangle
+*/
+
+static qboolean TraceTriangleReceives(traceInfo_t * ti, trace_t * trace)
+{
+	/* receive shadows from worldspawn group only */
+	if(trace->recvShadows == 1)
+	{
+		if(ti->castShadows != 1)
+			return qfalse;
+	}
+
+	/* receive shadows from same group and worldspawn group */
 	else if(trace->recvShadows > 1)
 	{
-		if(ti->castShadows != 1 && abs(ti->castShadows) != abs(trace->recvShadows))
-			return qfalse;
-		//% Sys_Printf( "%d:%d ", tt->castShadows, trace->recvShadows );
+		if(ti->castShadows != 1 && abs(ti->castShadows) != abs(trace->recvShadows))
+			return qfalse;
+		//% Sys_Printf( "%d:%d ", tt->castShadows, trace->recvShadows );
+	}
+
+	/* receive shadows from the same group only (< 0) */
+	else
+	{
+		if(abs(ti->castShadows) != abs(trace->recvShadows))
+			return qfalse;
+	}
+
+	/* skip patches when doing the grid (FIXME this is an ugly hack) */
+	if(inGrid)
+	{
+		if(ti->skipGrid)
+			return qfalse;
+	}
+
+	return qtrue;
+}
+
+
+
+/*
+TraceTriangleSelfShadows()
+returns qtrue if a hit at depth is the surface the trace starts on
+*/
+
+static qboolean TraceTriangleSelfShadows(traceInfo_t * ti, trace_t * trace, float depth)
+{
+	int             i;
+
+
+	/* if hitpoint is really close to trace origin (sample point), then check for self-shadowing */
+	if(depth <= SELF_SHADOW_EPSILON)
+	{
+		/* don't self-shadow */
+		for(i = 0; i < trace->numSurfaces; i++)
+		{
+			if(ti->surfaceNum == trace->surfaces[i])
+				return qtrue;
+		}
 	}
 
-	/* receive shadows from the same group only (< 0) */
-	else
+	return qfalse;
+}
+
+
+
+/*
+TraceTriangleFilter()
+filters the trace color through an alphashadow or lightfilter triangle, returns qtrue if nothing gets through
+*/
+
+static qboolean TraceTriangleFilter(traceTriangle_t * tt, shaderInfo_t * si, float u, float v, float depth, trace_t * trace)
+{
+	float           w, s, t;
+	int             is, it;
+	byte           *pixel;
+	float           shadow;
+
+
+	/* try to avoid double shadows near triangle seams */
+	if(u < -ASLF_EPSILON || u > (1.0f + ASLF_EPSILON) || v < -ASLF_EPSILON || (u + v) > (1.0f + ASLF_EPSILON))
+		return qfalse;
+
+	/* calculate w parameter */
+	w = 1.0f - (u + v);
+
+	/* calculate st from uvw (barycentric) coordinates */
+	s = w * tt->v[0].st[0] + u * tt->v[1].st[0] + v * tt->v[2].st[0];
+	t = w * tt->v[0].st[1] + u * tt->v[1].st[1] + v * tt->v[2].st[1];
+	s = s - floor(s);
+	t = t - floor(t);
+	is = s * si->lightImage->width;
+	it = t * si->lightImage->height;
+
+	/* get pixel */
+	pixel = si->lightImage->pixels + 4 * (it * si->lightImage->width + is);
+
+	/* ydnar: color filter */
+	if(si->compileFlags & C_LIGHTFILTER)
 	{
-		if(abs(ti->castShadows) != abs(trace->recvShadows))
-			return qfalse;
+		/* filter by texture color */
+		trace->color[0] *= ((1.0f / 255.0f) * pixel[0]);
+		trace->color[1] *= ((1.0f / 255.0f) * pixel[1]);
+		trace->color[2] *= ((1.0f / 255.0f) * pixel[2]);
 	}
 
-	/* skip patches when doing the grid (FIXME this is an ugly hack) */
-	if(inGrid)
+	/* ydnar: alpha filter */
+	if(si->compileFlags & C_ALPHASHADOW)
 	{
-		if(ti->skipGrid)
-			return qfalse;
+		/* filter by inverse texture alpha */
+		shadow = (1.0f / 255.0f) * (255 - pixel[3]);
+		trace->color[0] *= shadow;
+		trace->color[1] *= shadow;
+		trace->color[2] *= shadow;
+	}
+
+	/* check filter for opaque */
+	if(trace->color[0] <= 0.001f && trace->color[1] <= 0.001f && trace->color[2] <= 0.001f)
+	{
+		VectorMA(trace->origin, depth, trace->direction, trace->hit);
+		trace->opaque = qtrue;
+		return qtrue;
 	}
 
+	/* continue tracing */
+	return qfalse;
+}
+
+
+
+/*
+TraceTriangleIsOpaque()
+returns qtrue if the shader of the triangle blocks all light
+*/
+
+static qboolean TraceTriangleIsOpaque(shaderInfo_t * si)
+{
+	return !(si->compileFlags & (C_ALPHASHADOW | C_LIGHTFILTER)) || si->lightImage == NULL || si->lightImage->pixels == NULL;
+}
+
+
+
+/*
+TraceTriangle()
+based on code written by william 'spog' joseph
+based on code originally written by tomas moller and ben trumbore, journal of graphics tools, 2(1):21-28, 1997
+*/
+
+qboolean TraceTriangle(traceInfo_t * ti, traceTriangle_t * tt, trace_t * trace)
+{
+	float           tvec[3], pvec[3], qvec[3];
+	float           det, invDet, depth;
+	float           u, v;
+	shaderInfo_t   *si;
+
+
+	/* don't double-trace against sky */
+	si = ti->si;
+	if(trace->compileFlags & si->compileFlags & C_SKY)
+		return qfalse;
+
+	/* receive shadows from this triangle? */
+	if(!TraceTriangleReceives(ti, trace))
+		return qfalse;
+
 	/* begin calculating determinant - also used to calculate u parameter */
 	CrossProduct(trace->direction, tt->edge2, pvec);
 
@@ -1492,127 +2284,489 @@ qboolean TraceTriangle(traceInfo_t * ti, traceTriangle_t * tt, trace_t * trace)
 	/* prepare to test v parameter */
 	CrossProduct(tvec, tt->edge1, qvec);
 
-	/* calculate v parameter and test bounds */
-	v = DotProduct(trace->direction, qvec) * invDet;
-	if(v < -BARY_EPSILON || (u + v) > (1.0f + BARY_EPSILON))
-		return qfalse;
+	/* calculate v parameter and test bounds */
+	v = DotProduct(trace->direction, qvec) * invDet;
+	if(v < -BARY_EPSILON || (u + v) > (1.0f + BARY_EPSILON))
+		return qfalse;
+
+	/* calculate t (depth) */
+	depth = DotProduct(tt->edge2, qvec) * invDet;
+	if(depth <= trace->inhibitRadius || depth >= trace->distance)
+		return qfalse;
+
+	/* don't self-shadow */
+	if(TraceTriangleSelfShadows(ti, trace, depth))
+		return qfalse;
+
+	/* stack compile flags */
+	trace->compileFlags |= si->compileFlags;
+
+	/* don't trace against sky */
+	if(si->compileFlags & C_SKY)
+		return qfalse;
+
+	/* most surfaces are completely opaque */
+	if(TraceTriangleIsOpaque(si))
+	{
+		VectorMA(trace->origin, depth, trace->direction, trace->hit);
+		VectorClear(trace->color);
+		trace->opaque = qtrue;
+		return qtrue;
+	}
+
+	/* filter the light */
+	return TraceTriangleFilter(tt, si, u, v, depth, trace);
+}
+
+
+
+/*
+TraceWinding() - ydnar
+temporary hack
+*/
+
+qboolean TraceWinding(traceWinding_t * tw, trace_t * trace)
+{
+	int             i;
+	traceTriangle_t tt;
+
+
+	/* initial setup */
+	tt.infoNum = tw->infoNum;
+	tt.v[0] = tw->v[0];
+
+	/* walk vertex list */
+	for(i = 1; i + 1 < tw->numVerts; i++)
+	{
+		/* set verts */
+		tt.v[1] = tw->v[i];
+		tt.v[2] = tw->v[i + 1];
+
+		/* find vectors for two edges sharing the first vert */
+		VectorSubtract(tt.v[1].xyz, tt.v[0].xyz, tt.edge1);
+		VectorSubtract(tt.v[2].xyz, tt.v[0].xyz, tt.edge2);
+
+		/* trace it */
+		if(TraceTriangle(&traceInfos[tt.infoNum], &tt, trace))
+			return qtrue;
+	}
+
+	/* done */
+	return qfalse;
+}
+
+
+
+
+/*
+TraceBVHBounds()
+intersects the ray with the bounds of the children of a bvh node, returns a bit for each child hit
+*/
+
+static int TraceBVHBounds(traceBVHNode_t * node, const float *origin, const float *invDirection, float maxDepth, float *nears)
+{
+#if TRACE_SSE
+	int             i;
+	__m128          t0, t1, tnear, tfar, o, id;
+
+
+	tnear = _mm_setzero_ps();
+	tfar = _mm_set1_ps(maxDepth);
+
+	for(i = 0; i < 3; i++)
+	{
+		o = _mm_set1_ps(origin[i]);
+		id = _mm_set1_ps(invDirection[i]);
+
+		t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->mins[i]), o), id);
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->maxs[i]), o), id);
+
+		tnear = _mm_max_ps(tnear, _mm_min_ps(t0, t1));
+		tfar = _mm_min_ps(tfar, _mm_max_ps(t0, t1));
+	}
+
+	_mm_storeu_ps(nears, tnear);
+
+	return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) & ((1 << node->numChildren) - 1);
+#else
+	int             i, j, mask;
+	float           t, t0, t1, tnear, tfar;
+
+
+	mask = 0;
+	for(j = 0; j < node->numChildren; j++)
+	{
+		tnear = 0.0f;
+		tfar = maxDepth;
+
+		for(i = 0; i < 3; i++)
+		{
+			t0 = (node->mins[i][j] - origin[i]) * invDirection[i];
+			t1 = (node->maxs[i][j] - origin[i]) * invDirection[i];
+
+			if(t0 > t1)
+			{
+				t = t0;
+				t0 = t1;
+				t1 = t;
+			}
+
+			if(t0 > tnear)
+				tnear = t0;
+			if(t1 < tfar)
+				tfar = t1;
+		}
+
+		nears[j] = tnear;
+		if(tnear <= tfar)
+			mask |= 1 << j;
+	}
+
+	return mask;
+#endif
+}
+
+
+
+/*
+TraceBVHPacket()
+intersects the ray with the triangles of a bvh packet, same math as TraceTriangle
+returns a bit for each triangle hit in front of maxDepth
+*/
+
+static int TraceBVHPacket(traceBVHPacket_t * packet, trace_t * trace, float maxDepth, float *depths, float *us, float *vs)
+{
+#if TRACE_SSE
+	__m128          dx, dy, dz, tx, ty, tz, px, py, pz, qx, qy, qz;
+	__m128          det, invDet, u, v, depth, mask;
+
+
+	dx = _mm_set1_ps(trace->direction[0]);
+	dy = _mm_set1_ps(trace->direction[1]);
+	dz = _mm_set1_ps(trace->direction[2]);
+
+	/* begin calculating determinant - also used to calculate u parameter */
+	px = _mm_sub_ps(_mm_mul_ps(dy, _mm_loadu_ps(packet->edge2[2])), _mm_mul_ps(dz, _mm_loadu_ps(packet->edge2[1])));
+	py = _mm_sub_ps(_mm_mul_ps(dz, _mm_loadu_ps(packet->edge2[0])), _mm_mul_ps(dx, _mm_loadu_ps(packet->edge2[2])));
+	pz = _mm_sub_ps(_mm_mul_ps(dx, _mm_loadu_ps(packet->edge2[1])), _mm_mul_ps(dy, _mm_loadu_ps(packet->edge2[0])));
+
+	/* if determinant is near zero, trace lies in plane of triangle */
+	det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(packet->edge1[0]), px), _mm_mul_ps(_mm_loadu_ps(packet->edge1[1]), py)),
+					 _mm_mul_ps(_mm_loadu_ps(packet->edge1[2]), pz));
+	mask = _mm_cmpge_ps(_mm_max_ps(det, _mm_sub_ps(_mm_setzero_ps(), det)), _mm_set1_ps(COPLANAR_EPSILON));
+	if(!_mm_movemask_ps(mask))
+		return 0;
+	invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	/* calculate distance from first vertex to ray origin */
+	tx = _mm_sub_ps(_mm_set1_ps(trace->origin[0]), _mm_loadu_ps(packet->origin[0]));
+	ty = _mm_sub_ps(_mm_set1_ps(trace->origin[1]), _mm_loadu_ps(packet->origin[1]));
+	tz = _mm_sub_ps(_mm_set1_ps(trace->origin[2]), _mm_loadu_ps(packet->origin[2]));
+
+	/* calculate u parameter and test bounds */
+	u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u, _mm_set1_ps(-BARY_EPSILON)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(u, _mm_set1_ps(1.0f + BARY_EPSILON)));
+
+	/* prepare to test v parameter */
+	qx = _mm_sub_ps(_mm_mul_ps(ty, _mm_loadu_ps(packet->edge1[2])), _mm_mul_ps(tz, _mm_loadu_ps(packet->edge1[1])));
+	qy = _mm_sub_ps(_mm_mul_ps(tz, _mm_loadu_ps(packet->edge1[0])), _mm_mul_ps(tx, _mm_loadu_ps(packet->edge1[2])));
+	qz = _mm_sub_ps(_mm_mul_ps(tx, _mm_loadu_ps(packet->edge1[1])), _mm_mul_ps(ty, _mm_loadu_ps(packet->edge1[0])));
+
+	/* calculate v parameter and test bounds */
+	v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, _mm_set1_ps(-BARY_EPSILON)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f + BARY_EPSILON)));
+
+	/* calculate t (depth) */
+	depth = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(packet->edge2[0]), qx), _mm_mul_ps(_mm_loadu_ps(packet->edge2[1]), qy)),
+								  _mm_mul_ps(_mm_loadu_ps(packet->edge2[2]), qz)), invDet);
+	mask = _mm_and_ps(mask, _mm_cmpgt_ps(depth, _mm_set1_ps(trace->inhibitRadius)));
+	mask = _mm_and_ps(mask, _mm_cmplt_ps(depth, _mm_set1_ps(maxDepth)));
+
+	_mm_storeu_ps(depths, depth);
+	_mm_storeu_ps(us, u);
+	_mm_storeu_ps(vs, v);
+
+	return _mm_movemask_ps(mask);
+#else
+	int             i, j, mask;
+	float           tvec[3], pvec[3], qvec[3], edge1[3], edge2[3];
+	float           det, invDet, u, v, depth;
+
+
+	mask = 0;
+	for(j = 0; j < BVH_WIDTH; j++)
+	{
+		for(i = 0; i < 3; i++)
+		{
+			edge1[i] = packet->edge1[i][j];
+			edge2[i] = packet->edge2[i][j];
+			tvec[i] = trace->origin[i] - packet->origin[i][j];
+		}
+
+		CrossProduct(trace->direction, edge2, pvec);
+		det = DotProduct(edge1, pvec);
+		if(fabs(det) < COPLANAR_EPSILON)
+			continue;
+		invDet = 1.0f / det;
+
+		u = DotProduct(tvec, pvec) * invDet;
+		if(u < -BARY_EPSILON || u > (1.0f + BARY_EPSILON))
+			continue;
+
+		CrossProduct(tvec, edge1, qvec);
+		v = DotProduct(trace->direction, qvec) * invDet;
+		if(v < -BARY_EPSILON || (u + v) > (1.0f + BARY_EPSILON))
+			continue;
+
+		depth = DotProduct(edge2, qvec) * invDet;
+		if(depth <= trace->inhibitRadius || depth >= maxDepth)
+			continue;
+
+		depths[j] = depth;
+		us[j] = u;
+		vs[j] = v;
+		mask |= 1 << j;
+	}
+
+	return mask;
+#endif
+}
+
+
+
+/*
+TraceLineBVH()
+finds the nearest opaque triangle in front of maxDepth, then stacks the sky and filters
+of all triangles in front of it in the order of their depth.
+returns qfalse if there are too many of them, the caller has to use the trace node tree then
+*/
+
+static qboolean TraceLineBVH(trace_t * trace, float maxDepth)
+{
+	int             i, j, k, mask, stackSize, numHits, opaqueNum, order[BVH_WIDTH];
+	int             stack[BVH_STACK];
+	float           stackNears[BVH_STACK], nears[BVH_WIDTH], depths[BVH_WIDTH], us[BVH_WIDTH], vs[BVH_WIDTH];
+	float           invDirection[3], opaqueDepth;
+	traceBVHNode_t *node;
+	traceBVHPacket_t *packet;
+	traceTriangle_t *tt;
+	traceInfo_t    *ti;
+	traceHit_t      hits[MAX_TRACE_HITS], hit;
+
+
+	/* keep the slabs finite */
+	for(i = 0; i < 3; i++)
+	{
+		if(fabs(trace->direction[i]) < 1e-20f)
+			invDirection[i] = trace->direction[i] < 0.0f ? -1e20f : 1e20f;
+		else
+			invDirection[i] = 1.0f / trace->direction[i];
+	}
 
-	/* calculate t (depth) */
-	depth = DotProduct(tt->edge2, qvec) * invDet;
-	if(depth <= trace->inhibitRadius || depth >= trace->distance)
-		return qfalse;
+	numHits = 0;
+	opaqueNum = -1;
+	opaqueDepth = maxDepth;
 
-	/* if hitpoint is really close to trace origin (sample point), then check for self-shadowing */
-	if(depth <= SELF_SHADOW_EPSILON)
+	stack[0] = headBVHNodeNum;
+	stackNears[0] = 0.0f;
+	stackSize = 1;
+
+	while(stackSize > 0)
 	{
-		/* don't self-shadow */
-		for(i = 0; i < trace->numSurfaces; i++)
+		stackSize--;
+		if(stackNears[stackSize] > maxDepth)
+			continue;
+
+		/* bvh node, push the children that are hit, the nearest last */
+		if(stack[stackSize] >= 0)
 		{
-			if(ti->surfaceNum == trace->surfaces[i])
-				return qfalse;
+			node = &traceBVHNodes[stack[stackSize]];
+			mask = TraceBVHBounds(node, trace->origin, invDirection, maxDepth, nears);
+
+			for(i = 0, k = 0; i < node->numChildren; i++)
+			{
+				if(!(mask & (1 << i)))
+					continue;
+
+				for(j = k++; j > 0 && nears[order[j - 1]] < nears[i]; j--)
+					order[j] = order[j - 1];
+				order[j] = i;
+			}
+
+			for(i = 0; i < k; i++)
+			{
+				stack[stackSize] = node->children[order[i]];
+				stackNears[stackSize] = nears[order[i]];
+				stackSize++;
+			}
+			continue;
 		}
-	}
 
-	/* stack compile flags */
-	trace->compileFlags |= si->compileFlags;
+		/* leaf packet */
+		packet = &traceBVHPackets[-1 - stack[stackSize]];
+		mask = TraceBVHPacket(packet, trace, maxDepth, depths, us, vs);
 
-	/* don't trace against sky */
-	if(si->compileFlags & C_SKY)
-		return qfalse;
+		for(i = 0; mask; i++, mask >>= 1)
+		{
+			if(!(mask & 1) || depths[i] >= maxDepth)
+				continue;
 
-	/* most surfaces are completely opaque */
-	if(!(si->compileFlags & (C_ALPHASHADOW | C_LIGHTFILTER)) || si->lightImage == NULL || si->lightImage->pixels == NULL)
-	{
-		VectorMA(trace->origin, depth, trace->direction, trace->hit);
-		VectorClear(trace->color);
-		trace->opaque = qtrue;
-		return qtrue;
-	}
+			tt = &traceTriangles[packet->triangles[i]];
+			ti = &traceInfos[tt->infoNum];
 
-	/* try to avoid double shadows near triangle seams */
-	if(u < -ASLF_EPSILON || u > (1.0f + ASLF_EPSILON) || v < -ASLF_EPSILON || (u + v) > (1.0f + ASLF_EPSILON))
-		return qfalse;
+			if(!TraceTriangleReceives(ti, trace) || TraceTriangleSelfShadows(ti, trace, depths[i]))
+				continue;
 
-	/* calculate w parameter */
-	w = 1.0f - (u + v);
+			/* opaque triangles end the ray */
+			if(!(ti->si->compileFlags & C_SKY) && TraceTriangleIsOpaque(ti->si))
+			{
+				opaqueNum = packet->triangles[i];
+				opaqueDepth = maxDepth = depths[i];
+				continue;
+			}
 
-	/* calculate st from uvw (barycentric) coordinates */
-	s = w * tt->v[0].st[0] + u * tt->v[1].st[0] + v * tt->v[2].st[0];
-	t = w * tt->v[0].st[1] + u * tt->v[1].st[1] + v * tt->v[2].st[1];
-	s = s - floor(s);
-	t = t - floor(t);
-	is = s * si->lightImage->width;
-	it = t * si->lightImage->height;
+			/* remember the others until the nearest opaque triangle is known */
+			if(numHits == MAX_TRACE_HITS)
+				return qfalse;
 
-	/* get pixel */
-	pixel = si->lightImage->pixels + 4 * (it * si->lightImage->width + is);
+			hits[numHits].triangleNum = packet->triangles[i];
+			hits[numHits].depth = depths[i];
+			hits[numHits].u = us[i];
+			hits[numHits].v = vs[i];
+			numHits++;
+		}
+	}
 
-	/* ydnar: color filter */
-	if(si->compileFlags & C_LIGHTFILTER)
+	/* sort the hits front to back */
+	for(i = 1; i < numHits; i++)
 	{
-		/* filter by texture color */
-		trace->color[0] *= ((1.0f / 255.0f) * pixel[0]);
-		trace->color[1] *= ((1.0f / 255.0f) * pixel[1]);
-		trace->color[2] *= ((1.0f / 255.0f) * pixel[2]);
+		hit = hits[i];
+		for(j = i; j > 0 && hits[j - 1].depth > hit.depth; j--)
+			hits[j] = hits[j - 1];
+		hits[j] = hit;
 	}
 
-	/* ydnar: alpha filter */
-	if(si->compileFlags & C_ALPHASHADOW)
+	/* stack compile flags and filters like TraceTriangle */
+	for(i = 0; i < numHits && hits[i].depth < opaqueDepth; i++)
 	{
-		/* filter by inverse texture alpha */
-		shadow = (1.0f / 255.0f) * (255 - pixel[3]);
-		trace->color[0] *= shadow;
-		trace->color[1] *= shadow;
-		trace->color[2] *= shadow;
+		tt = &traceTriangles[hits[i].triangleNum];
+		ti = &traceInfos[tt->infoNum];
+
+		trace->compileFlags |= ti->si->compileFlags;
+
+		if(ti->si->compileFlags & C_SKY)
+			continue;
+
+		if(TraceTriangleFilter(tt, ti->si, hits[i].u, hits[i].v, hits[i].depth, trace))
+			return qtrue;
 	}
 
-	/* check filter for opaque */
-	if(trace->color[0] <= 0.001f && trace->color[1] <= 0.001f && trace->color[2] <= 0.001f)
+	if(opaqueNum >= 0)
 	{
-		VectorMA(trace->origin, depth, trace->direction, trace->hit);
+		trace->compileFlags |= traceInfos[traceTriangles[opaqueNum].infoNum].si->compileFlags;
+		VectorMA(trace->origin, opaqueDepth, trace->direction, trace->hit);
+		VectorClear(trace->color);
 		trace->opaque = qtrue;
-		return qtrue;
 	}
 
-	/* continue tracing */
-	return qfalse;
+	return qtrue;
 }
 
 
 
 /*
-TraceWinding() - ydnar
-temporary hack
+TraceSolid_r()
+returns qtrue if the ray enters a solid leaf of the bsp, the bvh does the rest
 */
 
-qboolean TraceWinding(traceWinding_t * tw, trace_t * trace)
+static qboolean TraceSolid_r(int nodeNum, vec3_t origin, vec3_t end, trace_t * trace)
 {
-	int             i;
-	traceTriangle_t tt;
+	traceNode_t    *node;
+	int             side;
+	float           front, back, frac;
+	vec3_t          mid;
 
 
-	/* initial setup */
-	tt.infoNum = tw->infoNum;
-	tt.v[0] = tw->v[0];
+	/* bogus node number means solid */
+	if(nodeNum < 0)
+	{
+		VectorCopy(origin, trace->hit);
+		trace->passSolid = qtrue;
+		return qtrue;
+	}
 
-	/* walk vertex list */
-	for(i = 1; i + 1 < tw->numVerts; i++)
+	/* nodes created by SubdivideTraceNode_r are never solid */
+	if(nodeNum > skyboxNodeNum)
+		return qfalse;
+
+	/* get node */
+	node = &traceNodes[nodeNum];
+
+	/* solid? */
+	if(node->type == TRACE_LEAF_SOLID)
 	{
-		/* set verts */
-		tt.v[1] = tw->v[i];
-		tt.v[2] = tw->v[i + 1];
+		VectorCopy(origin, trace->hit);
+		trace->passSolid = qtrue;
+		return qtrue;
+	}
 
-		/* find vectors for two edges sharing the first vert */
-		VectorSubtract(tt.v[1].xyz, tt.v[0].xyz, tt.edge1);
-		VectorSubtract(tt.v[2].xyz, tt.v[0].xyz, tt.edge2);
+	/* leafnode? */
+	if(node->type < 0)
+		return qfalse;
 
-		/* trace it */
-		if(TraceTriangle(&traceInfos[tt.infoNum], &tt, trace))
-			return qtrue;
+	/* same as TraceLine_r from here */
+	if(trace->testAll && node->numItems == 0)
+		return qfalse;
+
+	/* classify beginning and end points */
+	switch (node->type)
+	{
+		case PLANE_X:
+			front = origin[0] - node->plane[3];
+			back = end[0] - node->plane[3];
+			break;
+
+		case PLANE_Y:
+			front = origin[1] - node->plane[3];
+			back = end[1] - node->plane[3];
+			break;
+
+		case PLANE_Z:
+			front = origin[2] - node->plane[3];
+			back = end[2] - node->plane[3];
+			break;
+
+		default:
+			front = DotProduct(origin, node->plane) - node->plane[3];
+			back = DotProduct(end, node->plane) - node->plane[3];
+			break;
 	}
 
-	/* done */
-	return qfalse;
+	/* entirely in front side? */
+	if(front >= -TRACE_ON_EPSILON && back >= -TRACE_ON_EPSILON)
+		return TraceSolid_r(node->children[0], origin, end, trace);
+
+	/* entirely on back side? */
+	if(front < TRACE_ON_EPSILON && back < TRACE_ON_EPSILON)
+		return TraceSolid_r(node->children[1], origin, end, trace);
+
+	/* select side */
+	side = front < 0;
+
+	/* calculate intercept point */
+	frac = front / (front - back);
+	mid[0] = origin[0] + (end[0] - origin[0]) * frac;
+	mid[1] = origin[1] + (end[1] - origin[1]) * frac;
+	mid[2] = origin[2] + (end[2] - origin[2]) * frac;
+
+	/* trace first side */
+	if(TraceSolid_r(node->children[side], origin, mid, trace))
+		return qtrue;
+
+	/* trace other side */
+	return TraceSolid_r(node->children[!side], mid, end, trace);
 }
 
 
@@ -1722,11 +2876,11 @@ static qboolean TraceLine_r(int nodeNum, vec3_t origin, vec3_t end, trace_t * tr
 
 
 /*
-TraceLine() - ydnar
-rewrote this function a bit :)
+TraceTestNodes()
+traces through the skybox for sky hits of testall traces and then tests the triangles of the collected nodes
 */
 
-void TraceLine(trace_t * trace)
+static void TraceTestNodes(trace_t * trace)
 {
 	int             i, j;
 	traceNode_t    *node;
@@ -1734,28 +2888,6 @@ void TraceLine(trace_t * trace)
 	traceInfo_t    *ti;
 
 
-	/* setup output (note: this code assumes the input data is completely filled out) */
-	trace->passSolid = qfalse;
-	trace->opaque = qfalse;
-	trace->compileFlags = 0;
-	trace->numTestNodes = 0;
-
-	/* early outs */
-	if(!trace->recvShadows || !trace->testOcclusion || trace->distance <= 0.00001f)
-		return;
-
-	/* trace through nodes */
-	TraceLine_r(headNodeNum, trace->origin, trace->end, trace);
-	if(trace->passSolid && !trace->testAll)
-	{
-		trace->opaque = qtrue;
-		return;
-	}
-
-	/* skip surfaces? */
-	if(noSurfaces)
-		return;
-
 	/* testall means trace through sky */
 	if(trace->testAll && trace->numTestNodes < MAX_TRACE_TEST_NODES &&
 	   trace->compileFlags & C_SKY && (trace->numSurfaces == 0 || surfaceInfos[trace->surfaces[0]].childSurfaceNum < 0))
@@ -1785,6 +2917,81 @@ void TraceLine(trace_t * trace)
 
 
 
+/*
+TraceLine() - ydnar
+rewrote this function a bit :)
+*/
+
+void TraceLine(trace_t * trace)
+{
+	float           maxDepth;
+	vec3_t          displacement;
+
+
+	/* setup output (note: this code assumes the input data is completely filled out) */
+	trace->passSolid = qfalse;
+	trace->opaque = qfalse;
+	trace->compileFlags = 0;
+	trace->numTestNodes = 0;
+
+	/* early outs */
+	if(!trace->recvShadows || !trace->testOcclusion || trace->distance <= 0.00001f)
+		return;
+
+	/* trace through the bvh */
+	if(headBVHNodeNum >= 0)
+	{
+		/* the bsp still decides about solid */
+		TraceSolid_r(headNodeNum, trace->origin, trace->end, trace);
+		if(trace->passSolid && !trace->testAll)
+		{
+			trace->opaque = qtrue;
+			return;
+		}
+
+		/* skip surfaces? */
+		if(noSurfaces)
+			return;
+
+		/* TraceLine_r stops at the first solid leaf, so nothing behind it is tested */
+		maxDepth = trace->distance;
+		if(trace->passSolid)
+		{
+			VectorSubtract(trace->hit, trace->origin, displacement);
+			if(VectorLength(displacement) + TRACE_SOLID_EPSILON < maxDepth)
+				maxDepth = VectorLength(displacement) + TRACE_SOLID_EPSILON;
+		}
+
+		if(TraceLineBVH(trace, maxDepth))
+		{
+			/* the skybox isn't in the bvh */
+			if(!trace->opaque)
+				TraceTestNodes(trace);
+			return;
+		}
+
+		/* too many sky or translucent triangles, use the trace nodes */
+		trace->passSolid = qfalse;
+	}
+
+	/* trace through nodes */
+	TraceLine_r(headNodeNum, trace->origin, trace->end, trace);
+	if(trace->passSolid && !trace->testAll)
+	{
+		trace->opaque = qtrue;
+		return;
+	}
+
+	/* skip surfaces? */
+	if(noSurfaces)
+		return;
+
+	/* test the triangles */
+	TraceTestNodes(trace);
+}
+
+
+
 /*
 SetupTrace() - ydnar
 sets up certain trace values
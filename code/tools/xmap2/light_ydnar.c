@@ -1118,6 +1118,18 @@ static qboolean MapQuad(rawLightmap_t * lm, surfaceInfo_t * info, bspDrawVert_t
 
 
 
+/*
+RawLightmapCost()
+returns the number of luxels of a raw lightmap, the threads start with the biggest ones
+*/
+
+int RawLightmapCost(int rawLightmapNum)
+{
+	return rawLightmaps[rawLightmapNum].sw * rawLightmaps[rawLightmapNum].sh;
+}
+
+
+
 /*
 MapRawLightmap()
 maps the locations, normals, and pvs clusters for a raw lightmap
@@ -1994,6 +2006,407 @@ static void SubsampleRawLuxel_r(rawLightmap_t * lm, trace_t * trace, vec3_t samp
 
 
 
+/*
+light cache
+with -cache the luxels of every raw lightmap are kept in <map>.lightcache, keyed
+by the mapped luxels, the culled light list, the pvs between the luxels and the
+lights and the occluders the shadow traces can reach. a raw lightmap whose key
+didn't change since the last compile is restored instead of illuminated.
+the grid, the vertex lighting and the radiosity bounces are always computed.
+*/
+
+#define LIGHT_CACHE_VERSION		2
+
+#define HASH_VALUE( hash, v )	((hash) = HashData((hash), &(v), sizeof(v)))
+
+static cacheKey_t lightCacheOptions;
+
+
+
+/*
+OpenLightCache()
+loads the light cache, the options key covers the command line and the worldspawn keys
+*/
+
+void OpenLightCache(int argc, char **argv)
+{
+	int             i;
+	epair_t        *ep;
+	char            filename[1024];
+
+
+	if(!useCache)
+		return;
+
+	strcpy(filename, source);
+	StripExtension(filename);
+	strcat(filename, ".lightcache");
+	OpenCache(filename);
+
+	/* the map name is the last argument */
+	i = LIGHT_CACHE_VERSION;
+	lightCacheOptions = HashString(CACHE_HASH_INIT, game->arg);
+	HASH_VALUE(lightCacheOptions, i);
+	for(i = 0; i < argc - 1; i++)
+	{
+		if(argv[i] != NULL && strcmp(argv[i], "-cache"))
+			lightCacheOptions = HashString(lightCacheOptions, argv[i]);
+	}
+
+	/* ambient, minlight, sun and the like, but not the compile history */
+	for(ep = entities[0].epairs; ep != NULL; ep = ep->next)
+	{
+		if(!Q_stricmp(ep->key, "_xmap2_cmdline") || !Q_stricmp(ep->key, "_xmap2_version"))
+			continue;
+		lightCacheOptions = HashString(lightCacheOptions, ep->key);
+		lightCacheOptions = HashString(lightCacheOptions, ep->value);
+	}
+}
+
+
+
+/*
+CloseLightCache()
+writes the raw lightmaps of this compile to the light cache
+*/
+
+void CloseLightCache(void)
+{
+	if(useCache)
+		CloseCache();
+}
+
+
+
+/*
+HashLight()
+hashes everything about a light that changes the light it casts
+*/
+
+static cacheKey_t HashLight(const light_t * light)
+{
+	int             i;
+	cacheKey_t      hash;
+
+
+	hash = CACHE_HASH_INIT;
+	HASH_VALUE(hash, light->type);
+	HASH_VALUE(hash, light->flags);
+	HASH_VALUE(hash, light->origin);
+	HASH_VALUE(hash, light->radius);
+	HASH_VALUE(hash, light->normal);
+	HASH_VALUE(hash, light->dist);
+	HASH_VALUE(hash, light->photons);
+	HASH_VALUE(hash, light->style);
+	HASH_VALUE(hash, light->color);
+	HASH_VALUE(hash, light->radiusByDist);
+	HASH_VALUE(hash, light->fade);
+	HASH_VALUE(hash, light->angleScale);
+	HASH_VALUE(hash, light->extraDist);
+	HASH_VALUE(hash, light->add);
+	HASH_VALUE(hash, light->envelope);
+	HASH_VALUE(hash, light->mins);
+	HASH_VALUE(hash, light->maxs);
+	HASH_VALUE(hash, light->emitColor);
+	HASH_VALUE(hash, light->falloffTolerance);
+	HASH_VALUE(hash, light->filterRadius);
+	if(light->w != NULL)
+	{
+		for(i = 0; i < light->w->numpoints; i++)
+			HASH_VALUE(hash, light->w->p[i]);
+	}
+	if(light->si != NULL)
+		hash = HashString(hash, light->si->shader);
+
+	return hash;
+}
+
+
+
+/*
+HashClusterLights()
+hashes which lights of the list a cluster can see, cluster numbers change with every edit
+*/
+
+static cacheKey_t HashClusterLights(int cluster, const trace_t * trace)
+{
+	int             i;
+	byte            visible;
+	cacheKey_t      hash;
+
+
+	hash = CACHE_HASH_INIT;
+	for(i = 0; i < trace->numLights; i++)
+	{
+		visible = ClusterVisible(cluster, trace->lights[i]->cluster);
+		HASH_VALUE(hash, visible);
+	}
+
+	return hash;
+}
+
+
+
+/*
+RawLightmapCacheKey()
+hashes everything IlluminateRawLightmap computes the luxels of a raw lightmap from
+*/
+
+static cacheKey_t RawLightmapCacheKey(rawLightmap_t * lm, const trace_t * trace)
+{
+	int             i, j, x, y, lastCluster, *cluster;
+	light_t        *light;
+	float          *origin;
+	vec3_t          mins, maxs, luxelMins, luxelMaxs, temp;
+	cacheKey_t      hash, clusterHash, lightHash, occluders;
+
+
+	/* lightmap layout and settings */
+	hash = lightCacheOptions;
+	HASH_VALUE(hash, lm->sw);
+	HASH_VALUE(hash, lm->sh);
+	HASH_VALUE(hash, lm->sampleSize);
+	HASH_VALUE(hash, lm->actualSampleSize);
+	HASH_VALUE(hash, lm->axisNum);
+	HASH_VALUE(hash, lm->splotchFix);
+	HASH_VALUE(hash, lm->filterRadius);
+	HASH_VALUE(hash, lm->brightness);
+	HASH_VALUE(hash, lm->recvShadows);
+	HASH_VALUE(hash, lm->floodlightDirectionScale);
+	HASH_VALUE(hash, lm->floodlightRGB);
+	HASH_VALUE(hash, lm->floodlightIntensity);
+	HASH_VALUE(hash, lm->floodlightDistance);
+	HASH_VALUE(hash, lm->mins);
+	HASH_VALUE(hash, lm->maxs);
+	HASH_VALUE(hash, lm->axis);
+	HASH_VALUE(hash, lm->origin);
+	HASH_VALUE(hash, lm->styles);
+	if(lm->plane != NULL)
+		hash = HashData(hash, lm->plane, 4 * sizeof(float));
+	if(lm->vecs != NULL)
+		hash = HashData(hash, lm->vecs, 3 * sizeof(vec3_t));
+	HASH_VALUE(hash, trace->twoSided);
+	for(i = 0; i < trace->numSurfaces; i++)
+		hash = HashString(hash, surfaceInfos[trace->surfaces[i]].si->shader);
+
+	/* mapped luxels, dirt is in the normals */
+	hash = HashData(hash, lm->superOrigins, lm->sw * lm->sh * SUPER_ORIGIN_SIZE * sizeof(float));
+	hash = HashData(hash, lm->superNormals, lm->sw * lm->sh * SUPER_NORMAL_SIZE * sizeof(float));
+	if(lm->superFloodLight != NULL)
+		hash = HashData(hash, lm->superFloodLight, lm->sw * lm->sh * SUPER_FLOODLIGHT_SIZE * sizeof(float));
+
+	/* luxel clusters by what they see */
+	lastCluster = -1;
+	clusterHash = 0;
+	for(y = 0; y < lm->sh; y++)
+	{
+		for(x = 0; x < lm->sw; x++)
+		{
+			cluster = SUPER_CLUSTER(x, y);
+			if(*cluster < 0)
+			{
+				HASH_VALUE(hash, *cluster);
+				continue;
+			}
+			if(*cluster != lastCluster)
+			{
+				lastCluster = *cluster;
+				clusterHash = HashClusterLights(lastCluster, trace);
+			}
+			HASH_VALUE(hash, clusterHash);
+		}
+	}
+
+	/* subsamples find their cluster in the surface clusters */
+	for(i = 0; i < lm->numLightClusters; i++)
+	{
+		clusterHash = HashClusterLights(lm->lightClusters[i], trace);
+		HASH_VALUE(hash, clusterHash);
+	}
+
+	/* the box around the luxels */
+	VectorCopy(lm->mins, mins);
+	VectorCopy(lm->maxs, maxs);
+	for(y = 0; y < lm->sh; y++)
+	{
+		for(x = 0; x < lm->sw; x++)
+		{
+			cluster = SUPER_CLUSTER(x, y);
+			origin = SUPER_ORIGIN(x, y);
+			if(*cluster >= 0)
+				AddPointToBounds(origin, mins, maxs);
+		}
+	}
+	for(j = 0; j < 3; j++)
+	{
+		mins[j] -= lm->sampleSize;
+		maxs[j] += lm->sampleSize;
+	}
+	VectorCopy(mins, luxelMins);
+	VectorCopy(maxs, luxelMaxs);
+
+	/* lights, with the space their shadow traces sweep */
+	for(i = 0; i < trace->numLights; i++)
+	{
+		light = trace->lights[i];
+		lightHash = HashLight(light);
+		HASH_VALUE(hash, lightHash);
+
+		/* sun traces end at the luxel plus the light origin */
+		if(light->type == EMIT_SUN)
+		{
+			VectorAdd(luxelMins, light->origin, temp);
+			AddPointToBounds(temp, mins, maxs);
+			VectorAdd(luxelMaxs, light->origin, temp);
+			AddPointToBounds(temp, mins, maxs);
+		}
+		else
+		{
+			AddPointToBounds(light->origin, mins, maxs);
+			if(light->w != NULL)
+			{
+				for(j = 0; j < light->w->numpoints; j++)
+					AddPointToBounds(light->w->p[j], mins, maxs);
+			}
+		}
+	}
+
+	occluders = HashTraceOccluders(mins, maxs, trace->numSurfaces, trace->surfaces);
+	HASH_VALUE(hash, occluders);
+
+	return hash;
+}
+
+
+
+/*
+StoreRawLightmap()
+adds the illuminated luxels of a raw lightmap to the light cache
+*/
+
+static void StoreRawLightmap(rawLightmap_t * lm, cacheKey_t key)
+{
+	int             i, lightmapNum, numLuxels, size;
+	byte           *data, *out, present, deluxe;
+
+
+	numLuxels = lm->sw * lm->sh;
+
+	/* styles, the lightmaps they light, the deluxels and a bit per flooded luxel */
+	present = 0;
+	size = MAX_LIGHTMAPS + 2 + ((numLuxels + 7) >> 3);
+	for(lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++)
+	{
+		if(lm->superLuxels[lightmapNum] != NULL)
+		{
+			present |= 1 << lightmapNum;
+			size += numLuxels * SUPER_LUXEL_SIZE * sizeof(float);
+		}
+	}
+	deluxe = (deluxemap && lm->superDeluxels != NULL);
+	if(deluxe)
+		size += numLuxels * SUPER_DELUXEL_SIZE * sizeof(float);
+
+	data = out = safe_malloc(size);
+	memset(data, 0, size);
+	memcpy(out, lm->styles, MAX_LIGHTMAPS);
+	out += MAX_LIGHTMAPS;
+	*out++ = present;
+	*out++ = deluxe;
+	for(lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++)
+	{
+		if(present & (1 << lightmapNum))
+		{
+			memcpy(out, lm->superLuxels[lightmapNum], numLuxels * SUPER_LUXEL_SIZE * sizeof(float));
+			out += numLuxels * SUPER_LUXEL_SIZE * sizeof(float);
+		}
+	}
+	if(deluxe)
+	{
+		memcpy(out, lm->superDeluxels, numLuxels * SUPER_DELUXEL_SIZE * sizeof(float));
+		out += numLuxels * SUPER_DELUXEL_SIZE * sizeof(float);
+	}
+
+	/* the cluster numbers themselves change with the bsp, only the flooding is the same */
+	for(i = 0; i < numLuxels; i++)
+	{
+		if(lm->superClusters[i] == CLUSTER_FLOODED)
+			out[i >> 3] |= 1 << (i & 7);
+	}
+
+	AddCacheEntry(key, data, size);
+	free(data);
+}
+
+
+
+/*
+RestoreRawLightmap()
+copies the luxels of a raw lightmap out of the light cache, returns qfalse if they aren't there
+*/
+
+static qboolean RestoreRawLightmap(rawLightmap_t * lm, cacheKey_t key)
+{
+	int             i, lightmapNum, numLuxels, size, expected;
+	const byte     *in;
+	byte            present, deluxe;
+
+
+	in = FindCacheEntry(key, &size);
+	if(in == NULL || size < MAX_LIGHTMAPS + 2)
+		return qfalse;
+
+	/* check the size before touching the lightmap */
+	numLuxels = lm->sw * lm->sh;
+	present = in[MAX_LIGHTMAPS];
+	deluxe = in[MAX_LIGHTMAPS + 1];
+	expected = MAX_LIGHTMAPS + 2 + ((numLuxels + 7) >> 3);
+	for(lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++)
+	{
+		if(present & (1 << lightmapNum))
+			expected += numLuxels * SUPER_LUXEL_SIZE * sizeof(float);
+	}
+	if(deluxe)
+	{
+		if(lm->superDeluxels == NULL)
+			return qfalse;
+		expected += numLuxels * SUPER_DELUXEL_SIZE * sizeof(float);
+	}
+	if(size != expected)
+		return qfalse;
+
+	memcpy(lm->styles, in, MAX_LIGHTMAPS);
+	in += MAX_LIGHTMAPS + 2;
+	for(lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++)
+	{
+		if(present & (1 << lightmapNum))
+		{
+			if(lm->superLuxels[lightmapNum] == NULL)
+				lm->superLuxels[lightmapNum] = safe_malloc(numLuxels * SUPER_LUXEL_SIZE * sizeof(float));
+			memcpy(lm->superLuxels[lightmapNum], in, numLuxels * SUPER_LUXEL_SIZE * sizeof(float));
+			in += numLuxels * SUPER_LUXEL_SIZE * sizeof(float);
+		}
+		else if(lm->superLuxels[lightmapNum] != NULL)
+			memset(lm->superLuxels[lightmapNum], 0, numLuxels * SUPER_LUXEL_SIZE * sizeof(float));
+	}
+	if(deluxe)
+	{
+		memcpy(lm->superDeluxels, in, numLuxels * SUPER_DELUXEL_SIZE * sizeof(float));
+		in += numLuxels * SUPER_DELUXEL_SIZE * sizeof(float);
+	}
+
+	/* flood the unmapped luxels of this compile */
+	for(i = 0; i < numLuxels; i++)
+	{
+		if((in[i >> 3] & (1 << (i & 7))) && lm->superClusters[i] < 0)
+			lm->superClusters[i] = CLUSTER_FLOODED;
+	}
+
+	return qtrue;
+}
+
+
+
 /*
 IlluminateRawLightmap()
 illuminates the luxels
@@ -2016,6 +2429,8 @@ void IlluminateRawLightmap(int rawLightmapNum)
 	float           tests[4][2] = { {0.0f, 0}, {1, 0}, {0, 1}, {1, 1} };
 	trace_t         trace;
 	float           stackLightLuxels[STACK_LL_SIZE];
+	qboolean        cacheable;
+	cacheKey_t      key;
 
 
 	/* bail if this number exceeds the number of raw lightmaps */
@@ -2051,6 +2466,20 @@ void IlluminateRawLightmap(int rawLightmapNum)
 	/* create a culled light list for this raw lightmap */
 	CreateTraceLightsForBounds(lm->mins, lm->maxs, lm->plane, lm->numLightClusters, lm->lightClusters, LIGHT_SURFACES, &trace);
 
+	/* the light cache only holds the full quality first pass, debug surface colors depend on the lightmap number */
+	cacheable = (useCache && !bouncing && !previewing && !debugSurfaces);
+	key = 0;
+	if(cacheable)
+	{
+		key = RawLightmapCacheKey(lm, &trace);
+		if(RestoreRawLightmap(lm, key))
+		{
+			numRawLightmapsCached++;
+			FreeTraceLights(&trace);
+			return;
+		}
+	}
+
 	/* -----------------------------------------------------------------
 	   fill pass
 	   ----------------------------------------------------------------- */
@@ -2666,6 +3095,10 @@ void IlluminateRawLightmap(int rawLightmapNum)
 		}
 	}
 
+	/* keep it for the next compile */
+	if(cacheable)
+		StoreRawLightmap(lm, key);
+
 
 #if 0
 	// audit pass
@@ -4395,7 +4828,7 @@ void FloodlightRawLightmaps()
 {
 	Sys_Printf("--- FloodlightRawLightmap ---\n");
 	numSurfacesFloodlighten = 0;
-	RunThreadsOnIndividual(numRawLightmaps, qtrue, FloodLightRawLightmap);
+	RunThreadsOnIndividualSorted(numRawLightmaps, qtrue, FloodLightRawLightmap, RawLightmapCost);
 	Sys_Printf("%9d custom lightmaps floodlighted\n", numSurfacesFloodlighten);
 }
 
@@ -60,7 +60,7 @@ WriteTGA24()
 based on WriteTGA() from imagelib.c
 */
 
-void WriteTGA24(char *filename, byte * data, int width, int height, qboolean flip)
+void WriteTGA24(char *filename, const byte * data, int width, int height, qboolean flip)
 {
 	int             i, c;
 	byte           *buffer, *in;
@@ -174,7 +174,7 @@ void ExportLightmaps(void)
 {
 	int             i;
 	char            dirname[1024], filename[1024];
-	byte           *lightmap;
+	const byte     *lightmap;
 
 
 	/* note it */
@@ -185,7 +185,7 @@ void ExportLightmaps(void)
 	StripExtension(dirname);
 
 	/* sanity check */
-	if(bspLightBytes == NULL)
+	if(numBSPLightBytes <= 0)
 	{
 		Sys_Printf("WARNING: No BSP lightmap data\n");
 		return;
@@ -195,9 +195,11 @@ void ExportLightmaps(void)
 	Q_mkdir(dirname);
 
 	/* iterate through the lightmaps */
-	for(i = 0, lightmap = bspLightBytes; lightmap < (bspLightBytes + numBSPLightBytes);
-		i++, lightmap += (game->lightmapSize * game->lightmapSize * 3))
+	for(i = 0; i < numBSPLightBytes / (game->lightmapSize * game->lightmapSize * 3); i++)
 	{
+		/* get the page, stored by -light or loaded from the bsp */
+		lightmap = BSPLightmapPage(i);
+
 		/* write a tga image out */
 		sprintf(filename, "%s/lightmap_%04d.tga", dirname, i);
 		Sys_Printf("Writing %s\n", filename);
@@ -1958,6 +1960,8 @@ static void SetupOutLightmap(rawLightmap_t * lm, outLightmap_t * olm)
 	/* allocate buffers */
 	olm->lightBits = safe_malloc((olm->customWidth * olm->customHeight / 8) + 8);
 	memset(olm->lightBits, 0, (olm->customWidth * olm->customHeight / 8) + 8);
+	olm->skyline = safe_malloc(olm->customWidth * sizeof(*olm->skyline));
+	memset(olm->skyline, 0, olm->customWidth * sizeof(*olm->skyline));
 
 #if defined(USE_HDR_LIGHTMAPS)
 	if(hdr)
@@ -1983,6 +1987,82 @@ static void SetupOutLightmap(rawLightmap_t * lm, outLightmap_t * olm)
 
 
 
+/*
+FitOutLightmapSkyline()
+finds the lowest position for a w x h block on top of the used columns of an
+output lightmap, the leftmost one if several are equally low. everything
+stored on the page lies below its skyline, so the block is free there
+*/
+
+static qboolean FitOutLightmapSkyline(outLightmap_t * olm, int w, int h, int *outX, int *outY)
+{
+	int             x, sx, y, bestX, bestY;
+
+
+	if(h > olm->customHeight)
+		return qfalse;
+
+	bestX = -1;
+	bestY = olm->customHeight - h;
+	for(x = 0; x + w <= olm->customWidth; x++)
+	{
+		/* the block rests on the highest column below it */
+		y = 0;
+		for(sx = x; sx < x + w; sx++)
+		{
+			if(olm->skyline[sx] > y)
+			{
+				y = olm->skyline[sx];
+
+				/* skip the columns the block can't get past */
+				if(y > bestY || (y == bestY && bestX >= 0))
+					break;
+			}
+		}
+
+		if(sx < x + w)
+		{
+			x = sx;
+			continue;
+		}
+
+		bestX = x;
+		bestY = y;
+
+		/* can't get any lower */
+		if(y == 0)
+			break;
+	}
+
+	if(bestX < 0)
+		return qfalse;
+
+	*outX = bestX;
+	*outY = bestY;
+	return qtrue;
+}
+
+
+
+/*
+RaiseOutLightmapSkyline()
+raises the used columns of an output lightmap over a stored block
+*/
+
+static void RaiseOutLightmapSkyline(outLightmap_t * olm, int x, int y, int w, int h)
+{
+	int             sx;
+
+
+	for(sx = x; sx < x + w && sx < olm->customWidth; sx++)
+	{
+		if(olm->skyline[sx] < y + h)
+			olm->skyline[sx] = y + h;
+	}
+}
+
+
+
 /*
 FindOutLightmaps()
 for a given surface lightmap, find output lightmap pages and positions for it
@@ -2102,33 +2182,11 @@ static void FindOutLightmaps(rawLightmap_t * lm)
 				if(olm->customWidth != lm->customWidth || olm->customHeight != lm->customHeight)
 					continue;
 
-				/* set maxs */
+				/* find a fine tract of lauhnd on top of the skyline */
 				if(lm->solid[lightmapNum])
-				{
-					xMax = olm->customWidth;
-					yMax = olm->customHeight;
-				}
+					ok = FitOutLightmapSkyline(olm, 1, 1, &x, &y);
 				else
-				{
-					xMax = (olm->customWidth - lm->w) + 1;
-					yMax = (olm->customHeight - lm->h) + 1;
-				}
-
-				/* walk the origin around the lightmap */
-				for(y = 0; y < yMax; y++)
-				{
-					for(x = 0; x < xMax; x++)
-					{
-						/* find a fine tract of lauhnd */
-						ok = TestOutLightmapStamp(lm, lightmapNum, olm, x, y);
-
-						if(ok)
-							break;
-					}
-
-					if(ok)
-						break;
-				}
+					ok = FitOutLightmapSkyline(olm, lm->w, lm->h, &x, &y);
 
 				if(ok)
 					break;
@@ -2212,6 +2270,9 @@ static void FindOutLightmaps(rawLightmap_t * lm)
 			yMax = lm->h;
 		}
 
+		/* styled lightmaps may have been stamped in below the skyline */
+		RaiseOutLightmapSkyline(olm, lm->lightmapX[lightmapNum], lm->lightmapY[lightmapNum], xMax, yMax);
+
 		/* mark the bits used */
 		for(y = 0; y < yMax; y++)
 		{
@@ -2344,8 +2405,74 @@ static int CompareRawLightmap(const void *a, const void *b)
 	if(diff != 0)
 		return diff;
 
-	/* must be equivalent */
-	return 0;
+	/* taller ones first, the skyline stays flatter */
+	diff = blm->h - alm->h;
+	if(diff != 0)
+		return diff;
+
+	/* keep the surface order, so every qsort() packs the same pages */
+	return *((int *)a) - *((int *)b);
+}
+
+
+
+/*
+ReplaceLightmapFile()
+moves a written external lightmap over the old one, so the engine never sees a
+half written or missing file, and deletes the old one of the other format
+*/
+
+static void ReplaceLightmapFile(const char *tempName, const char *filename, const char *otherName)
+{
+	/* rename replaces the file in one step where the os allows it */
+	if(rename(tempName, filename) != 0)
+	{
+		remove(filename);
+		rename(tempName, filename);
+	}
+
+	if(FileExists(otherName))
+		remove(otherName);
+}
+
+
+
+/*
+BSPLightmapPage()
+returns a page of the bsp lightmap lump, from bspLightBytes when the bsp was loaded
+and from the output lightmaps after StoreSurfaceLightmaps()
+*/
+
+const byte *BSPLightmapPage(int pageNum)
+{
+	int             i, pageSize;
+	outLightmap_t  *olm;
+	static byte    *emptyPage = NULL;
+
+
+	pageSize = game->lightmapSize * game->lightmapSize * 3;
+
+	if(bspLightBytes != NULL)
+		return bspLightBytes + pageNum * pageSize;
+
+	/* deluxemaps follow their lightmap */
+	for(i = 0; i < numOutLightmaps; i++)
+	{
+		olm = &outLightmaps[i];
+		if(olm->lightmapNum == pageNum && olm->bspLightBytes != NULL)
+			return olm->bspLightBytes;
+		if(deluxemap && olm->lightmapNum >= 0 && olm->lightmapNum + 1 == pageNum && olm->bspDirBytes != NULL)
+			return olm->bspDirBytes;
+	}
+
+	/* black like the zeroed lump it replaces */
+	if(emptyPage == NULL)
+	{
+		emptyPage = safe_malloc(pageSize);
+		memset(emptyPage, 0, pageSize);
+	}
+
+	return emptyPage;
 }
 
 
@@ -2362,8 +2489,8 @@ void StoreSurfaceLightmaps(void)
 	float          *normal, *luxel, *bspLuxel, *bspLuxel2, *radLuxel, samples, occludedSamples;
 	vec3_t          sample, occludedSample, dirSample, colorMins, colorMaxs;
 	float          *deluxel, *bspDeluxel, *bspDeluxel2;
-	byte           *lb;
 	int             numUsed, numTwins, numTwinLuxels, numStored;
+	int             numPageLuxels, numPackedLuxels, numSkylineLuxels;
 	float           lmx, lmy, efficiency;
 	vec3_t          color;
 	vec3_t			lightDirection;
@@ -2372,7 +2499,7 @@ void StoreSurfaceLightmaps(void)
 	rawLightmap_t  *lm, *lm2;
 	outLightmap_t  *olm;
 	bspDrawVert_t  *dv, *ydv, *dvParent;
-	char            dirname[1024], filename[1024];
+	char            dirname[1024], filename[1024], otherName[1024], tempName[1024];
 	shaderInfo_t   *csi;
 	char            lightmapName[128];
 	char           *rgbGenValues[256];
@@ -2962,6 +3089,7 @@ void StoreSurfaceLightmaps(void)
 		for(i = 0; i < numOutLightmaps; i++)
 		{
 			free(outLightmaps[i].lightBits);
+			free(outLightmaps[i].skyline);
 #if defined(USE_HDR_LIGHTMAPS)
 			if(hdr)
 			{
@@ -3016,50 +3144,27 @@ void StoreSurfaceLightmaps(void)
 	   store output lightmaps
 	   ----------------------------------------------------------------- */
 
-	/* delete old conflicting external lightmaps */
+	/* delete old conflicting external lightmaps, the others are replaced as they are written */
 	// FIXME scan for all lightmaps
 	for(i = 0; i < (numOutLightmaps * 2); i++)
 	{
 		/* determine if file exists */
-		sprintf(filename, "%s/" EXTERNAL_LIGHTMAP, dirname, i);
-		if(FileExists(filename))
-			remove(filename);
-
 		sprintf(filename, "%s/" EXTERNAL_OLDLIGHTMAP, dirname, i);
 		if(FileExists(filename))
 			remove(filename);
-
-		sprintf(filename, "%s/" EXTERNAL_HDRLIGHTMAP, dirname, i);
-		if(FileExists(filename))
-			remove(filename);
 	}
 
 	/* note it */
 	Sys_Printf("storing...");
 
-	/* count the bsp lightmaps and allocate space */
+	/* count the bsp lightmaps, their pages stay in the output lightmaps until AddLightmapLump writes them */
 	if(bspLightBytes != NULL)
 		free(bspLightBytes);
+	bspLightBytes = NULL;
 	if(numBSPLightmaps == 0 || externalLightmaps)
-	{
 		numBSPLightBytes = 0;
-		bspLightBytes = NULL;
-	}
 	else
-	{
-		/*
-		if(hdr)
-		{
-			numBSPLightBytes = (numBSPLightmaps * game->lightmapSize * game->lightmapSize * 4);
-		}
-		else
-		*/
-		{
-			numBSPLightBytes = (numBSPLightmaps * game->lightmapSize * game->lightmapSize * 3);
-		}
-		bspLightBytes = safe_malloc(numBSPLightBytes);
-		memset(bspLightBytes, 0, numBSPLightBytes);
-	}
+		numBSPLightBytes = (numBSPLightmaps * game->lightmapSize * game->lightmapSize * 3);
 
 	/* walk the list of output lightmaps */
 	for(i = 0; i < numOutLightmaps; i++)
@@ -3067,21 +3172,6 @@ void StoreSurfaceLightmaps(void)
 		/* get output lightmap */
 		olm = &outLightmaps[i];
 
-		/* is this a valid bsp lightmap? */
-		if(olm->lightmapNum >= 0 && !externalLightmaps)
-		{
-			/* copy lighting data */
-			lb = bspLightBytes + (olm->lightmapNum * game->lightmapSize * game->lightmapSize * 3);
-			memcpy(lb, olm->bspLightBytes, game->lightmapSize * game->lightmapSize * 3);
-
-			/* copy direction data */
-			if(deluxemap)
-			{
-				lb = bspLightBytes + ((olm->lightmapNum + 1) * game->lightmapSize * game->lightmapSize * 3);
-				memcpy(lb, olm->bspDirBytes, game->lightmapSize * game->lightmapSize * 3);
-			}
-		}
-
 		/* external lightmap? */
 		if(olm->lightmapNum < 0 || olm->extLightmapNum >= 0 || externalLightmaps)
 		{
@@ -3096,24 +3186,32 @@ void StoreSurfaceLightmaps(void)
 			if(hdr)
 			{
 				sprintf(filename, "%s/" EXTERNAL_HDRLIGHTMAP, dirname, numExtLightmaps);
+				sprintf(otherName, "%s/" EXTERNAL_LIGHTMAP, dirname, numExtLightmaps);
+				snprintf(tempName, sizeof(tempName), "%s.tmp", filename);
 				Sys_FPrintf(SYS_VRB, "\nwriting %s", filename);
-				WriteRGBE(filename, olm->bspLightFloats, olm->customWidth, olm->customHeight);
+				WriteRGBE(tempName, olm->bspLightFloats, olm->customWidth, olm->customHeight);
 			}
 			else
 #endif
 			{
 				sprintf(filename, "%s/" EXTERNAL_LIGHTMAP, dirname, numExtLightmaps);
+				sprintf(otherName, "%s/" EXTERNAL_HDRLIGHTMAP, dirname, numExtLightmaps);
+				snprintf(tempName, sizeof(tempName), "%s.tmp", filename);
 				Sys_FPrintf(SYS_VRB, "\nwriting %s", filename);
-				WritePNG(filename, olm->bspLightBytes, olm->customWidth, olm->customHeight, qtrue);
+				WritePNG(tempName, olm->bspLightBytes, olm->customWidth, olm->customHeight, qtrue);
 			}
+			ReplaceLightmapFile(tempName, filename, otherName);
 			numExtLightmaps++;
 
 			/* write deluxemap */
 			if(deluxemap)
 			{
 				sprintf(filename, "%s/" EXTERNAL_LIGHTMAP, dirname, numExtLightmaps);
+				sprintf(otherName, "%s/" EXTERNAL_HDRLIGHTMAP, dirname, numExtLightmaps);
+				snprintf(tempName, sizeof(tempName), "%s.tmp", filename);
 				Sys_FPrintf(SYS_VRB, "\nwriting %s", filename);
-				WritePNG(filename, olm->bspDirBytes, olm->customWidth, olm->customHeight, qtrue);
+				WritePNG(tempName, olm->bspDirBytes, olm->customWidth, olm->customHeight, qtrue);
+				ReplaceLightmapFile(tempName, filename, otherName);
 				numExtLightmaps++;
 
 				if(debugDeluxemap)
@@ -3126,6 +3224,16 @@ void StoreSurfaceLightmaps(void)
 		Sys_Printf("\n");
 
 	/* delete unused external lightmaps */
+	for(i = numExtLightmaps; i < (numOutLightmaps * 2); i++)
+	{
+		sprintf(filename, "%s/" EXTERNAL_LIGHTMAP, dirname, i);
+		if(FileExists(filename))
+			remove(filename);
+
+		sprintf(filename, "%s/" EXTERNAL_HDRLIGHTMAP, dirname, i);
+		if(FileExists(filename))
+			remove(filename);
+	}
 	for(i = numExtLightmaps; i; i++)
 	{
 		/* determine if file exists */
@@ -3434,6 +3542,19 @@ void StoreSurfaceLightmaps(void)
 	numStored = numBSPLightBytes / 3;
 	efficiency = (numStored <= 0) ? 0 : (float)numUsed / (float)numStored;
 
+	/* sum up how well the pages are packed, luxels below the skyline can't be used anymore */
+	numPageLuxels = 0;
+	numPackedLuxels = 0;
+	numSkylineLuxels = 0;
+	for(i = 0; i < numOutLightmaps; i++)
+	{
+		olm = &outLightmaps[i];
+		numPageLuxels += olm->customWidth * olm->customHeight;
+		numPackedLuxels += olm->customWidth * olm->customHeight - olm->freeLuxels;
+		for(x = 0; x < olm->customWidth; x++)
+			numSkylineLuxels += olm->skyline[x];
+	}
+
 	/* print stats */
 	Sys_Printf("%9d luxels used\n", numUsed);
 	Sys_Printf("%9d luxels stored (%3.2f percent efficiency)\n", numStored, efficiency * 100.0f);
@@ -3443,6 +3564,9 @@ void StoreSurfaceLightmaps(void)
 	Sys_Printf("%9d vertex approximated surfaces\n", numSurfsVertexApproximated);
 	Sys_Printf("%9d BSP lightmaps\n", numBSPLightmaps);
 	Sys_Printf("%9d total lightmaps\n", numOutLightmaps);
+	Sys_Printf("%9d of %d luxels packed on %d pages (%3.2f percent full, %3.2f percent below the skyline)\n", numPackedLuxels,
+			   numPageLuxels, numOutLightmaps, numPageLuxels <= 0 ? 0.0f : 100.0f * numPackedLuxels / numPageLuxels,
+			   numSkylineLuxels <= 0 ? 0.0f : 100.0f * numPackedLuxels / numSkylineLuxels);
 	Sys_Printf("%9d unique lightmap/shader combinations\n", numLightmapShaders);
 
 	/* write map shader file */
@@ -328,6 +328,9 @@ abstracted bsp file
 
 #define MAX_MAP_ADVERTISEMENTS	30
 
+/* converted lumps are written in blocks of this many elements */
+#define	LUMP_BLOCK_ELEMENTS		256
+
 /* key / value pair sizes in the entities lump */
 #define	MAX_KEY					32
 #define	MAX_VALUE				1024
@@ -528,6 +531,12 @@ general types
 typedef char    qb_t;
 
 
+/* key of a build cache entry */
+typedef unsigned long long cacheKey_t;
+
+#define CACHE_HASH_INIT			14695981039346656037ULL
+
+
 /* ydnar: for xmap_tcMod */
 typedef float   tcMod_t[3][3];
 
@@ -1423,6 +1432,7 @@ typedef struct outLightmap_s
 	int             numShaders;
 	shaderInfo_t   *shaders[MAX_LIGHTMAP_SHADERS];
 	byte           *lightBits;
+	short          *skyline;
 	byte           *bspLightBytes;
 	float          *bspLightFloats;
 	byte           *bspDirBytes;
@@ -1516,6 +1526,16 @@ int             ScaleBSPMain(int argc, char **argv);
 int             ConvertMain(int argc, char **argv);
 
 
+/* cache.c */
+cacheKey_t      HashData(cacheKey_t hash, const void *data, int size);
+cacheKey_t      HashString(cacheKey_t hash, const char *s);
+cacheKey_t      HashMix(cacheKey_t hash);
+void            OpenCache(const char *filename);
+const void     *FindCacheEntry(cacheKey_t key, int *size);
+void            AddCacheEntry(cacheKey_t key, const void *data, int size);
+void            CloseCache(void);
+
+
 /* path_init.c */
 game_t         *GetGame(char *arg);
 void            InitPaths(int *argc, char **argv);
@@ -1771,6 +1791,8 @@ int             VisMain(int argc, char **argv);
 
 /* visflow.c */
 int             CountBits(byte * bits, int numbits);
+qboolean        AndPortalBits(byte * out, const byte * a, const byte * b, const byte * c, const byte * vis);
+void            OrPortalBits(byte * out, const byte * in);
 void            PassageFlow(int portalnum);
 void            CreatePassages(int portalnum);
 void            PassageMemory(void);
@@ -1793,6 +1815,7 @@ int             LightMain(int argc, char **argv);
 void            SetupTraceNodes(void);
 void            TraceLine(trace_t * trace);
 float           SetupTrace(trace_t * trace);
+cacheKey_t      HashTraceOccluders(const vec3_t mins, const vec3_t maxs, int numSurfaces, const int *surfaces);
 
 
 /* light_bounce.c */
@@ -1803,6 +1826,7 @@ void            RadLightForPatch(int num, int lightmapNum, rawLightmap_t * lm, s
 								 clipWork_t * cw);
 void            RadCreateDiffuseLights(void);
 void            RadFreeLights();
+void            PhotonBounce(void);
 
 
 /* light_ydnar.c */
@@ -1823,6 +1847,9 @@ void            FloodlightIlluminateLightmap(rawLightmap_t * lm);
 float           FloodLightForSample(trace_t * trace, float floodLightDistance, qboolean floodLightLowQuality);
 void            FloodLightRawLightmap(int num);
 
+int             RawLightmapCost(int num);
+void            OpenLightCache(int argc, char **argv);
+void            CloseLightCache(void);
 void            IlluminateRawLightmap(int num);
 void            IlluminateVertexes(int num);
 
@@ -1851,6 +1878,7 @@ int             ImportLightmapsMain(int argc, char **argv);
 void            SetupSurfaceLightmaps(void);
 void            StitchSurfaceLightmaps(void);
 void            StoreSurfaceLightmaps(void);
+const byte     *BSPLightmapPage(int pageNum);
 
 
 /* image.c */
@@ -1890,11 +1918,16 @@ void            BSPFilesCleanup();
 
 void            SwapBlock(int *block, int size);
 
+void           *MapBSPFile(const char *filename, int headerSize);
+void            UnmapBSPFile(void);
 int             GetLumpElements(bspHeader_t * header, int lump, int size);
 void           *GetLump(bspHeader_t * header, int lump);
 int             CopyLump(bspHeader_t * header, int lump, void *dest, int size);
 int             CopyLump_Allocate(bspHeader_t * header, int lump, void **dest, int size, int *allocationVariable);
+void            BeginLump(FILE * file, bspHeader_t * header, int lumpNum);
+void            EndLump(FILE * file, bspHeader_t * header, int lumpNum);
 void            AddLump(FILE * file, bspHeader_t * header, int lumpNum, const void *data, int length);
+void            AddLightmapLump(FILE * file, bspHeader_t * header, int lumpNum);
 
 void            LoadBSPFile(const char *filename);
 void            WriteBSPFile(const char *filename);
@@ -2015,6 +2048,9 @@ Q_EXTERN qboolean			bspAlternateSplitWeights Q_ASSIGN( qtrue );			/* 27 */
 Q_EXTERN qboolean			deepBSP Q_ASSIGN( qfalse );				/* div0 */
 Q_EXTERN qboolean			inlineEntityModels Q_ASSIGN( qtrue );	/* Tr3B */
 Q_EXTERN qboolean			drawBSP Q_ASSIGN( qfalse );				/* Tr3B */
+Q_EXTERN qboolean			exactSplits Q_ASSIGN( qfalse );			/* test every face plane and build the face bsp on one thread */
+Q_EXTERN int				splitSamples Q_ASSIGN( 256 );			/* split planes tested at a face bsp node */
+Q_EXTERN qboolean			useCache Q_ASSIGN( qfalse );			/* -vis and -light reuse the results of the last compile */
 
 Q_EXTERN int				patchSubdivisions Q_ASSIGN( 8 );		/* ydnar: -patchmeta subdivisions */
 
@@ -2134,6 +2170,7 @@ Q_EXTERN qboolean			mergevisportals;
 Q_EXTERN qboolean			nosort;
 Q_EXTERN qboolean			hint;	/* ydnar */
 Q_EXTERN char				inbase[ MAX_QPATH ];
+Q_EXTERN int				visCheckpointInterval Q_ASSIGN( 300 );	/* seconds between portal flow checkpoints, 0 = off */
 
 /* other bits */
 Q_EXTERN int				totalvis;
@@ -2188,6 +2225,7 @@ Q_EXTERN qboolean			noGridLighting Q_ASSIGN( qfalse );
 
 Q_EXTERN qboolean			noTrace Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			noSurfaces Q_ASSIGN( qfalse );
+Q_EXTERN qboolean			noTraceBVH Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			patchShadows Q_ASSIGN( qtrue );
 Q_EXTERN qboolean			cpmaHack Q_ASSIGN( qfalse );
 
@@ -2205,6 +2243,11 @@ Q_EXTERN int				bounce Q_ASSIGN( 0 );
 Q_EXTERN qboolean			bounceOnly Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			bouncing Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			bouncegrid Q_ASSIGN( qfalse );
+Q_EXTERN int				numBouncePhotons Q_ASSIGN( 0 );	/* photon mapped radiosity if > 0 */
+Q_EXTERN int				photonGather Q_ASSIGN( 64 );
+Q_EXTERN float				photonRadius Q_ASSIGN( 128.0f );
+Q_EXTERN qboolean			progressive Q_ASSIGN( qfalse );
+Q_EXTERN qboolean			previewing Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			normalmap Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			trisoup Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			shade Q_ASSIGN( qfalse );
@@ -2401,6 +2444,7 @@ Q_EXTERN int				numLuxels Q_ASSIGN( 0 );
 Q_EXTERN int				numLuxelsMapped Q_ASSIGN( 0 );
 Q_EXTERN int				numLuxelsOccluded Q_ASSIGN( 0 );
 Q_EXTERN int				numLuxelsIlluminated Q_ASSIGN( 0 );
+Q_EXTERN int				numRawLightmapsCached Q_ASSIGN( 0 );
 Q_EXTERN int				numVertsIlluminated Q_ASSIGN( 0 );
 
 /* lightgrid */
@@ -49,6 +49,8 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 #define GROW_META_VERTS		1024
 #define GROW_META_TRIANGLES	1024
 
+#define META_VERT_HASH_SIZE	65536	// power of 2
+
 static int      numMetaSurfaces, numPatchMetaSurfaces;
 
 static int      maxMetaVerts = 0;
@@ -56,6 +58,10 @@ static int      numMetaVerts = 0;
 static int      firstSearchMetaVert = 0;
 static bspDrawVert_t *metaVerts = NULL;
 
+/* FindMetaVertex chains, index + 1 of the latest meta vert with the hash and of the one before it */
+static int      metaVertHash[META_VERT_HASH_SIZE];
+static int     *metaVertHashChain = NULL;
+
 static int      maxMetaTriangles = 0;
 static int      numMetaTriangles = 0;
 static metaTriangle_t *metaTriangles = NULL;
@@ -71,6 +77,33 @@ void ClearMetaTriangles(void)
 {
 	numMetaVerts = 0;
 	numMetaTriangles = 0;
+	memset(metaVertHash, 0, sizeof(metaVertHash));
+}
+
+
+
+/*
+HashMetaVertex()
+hashes the bits of the position, texture coordinates and normal of a drawvert
+*/
+
+static int HashMetaVertex(bspDrawVert_t * v)
+{
+	size_t          i;
+	unsigned int    hash;
+	const byte     *b;
+
+
+	hash = 2166136261u;
+
+	for(i = 0, b = (const byte *)v->xyz; i < sizeof(v->xyz); i++)
+		hash = (hash ^ b[i]) * 16777619u;
+	for(i = 0, b = (const byte *)v->st; i < sizeof(v->st); i++)
+		hash = (hash ^ b[i]) * 16777619u;
+	for(i = 0, b = (const byte *)v->normal; i < sizeof(v->normal); i++)
+		hash = (hash ^ b[i]) * 16777619u;
+
+	return hash & (META_VERT_HASH_SIZE - 1);
 }
 
 
@@ -82,14 +115,15 @@ finds a matching metavertex in the global list, returning its index
 
 static int FindMetaVertex(bspDrawVert_t * src)
 {
-	int             i;
-	bspDrawVert_t  *v, *temp;
+	int             i, hash, *chain;
+	bspDrawVert_t  *temp;
 
 
-	/* try to find an existing drawvert */
-	for(i = firstSearchMetaVert, v = &metaVerts[i]; i < numMetaVerts; i++, v++)
+	/* try to find an existing drawvert, the chains run from the newest to the oldest one */
+	hash = HashMetaVertex(src);
+	for(i = metaVertHash[hash] - 1; i >= firstSearchMetaVert; i = metaVertHashChain[i] - 1)
 	{
-		if(memcmp(src, v, sizeof(bspDrawVert_t)) == 0)
+		if(memcmp(src, &metaVerts[i], sizeof(bspDrawVert_t)) == 0)
 			return i;
 	}
 
@@ -99,16 +133,22 @@ static int FindMetaVertex(bspDrawVert_t * src)
 		/* reallocate more room */
 		maxMetaVerts += GROW_META_VERTS;
 		temp = safe_malloc(maxMetaVerts * sizeof(bspDrawVert_t));
+		chain = safe_malloc(maxMetaVerts * sizeof(int));
 		if(metaVerts != NULL)
 		{
 			memcpy(temp, metaVerts, numMetaVerts * sizeof(bspDrawVert_t));
+			memcpy(chain, metaVertHashChain, numMetaVerts * sizeof(int));
 			free(metaVerts);
+			free(metaVertHashChain);
 		}
 		metaVerts = temp;
+		metaVertHashChain = chain;
 	}
 
 	/* add the triangle */
 	memcpy(&metaVerts[numMetaVerts], src, sizeof(bspDrawVert_t));
+	metaVertHashChain[numMetaVerts] = metaVertHash[hash];
+	metaVertHash[hash] = numMetaVerts + 1;
 	numMetaVerts++;
 
 	/* return the count */
@@ -990,11 +1030,89 @@ averages coincident vertex normals in the meta triangles
 
 #define MAX_SAMPLES				256
 #define THETA_EPSILON			0.000001
+
+#define SMOOTH_CELL_SIZE		8.0f
+
+/*
+SmoothCellHash()
+hashes a cell of the SmoothMetaTriangles grid
+*/
+
+static int SmoothCellHash(int x, int y, int z, int hashSize)
+{
+	return ((unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ (unsigned int)z * 83492791u) & (hashSize - 1);
+}
+
+
+
+/*
+CompareInts()
+compare function for qsort()
+*/
+
+static int CompareInts(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+
+
+/*
+FindCoincidentMetaVerts()
+collects the meta verts from first on that VectorCompare can match with the position, sorted by index.
+returns the number of verts
+*/
+
+static int FindCoincidentMetaVerts(vec3_t xyz, int first, int *hash, int hashSize, int *chain, int *verts)
+{
+	int             i, j, numVerts, numBuckets, bucket, buckets[8];
+	int             mins[3], maxs[3], cell[3];
+
+
+	/* VectorCompare allows EQUAL_EPSILON, so the position may sit on a cell border */
+	for(i = 0; i < 3; i++)
+	{
+		mins[i] = (int)floor((xyz[i] - 2 * EQUAL_EPSILON) / SMOOTH_CELL_SIZE);
+		maxs[i] = (int)floor((xyz[i] + 2 * EQUAL_EPSILON) / SMOOTH_CELL_SIZE);
+	}
+
+	numVerts = 0;
+	numBuckets = 0;
+	for(cell[0] = mins[0]; cell[0] <= maxs[0]; cell[0]++)
+	{
+		for(cell[1] = mins[1]; cell[1] <= maxs[1]; cell[1]++)
+		{
+			for(cell[2] = mins[2]; cell[2] <= maxs[2]; cell[2]++)
+			{
+				/* walk every bucket once */
+				bucket = SmoothCellHash(cell[0], cell[1], cell[2], hashSize);
+				for(i = 0; i < numBuckets; i++)
+				{
+					if(buckets[i] == bucket)
+						break;
+				}
+				if(i < numBuckets)
+					continue;
+				buckets[numBuckets++] = bucket;
+
+				for(j = hash[bucket]; j >= 0; j = chain[j])
+				{
+					if(j >= first)
+						verts[numVerts++] = j;
+				}
+			}
+		}
+	}
+
+	qsort(verts, numVerts, sizeof(*verts), CompareInts);
+	return numVerts;
+}
 #define EQUAL_NORMAL_EPSILON	0.01
 
 void SmoothMetaTriangles(void)
 {
-	int             i, j, k, f, fOld, start, cs, numVerts, numVotes, numSmoothed;
+	int             i, j, k, n, f, fOld, start, cs, numVerts, numVotes, numSmoothed;
+	int             hashSize, *hash, *chain, numCoincident, *coincident;
 	float           shadeAngle, defaultShadeAngle, maxShadeAngle, dot, testAngle;
 	metaTriangle_t *tri;
 	float          *shadeAngles;
@@ -1061,6 +1179,21 @@ void SmoothMetaTriangles(void)
 	fOld = -1;
 	start = I_FloatTime();
 
+	/* sort the vertexes into a grid, the chains run from the lowest to the highest index */
+	for(hashSize = 1024; hashSize < numMetaVerts; hashSize <<= 1);
+	hash = safe_malloc(hashSize * sizeof(int));
+	memset(hash, -1, hashSize * sizeof(int));
+	chain = safe_malloc(numMetaVerts * sizeof(int));
+	coincident = safe_malloc(numMetaVerts * sizeof(int));
+
+	for(i = numMetaVerts - 1; i >= 0; i--)
+	{
+		k = SmoothCellHash((int)floor(metaVerts[i].xyz[0] / SMOOTH_CELL_SIZE), (int)floor(metaVerts[i].xyz[1] / SMOOTH_CELL_SIZE),
+						   (int)floor(metaVerts[i].xyz[2] / SMOOTH_CELL_SIZE), hashSize);
+		chain[i] = hash[k];
+		hash[k] = i;
+	}
+
 	/* go through the list of vertexes */
 	numSmoothed = 0;
 	for(i = 0; i < numMetaVerts; i++)
@@ -1082,9 +1215,14 @@ void SmoothMetaTriangles(void)
 		numVerts = 0;
 		numVotes = 0;
 
+		/* the grid only returns verts that may be coincident */
+		numCoincident = FindCoincidentMetaVerts(metaVerts[i].xyz, i, hash, hashSize, chain, coincident);
+
 		/* build a table of coincident vertexes */
-		for(j = i; j < numMetaVerts && numVerts < MAX_SAMPLES; j++)
+		for(n = 0; n < numCoincident && numVerts < MAX_SAMPLES; n++)
 		{
+			j = coincident[n];
+
 			/* already smoothed? */
 			if(smoothed[j >> 3] & (1 << (j & 7)))
 				continue;
@@ -1147,6 +1285,9 @@ void SmoothMetaTriangles(void)
 	/* free the tables */
 	free(shadeAngles);
 	free(smoothed);
+	free(hash);
+	free(chain);
+	free(coincident);
 
 	/* print time */
 	Sys_FPrintf(SYS_VRB, " (%d)\n", (int)(I_FloatTime() - start));
@@ -1276,25 +1417,6 @@ static int AddMetaTriangleToSurface(mapDrawSurface_t * ds, metaTriangle_t * tri,
 	else
 		score += AXIS_SCORE * DotProduct(ds->lightmapAxis, tri->plane);
 
-	/* preserve old drawsurface if this fails */
-	memcpy(&old, ds, sizeof(*ds));
-
-	/* attempt to add the verts */
-	coincident = 0;
-	ai = AddMetaVertToSurface(ds, &metaVerts[tri->indexes[0]], &coincident);
-	bi = AddMetaVertToSurface(ds, &metaVerts[tri->indexes[1]], &coincident);
-	ci = AddMetaVertToSurface(ds, &metaVerts[tri->indexes[2]], &coincident);
-
-	/* check vertex underflow */
-	if(ai < 0 || bi < 0 || ci < 0)
-	{
-		memcpy(ds, &old, sizeof(*ds));
-		return 0;
-	}
-
-	/* score coincident vertex count (2003-02-14: changed so this only matters on planar surfaces) */
-	score += (coincident * VERT_SCORE);
-
 	/* add new vertex bounds to mins/maxs */
 	VectorCopy(ds->mins, mins);
 	VectorCopy(ds->maxs, maxs);
@@ -1302,7 +1424,8 @@ static int AddMetaTriangleToSurface(mapDrawSurface_t * ds, metaTriangle_t * tri,
 	AddPointToBounds(metaVerts[tri->indexes[1]].xyz, mins, maxs);
 	AddPointToBounds(metaVerts[tri->indexes[2]].xyz, mins, maxs);
 
-	/* check lightmap bounds overflow (after at least 1 triangle has been added) */
+	/* check lightmap bounds overflow (after at least 1 triangle has been added),
+	   this doesn't depend on the verts, so do it before copying the surface */
 	if(!(ds->shaderInfo->compileFlags & C_VERTEXLIT) &&
 	   ds->numIndexes > 0 && VectorLength(ds->lightmapAxis) > 0.0f &&
 	   (VectorCompare(ds->mins, mins) == qfalse || VectorCompare(ds->maxs, maxs) == qfalse))
@@ -1314,13 +1437,29 @@ static int AddMetaTriangleToSurface(mapDrawSurface_t * ds, metaTriangle_t * tri,
 		for(i = 0; i < 3; i++)
 		{
 			if((maxs[i] - mins[i]) > lmMax)
-			{
-				memcpy(ds, &old, sizeof(*ds));
 				return 0;
-			}
 		}
 	}
 
+	/* preserve old drawsurface if this fails */
+	memcpy(&old, ds, sizeof(*ds));
+
+	/* attempt to add the verts */
+	coincident = 0;
+	ai = AddMetaVertToSurface(ds, &metaVerts[tri->indexes[0]], &coincident);
+	bi = AddMetaVertToSurface(ds, &metaVerts[tri->indexes[1]], &coincident);
+	ci = AddMetaVertToSurface(ds, &metaVerts[tri->indexes[2]], &coincident);
+
+	/* check vertex underflow */
+	if(ai < 0 || bi < 0 || ci < 0)
+	{
+		memcpy(ds, &old, sizeof(*ds));
+		return 0;
+	}
+
+	/* score coincident vertex count (2003-02-14: changed so this only matters on planar surfaces) */
+	score += (coincident * VERT_SCORE);
+
 	/* check texture range overflow */
 	oldTexRange[0] = ds->texRange[0];
 	oldTexRange[1] = ds->texRange[1];
@@ -1423,6 +1562,42 @@ static int AddMetaTriangleToSurface(mapDrawSurface_t * ds, metaTriangle_t * tri,
 
 
 
+/*
+MetaTriangleExceedsLightmap()
+returns qtrue if AddMetaTriangleToSurface rejects the triangle and all triangles
+after it in the list of possibles, because they stick out of the lightmap on x.
+the possibles are sorted by falling mins x (see CompareMetaTriangles)
+*/
+
+static qboolean MetaTriangleExceedsLightmap(mapDrawSurface_t * ds, metaTriangle_t * tri)
+{
+	int             i;
+	float           minX, lmMax;
+
+
+	/* the lightmap bounds are only checked after the first triangle */
+	if((ds->shaderInfo->compileFlags & C_VERTEXLIT) || ds->numIndexes <= 0 || VectorLength(ds->lightmapAxis) <= 0.0f)
+		return qfalse;
+
+	/* find mins like CompareMetaTriangles */
+	minX = 999999;
+	for(i = 0; i < 3; i++)
+	{
+		if(metaVerts[tri->indexes[i]].xyz[0] < minX)
+			minX = metaVerts[tri->indexes[i]].xyz[0];
+	}
+
+	/* the surface has to grow on x for VectorCompare in AddMetaTriangleToSurface */
+	if(minX >= ds->mins[0] || fabs(ds->mins[0] - minX) <= EQUAL_EPSILON)
+		return qfalse;
+
+	/* the following triangles start even further away */
+	lmMax = (ds->sampleSize * (ds->shaderInfo->lmCustomWidth - 1));
+	return (ds->maxs[0] - minX) > lmMax;
+}
+
+
+
 /*
 MetaTrianglesToSurface()
 creates map drawsurface(s) from the list of possibles
@@ -1508,6 +1683,10 @@ static void MetaTrianglesToSurface(int numPossibles, metaTriangle_t * possibles,
 				if(test->si == NULL)
 					continue;
 
+				/* stop at the first triangle that is too far away */
+				if(MetaTriangleExceedsLightmap(ds, test))
+					break;
+
 				/* score this triangle */
 				score = AddMetaTriangleToSurface(ds, test, qtrue);
 				if(score > bestScore)
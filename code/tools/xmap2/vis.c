@@ -174,7 +174,7 @@ void ClusterMerge(int leafnum)
 	leaf_t         *leaf;
 	byte            portalvector[MAX_PORTALS / 8];
 	byte            uncompressed[MAX_MAP_LEAFS / 8];
-	int             i, j;
+	int             i;
 	int             numvis, mergedleafnum;
 	vportal_t      *p;
 	int             pnum;
@@ -195,8 +195,7 @@ void ClusterMerge(int leafnum)
 
 		if(p->status != stat_done)
 			Error("portal not done");
-		for(j = 0; j < portallongs; j++)
-			((long *)portalvector)[j] |= ((long *)p->portalvis)[j];
+		OrPortalBits(portalvector, p->portalvis);
 		pnum = p - portals;
 		portalvector[pnum >> 3] |= 1 << (pnum & 7);
 	}
@@ -215,11 +214,644 @@ void ClusterMerge(int leafnum)
 	numvis++;					// count the leaf itself
 
 	//Sys_FPrintf (SYS_VRB,"cluster %4i : %4i visible\n", leafnum, numvis);
+	ThreadLock();
 	++clustersizehistogram[numvis];
+	ThreadUnlock();
 
 	memcpy(bspVisBytes + VIS_HEADER_SIZE + leafnum * leafbytes, uncompressed, leafbytes);
 }
 
+/*
+==================
+AllocPortalBits
+
+The portalfront, portalflood and portalvis vectors of all portals live in
+three flat arrays with one 16 byte aligned row of portalbytes per portal
+==================
+*/
+static byte    *portalBits;
+
+static void AllocPortalBits(void)
+{
+	int             i, numrows;
+	size_t          size;
+	byte           *bits;
+
+	numrows = numportals * 2;
+	size = (size_t) numrows * portalbytes * 3;
+
+	portalBits = safe_malloc(size + 16);
+	memset(portalBits, 0, size + 16);
+	bits = (byte *) (((size_t) portalBits + 15) & ~(size_t) 15);
+
+	for(i = 0; i < numrows; i++)
+	{
+		portals[i].portalfront = bits + (size_t) i * portalbytes;
+		portals[i].portalflood = bits + (size_t) (numrows + i) * portalbytes;
+		portals[i].portalvis = bits + (size_t) (numrows * 2 + i) * portalbytes;
+	}
+}
+
+/*
+==================
+PortalFlowCost
+
+Relative cost of a sorted portal
+==================
+*/
+static int PortalFlowCost(int portalnum)
+{
+	return sorted_portals[portalnum]->nummightsee;
+}
+
+/*
+=============================================================================
+
+CACHE
+
+With -cache the portalvis of every portal is kept in <map>.viscache. The key
+of a portal hashes its winding, the portals in its flood and the floods of
+those, all compared by their windings instead of their numbers. A portal
+whose surroundings didn't change gets its portalvis back after an edit in
+another part of the map and isn't flowed again. The portalvis is stored over
+the flood of the portal in the order of the portal hashes, so it doesn't
+depend on the portal numbering either.
+
+The key is not complete. The flow of a portal also clips against the
+portalvis of the portals in its flood that were finished before it, and
+those depend on portals further away than the key looks. An edit can change
+them without changing the key, so a cached portalvis can differ from what a
+fresh compile would give. Delete <map>.viscache, or vis without -cache,
+for release builds and whenever the vis looks wrong after an edit.
+
+=============================================================================
+*/
+
+#define VIS_CACHE_VERSION		1
+
+static cacheKey_t *portalHashes;	// [portals] winding and the portals of the leaf it leads into
+static cacheKey_t *portalKeys;	// [portals]
+static byte    *portalCached;	// [portals], portalvis came from the cache
+static int     *hashOrder;		// all portals sorted by portalHashes
+static byte    *passagePortals;	// [portalbytes], the portals the remaining flows can go through
+
+/*
+==================
+PortalWindingHash
+==================
+*/
+static cacheKey_t PortalWindingHash(vportal_t * p)
+{
+	int             i;
+	cacheKey_t      hash;
+
+	hash = HashData(CACHE_HASH_INIT, &p->winding->numpoints, sizeof(p->winding->numpoints));
+	for(i = 0; i < p->winding->numpoints; i++)
+		hash = HashData(hash, p->winding->points[i], sizeof(vec3_t));
+
+	return hash;
+}
+
+/*
+==================
+FloodHashSum
+
+Sums up hashes[] of the portals in a flood
+==================
+*/
+static cacheKey_t FloodHashSum(const byte * flood, const cacheKey_t * hashes)
+{
+	int             i, j;
+	cacheKey_t      sum;
+
+	sum = 0;
+	for(i = 0; i < portalbytes; i++)
+	{
+		if(!flood[i])
+			continue;
+
+		for(j = 0; j < 8; j++)
+		{
+			if(flood[i] & (1 << j))
+				sum += hashes[(i << 3) + j];
+		}
+	}
+
+	return sum;
+}
+
+/*
+==================
+ComparePortalHashes
+==================
+*/
+static int ComparePortalHashes(const void *a, const void *b)
+{
+	cacheKey_t      ha, hb;
+
+	ha = portalHashes[*(const int *)a];
+	hb = portalHashes[*(const int *)b];
+	if(ha < hb)
+		return -1;
+	if(ha > hb)
+		return 1;
+	return 0;
+}
+
+/*
+==================
+CopyCachedPortalVis
+
+Packs the portalvis of p into the bits of its flood portals in hash order,
+or unpacks them with restore
+==================
+*/
+static void CopyCachedPortalVis(vportal_t * p, byte * packed, qboolean restore)
+{
+	int             i, j, q;
+
+	for(i = 0, j = 0; i < numportals * 2; i++)
+	{
+		q = hashOrder[i];
+		if(!(p->portalflood[q >> 3] & (1 << (q & 7))))
+			continue;
+
+		if(restore)
+		{
+			if(packed[j >> 3] & (1 << (j & 7)))
+				p->portalvis[q >> 3] |= (1 << (q & 7));
+		}
+		else if(p->portalvis[q >> 3] & (1 << (q & 7)))
+			packed[j >> 3] |= (1 << (j & 7));
+		j++;
+	}
+}
+
+/*
+==================
+OpenVisCache
+
+Restores the portals with a matching key and returns the number of portals
+that still have to be flowed
+==================
+*/
+static int OpenVisCache(void)
+{
+	int             i, j, numFlow, numRestored, size, options[6];
+	char            cacheFile[1024];
+	vportal_t      *p;
+	leaf_t         *leaf;
+	cacheKey_t      optionsHash, leafHash, *windingHashes, *floodHashes, *mixedHashes;
+	const byte     *data;
+
+	if(!useCache)
+		return numportals * 2;
+
+	strcpy(cacheFile, source);
+	StripExtension(cacheFile);
+	strcat(cacheFile, ".viscache");
+	OpenCache(cacheFile);
+
+	options[0] = VIS_CACHE_VERSION;
+	options[1] = noPassageVis;
+	options[2] = passageVisOnly;
+	options[3] = mergevis;
+	options[4] = mergevisportals;
+	options[5] = hint;
+	optionsHash = HashData(CACHE_HASH_INIT, options, sizeof(options));
+	optionsHash = HashData(optionsHash, &farPlaneDist, sizeof(farPlaneDist));
+
+	portalHashes = safe_malloc(numportals * 2 * sizeof(*portalHashes));
+	portalKeys = safe_malloc(numportals * 2 * sizeof(*portalKeys));
+	portalCached = safe_malloc(numportals * 2);
+	hashOrder = safe_malloc(numportals * 2 * sizeof(*hashOrder));
+	windingHashes = safe_malloc(numportals * 2 * sizeof(*windingHashes));
+	floodHashes = safe_malloc(numportals * 2 * sizeof(*floodHashes));
+	mixedHashes = safe_malloc(numportals * 2 * sizeof(*mixedHashes));
+	memset(portalCached, 0, numportals * 2);
+
+	for(i = 0, p = portals; i < numportals * 2; i++, p++)
+		windingHashes[i] = p->removed ? 0 : HashMix(PortalWindingHash(p));
+
+	// a portal is its winding and the leaf behind it, the flow goes on through the portals of that leaf
+	for(i = 0, p = portals; i < numportals * 2; i++, p++)
+	{
+		portalHashes[i] = 0;
+		if(p->removed)
+			continue;
+
+		leafHash = 0;
+		leaf = &leafs[p->leaf];
+		for(j = 0; j < leaf->numportals; j++)
+		{
+			if(!leaf->portals[j]->removed)
+				leafHash += windingHashes[leaf->portals[j] - portals];
+		}
+		portalHashes[i] = HashMix(HashData(windingHashes[i], &leafHash, sizeof(leafHash)));
+	}
+
+	// the passages of the portals in the flood clip against their own floods
+	for(i = 0, p = portals; i < numportals * 2; i++, p++)
+	{
+		floodHashes[i] = FloodHashSum(p->portalflood, portalHashes);
+		mixedHashes[i] = HashMix(portalHashes[i] + HashMix(floodHashes[i]));
+	}
+
+	for(i = 0, p = portals; i < numportals * 2; i++, p++)
+	{
+		portalKeys[i] = HashData(optionsHash, &portalHashes[i], sizeof(portalHashes[i]));
+		portalKeys[i] = HashData(portalKeys[i], &floodHashes[i], sizeof(floodHashes[i]));
+		leafHash = FloodHashSum(p->portalflood, mixedHashes);
+		portalKeys[i] = HashData(portalKeys[i], &leafHash, sizeof(leafHash));
+	}
+
+	free(windingHashes);
+	free(floodHashes);
+	free(mixedHashes);
+
+	for(i = 0; i < numportals * 2; i++)
+		hashOrder[i] = i;
+	qsort(hashOrder, numportals * 2, sizeof(hashOrder[0]), ComparePortalHashes);
+
+	// restore the unchanged portals
+	numFlow = 0;
+	numRestored = 0;
+	for(i = 0, p = portals; i < numportals * 2; i++, p++)
+	{
+		if(p->removed)
+			continue;
+
+		data = FindCacheEntry(portalKeys[i], &size);
+		if(!data || size != (p->nummightsee + 7) >> 3)
+		{
+			numFlow++;
+			continue;
+		}
+
+		// marked done when the flow gets to it, so the portals before it see the same as without the cache
+		memset(p->portalvis, 0, portalbytes);
+		CopyCachedPortalVis(p, (byte *) data, qtrue);
+		portalCached[i] = 1;
+		numRestored++;
+	}
+
+	// only the floods of the remaining portals need passages
+	passagePortals = safe_malloc(portalbytes);
+	memset(passagePortals, 0, portalbytes);
+	for(i = 0, p = portals; i < numportals * 2; i++, p++)
+	{
+		if(p->removed || portalCached[i])
+			continue;
+
+		OrPortalBits(passagePortals, p->portalflood);
+		passagePortals[i >> 3] |= (1 << (i & 7));
+	}
+
+	Sys_Printf("%9d portals restored from %s\n", numRestored, cacheFile);
+
+	return numFlow;
+}
+
+/*
+==================
+CloseVisCache
+
+Adds the flowed portals to the cache and writes it
+==================
+*/
+static void CloseVisCache(void)
+{
+	int             i, size;
+	byte           *packed;
+	vportal_t      *p;
+
+	if(!useCache)
+		return;
+
+	packed = safe_malloc(portalbytes);
+	for(i = 0, p = portals; i < numportals * 2; i++, p++)
+	{
+		if(portalCached[i])
+		{
+			// no flow at all if every portal came from the cache
+			p->status = stat_done;
+			continue;
+		}
+
+		if(p->removed || p->status != stat_done)
+			continue;
+
+		size = (p->nummightsee + 7) >> 3;
+		memset(packed, 0, size);
+		CopyCachedPortalVis(p, packed, qfalse);
+		AddCacheEntry(portalKeys[i], packed, size);
+	}
+	free(packed);
+
+	CloseCache();
+
+	free(portalHashes);
+	free(portalKeys);
+	free(portalCached);
+	free(hashOrder);
+	free(passagePortals);
+	portalHashes = portalKeys = NULL;
+	portalCached = passagePortals = NULL;
+	hashOrder = NULL;
+}
+
+/*
+==================
+CreateFlowPassages
+
+Skips the passages the flow can't use after most of the portals came from the cache
+==================
+*/
+static void CreateFlowPassages(int portalnum)
+{
+	vportal_t      *p;
+	int             pnum;
+
+	p = sorted_portals[portalnum];
+	pnum = p - portals;
+	if(passagePortals && !p->removed && !(passagePortals[pnum >> 3] & (1 << (pnum & 7))))
+		return;
+
+	CreatePassages(portalnum);
+}
+
+/*
+=============================================================================
+
+CHECKPOINTS
+
+The portalvis vectors of the finished portals are appended to <map>.vcp
+every visCheckpointInterval seconds during the final portal flow. A later
+run over the same portals with the same options marks them as done again
+and only flows the rest. The file is removed once the bsp is written.
+
+=============================================================================
+*/
+
+#define VIS_CHECKPOINT_IDENT	(('P'<<24)+('C'<<16)+('V'<<8)+'X')
+#define VIS_CHECKPOINT_VERSION	1
+
+typedef struct
+{
+	int             ident;
+	int             version;
+	int             numportals;
+	int             portalbytes;
+	unsigned int    checksum;	// of the portals and the vis options
+}
+visCheckpointHeader_t;
+
+static char     checkpointName[1024];
+static FILE    *checkpointFile;
+enum
+{
+	CHECKPOINT_NONE,
+	CHECKPOINT_FLOWED,			// portalvis is final but not in the file yet
+	CHECKPOINT_WRITTEN
+};
+
+static byte    *checkpointed;	// [portals], CHECKPOINT_*, only touched under ThreadLock
+static double   lastCheckpoint;
+static void     (*checkpointFlow) (int);
+
+/*
+==================
+VisCheckpointChecksum
+
+The flow only reproduces the same portalvis for the same portals and options
+==================
+*/
+static unsigned int VisCheckpointChecksum(void)
+{
+	int             i, j, k, options[6];
+	unsigned int    checksum;
+	vportal_t      *p;
+	float           v;
+
+	checksum = 2166136261u;
+#define CHECKSUM_BYTES(ptr, size) \
+	for(k = 0; k < (int)(size); k++) \
+		checksum = (checksum ^ ((const byte *)(ptr))[k]) * 16777619u
+
+	options[0] = noPassageVis;
+	options[1] = passageVisOnly;
+	options[2] = mergevis;
+	options[3] = mergevisportals;
+	options[4] = hint;
+	options[5] = portalclusters;
+	CHECKSUM_BYTES(options, sizeof(options));
+	CHECKSUM_BYTES(&farPlaneDist, sizeof(farPlaneDist));
+
+	for(i = 0, p = portals; i < numportals * 2; i++, p++)
+	{
+		CHECKSUM_BYTES(&p->leaf, sizeof(p->leaf));
+		CHECKSUM_BYTES(&p->removed, sizeof(p->removed));
+		CHECKSUM_BYTES(&p->winding->numpoints, sizeof(p->winding->numpoints));
+		for(j = 0; j < p->winding->numpoints * 3; j++)
+		{
+			v = p->winding->points[j / 3][j % 3];
+			CHECKSUM_BYTES(&v, sizeof(v));
+		}
+	}
+#undef CHECKSUM_BYTES
+
+	return checksum;
+}
+
+/*
+==================
+OpenVisCheckpoint
+
+Restores the portals of a matching checkpoint and opens the file for appending
+==================
+*/
+static void OpenVisCheckpoint(void)
+{
+	visCheckpointHeader_t header, old;
+	vportal_t      *p;
+	FILE           *f;
+	int             portalnum, numRestored;
+
+	if(visCheckpointInterval <= 0)
+		return;
+
+	strcpy(checkpointName, source);
+	StripExtension(checkpointName);
+	strcat(checkpointName, ".vcp");
+
+	header.ident = VIS_CHECKPOINT_IDENT;
+	header.version = VIS_CHECKPOINT_VERSION;
+	header.numportals = numportals;
+	header.portalbytes = portalbytes;
+	header.checksum = VisCheckpointChecksum();
+
+	checkpointed = safe_malloc(numportals * 2);
+	memset(checkpointed, 0, numportals * 2);
+
+	// restore the finished portals
+	numRestored = 0;
+	f = fopen(checkpointName, "rb");
+	if(f)
+	{
+		if(fread(&old, sizeof(old), 1, f) == 1 && !memcmp(&old, &header, sizeof(header)))
+		{
+			while(fread(&portalnum, sizeof(portalnum), 1, f) == 1)
+			{
+				if(portalnum < 0 || portalnum >= numportals * 2)
+					break;
+
+				p = &portals[portalnum];
+				if(fread(p->portalvis, portalbytes, 1, f) != 1)
+				{
+					// cut off by a crash, flow it again
+					memset(p->portalvis, 0, portalbytes);
+					break;
+				}
+
+				p->status = stat_done;
+				checkpointed[portalnum] = CHECKPOINT_WRITTEN;
+				numRestored++;
+			}
+		}
+		fclose(f);
+	}
+
+	// write a new file with the restored portals so a cut off record doesn't stay in the middle
+	checkpointFile = fopen(checkpointName, "wb");
+	if(!checkpointFile)
+	{
+		Sys_Printf("WARNING: couldn't write %s, no checkpoints\n", checkpointName);
+		return;
+	}
+
+	fwrite(&header, sizeof(header), 1, checkpointFile);
+	for(portalnum = 0; portalnum < numportals * 2; portalnum++)
+	{
+		if(checkpointed[portalnum] == CHECKPOINT_WRITTEN)
+		{
+			fwrite(&portalnum, sizeof(portalnum), 1, checkpointFile);
+			fwrite(portals[portalnum].portalvis, portalbytes, 1, checkpointFile);
+		}
+	}
+	fflush(checkpointFile);
+
+	if(numRestored)
+		Sys_Printf("%9d portals restored from %s\n", numRestored, checkpointName);
+
+	lastCheckpoint = I_FloatTime();
+}
+
+/*
+==================
+WriteVisCheckpoint
+
+Appends the portals that were finished since the last checkpoint.
+Only portals that CheckpointedFlow marked under the lock are written, the
+status and portalvis of the other portals are still changed by the workers.
+==================
+*/
+static void WriteVisCheckpoint(qboolean force)
+{
+	int             i;
+
+	if(!checkpointFile)
+		return;
+
+	ThreadLock();
+
+	if(force || I_FloatTime() - lastCheckpoint >= visCheckpointInterval)
+	{
+		for(i = 0; i < numportals * 2; i++)
+		{
+			if(checkpointed[i] != CHECKPOINT_FLOWED)
+				continue;
+
+			fwrite(&i, sizeof(i), 1, checkpointFile);
+			fwrite(portals[i].portalvis, portalbytes, 1, checkpointFile);
+			checkpointed[i] = CHECKPOINT_WRITTEN;
+		}
+		fflush(checkpointFile);
+
+		lastCheckpoint = I_FloatTime();
+	}
+
+	ThreadUnlock();
+}
+
+/*
+==================
+CloseVisCheckpoint
+==================
+*/
+static void CloseVisCheckpoint(void)
+{
+	if(!checkpointFile)
+		return;
+
+	WriteVisCheckpoint(qtrue);
+	fclose(checkpointFile);
+	checkpointFile = NULL;
+
+	free(checkpointed);
+	checkpointed = NULL;
+}
+
+/*
+==================
+CheckpointedFlow
+
+Runs the final flow on a sorted portal and writes a checkpoint when it is due,
+a portal from the cache is only marked as done
+==================
+*/
+static void CheckpointedFlow(int portalnum)
+{
+	vportal_t      *p;
+	int             i;
+
+	p = sorted_portals[portalnum];
+	i = p - portals;
+	if(portalCached && portalCached[i])
+		p->status = stat_done;
+	else
+		checkpointFlow(portalnum);
+
+	if(!checkpointFile)
+		return;
+
+	// the lock publishes the finished portalvis to the thread that writes the checkpoint
+	ThreadLock();
+	if(checkpointed[i] == CHECKPOINT_NONE && !p->removed && p->status == stat_done)
+		checkpointed[i] = CHECKPOINT_FLOWED;
+	ThreadUnlock();
+
+	WriteVisCheckpoint(qfalse);
+}
+
+/*
+==================
+RunPortalFlow
+
+The flow is done from the least complex portal on, so it is handed out in
+order instead of by cost, the later portals clip against the finished
+portalvis of the earlier ones.
+==================
+*/
+static void RunPortalFlow(qboolean showpacifier, void (*flow) (int))
+{
+	OpenVisCheckpoint();
+
+	checkpointFlow = flow;
+	RunThreadsOnIndividualOrdered(numportals * 2, showpacifier, CheckpointedFlow);
+
+	CloseVisCheckpoint();
+}
+
 /*
 ==================
 CalcPortalVis
@@ -230,9 +862,9 @@ void CalcPortalVis(void)
 #ifdef MREDEBUG
 	Sys_Printf("%6d portals out of %d", 0, numportals * 2);
 	//get rid of the counter
-	RunThreadsOnIndividual(numportals * 2, qfalse, PortalFlow);
+	RunPortalFlow(qfalse, PortalFlow);
 #else
-	RunThreadsOnIndividual(numportals * 2, qtrue, PortalFlow);
+	RunPortalFlow(qtrue, PortalFlow);
 #endif
 
 }
@@ -248,17 +880,17 @@ void CalcPassageVis(void)
 
 #ifdef MREDEBUG
 	_printf("%6d portals out of %d", 0, numportals * 2);
-	RunThreadsOnIndividual(numportals * 2, qfalse, CreatePassages);
+	RunThreadsOnIndividualSorted(numportals * 2, qfalse, CreateFlowPassages, PortalFlowCost);
 	_printf("\n");
 	_printf("%6d portals out of %d", 0, numportals * 2);
-	RunThreadsOnIndividual(numportals * 2, qfalse, PassageFlow);
+	RunPortalFlow(qfalse, PassageFlow);
 	_printf("\n");
 #else
 	Sys_Printf("\n--- CreatePassages (%d) ---\n", numportals * 2);
-	RunThreadsOnIndividual(numportals * 2, qtrue, CreatePassages);
+	RunThreadsOnIndividualSorted(numportals * 2, qtrue, CreateFlowPassages, PortalFlowCost);
 
 	Sys_Printf("\n--- PassageFlow (%d) ---\n", numportals * 2);
-	RunThreadsOnIndividual(numportals * 2, qtrue, PassageFlow);
+	RunPortalFlow(qtrue, PassageFlow);
 #endif
 }
 
@@ -273,17 +905,17 @@ void CalcPassagePortalVis(void)
 
 #ifdef MREDEBUG
 	Sys_Printf("%6d portals out of %d", 0, numportals * 2);
-	RunThreadsOnIndividual(numportals * 2, qfalse, CreatePassages);
+	RunThreadsOnIndividualSorted(numportals * 2, qfalse, CreateFlowPassages, PortalFlowCost);
 	Sys_Printf("\n");
 	Sys_Printf("%6d portals out of %d", 0, numportals * 2);
-	RunThreadsOnIndividual(numportals * 2, qfalse, PassagePortalFlow);
+	RunPortalFlow(qfalse, PassagePortalFlow);
 	Sys_Printf("\n");
 #else
 	Sys_Printf("\n--- CreatePassages (%d) ---\n", numportals * 2);
-	RunThreadsOnIndividual(numportals * 2, qtrue, CreatePassages);
+	RunThreadsOnIndividualSorted(numportals * 2, qtrue, CreateFlowPassages, PortalFlowCost);
 
 	Sys_Printf("\n--- PassagePortalFlow (%d) ---\n", numportals * 2);
-	RunThreadsOnIndividual(numportals * 2, qtrue, PassagePortalFlow);
+	RunPortalFlow(qtrue, PassagePortalFlow);
 #endif
 }
 
@@ -334,6 +966,8 @@ void CalcVis(void)
 
 
 
+	AllocPortalBits();
+
 	Sys_Printf("\n--- BasePortalVis (%d) ---\n", numportals * 2);
 	RunThreadsOnIndividual(numportals * 2, qtrue, BasePortalVis);
 
@@ -345,24 +979,25 @@ void CalcVis(void)
 	{
 		CalcFastVis();
 	}
-	else if(noPassageVis)
-	{
-		CalcPortalVis();
-	}
-	else if(passageVisOnly)
-	{
-		CalcPassageVis();
-	}
 	else
 	{
-		CalcPassagePortalVis();
+		if(OpenVisCache() > 0)
+		{
+			if(noPassageVis)
+				CalcPortalVis();
+			else if(passageVisOnly)
+				CalcPassageVis();
+			else
+				CalcPassagePortalVis();
+		}
+
+		CloseVisCache();
 	}
 	//
 	// assemble the leaf vis lists by oring and compressing the portal lists
 	//
 	Sys_Printf("creating leaf vis...\n");
-	for(i = 0; i < portalclusters; i++)
-		ClusterMerge(i);
+	RunThreadsOnIndividual(portalclusters, qfalse, ClusterMerge);
 
 	totalvis = 0;
 	totalvis2 = 0;
@@ -921,7 +1556,8 @@ void LoadPortals(char *name)
 	leafbytes = ((portalclusters + 63) & ~63) >> 3;
 	leaflongs = leafbytes / sizeof(long);
 
-	portalbytes = ((numportals * 2 + 63) & ~63) >> 3;
+	// portal vectors are padded to 128 bits for SSE2
+	portalbytes = ((numportals * 2 + 127) & ~127) >> 3;
 	portallongs = portalbytes / sizeof(long);
 
 	// each file portal is split into two memory portals
@@ -1107,6 +1743,20 @@ int VisMain(int argc, char **argv)
 			Sys_Printf("passageOnly = true\n");
 			passageVisOnly = qtrue;
 		}
+		else if(!strcmp(argv[i], "-checkpoint"))
+		{
+			visCheckpointInterval = atoi(argv[i + 1]);
+			i++;
+			if(visCheckpointInterval > 0)
+				Sys_Printf("Writing checkpoints every %d seconds\n", visCheckpointInterval);
+			else
+				Sys_Printf("Checkpoints disabled\n");
+		}
+		else if(!strcmp(argv[i], "-cache"))
+		{
+			Sys_Printf("Reusing the portal flow of the last compile, may differ slightly from a full vis\n");
+			useCache = qtrue;
+		}
 		else if(!strcmp(argv[i], "-nosort"))
 		{
 			Sys_Printf("nosort = true\n");
@@ -1190,5 +1840,9 @@ int VisMain(int argc, char **argv)
 	Sys_Printf("Writing %s\n", source);
 	WriteBSPFile(source);
 
+	/* the checkpoint is obsolete now */
+	if(checkpointName[0] != '\0')
+		remove(checkpointName);
+
 	return 0;
 }
@@ -36,6 +36,13 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 /* dependencies */
 #include "q3map2.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VIS_SSE2				1
+#include <emmintrin.h>
+#else
+#define VIS_SSE2				0
+#endif
+
 
 
 
@@ -58,19 +65,105 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
   void CalcMightSee (leaf_t *leaf, 
 */
 
+/*
+==================
+CountBits
+
+Counts 32 bits at a time, the bit vectors don't have to be aligned
+==================
+*/
 int CountBits(byte * bits, int numbits)
 {
-	int             i;
+	int             i, numbytes;
 	int             c;
+	unsigned int    v;
 
 	c = 0;
-	for(i = 0; i < numbits; i++)
+	numbytes = numbits >> 3;
+	for(i = 0; i + 4 <= numbytes; i += 4)
+	{
+		memcpy(&v, bits + i, 4);
+		v = v - ((v >> 1) & 0x55555555);
+		v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+		c += (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+	}
+
+	for(i <<= 3; i < numbits; i++)
 		if(bits[i >> 3] & (1 << (i & 7)))
 			c++;
 
 	return c;
 }
 
+/*
+==================
+AndPortalBits
+
+out = a & b & c over portalbytes, c may be NULL.
+Returns qtrue if out has bits that are not set in vis.
+portalbytes is a multiple of 16 so SSE2 handles all of it.
+==================
+*/
+qboolean AndPortalBits(byte * out, const byte * a, const byte * b, const byte * c, const byte * vis)
+{
+	int             i;
+
+#if VIS_SSE2
+	__m128i         m, more;
+
+	more = _mm_setzero_si128();
+	for(i = 0; i < portalbytes; i += 16)
+	{
+		m = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+		if(c)
+			m = _mm_and_si128(m, _mm_loadu_si128((const __m128i *)(c + i)));
+		_mm_storeu_si128((__m128i *) (out + i), m);
+
+		more = _mm_or_si128(more, _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(vis + i)), m));
+	}
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(more, _mm_setzero_si128())) != 0xFFFF;
+#else
+	long            m, more;
+
+	more = 0;
+	for(i = 0; i < portallongs; i++)
+	{
+		m = ((const long *)a)[i] & ((const long *)b)[i];
+		if(c)
+			m &= ((const long *)c)[i];
+		((long *)out)[i] = m;
+
+		more |= m & ~((const long *)vis)[i];
+	}
+
+	return more != 0;
+#endif
+}
+
+/*
+==================
+OrPortalBits
+
+out |= in over portalbytes
+==================
+*/
+void OrPortalBits(byte * out, const byte * in)
+{
+	int             i;
+
+#if VIS_SSE2
+	for(i = 0; i < portalbytes; i += 16)
+	{
+		_mm_storeu_si128((__m128i *) (out + i),
+						 _mm_or_si128(_mm_loadu_si128((const __m128i *)(out + i)), _mm_loadu_si128((const __m128i *)(in + i))));
+	}
+#else
+	for(i = 0; i < portallongs; i++)
+		((long *)out)[i] |= ((const long *)in)[i];
+#endif
+}
+
 int             c_fullskip;
 int             c_portalskip, c_leafskip;
 int             c_vistest, c_mighttest;
@@ -416,8 +509,8 @@ void RecursiveLeafFlow(int leafnum, threaddata_t * thread, pstack_t * prevstack)
 	vportal_t      *p;
 	visPlane_t      backplane;
 	leaf_t         *leaf;
-	int             i, j, n;
-	long           *test, *might, *prevmight, *vis, more;
+	int             i, n;
+	byte           *test;
 	int             pnum;
 
 	thread->c_chains++;
@@ -437,9 +530,6 @@ void RecursiveLeafFlow(int leafnum, threaddata_t * thread, pstack_t * prevstack)
 	stack.numseperators[1] = 0;
 #endif
 
-	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
-
 	// check all portals for flowing into other leafs   
 	for(i = 0; i < leaf->numportals; i++)
 	{
@@ -475,22 +565,15 @@ void RecursiveLeafFlow(int leafnum, threaddata_t * thread, pstack_t * prevstack)
 		// if the portal can't see anything we haven't allready seen, skip it
 		if(p->status == stat_done)
 		{
-			test = (long *)p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = (long *)p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		prevmight = (long *)prevstack->mightsee;
-		for(j = 0; j < portallongs; j++)
-		{
-			might[j] = prevmight[j] & test[j];
-			more |= (might[j] & ~vis[j]);
-		}
-
-		if(!more && (thread->base->portalvis[pnum >> 3] & (1 << (pnum & 7))))
+		if(!AndPortalBits(stack.mightsee, prevstack->mightsee, test, NULL, thread->base->portalvis) &&
+		   (thread->base->portalvis[pnum >> 3] & (1 << (pnum & 7))))
 		{						// can't see anything new
 			continue;
 		}
@@ -640,7 +723,6 @@ generates the portalvis bit vector
 void PortalFlow(int portalnum)
 {
 	threaddata_t    data;
-	int             i;
 	vportal_t      *p;
 	int             c_might, c_can;
 
@@ -656,6 +738,10 @@ void PortalFlow(int portalnum)
 		return;
 	}
 
+	/* restored from a checkpoint */
+	if(p->status == stat_done)
+		return;
+
 	p->status = stat_working;
 
 	c_might = CountBits(p->portalflood, numportals * 2);
@@ -667,8 +753,7 @@ void PortalFlow(int portalnum)
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
 	data.pstack_head.depth = 0;
-	for(i = 0; i < portallongs; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+	memcpy(data.pstack_head.mightsee, p->portalflood, portalbytes);
 
 	RecursiveLeafFlow(p->leaf, &data, &data.pstack_head);
 
@@ -690,8 +775,9 @@ void RecursivePassageFlow(vportal_t * portal, threaddata_t * thread, pstack_t *
 	vportal_t      *p;
 	leaf_t         *leaf;
 	passage_t      *passage, *nextpassage;
-	int             i, j;
-	long           *might, *vis, *prevmight, *cansee, *portalvis, more;
+	int             i;
+	byte           *portalvis;
+	qboolean        more;
 	int             pnum;
 
 	leaf = &leafs[portal->leaf];
@@ -701,8 +787,6 @@ void RecursivePassageFlow(vportal_t * portal, threaddata_t * thread, pstack_t *
 	stack.next = NULL;
 	stack.depth = prevstack->depth + 1;
 
-	vis = (long *)thread->base->portalvis;
-
 	passage = portal->passages;
 	nextpassage = passage;
 	// check all portals for flowing into other leafs   
@@ -724,29 +808,11 @@ void RecursivePassageFlow(vportal_t * portal, threaddata_t * thread, pstack_t *
 		// mark the portal as visible
 		thread->base->portalvis[pnum >> 3] |= (1 << (pnum & 7));
 
-		prevmight = (long *)prevstack->mightsee;
-		cansee = (long *)passage->cansee;
-		might = (long *)stack.mightsee;
-		memcpy(might, prevmight, portalbytes);
 		if(p->status == stat_done)
-			portalvis = (long *)p->portalvis;
+			portalvis = p->portalvis;
 		else
-			portalvis = (long *)p->portalflood;
-		more = 0;
-		for(j = 0; j < portallongs; j++)
-		{
-			if(*might)
-			{
-				*might &= *cansee++ & *portalvis++;
-				more |= (*might & ~vis[j]);
-			}
-			else
-			{
-				cansee++;
-				portalvis++;
-			}
-			might++;
-		}
+			portalvis = p->portalflood;
+		more = AndPortalBits(stack.mightsee, prevstack->mightsee, passage->cansee, portalvis, thread->base->portalvis);
 
 		if(!more)
 		{
@@ -769,7 +835,6 @@ PassageFlow
 void PassageFlow(int portalnum)
 {
 	threaddata_t    data;
-	int             i;
 	vportal_t      *p;
 
 //  int             c_might, c_can;
@@ -786,6 +851,10 @@ void PassageFlow(int portalnum)
 		return;
 	}
 
+	/* restored from a checkpoint */
+	if(p->status == stat_done)
+		return;
+
 	p->status = stat_working;
 
 //  c_might = CountBits (p->portalflood, numportals*2);
@@ -797,8 +866,7 @@ void PassageFlow(int portalnum)
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
 	data.pstack_head.depth = 0;
-	for(i = 0; i < portallongs; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+	memcpy(data.pstack_head.mightsee, p->portalflood, portalbytes);
 
 	RecursivePassageFlow(p, &data, &data.pstack_head);
 
@@ -824,8 +892,9 @@ void RecursivePassagePortalFlow(vportal_t * portal, threaddata_t * thread, pstac
 	leaf_t         *leaf;
 	visPlane_t      backplane;
 	passage_t      *passage, *nextpassage;
-	int             i, j, n;
-	long           *might, *vis, *prevmight, *cansee, *portalvis, more;
+	int             i, n;
+	byte           *portalvis;
+	qboolean        more;
 	int             pnum;
 
 //  thread->c_chains++;
@@ -845,8 +914,6 @@ void RecursivePassagePortalFlow(vportal_t * portal, threaddata_t * thread, pstac
 	stack.numseperators[1] = 0;
 #endif
 
-	vis = (long *)thread->base->portalvis;
-
 	passage = portal->passages;
 	nextpassage = passage;
 	// check all portals for flowing into other leafs   
@@ -861,29 +928,11 @@ void RecursivePassagePortalFlow(vportal_t * portal, threaddata_t * thread, pstac
 		if(!(prevstack->mightsee[pnum >> 3] & (1 << (pnum & 7))))
 			continue;			// can't possibly see it
 
-		prevmight = (long *)prevstack->mightsee;
-		cansee = (long *)passage->cansee;
-		might = (long *)stack.mightsee;
-		memcpy(might, prevmight, portalbytes);
 		if(p->status == stat_done)
-			portalvis = (long *)p->portalvis;
+			portalvis = p->portalvis;
 		else
-			portalvis = (long *)p->portalflood;
-		more = 0;
-		for(j = 0; j < portallongs; j++)
-		{
-			if(*might)
-			{
-				*might &= *cansee++ & *portalvis++;
-				more |= (*might & ~vis[j]);
-			}
-			else
-			{
-				cansee++;
-				portalvis++;
-			}
-			might++;
-		}
+			portalvis = p->portalflood;
+		more = AndPortalBits(stack.mightsee, prevstack->mightsee, passage->cansee, portalvis, thread->base->portalvis);
 
 		if(!more && (thread->base->portalvis[pnum >> 3] & (1 << (pnum & 7))))
 		{						// can't see anything new
@@ -1033,7 +1082,6 @@ PassagePortalFlow
 void PassagePortalFlow(int portalnum)
 {
 	threaddata_t    data;
-	int             i;
 	vportal_t      *p;
 
 //  int             c_might, c_can;
@@ -1050,6 +1098,10 @@ void PassagePortalFlow(int portalnum)
 		return;
 	}
 
+	/* restored from a checkpoint */
+	if(p->status == stat_done)
+		return;
+
 	p->status = stat_working;
 
 //  c_might = CountBits (p->portalflood, numportals*2);
@@ -1061,8 +1113,7 @@ void PassagePortalFlow(int portalnum)
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
 	data.pstack_head.depth = 0;
-	for(i = 0; i < portallongs; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+	memcpy(data.pstack_head.mightsee, p->portalflood, portalbytes);
 
 	RecursivePassagePortalFlow(p, &data, &data.pstack_head);
 
@@ -1328,6 +1379,7 @@ void CreatePassages(int portalnum)
 	visPlane_t      seperators[MAX_SEPERATORS * 2];
 	fixedWinding_t *w;
 	fixedWinding_t  in, out, *res;
+	byte            both = 0;
 
 
 #ifdef MREDEBUG
@@ -1368,13 +1420,22 @@ void CreatePassages(int portalnum)
 		//create the passage->cansee
 		for(j = 0; j < numportals * 2; j++)
 		{
+			// skip the bytes that have no portal in both floods
+			if(!(j & 7))
+			{
+				both = target->portalflood[j >> 3] & portal->portalflood[j >> 3];
+				if(!both)
+				{
+					j += 7;
+					continue;
+				}
+			}
+			if(!(both & (1 << (j & 7))))
+				continue;
+
 			p = &portals[j];
 			if(p->removed)
 				continue;
-			if(!(target->portalflood[j >> 3] & (1 << (j & 7))))
-				continue;
-			if(!(portal->portalflood[j >> 3] & (1 << (j & 7))))
-				continue;
 			for(k = 0; k < numseperators; k++)
 			{
 				//
@@ -1557,15 +1618,7 @@ void BasePortalVis(int portalnum)
 	if(p->removed)
 		return;
 
-	p->portalfront = safe_malloc(portalbytes);
-	memset(p->portalfront, 0, portalbytes);
-
-	p->portalflood = safe_malloc(portalbytes);
-	memset(p->portalflood, 0, portalbytes);
-
-	p->portalvis = safe_malloc(portalbytes);
-	memset(p->portalvis, 0, portalbytes);
-
+	// the bit vectors were cleared by AllocPortalBits
 	for(j = 0, tp = portals; j < numportals * 2; j++, tp++)
 	{
 		if(j == portalnum)